@@ -0,0 +1,602 @@
+/**
+ * This file is the conversion core of calendar_tool: the date conversions alone, for small containers and appliances
+ * that cannot carry the whole program. It is freestanding: it calls no function of the C library, uses no heap
+ * and no writable data, and its only tables are the astronomical leap years of CORE_ASTRONOMICAL_FIRST_YEAR to
+ * CORE_ASTRONOMICAL_LAST_YEAR, packed into 470 bytes of constant data. Everything else is integer arithmetic.
+ *
+ * Build it, and print the size of its code (text) and data, for example:
+ *     gcc -Os -ffreestanding -fno-builtin -c calendar_core.c -o calendar_core.o && size calendar_core.o
+ * main.c includes this file, so calendar_tool --verify checks every day of the core against the full conversions,
+ * and calendar_tool --bench compares their speed. sqlite_calendar.c builds the SQLite extension on it alone.
+ */
+#include <stdint.h>
+
+#include "calendar_core.h"
+
+/**
+ * The astronomical Nowruz of year 1 of the Shamsi calendar (22 March 622) as a day number,
+ * the first day of the Lunar calendar (1 Muharram 1, 19 July 622) as a day number,
+ * and the number of years that share one word of coreLeapYears[].
+ */
+#define CORE_FIRST_NOWRUZ 1948321
+#define CORE_LUNAR_EPOCH 1948440
+#define CORE_BLOCK_YEARS 64
+#define CORE_BLOCK_COUNT ((CORE_ASTRONOMICAL_LAST_YEAR - CORE_ASTRONOMICAL_FIRST_YEAR) / CORE_BLOCK_YEARS + 1)
+
+/**
+ * These tables describe the astronomical calendar of calendar_tool --astronomical, and are printed by
+ * calendar_tool --core-tables. Bit i of word k of coreLeapYears[] is set if the Shamsi year 64 * k + i + 1 has 366 days,
+ * and coreLeapsBefore[k] is the number of such years before the year 64 * k + 1,
+ * so the Nowruz of any year is found with one bit count instead of a table of 3000 day numbers.
+ */
+static const uint64_t coreLeapYears[CORE_BLOCK_COUNT] = {
+        0x2222222111111110, 0x8888888444444442, 0x2222221111111108, 0x8888888444444442, 0x2222221111111108,
+        0x8888884444444422, 0x2222211111111088, 0x8888844444444422, 0x2222211111110888, 0x8888844444444222,
+        0x2222111111110888, 0x8888444444442222, 0x2222111111108888, 0x8888444444442222, 0x2221111111108888,
+        0x8884444444422222, 0x2211111111088888, 0x8844444444222222, 0x2211111110888888, 0x8844444444222222,
+        0x2111111110888888, 0x8444444442222222, 0x1111111108888888, 0x4444444422222222, 0x1111111088888888,
+        0x4444444422222221, 0x1111110888888888, 0x4444444222222221, 0x1111110888888884, 0x4444442222222211,
+        0x1111108888888844, 0x4444422222222111, 0x1111088888888844, 0x4444222222221111, 0x1111088888888444,
+        0x4444222222221111, 0x1110888888884444, 0x4442222222211111, 0x1108888888844444, 0x4422222222111111,
+        0x1088888888444444, 0x4222222221111111, 0x1088888884444444, 0x2222222221111111, 0x0888888884444444,
+        0x2222222211111111, 0x0088888844444444
+};
+
+static const uint16_t coreLeapsBefore[CORE_BLOCK_COUNT] = {
+        0, 15, 31, 46, 62, 77, 93, 108, 124, 139, 155, 170, 186, 201, 217, 232, 248, 263, 279, 294, 310, 325, 341, 356,
+        372, 387, 403, 418, 434, 449, 465, 480, 496, 511, 527, 542, 558, 573, 589, 604, 620, 635, 651, 666, 682, 697, 713
+};
+
+/**
+ * The day of the year each Gregorian month starts on, counted from 0, in common years and in leap years.
+ */
+static const uint16_t coreMonthStarts[2][13] = {
+        {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334, 365},
+        {0, 31, 60, 91, 121, 152, 182, 213, 244, 274, 305, 335, 366}
+};
+
+_Static_assert(sizeof(coreLeapYears) + sizeof(coreLeapsBefore) + sizeof(coreMonthStarts) <= 1024,
+               "the tables of the core must stay small");
+
+/**
+ * This function determines if a year of the Gregorian calendar is a leap year.
+ *
+ * @param year The year.
+ * @return 1 if the year is a leap year, 0 otherwise.
+ */
+static int coreGregorianLeapYear(int year)
+{
+    // A year divisible by 100 is divisible by 400 if it is divisible by 16, which saves two divisions
+    return (year & 3) == 0 && (year % 25 != 0 || (year & 15) == 0);
+}
+
+/**
+ * This function counts the bits set in a word, without relying on a compiler builtin.
+ *
+ * @param word The word.
+ * @return The number of bits set.
+ */
+static int coreCountBits(uint64_t word)
+{
+    word = word - (word >> 1 & 0x5555555555555555);
+    word = (word & 0x3333333333333333) + (word >> 2 & 0x3333333333333333);
+    word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0F;
+    return (int)(word * 0x0101010101010101 >> 56);
+}
+
+/**
+ * This function finds the day number of Nowruz (1 Farvardin) of a Shamsi year.
+ * The astronomical calendar also gives the Nowruz of the year after CORE_ASTRONOMICAL_LAST_YEAR,
+ * so the length of its last year is known.
+ *
+ * @param rule CORE_ARITHMETIC or CORE_ASTRONOMICAL.
+ * @param year The Shamsi year.
+ * @param dayNumber Pointer to store the day number of Nowruz.
+ * @return 1 on success, 0 if the astronomical calendar does not cover the year.
+ */
+static int coreNowruz(int rule, int year, int *dayNumber)
+{
+    unsigned int index = (unsigned int)(year - CORE_ASTRONOMICAL_FIRST_YEAR);
+    unsigned int block = index / CORE_BLOCK_YEARS, bit = index % CORE_BLOCK_YEARS;
+
+    if (rule != CORE_ASTRONOMICAL)
+    {
+        // The 80th day of the Gregorian year, as in shamsiToGregorian() of main.c
+        *dayNumber = coreGregorianToDayNumber(year + 621, 1, 1) + 79;
+        return 1;
+    }
+
+    if (index > CORE_ASTRONOMICAL_LAST_YEAR - CORE_ASTRONOMICAL_FIRST_YEAR + 1)
+        return 0;
+
+    *dayNumber = CORE_FIRST_NOWRUZ + 365 * (int)index + coreLeapsBefore[block]
+                 + coreCountBits(coreLeapYears[block] & (((uint64_t)1 << bit) - 1));
+    return 1;
+}
+
+/**
+ * This function converts a date of the Gregorian calendar to a day number (Julian Day Number).
+ *
+ * @param year The year.
+ * @param month The month.
+ * @param day The day.
+ * @return The day number.
+ */
+int coreGregorianToDayNumber(int year, int month, int day)
+{
+    // Shift the year so that it starts in March and February becomes the last month
+    int a = (14 - month) / 12;
+    int y = year + 4800 - a;
+    int m = month + 12 * a - 3;
+
+    return day + (153 * m + 2) / 5 + 365 * y + y / 4 - y / 100 + y / 400 - 32045;
+}
+
+/**
+ * This function converts a day number to a date of the Gregorian calendar.
+ *
+ * @param dayNumber The day number.
+ * @param year Pointer to store the year.
+ * @param month Pointer to store the month.
+ * @param day Pointer to store the day.
+ */
+void coreDayNumberToGregorian(int dayNumber, int *year, int *month, int *day)
+{
+    int a = dayNumber + 32044;
+    int b = (4 * a + 3) / 146097;
+    int c = a - 146097 * b / 4;
+    int d = (4 * c + 3) / 1461;
+    int e = c - 1461 * d / 4;
+    int m = (5 * e + 2) / 153;
+
+    *day = e - (153 * m + 2) / 5 + 1;
+    *month = m + 3 - 12 * (m / 10);
+    *year = 100 * b + d - 4800 + m / 10;
+}
+
+/**
+ * This function returns the number of days in a month.
+ *
+ * @param calendar CORE_SHAMSI, CORE_GREGORIAN, CORE_LUNAR or CORE_JULIAN.
+ * @param rule CORE_ARITHMETIC or CORE_ASTRONOMICAL, for Shamsi months.
+ * @param year The year.
+ * @param month The month.
+ * @return The number of days, or 0 if the month does not exist.
+ */
+int coreMonthLength(int calendar, int rule, int year, int month)
+{
+    int nowruz, nextNowruz;
+
+    if (month < 1 || month > 12)
+        return 0;
+
+    if (calendar == CORE_SHAMSI)
+    {
+        if (month <= 6)
+            return 31;
+        if (month <= 11)
+            return 30;
+
+        // Esfand lasts until the next Nowruz
+        if (!coreNowruz(rule, year, &nowruz) || !coreNowruz(rule, year + 1, &nextNowruz))
+            return 0;
+        return nextNowruz - nowruz - 336;
+    }
+
+    if (calendar == CORE_GREGORIAN || calendar == CORE_JULIAN)
+    {
+        // Julian years are leap years every fourth year, also in the century years
+        int leap = calendar == CORE_GREGORIAN ? coreGregorianLeapYear(year) : (year & 3) == 0;
+
+        return coreMonthStarts[leap][month] - coreMonthStarts[leap][month - 1];
+    }
+
+    if (calendar == CORE_LUNAR)
+    {
+        // Odd months have 30 days, and the last month has 30 days in 11 years out of 30
+        if (month % 2 == 1 || (month == 12 && (14 + 11 * year) % 30 < 11))
+            return 30;
+        return 29;
+    }
+
+    return 0;
+}
+
+/**
+ * This function converts a date to a day number, after checking that the date exists.
+ *
+ * @param calendar CORE_SHAMSI, CORE_GREGORIAN, CORE_LUNAR or CORE_JULIAN.
+ * @param rule CORE_ARITHMETIC or CORE_ASTRONOMICAL, for Shamsi dates.
+ * @param year The year.
+ * @param month The month.
+ * @param day The day.
+ * @param dayNumber Pointer to store the day number.
+ * @return 1 on success, 0 if the date does not exist or is out of range.
+ */
+int coreToDayNumber(int calendar, int rule, int year, int month, int day, int *dayNumber)
+{
+    int nowruz;
+
+    if (day < 1 || day > coreMonthLength(calendar, rule, year, month))
+        return 0;
+
+    // The Shamsi and Lunar calendars start with the year 1
+    if (year < 1 && (calendar == CORE_SHAMSI || calendar == CORE_LUNAR))
+        return 0;
+
+    if (calendar == CORE_SHAMSI)
+    {
+        if (!coreNowruz(rule, year, &nowruz))
+            return 0;
+        *dayNumber = nowruz + (month <= 6 ? (month - 1) * 31 : 186 + (month - 7) * 30) + day - 1;
+    }
+    else if (calendar == CORE_GREGORIAN)
+        *dayNumber = coreGregorianToDayNumber(year, month, day);
+    else if (calendar == CORE_LUNAR)
+        *dayNumber = (11 * year + 3) / 30 + 354 * year + 30 * month - (month - 1) / 2 + day + CORE_LUNAR_EPOCH - 385;
+    else
+    {
+        // The formula of coreGregorianToDayNumber() without the corrections for the century years
+        int a = (14 - month) / 12;
+        int y = year + 4800 - a;
+        int m = month + 12 * a - 3;
+
+        *dayNumber = day + (153 * m + 2) / 5 + 365 * y + y / 4 - 32083;
+    }
+
+    return 1;
+}
+
+/**
+ * This function finds the day of the Gregorian year on which a Shamsi year starts.
+ * The Shamsi year always starts in March of the Gregorian year 621 years later.
+ *
+ * @param rule CORE_ARITHMETIC or CORE_ASTRONOMICAL.
+ * @param year The Shamsi year.
+ * @param dayOfYear Pointer to store the day of Nowruz, counted from 1 January as 0.
+ * @return 1 on success, 0 if the astronomical calendar does not cover the year.
+ */
+static int coreNowruzDayOfYear(int rule, int year, int *dayOfYear)
+{
+    int nowruz;
+
+    if (rule != CORE_ASTRONOMICAL)
+    {
+        // The 80th day of the Gregorian year, as in shamsiToGregorian() of main.c
+        *dayOfYear = 79;
+        return 1;
+    }
+
+    if (!coreNowruz(rule, year, &nowruz))
+        return 0;
+    *dayOfYear = nowruz - coreGregorianToDayNumber(year + 621, 1, 1);
+    return 1;
+}
+
+/**
+ * This function splits a day of a Shamsi year into its month and day.
+ *
+ * @param dayOfYear The day, counted from Nowruz as 0.
+ * @param month Pointer to store the month.
+ * @param day Pointer to store the day.
+ */
+static void coreSplitShamsiDay(int dayOfYear, int *month, int *day)
+{
+    if (dayOfYear < 186)
+    {
+        // One of the first six months, which have 31 days
+        *month = dayOfYear / 31 + 1;
+        *day = dayOfYear % 31 + 1;
+    }
+    else
+    {
+        // One of the last six months, which have 30 days (Esfand may have 29)
+        *month = (dayOfYear - 186) / 30 + 7;
+        *day = (dayOfYear - 186) % 30 + 1;
+    }
+}
+
+/**
+ * This function converts a Gregorian date to a Shamsi date, without going through a day number,
+ * after checking that the date exists.
+ * A day before Nowruz belongs to the Shamsi year that started in the previous Gregorian year.
+ *
+ * @param rule CORE_ARITHMETIC or CORE_ASTRONOMICAL.
+ * @param gYear The Gregorian year.
+ * @param gMonth The Gregorian month.
+ * @param gDay The Gregorian day.
+ * @param year Pointer to store the year.
+ * @param month Pointer to store the month.
+ * @param day Pointer to store the day.
+ * @return 1 on success, 0 if the date does not exist, is before the Shamsi year 1
+ *         or the astronomical calendar does not cover it.
+ */
+static int coreGregorianToShamsi(int rule, int gYear, int gMonth, int gDay, int *year, int *month, int *day)
+{
+    const uint16_t *starts = coreMonthStarts[coreGregorianLeapYear(gYear)];
+    int dayOfYear, nowruzDay;
+
+    if (gMonth < 1 || gMonth > 12 || gDay < 1 || gDay > starts[gMonth] - starts[gMonth - 1])
+        return 0;
+    dayOfYear = starts[gMonth - 1] + gDay - 1;
+
+    // The table also holds the Nowruz that ends its last year
+    *year = gYear - 621;
+    if (!coreNowruzDayOfYear(rule, *year, &nowruzDay))
+        return 0;
+    if (dayOfYear < nowruzDay)
+    {
+        // Count the day from the start of the previous Gregorian year instead
+        if (!coreNowruzDayOfYear(rule, --*year, &nowruzDay))
+            return 0;
+        dayOfYear += 365 + coreGregorianLeapYear(gYear - 1);
+    }
+    if (*year < 1 || (rule == CORE_ASTRONOMICAL && *year > CORE_ASTRONOMICAL_LAST_YEAR))
+        return 0;
+
+    coreSplitShamsiDay(dayOfYear - nowruzDay, month, day);
+    return 1;
+}
+
+/**
+ * This function finds the Gregorian date of a day of a Gregorian year, without going through a day number.
+ * The day may be in the next year, as the days of a Shamsi year run into it.
+ *
+ * @param gYear The Gregorian year.
+ * @param dayOfYear The day, counted from 1 January as 0.
+ * @param year Pointer to store the year.
+ * @param month Pointer to store the month.
+ * @param day Pointer to store the day.
+ */
+static void coreDayOfYearToGregorian(int gYear, int dayOfYear, int *year, int *month, int *day)
+{
+    int leap = coreGregorianLeapYear(gYear);
+    int index;
+
+    if (dayOfYear >= 365 + leap)
+    {
+        dayOfYear -= 365 + leap;
+        leap = coreGregorianLeapYear(++gYear);
+    }
+
+    // Every month has at most 31 days, so the month is at least dayOfYear / 32 and at most two more
+    index = dayOfYear >> 5;
+    while (dayOfYear >= coreMonthStarts[leap][index + 1])
+        index++;
+
+    *year = gYear;
+    *month = index + 1;
+    *day = dayOfYear - coreMonthStarts[leap][index] + 1;
+}
+
+/**
+ * This function converts a day number to a date.
+ *
+ * @param calendar CORE_SHAMSI, CORE_GREGORIAN, CORE_LUNAR or CORE_JULIAN.
+ * @param rule CORE_ARITHMETIC or CORE_ASTRONOMICAL, for Shamsi dates.
+ * @param dayNumber The day number.
+ * @param year Pointer to store the year.
+ * @param month Pointer to store the month.
+ * @param day Pointer to store the day.
+ * @return 1 on success, 0 if the day is out of range, such as a Shamsi or Lunar day before the year 1.
+ */
+int coreFromDayNumber(int calendar, int rule, int dayNumber, int *year, int *month, int *day)
+{
+    int gYear, gMonth, gDay;
+
+    if (calendar == CORE_SHAMSI)
+    {
+        coreDayNumberToGregorian(dayNumber, &gYear, &gMonth, &gDay);
+        return coreGregorianToShamsi(rule, gYear, gMonth, gDay, year, month, day);
+    }
+
+    if (calendar == CORE_GREGORIAN)
+    {
+        coreDayNumberToGregorian(dayNumber, year, month, day);
+        return 1;
+    }
+
+    if (calendar == CORE_LUNAR)
+    {
+        // The tabular Islamic calendar, with the formula of gregorianToLunar() in main.c, which only holds from its epoch
+        int l = dayNumber - CORE_LUNAR_EPOCH + 10632;
+        int n = (l - 1) / 10631;
+        int j;
+
+        if (dayNumber < CORE_LUNAR_EPOCH)
+            return 0;
+
+        l = l - 10631 * n + 354;
+        j = (10985 - l) / 5316 * (50 * l / 17719) + l / 5670 * (43 * l / 15238);
+        l = l - (30 - j) / 15 * (17719 * j / 50) - j / 16 * (15238 * j / 43) + 29;
+
+        *month = 24 * l / 709;
+        *day = l - 709 * *month / 24;
+        *year = 30 * n + j - 30;
+        return 1;
+    }
+
+    if (calendar == CORE_JULIAN)
+    {
+        // The inverse of the Julian formula of coreToDayNumber()
+        int c = dayNumber + 32082;
+        int d = (4 * c + 3) / 1461;
+        int e = c - 1461 * d / 4;
+        int m = (5 * e + 2) / 153;
+
+        *day = e - (153 * m + 2) / 5 + 1;
+        *month = m + 3 - 12 * (m / 10);
+        *year = d - 4800 + m / 10;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * This function converts a date from one calendar to another.
+ * Between the Shamsi and Gregorian calendars the date is converted within the year, without a day number.
+ *
+ * @param from The calendar of the date.
+ * @param to The calendar to convert to.
+ * @param rule CORE_ARITHMETIC or CORE_ASTRONOMICAL, for Shamsi dates.
+ * @param year The year.
+ * @param month The month.
+ * @param day The day.
+ * @param toYear Pointer to store the converted year.
+ * @param toMonth Pointer to store the converted month.
+ * @param toDay Pointer to store the converted day.
+ * @return 1 on success, 0 if the date does not exist or is out of range.
+ */
+int coreConvert(int from, int to, int rule, int year, int month, int day, int *toYear, int *toMonth, int *toDay)
+{
+    int dayNumber, nowruzDay;
+
+    if (from == CORE_SHAMSI && to == CORE_GREGORIAN)
+    {
+        if (day < 1 || day > coreMonthLength(from, rule, year, month) || !coreNowruzDayOfYear(rule, year, &nowruzDay))
+            return 0;
+
+        coreDayOfYearToGregorian(year + 621, nowruzDay + (month <= 6 ? (month - 1) * 31 : 186 + (month - 7) * 30)
+                                             + day - 1, toYear, toMonth, toDay);
+        return 1;
+    }
+
+    if (from == CORE_GREGORIAN && to == CORE_SHAMSI)
+        return coreGregorianToShamsi(rule, year, month, day, toYear, toMonth, toDay);
+
+    return coreToDayNumber(from, rule, year, month, day, &dayNumber)
+           && coreFromDayNumber(to, rule, dayNumber, toYear, toMonth, toDay);
+}
+
+/**
+ * This function returns the day of the week of a day number.
+ *
+ * @param dayNumber The day number.
+ * @return 0 for Saturday up to 6 for Friday.
+ */
+int coreWeekday(int dayNumber)
+{
+    return (dayNumber + 2) % 7;
+}
+
+/**
+ * This function reads a date written as YEAR/MONTH/DAY (or YEAR-MONTH-DAY), like parseDateText() of main.c.
+ * Spaces, tabs and a carriage return may follow the date.
+ *
+ * @param text The text.
+ * @param length The length of the text.
+ * @param year Pointer to store the year.
+ * @param month Pointer to store the month.
+ * @param day Pointer to store the day.
+ * @return 1 if the text is a date, 0 otherwise.
+ */
+int coreParseDate(const char *text, int length, int *year, int *month, int *day)
+{
+    const char *end = text + length;
+    int values[3] = {0, 0, 0};
+    char separator = 0;
+
+    for (int part = 0; part < 3; part++)
+    {
+        const char *start = text;
+
+        while (text < end && *text >= '0' && *text <= '9' && text - start < 6)
+            values[part] = values[part] * 10 + (*text++ - '0');
+
+        if (text == start)
+            return 0; // No digits
+
+        if (part < 2)
+        {
+            // The two separators must be the same, either '/' or '-'
+            if (text == end || (*text != '/' && *text != '-') || (separator != 0 && *text != separator))
+                return 0;
+            separator = *text++;
+        }
+    }
+
+    while (text < end && (*text == ' ' || *text == '\t' || *text == '\r'))
+        text++;
+    if (text != end)
+        return 0;
+
+    *year = values[0];
+    *month = values[1];
+    *day = values[2];
+    return 1;
+}
+
+/**
+ * This function writes a date as YEAR/MONTH/DAY, with two-digit months and days. Nothing is added after it.
+ *
+ * @param buffer The buffer to write to, with room for at least 18 bytes.
+ * @param year The year.
+ * @param month The month.
+ * @param day The day.
+ * @return The number of bytes written.
+ */
+int coreFormatDate(char *buffer, int year, int month, int day)
+{
+    char digits[11];
+    unsigned int value = year < 0 ? 0u - (unsigned int)year : (unsigned int)year;
+    int count = 0, length = 0;
+
+    if (year < 0)
+        buffer[length++] = '-';
+    do
+    {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    while (count > 0)
+        buffer[length++] = digits[--count];
+
+    buffer[length++] = '/';
+    buffer[length++] = (char)('0' + month / 10 % 10);
+    buffer[length++] = (char)('0' + month % 10);
+    buffer[length++] = '/';
+    buffer[length++] = (char)('0' + day / 10 % 10);
+    buffer[length++] = (char)('0' + day % 10);
+    return length;
+}
+
+/**
+ * This function converts one line of text like calendar_tool --convert: the date on the line is written in the
+ * Shamsi, Gregorian and Lunar calendars, separated by tabs and followed by a newline,
+ * or the line becomes "-" if it is not a valid date.
+ *
+ * @param text The line, without its newline.
+ * @param length The length of the line.
+ * @param calendar The calendar of the date on the line.
+ * @param rule CORE_ARITHMETIC or CORE_ASTRONOMICAL, for Shamsi dates.
+ * @param buffer The buffer to write to, of at least CORE_LINE_SIZE bytes.
+ * @return The number of bytes written.
+ */
+int coreConvertLine(const char *text, int length, int calendar, int rule, char *buffer)
+{
+    int year, month, day, dayNumber, written = 0;
+
+    if (!coreParseDate(text, length, &year, &month, &day)
+        || !coreToDayNumber(calendar, rule, year, month, day, &dayNumber))
+    {
+        buffer[0] = '-';
+        buffer[1] = '\n';
+        return 2;
+    }
+
+    for (int target = CORE_SHAMSI; target <= CORE_LUNAR; target++)
+    {
+        if (!coreFromDayNumber(target, rule, dayNumber, &year, &month, &day))
+        {
+            buffer[0] = '-';
+            buffer[1] = '\n';
+            return 2;
+        }
+
+        written += coreFormatDate(buffer + written, year, month, day);
+        buffer[written++] = target == CORE_LUNAR ? '\n' : '\t';
+    }
+
+    return written;
+}
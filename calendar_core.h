@@ -0,0 +1,49 @@
+/**
+ * This header declares the conversion core of calendar_core.c: the Shamsi, Gregorian and Lunar conversions
+ * of calendar_tool without the menu, stdio, the heap or any other part of the C library,
+ * for programs that only need to convert dates (see calendar_core.c for how to build it).
+ *
+ * Dates are converted through day numbers (Julian Day Numbers). Gregorian dates are proleptic,
+ * so dates before the reform of 1582 are not read as Julian dates.
+ * Shamsi dates follow either the arithmetic rule of calendar_tool (Nowruz on 21 March, or 20 March in Gregorian leap
+ * years) or the astronomical Nowruz of its --astronomical option, which the core covers from
+ * CORE_ASTRONOMICAL_FIRST_YEAR to CORE_ASTRONOMICAL_LAST_YEAR. Lunar dates follow the tabular Islamic calendar,
+ * and Julian dates have a leap year every fourth year without exception.
+ */
+#ifndef CALENDAR_CORE_H
+#define CALENDAR_CORE_H
+
+/**
+ * The calendars of the core, with the same values as the CALENDAR_ constants of main.c.
+ */
+#define CORE_SHAMSI 0
+#define CORE_GREGORIAN 1
+#define CORE_LUNAR 2
+#define CORE_JULIAN 3
+
+/**
+ * The rules for the start of the Shamsi year.
+ */
+#define CORE_ARITHMETIC 0
+#define CORE_ASTRONOMICAL 1
+
+#define CORE_ASTRONOMICAL_FIRST_YEAR 1
+#define CORE_ASTRONOMICAL_LAST_YEAR 3000
+
+/**
+ * The size of a buffer that always holds a line written by coreConvertLine().
+ */
+#define CORE_LINE_SIZE 64
+
+int coreGregorianToDayNumber(int year, int month, int day);
+void coreDayNumberToGregorian(int dayNumber, int *year, int *month, int *day);
+int coreMonthLength(int calendar, int rule, int year, int month);
+int coreToDayNumber(int calendar, int rule, int year, int month, int day, int *dayNumber);
+int coreFromDayNumber(int calendar, int rule, int dayNumber, int *year, int *month, int *day);
+int coreConvert(int from, int to, int rule, int year, int month, int day, int *toYear, int *toMonth, int *toDay);
+int coreWeekday(int dayNumber);
+int coreParseDate(const char *text, int length, int *year, int *month, int *day);
+int coreFormatDate(char *buffer, int year, int month, int day);
+int coreConvertLine(const char *text, int length, int calendar, int rule, char *buffer);
+
+#endif
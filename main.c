@@ -1,8 +1,41 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <termios.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define CALENDAR_HAVE_IO_URING
+#endif
+#if __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define CALENDAR_HAVE_PERF_EVENTS
+#endif
+#endif
+
+// The freestanding conversion core, which --verify and --bench compare with the conversions of this file
+#include "calendar_core.c"
 
 /**
  * This section defines ANSI escape codes for different text and background colors, as well as text formatting styles.
@@ -47,14 +80,94 @@ char *shamsiMonths[] = {
         BLACK_TEXT WHITE_BACKGROUND "                 Esfand               " RESET
 };
 
+/**
+ * These arrays hold the plain names of the months of the Shamsi, Gregorian (and Julian) and Lunar calendars,
+ * indexed from 1 to 12.
+ * Unlike shamsiMonths[], they carry no escape codes, so they can be written to files.
+ */
+char *shamsiMonthNames[] = {"", "Farvardin", "Ordibehesht", "Khordad", "Tir", "Mordad", "Shahrivar",
+                            "Mehr", "Aban", "Azar", "Dey", "Bahman", "Esfand"};
+char *gregorianMonthNames[] = {"", "January", "February", "March", "April", "May", "June",
+                               "July", "August", "September", "October", "November", "December"};
+char *lunarMonthNames[] = {"", "Muharram", "Safar", "Rabi al-Awwal", "Rabi al-Thani", "Jumada al-Awwal",
+                           "Jumada al-Thani", "Rajab", "Shaban", "Ramadan", "Shawwal", "Dhu al-Qadah",
+                           "Dhu al-Hijjah"};
+
+/**
+ * This array holds the names of the days of the week, from SHANBE (Saturday) to JOOMEH (Friday).
+ */
+char *days_of_week_shamsi[] = {"SHANBE", "YEKSHANBE", "DOSHANBE", "SESHANBE", "CHAHARSHANBE", "PANJESHANBE", "JOOMEH"};
+
+/**
+ * These constants identify the calendar a date belongs to.
+ */
+#define CALENDAR_SHAMSI 0
+#define CALENDAR_GREGORIAN 1
+#define CALENDAR_LUNAR 2
+#define CALENDAR_JULIAN 3
+#define CALENDAR_COUNT 4
+
+/**
+ * A holiday is stored as a month and day in either the Shamsi or the Lunar calendar.
+ * A day of LAST_DAY_OF_MONTH stands for the last day of the month, whatever its length.
+ */
+#define LAST_DAY_OF_MONTH 0
+
+struct holiday
+{
+    int calendar; // CALENDAR_SHAMSI or CALENDAR_LUNAR
+    int month;
+    int day;
+    char *name;
+};
+
+/**
+ * This array lists the official holidays of the Shamsi calendar and the Lunar calendar.
+ */
+struct holiday holidays[] = {
+        {CALENDAR_SHAMSI, 1, 1, "Nowruz"},
+        {CALENDAR_SHAMSI, 1, 2, "Nowruz"},
+        {CALENDAR_SHAMSI, 1, 3, "Nowruz"},
+        {CALENDAR_SHAMSI, 1, 4, "Nowruz"},
+        {CALENDAR_SHAMSI, 1, 12, "Islamic Republic Day"},
+        {CALENDAR_SHAMSI, 1, 13, "Sizdah Bedar"},
+        {CALENDAR_SHAMSI, 3, 14, "Demise of Imam Khomeini"},
+        {CALENDAR_SHAMSI, 3, 15, "Khordad 15 Uprising"},
+        {CALENDAR_SHAMSI, 11, 22, "Islamic Revolution Day"},
+        {CALENDAR_SHAMSI, 12, 29, "Oil Nationalization Day"},
+        {CALENDAR_LUNAR, 1, 9, "Tasua"},
+        {CALENDAR_LUNAR, 1, 10, "Ashura"},
+        {CALENDAR_LUNAR, 2, 20, "Arbaeen"},
+        {CALENDAR_LUNAR, 2, 28, "Demise of the Prophet and Imam Hasan"},
+        {CALENDAR_LUNAR, 2, LAST_DAY_OF_MONTH, "Martyrdom of Imam Reza"},
+        {CALENDAR_LUNAR, 3, 17, "Birth of the Prophet"},
+        {CALENDAR_LUNAR, 6, 3, "Martyrdom of Fatimah"},
+        {CALENDAR_LUNAR, 7, 13, "Birth of Imam Ali"},
+        {CALENDAR_LUNAR, 7, 27, "Mab'ath"},
+        {CALENDAR_LUNAR, 8, 15, "Birth of Imam Mahdi"},
+        {CALENDAR_LUNAR, 9, 21, "Martyrdom of Imam Ali"},
+        {CALENDAR_LUNAR, 10, 1, "Eid al-Fitr"},
+        {CALENDAR_LUNAR, 10, 2, "Eid al-Fitr"},
+        {CALENDAR_LUNAR, 10, 25, "Martyrdom of Imam Sadiq"},
+        {CALENDAR_LUNAR, 12, 10, "Eid al-Adha"},
+        {CALENDAR_LUNAR, 12, 18, "Eid al-Ghadir"}
+};
+
+#define HOLIDAY_COUNT (int)(sizeof(holidays) / sizeof(holidays[0]))
+
 /**
  * This function clears the screen by executing the "cls" command in the system.
- * This function is specific to Windows systems and uses the "system" function to execute the command.
+ * On Windows systems it uses the "system" function to execute the command,
+ * and on other systems it executes the "clear" command instead.
  * After calling this function, the screen will be cleared and any previous output will be removed.
  */
 void clearScreen()
 {
+#ifdef _WIN32
     system("cls");
+#else
+    system("clear");
+#endif
 }
 
 /**
@@ -89,6 +202,509 @@ struct tm getCurrentDateAndTime(){
     return current_date;
 }
 
+/**
+ * This section implements the runtime metrics of the program: a counter of calls and a latency histogram
+ * for each instrumented operation, and a counter of validation failures.
+ * Metrics are off by default and are turned on with the --metrics option.
+ *
+ * Every thread records into its own metricsBlock, so recording never waits for a lock or bounces a cache line
+ * between threads. The blocks are linked into a list when a thread records its first metric,
+ * and dumpMetrics() adds up all the blocks.
+ * The counters are atomics updated with relaxed loads and stores, which compile to plain instructions
+ * but can be read safely by the thread that dumps the metrics.
+ *
+ * Every call is counted, but reading the clock costs more than a conversion itself,
+ * so only one call in METRICS_SAMPLE_INTERVAL is timed.
+ * Latencies are measured in ticks of the fastest clock available (the time-stamp counter on x86)
+ * and kept in log-linear histograms: values below 16 have their own bucket,
+ * and every power of two above that is split into 16 buckets, so each bucket is within 6.25% of its values.
+ * Ticks are converted to nanoseconds when the metrics are dumped.
+ */
+#define METRIC_SHAMSI_TO_GREGORIAN 0
+#define METRIC_GREGORIAN_TO_SHAMSI 1
+#define METRIC_GREGORIAN_TO_LUNAR 2
+#define METRIC_CALCULATE_AGE 3
+#define METRIC_CALENDAR 4
+#define METRIC_OPERATIONS 5
+
+#define METRICS_SAMPLE_INTERVAL 64
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+#define METRICS_PROMETHEUS 1
+#define METRICS_JSON 2
+
+char *metricNames[] = {"shamsi_to_gregorian", "gregorian_to_shamsi", "gregorian_to_lunar", "calculate_age",
+                       "calendar_render"};
+
+struct metricsBlock
+{
+    _Atomic uint64_t calls[METRIC_OPERATIONS];
+    _Atomic uint64_t samples[METRIC_OPERATIONS]; // The number of timed calls
+    _Atomic uint64_t totalTicks[METRIC_OPERATIONS]; // The total latency of the timed calls
+    _Atomic uint64_t histogram[METRIC_OPERATIONS][HISTOGRAM_BUCKETS];
+    _Atomic uint64_t validationFailures;
+    struct metricsBlock *next;
+};
+
+/**
+ * These variables hold the state of the metrics:
+ * the output format (0 while metrics are off), the list of per-thread blocks,
+ * the clock readings taken when the metrics were turned on (used to convert ticks to nanoseconds),
+ * and the flag set by the signal handler to request a dump.
+ */
+int metricsFormat = 0;
+_Atomic(struct metricsBlock *) metricsBlocks = NULL;
+uint64_t metricsStartTicks, metricsStartNanoseconds;
+volatile sig_atomic_t metricsDumpRequested = 0;
+
+/**
+ * This function reads the fastest clock available, in ticks of unspecified length.
+ *
+ * @return The current number of ticks.
+ */
+uint64_t readTicks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(_WIN32)
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)counter.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+/**
+ * This function reads a monotonic clock in nanoseconds.
+ *
+ * @return The current time in nanoseconds, counted from an unspecified starting point.
+ */
+uint64_t readNanoseconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+/**
+ * This function adds an amount to a counter of the calling thread's metrics block.
+ * Only the owning thread writes the counter, so a relaxed load and store are enough.
+ *
+ * @param counter The counter to increase.
+ * @param amount The amount to add.
+ */
+void addToCounter(_Atomic uint64_t *counter, uint64_t amount)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount,
+                          memory_order_relaxed);
+}
+
+/**
+ * This function returns the metrics block of the calling thread, creating it on first use.
+ * New blocks are pushed onto the list of blocks with a compare-and-swap, without any lock.
+ *
+ * @return The metrics block of the calling thread, or NULL if memory ran out.
+ */
+struct metricsBlock *threadMetrics(void)
+{
+    static _Thread_local struct metricsBlock *block = NULL;
+
+    if (block == NULL)
+    {
+        block = calloc(1, sizeof(struct metricsBlock));
+        if (block == NULL)
+            return NULL;
+
+        block->next = atomic_load(&metricsBlocks);
+        while (!atomic_compare_exchange_weak(&metricsBlocks, &block->next, block))
+            ;
+    }
+
+    return block;
+}
+
+/**
+ * This function returns the histogram bucket of a latency.
+ *
+ * @param ticks The latency in ticks.
+ * @return The index of the bucket.
+ */
+int histogramBucket(uint64_t ticks)
+{
+    if (ticks < HISTOGRAM_SUB_BUCKETS)
+        return (int)ticks;
+
+    // The position of the highest set bit selects the power of two, the next bits select the sub-bucket
+    int exponent = 63 - __builtin_clzll(ticks);
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+           + (int)(ticks >> (exponent - HISTOGRAM_SUB_BITS) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/**
+ * This function returns the smallest latency that falls into a histogram bucket.
+ *
+ * @param bucket The index of the bucket.
+ * @return The lower bound of the bucket in ticks.
+ */
+uint64_t histogramBucketStart(int bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return (uint64_t)bucket;
+
+    int exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    return (uint64_t)(HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << (exponent - HISTOGRAM_SUB_BITS);
+}
+
+/**
+ * This array counts down the calls of each operation in the current thread until the next call to be timed.
+ * Each operation has its own countdown, so operations that are always called together are all sampled.
+ */
+_Thread_local int metricsCountdown[METRIC_OPERATIONS];
+
+/**
+ * These macros measure an instrumented operation.
+ * METRICS_START reads the clock if the call is one of the sampled calls,
+ * and METRICS_STOP counts the call and records its latency if it was timed.
+ * When metrics are off, each costs a single test of metricsFormat.
+ */
+#define METRICS_START(operation, start) uint64_t start = metricsFormat != 0 ? startMetric(operation) : 0
+#define METRICS_STOP(operation, start) \
+    do { if (metricsFormat != 0) recordMetric(operation, start); } while (0)
+
+/**
+ * This function starts measuring a call, reading the clock only for one call in METRICS_SAMPLE_INTERVAL.
+ *
+ * @param operation The operation, one of the METRIC_ constants.
+ * @return The current tick count if the call is timed, 0 otherwise.
+ */
+uint64_t startMetric(int operation)
+{
+    if (--metricsCountdown[operation] > 0)
+        return 0;
+
+    metricsCountdown[operation] = METRICS_SAMPLE_INTERVAL;
+    return readTicks();
+}
+
+/**
+ * This function records one call of an instrumented operation in the calling thread's metrics block.
+ *
+ * @param operation The operation, one of the METRIC_ constants.
+ * @param start The tick count read when the operation started, or 0 if the call was not timed.
+ */
+void recordMetric(int operation, uint64_t start)
+{
+    struct metricsBlock *block = threadMetrics();
+
+    if (block == NULL)
+        return;
+
+    addToCounter(&block->calls[operation], 1);
+
+    if (start != 0)
+    {
+        uint64_t elapsed = readTicks() - start;
+
+        addToCounter(&block->samples[operation], 1);
+        addToCounter(&block->totalTicks[operation], elapsed);
+        addToCounter(&block->histogram[operation][histogramBucket(elapsed)], 1);
+    }
+}
+
+/**
+ * This function counts an input that was rejected as an invalid date.
+ */
+void recordValidationFailure(void)
+{
+    struct metricsBlock *block;
+
+    if (metricsFormat != 0 && (block = threadMetrics()) != NULL)
+        addToCounter(&block->validationFailures, 1);
+}
+
+/**
+ * This function is the handler of the SIGUSR1 signal. It only sets a flag,
+ * and the dump itself is written by checkMetricsDump() outside the signal handler.
+ *
+ * @param signalNumber The number of the signal.
+ */
+void requestMetricsDump(int signalNumber)
+{
+    (void)signalNumber;
+    metricsDumpRequested = 1;
+}
+
+/**
+ * This function turns on the metrics in a given output format.
+ * On systems with SIGUSR1, sending that signal to the process writes a dump at the next checkpoint.
+ *
+ * @param format METRICS_PROMETHEUS or METRICS_JSON.
+ */
+void enableMetrics(int format)
+{
+    metricsStartNanoseconds = readNanoseconds();
+    metricsStartTicks = readTicks();
+    metricsFormat = format;
+#ifdef SIGUSR1
+    signal(SIGUSR1, requestMetricsDump);
+#endif
+}
+
+/**
+ * This function writes the metrics of all threads to a stream,
+ * either in the Prometheus text exposition format or as a JSON object.
+ * The call counters are exact, while the latency histograms only hold the timed (sampled) calls.
+ * The Prometheus histograms use one bucket per power of two of nanoseconds,
+ * and the JSON object lists the main percentiles of every operation.
+ *
+ * @param stream The stream to write the metrics to.
+ */
+void dumpMetrics(FILE *stream)
+{
+    static uint64_t histogram[METRIC_OPERATIONS][HISTOGRAM_BUCKETS];
+    uint64_t calls[METRIC_OPERATIONS] = {0}, samples[METRIC_OPERATIONS] = {0};
+    uint64_t totalTicks[METRIC_OPERATIONS] = {0}, validationFailures = 0;
+    double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+    double nanosecondsPerTick;
+
+    // Add up the blocks of all threads
+    memset(histogram, 0, sizeof(histogram));
+    for (struct metricsBlock *block = atomic_load(&metricsBlocks); block != NULL; block = block->next)
+    {
+        for (int operation = 0; operation < METRIC_OPERATIONS; operation++)
+        {
+            calls[operation] += atomic_load_explicit(&block->calls[operation], memory_order_relaxed);
+            samples[operation] += atomic_load_explicit(&block->samples[operation], memory_order_relaxed);
+            totalTicks[operation] += atomic_load_explicit(&block->totalTicks[operation], memory_order_relaxed);
+            for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+                histogram[operation][bucket] += atomic_load_explicit(&block->histogram[operation][bucket],
+                                                                     memory_order_relaxed);
+        }
+        validationFailures += atomic_load_explicit(&block->validationFailures, memory_order_relaxed);
+    }
+
+    // Measure the length of a tick against the nanosecond clock
+    uint64_t elapsedTicks = readTicks() - metricsStartTicks;
+    uint64_t elapsedNanoseconds = readNanoseconds() - metricsStartNanoseconds;
+    nanosecondsPerTick = elapsedTicks > 0 ? (double)elapsedNanoseconds / (double)elapsedTicks : 1.0;
+
+    if (metricsFormat == METRICS_PROMETHEUS)
+    {
+        fprintf(stream, "# HELP calendar_operations_total Number of calls of each operation.\n");
+        fprintf(stream, "# TYPE calendar_operations_total counter\n");
+        for (int operation = 0; operation < METRIC_OPERATIONS; operation++)
+            fprintf(stream, "calendar_operations_total{operation=\"%s\"} %llu\n",
+                    metricNames[operation], (unsigned long long)calls[operation]);
+
+        fprintf(stream, "# HELP calendar_validation_failures_total Number of inputs rejected as invalid dates.\n");
+        fprintf(stream, "# TYPE calendar_validation_failures_total counter\n");
+        fprintf(stream, "calendar_validation_failures_total %llu\n", (unsigned long long)validationFailures);
+
+        fprintf(stream, "# HELP calendar_operation_duration_seconds Latency of each operation, sampled.\n");
+        fprintf(stream, "# TYPE calendar_operation_duration_seconds histogram\n");
+        for (int operation = 0; operation < METRIC_OPERATIONS; operation++)
+        {
+            uint64_t cumulative = 0;
+            int bucket = 0;
+
+            // Merge the fine buckets into one bucket per power of two nanoseconds, up to about 1 second
+            for (int power = 0; power <= 30; power++)
+            {
+                double limit = (double)(1u << power);
+
+                while (bucket < HISTOGRAM_BUCKETS
+                       && (double)histogramBucketStart(bucket) * nanosecondsPerTick < limit)
+                    cumulative += histogram[operation][bucket++];
+
+                fprintf(stream, "calendar_operation_duration_seconds_bucket{operation=\"%s\",le=\"%.9g\"} %llu\n",
+                        metricNames[operation], limit * 1e-9, (unsigned long long)cumulative);
+            }
+
+            fprintf(stream, "calendar_operation_duration_seconds_bucket{operation=\"%s\",le=\"+Inf\"} %llu\n",
+                    metricNames[operation], (unsigned long long)samples[operation]);
+            fprintf(stream, "calendar_operation_duration_seconds_sum{operation=\"%s\"} %.9g\n",
+                    metricNames[operation], (double)totalTicks[operation] * nanosecondsPerTick * 1e-9);
+            fprintf(stream, "calendar_operation_duration_seconds_count{operation=\"%s\"} %llu\n",
+                    metricNames[operation], (unsigned long long)samples[operation]);
+        }
+        return;
+    }
+
+    fprintf(stream, "{\"validation_failures\": %llu, \"operations\": {", (unsigned long long)validationFailures);
+    for (int operation = 0; operation < METRIC_OPERATIONS; operation++)
+    {
+        fprintf(stream, "%s\n  \"%s\": {\"count\": %llu, \"samples\": %llu, \"mean_ns\": %.1f",
+                operation > 0 ? "," : "", metricNames[operation], (unsigned long long)calls[operation],
+                (unsigned long long)samples[operation],
+                samples[operation] > 0 ? (double)totalTicks[operation] * nanosecondsPerTick / (double)samples[operation] : 0.0);
+
+        // Each percentile is reported as the start of the bucket that reaches it
+        for (int i = 0; i < 4; i++)
+        {
+            uint64_t target = (uint64_t)(percentiles[i] * (double)samples[operation]), cumulative = 0;
+            int bucket = 0;
+
+            while (bucket < HISTOGRAM_BUCKETS - 1 && cumulative + histogram[operation][bucket] <= target)
+                cumulative += histogram[operation][bucket++];
+
+            fprintf(stream, ", \"p%g_ns\": %.1f", percentiles[i] * 100,
+                    samples[operation] > 0 ? (double)histogramBucketStart(bucket) * nanosecondsPerTick : 0.0);
+        }
+        fprintf(stream, "}");
+    }
+    fprintf(stream, "\n}}\n");
+}
+
+/**
+ * This function writes a metrics dump to the standard error stream if one was requested with SIGUSR1.
+ * It is called at points where a long-running mode can pause briefly, such as between chunks of a batch.
+ */
+void checkMetricsDump(void)
+{
+    if (metricsDumpRequested)
+    {
+        metricsDumpRequested = 0;
+        dumpMetrics(stderr);
+    }
+}
+
+/**
+ * Tracing records how long each stage of the batch modes takes, chunk by chunk: reading, parsing, converting,
+ * formatting and writing, and in the threaded modes the work of every thread. It is off by default and is
+ * turned on with the --trace FILE option, which writes the spans at exit in the Chrome trace event format,
+ * to be opened in chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Every thread records its spans into its own ring buffer of TRACE_RING_SPANS spans, so recording takes no lock.
+ * The rings are linked into a list like the metrics blocks. When a ring is full its oldest spans are overwritten,
+ * so a long run keeps its most recent spans. While tracing is off, a span costs a single test of tracePath.
+ */
+#define TRACE_RING_SPANS (1 << 16)
+
+struct traceSpan
+{
+    const char *name; // The name of the stage, a string constant
+    uint64_t start; // The start of the span, from readNanoseconds()
+    uint64_t duration; // The length of the span in nanoseconds
+};
+
+struct traceRing
+{
+    struct traceSpan spans[TRACE_RING_SPANS];
+    uint64_t count; // The number of spans recorded; the ring holds the last TRACE_RING_SPANS of them
+    int thread; // The number of the thread, from 1 in the order the threads recorded their first span
+    struct traceRing *next;
+};
+
+/**
+ * These variables hold the state of tracing: the file the trace is written to (NULL while tracing is off),
+ * the list of per-thread rings, the number of rings and the time tracing was turned on.
+ */
+char *tracePath = NULL;
+_Atomic(struct traceRing *) traceRings = NULL;
+atomic_int traceThreadCount;
+uint64_t traceStartNanoseconds;
+
+/**
+ * These macros record a span of a traced stage.
+ * TRACE_START reads the clock, and TRACE_STOP records the span in the ring of the calling thread.
+ */
+#define TRACE_START(start) uint64_t start = tracePath != NULL ? readNanoseconds() : 0
+#define TRACE_STOP(name, start) \
+    do { if (tracePath != NULL) recordTraceSpan(name, start); } while (0)
+
+/**
+ * This function records a span in the ring of the calling thread, creating the ring on first use.
+ *
+ * @param name The name of the stage, a string constant.
+ * @param start The time the stage started, from readNanoseconds().
+ */
+void recordTraceSpan(const char *name, uint64_t start)
+{
+    static _Thread_local struct traceRing *ring = NULL;
+    uint64_t end = readNanoseconds();
+
+    if (ring == NULL)
+    {
+        ring = malloc(sizeof(struct traceRing));
+        if (ring == NULL)
+            return;
+
+        ring->count = 0;
+        ring->thread = atomic_fetch_add(&traceThreadCount, 1) + 1;
+        ring->next = atomic_load(&traceRings);
+        while (!atomic_compare_exchange_weak(&traceRings, &ring->next, ring))
+            ;
+    }
+
+    struct traceSpan *span = &ring->spans[ring->count++ % TRACE_RING_SPANS];
+    span->name = name;
+    span->start = start;
+    span->duration = end - start;
+}
+
+/**
+ * This function writes the spans of all threads to the trace file as a JSON object in the Chrome trace event format.
+ * Every span becomes a complete ("X") event with its start and duration in microseconds.
+ * It is registered with atexit() by the --trace option, when the other threads have finished.
+ */
+void writeTraceAtExit(void)
+{
+    FILE *file;
+    uint64_t dropped = 0;
+    int first = 1;
+
+    if (tracePath == NULL)
+        return;
+
+    file = fopen(tracePath, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "%s %s\n", RED_TEXT "Could not write" RESET, tracePath);
+        return;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for (struct traceRing *ring = atomic_load(&traceRings); ring != NULL; ring = ring->next)
+    {
+        uint64_t firstSpan = ring->count > TRACE_RING_SPANS ? ring->count - TRACE_RING_SPANS : 0;
+
+        fprintf(file, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                      "\"args\": {\"name\": \"thread %d\"}}", first ? "" : ",", ring->thread, ring->thread);
+        first = 0;
+
+        for (uint64_t i = firstSpan; i < ring->count; i++)
+        {
+            struct traceSpan *span = &ring->spans[i % TRACE_RING_SPANS];
+
+            fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"calendar\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                          "\"ts\": %.3f, \"dur\": %.3f}", span->name, ring->thread,
+                    (double)(span->start - traceStartNanoseconds) / 1000.0, (double)span->duration / 1000.0);
+        }
+        dropped += firstSpan;
+    }
+    fprintf(file, "\n]}\n");
+
+    if (fclose(file) != 0)
+        fprintf(stderr, "%s %s\n", RED_TEXT "Could not write" RESET, tracePath);
+    if (dropped > 0)
+        fprintf(stderr, "The trace holds the last %d spans of each thread; %llu older spans were dropped.\n",
+                TRACE_RING_SPANS, (unsigned long long)dropped);
+}
+
+#ifdef _WIN32
 /**
  * This function reads keyboard input from the user.
  * It uses the Windows API function to handle input from the standard input (keyboard).
@@ -148,62 +764,499 @@ int readKeyboardInput()
         }
     }
 }
-
-/**
- * This function displays the calendar menu to the user.
- * It uses the printf() function to print out the menu options and information.
- * The menu includes options for returning to the main menu,
- as well as information about the valid range of calendar years and months.
- */
-void calendarMenu()
-{
-    printf("\n%s", BLACK_TEXT WHITE_BACKGROUND "               Calendar Menu               \n" RESET);
-    printf("\n%s Back to menu!\n",
-           GRAY_TEXT "[0]" RESET);
-    printf("\n%s Calendar Year is between %s and %s.\n",
-           GRAY_TEXT "{!}" RESET,
-           UNDERLINE GRAY_TEXT "1206" RESET,
-           UNDERLINE GRAY_TEXT "1498" RESET);
-    printf("\n%s Calendar Month is between %s and %s.\n",
-           GRAY_TEXT "{!}" RESET,
-           UNDERLINE GRAY_TEXT "1" RESET,
-           UNDERLINE GRAY_TEXT "12" RESET);
-    printf("\n%s\n", BLACK_TEXT WHITE_BACKGROUND "-------------------------------------------" RESET);
-    // Prompt the user to enter a year
-    printf("\nPlease enter a year: ");
-}
-
+#else
 /**
- * This function prompts the user to input a calendar year and validates the input.
- * It uses the calendarMenu() function to display the calendar menu to the user.
- * The function then uses scanf() to read the inputted year from the user.
- * If the user enters 0, indicating they want to go back to the main menu, the function returns 0.
- * If the inputted year is not within the valid range of 1206 to 1498, the function displays an error message,
- prompts the user to try again, and clears the input buffer and screen.
- * The function continues to loop until a valid year is inputted.
- * Once a valid year is inputted, the function returns the year.
+ * This function reads keyboard input from the user on systems without the Windows console API.
+ * It switches the terminal to raw mode, so key presses are read immediately without being echoed,
+ * and decodes the escape sequences sent for the arrow keys.
+ * A lone Escape key is told apart from an escape sequence by waiting briefly for the rest of the sequence.
+ * The terminal settings are restored before the function returns.
  *
- * @return An integer representing the inputted calendar year, or 0 if the user wants to go back to the main menu.
+ * @return An integer representing the keyboard input, with the same values as the Windows version:
+ *         0 for Escape (or the end of the input), 1 for Left, 2 for Right, 3 for Up and 4 for Down.
  */
-int inputCalendarYear(void)
+int readKeyboardInput()
 {
-    int year;
+    struct termios original, raw;
+    unsigned char key = 0;
+    int result = -1;
 
-    do
+    // Switch the terminal to raw mode
+    tcgetattr(STDIN_FILENO, &original);
+    raw = original;
+    raw.c_lflag &= ~(ICANON | ECHO);
+
+    while (result < 0)
     {
-        // Display the calendar menu
-        calendarMenu();
-        // Read the inputted year
-        scanf("%d", &year);
+        // Wait for the next key press
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
 
-        if (year == 0)
+        if (read(STDIN_FILENO, &key, 1) != 1)
         {
-            // Return 0 to go back to the main menu
-            return 0;
+            result = 0; // End of the input
+            break;
         }
 
-        if (year < 1206 || year > 1498)
-        {
+        if (key != 27)
+            continue; // Not an Escape key or an arrow key
+
+        // Arrow keys send ESC [ followed by a letter, so wait a tenth of a second for the rest of the sequence
+        raw.c_cc[VMIN] = 0;
+        raw.c_cc[VTIME] = 1;
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+        if (read(STDIN_FILENO, &key, 1) != 1 || key != '[' || read(STDIN_FILENO, &key, 1) != 1)
+        {
+            result = 0; // Escape key pressed
+        }
+        else if (key == 'D')
+        {
+            result = 1; // Left arrow key pressed
+        }
+        else if (key == 'C')
+        {
+            result = 2; // Right arrow key pressed
+        }
+        else if (key == 'A')
+        {
+            result = 3; // Up arrow key pressed
+        }
+        else if (key == 'B')
+        {
+            result = 4; // Down arrow key pressed
+        }
+    }
+
+    // Restore the terminal settings
+    tcsetattr(STDIN_FILENO, TCSANOW, &original);
+    return result;
+}
+#endif
+
+/**
+ * This table holds the two-digit decimal representation of every number from 0 to 99.
+ * It lets appendNumber() emit two digits per step instead of dividing by 10 for every digit.
+ */
+char digitPairs[] =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+/**
+ * An output buffer collects text in memory and writes it to a file in large blocks,
+ * so that exporting many lines does not cost one write per line.
+ */
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+
+struct outputBuffer
+{
+    FILE *file; // The file the buffer is flushed to
+    int length; // The number of bytes waiting in data[]
+    char data[OUTPUT_BUFFER_SIZE];
+};
+
+/**
+ * This function writes the contents of an output buffer to its file and empties the buffer.
+ *
+ * @param out Pointer to the output buffer.
+ */
+void flushOutput(struct outputBuffer *out)
+{
+    TRACE_START(start);
+
+    if (out->length > 0)
+        fwrite(out->data, 1, out->length, out->file);
+    out->length = 0;
+
+    TRACE_STOP("write", start);
+}
+
+/**
+ * This function appends a number of bytes to an output buffer, flushing it first if there is not enough room.
+ *
+ * @param out Pointer to the output buffer.
+ * @param bytes The bytes to append.
+ * @param count The number of bytes to append.
+ */
+void appendBytes(struct outputBuffer *out, const char *bytes, int count)
+{
+    if (out->length + count > OUTPUT_BUFFER_SIZE)
+    {
+        flushOutput(out);
+
+        if (count > OUTPUT_BUFFER_SIZE)
+        {
+            // Write very large blocks directly
+            TRACE_START(start);
+            fwrite(bytes, 1, count, out->file);
+            TRACE_STOP("write", start);
+            return;
+        }
+    }
+
+    memcpy(out->data + out->length, bytes, count);
+    out->length += count;
+}
+
+/**
+ * This function appends a null-terminated string to an output buffer.
+ *
+ * @param out Pointer to the output buffer.
+ * @param text The string to append.
+ */
+void appendText(struct outputBuffer *out, const char *text)
+{
+    appendBytes(out, text, (int)strlen(text));
+}
+
+/**
+ * This function appends a non-negative number to an output buffer in decimal.
+ * The number is padded with leading zeros up to the given width, like printf("%0*d").
+ *
+ * @param out Pointer to the output buffer.
+ * @param value The number to append.
+ * @param width The minimum number of digits to write.
+ */
+void appendNumber(struct outputBuffer *out, int value, int width)
+{
+    char digits[16];
+    int position = sizeof(digits);
+
+    // Write two digits at a time from the end
+    while (value >= 100)
+    {
+        position -= 2;
+        memcpy(digits + position, digitPairs + (value % 100) * 2, 2);
+        value /= 100;
+    }
+
+    if (value >= 10)
+    {
+        position -= 2;
+        memcpy(digits + position, digitPairs + value * 2, 2);
+    }
+    else
+    {
+        digits[--position] = (char)('0' + value);
+    }
+
+    // Pad with zeros up to the requested width
+    while ((int)sizeof(digits) - position < width)
+        digits[--position] = '0';
+
+    appendBytes(out, digits + position, sizeof(digits) - position);
+}
+
+/**
+ * These constants select the script of the digits and names in the output.
+ * The Latin script is the default; the --persian option switches to Persian digits and month names in UTF-8.
+ */
+#define SCRIPT_LATIN 0
+#define SCRIPT_PERSIAN 1
+
+int outputScript = SCRIPT_LATIN;
+
+/**
+ * This array holds the titles of the Shamsi months in Persian script for the calendar grid,
+ * padded like shamsiMonths[] so they are centered in a bar of the same width.
+ */
+char *persianShamsiMonths[] = {
+        " ",
+        BLACK_TEXT WHITE_BACKGROUND "               فروردین                " RESET,
+        BLACK_TEXT WHITE_BACKGROUND "               اردیبهشت               " RESET,
+        BLACK_TEXT WHITE_BACKGROUND "                خرداد                 " RESET,
+        BLACK_TEXT WHITE_BACKGROUND "                 تیر                  " RESET,
+        BLACK_TEXT WHITE_BACKGROUND "                مرداد                 " RESET,
+        BLACK_TEXT WHITE_BACKGROUND "                شهریور                " RESET,
+        BLACK_TEXT WHITE_BACKGROUND "                 مهر                  " RESET,
+        BLACK_TEXT WHITE_BACKGROUND "                 آبان                 " RESET,
+        BLACK_TEXT WHITE_BACKGROUND "                 آذر                  " RESET,
+        BLACK_TEXT WHITE_BACKGROUND "                  دی                  " RESET,
+        BLACK_TEXT WHITE_BACKGROUND "                 بهمن                 " RESET,
+        BLACK_TEXT WHITE_BACKGROUND "                اسفند                 " RESET
+};
+
+/**
+ * These strings are the column headers of the calendar grid, from Saturday to Friday, in each script.
+ * Every column is six characters wide.
+ */
+char latinWeekdayHeader[] =
+        GRAY_TEXT "SH" RESET "    " GRAY_TEXT "YE" RESET "    " GRAY_TEXT "DO" RESET "    " GRAY_TEXT "SE" RESET "    "
+        GRAY_TEXT "CH" RESET "    " GRAY_TEXT "PA" RESET "    " GRAY_TEXT "JO" RESET;
+char persianWeekdayHeader[] =
+        GRAY_TEXT "ش" RESET "     " GRAY_TEXT "ی" RESET "     " GRAY_TEXT "د" RESET "     " GRAY_TEXT "س" RESET "     "
+        GRAY_TEXT "چ" RESET "     " GRAY_TEXT "پ" RESET "     " GRAY_TEXT "ج" RESET;
+
+/**
+ * This table holds every number from 0 to 99 as two Persian digits (U+06F0 to U+06F9) in UTF-8, four bytes per number.
+ * Every digit d is the two bytes 0xDB, 0xB0 + d. The table is constant, so the threads of the batch modes can share it,
+ * and lets appendPersianNumber() emit two digits per step like appendNumber().
+ */
+#define PERSIAN_DIGIT_0 "\xDB\xB0"
+#define PERSIAN_DIGIT_1 "\xDB\xB1"
+#define PERSIAN_DIGIT_2 "\xDB\xB2"
+#define PERSIAN_DIGIT_3 "\xDB\xB3"
+#define PERSIAN_DIGIT_4 "\xDB\xB4"
+#define PERSIAN_DIGIT_5 "\xDB\xB5"
+#define PERSIAN_DIGIT_6 "\xDB\xB6"
+#define PERSIAN_DIGIT_7 "\xDB\xB7"
+#define PERSIAN_DIGIT_8 "\xDB\xB8"
+#define PERSIAN_DIGIT_9 "\xDB\xB9"
+#define PERSIAN_DIGIT_PAIRS(tens) \
+    tens PERSIAN_DIGIT_0 tens PERSIAN_DIGIT_1 tens PERSIAN_DIGIT_2 tens PERSIAN_DIGIT_3 tens PERSIAN_DIGIT_4 \
+    tens PERSIAN_DIGIT_5 tens PERSIAN_DIGIT_6 tens PERSIAN_DIGIT_7 tens PERSIAN_DIGIT_8 tens PERSIAN_DIGIT_9
+
+static const char persianDigitPairs[100 * 4 + 1] =
+        PERSIAN_DIGIT_PAIRS(PERSIAN_DIGIT_0) PERSIAN_DIGIT_PAIRS(PERSIAN_DIGIT_1) PERSIAN_DIGIT_PAIRS(PERSIAN_DIGIT_2)
+        PERSIAN_DIGIT_PAIRS(PERSIAN_DIGIT_3) PERSIAN_DIGIT_PAIRS(PERSIAN_DIGIT_4) PERSIAN_DIGIT_PAIRS(PERSIAN_DIGIT_5)
+        PERSIAN_DIGIT_PAIRS(PERSIAN_DIGIT_6) PERSIAN_DIGIT_PAIRS(PERSIAN_DIGIT_7) PERSIAN_DIGIT_PAIRS(PERSIAN_DIGIT_8)
+        PERSIAN_DIGIT_PAIRS(PERSIAN_DIGIT_9);
+
+/**
+ * This function appends a non-negative number to an output buffer in Persian digits.
+ * The number is padded with leading zeros up to the given width, like appendNumber().
+ *
+ * @param out Pointer to the output buffer.
+ * @param value The number to append.
+ * @param width The minimum number of digits to write.
+ */
+void appendPersianNumber(struct outputBuffer *out, int value, int width)
+{
+    char digits[32];
+    int position = sizeof(digits);
+
+    // Write two digits (four bytes) at a time from the end
+    while (value >= 100)
+    {
+        position -= 4;
+        memcpy(digits + position, persianDigitPairs + (value % 100) * 4, 4);
+        value /= 100;
+    }
+
+    if (value >= 10)
+    {
+        position -= 4;
+        memcpy(digits + position, persianDigitPairs + value * 4, 4);
+    }
+    else
+    {
+        position -= 2;
+        memcpy(digits + position, persianDigitPairs + value * 4 + 2, 2);
+    }
+
+    // Pad with zeros up to the requested width
+    while (((int)sizeof(digits) - position) / 2 < width && position >= 2)
+    {
+        position -= 2;
+        memcpy(digits + position, persianDigitPairs, 2);
+    }
+
+    appendBytes(out, digits + position, sizeof(digits) - position);
+}
+
+/**
+ * This function appends a number to an output buffer in the digits of the output script.
+ * Machine-readable output such as iCalendar files always uses appendNumber() instead.
+ *
+ * @param out Pointer to the output buffer.
+ * @param value The number to append.
+ * @param width The minimum number of digits to write.
+ */
+void appendLocalNumber(struct outputBuffer *out, int value, int width)
+{
+    if (outputScript == SCRIPT_PERSIAN)
+        appendPersianNumber(out, value, width);
+    else
+        appendNumber(out, value, width);
+}
+
+/**
+ * The size of a buffer that holds any number or date written by formatLocalNumber() or formatLocalDate().
+ */
+#define LOCAL_TEXT_SIZE 64
+
+/**
+ * This function writes a number as text in the digits of the output script, for the messages of the menu,
+ * which are printed with printf() rather than through an output buffer.
+ *
+ * @param text The buffer to write to, of LOCAL_TEXT_SIZE bytes.
+ * @param value The number.
+ * @param width The minimum number of digits to write.
+ * @return text.
+ */
+char *formatLocalNumber(char *text, int value, int width)
+{
+    char digits[16];
+    int length = snprintf(digits, sizeof(digits), "%0*d", width, value), size = 0;
+
+    for (int i = 0; i < length; i++)
+    {
+        if (outputScript == SCRIPT_PERSIAN && digits[i] >= '0' && digits[i] <= '9')
+        {
+            // The second digit of the pair 0d is the Persian digit d
+            memcpy(text + size, persianDigitPairs + (digits[i] - '0') * 4 + 2, 2);
+            size += 2;
+        }
+        else
+            text[size++] = digits[i];
+    }
+    text[size] = '\0';
+
+    return text;
+}
+
+/**
+ * This function writes a date as YEAR/MONTH/DAY in the digits of the output script, for the messages of the menu.
+ *
+ * @param text The buffer to write to, of LOCAL_TEXT_SIZE bytes.
+ * @param year The year.
+ * @param month The month.
+ * @param day The day.
+ * @param width The minimum number of digits of the month and the day.
+ * @return text.
+ */
+char *formatLocalDate(char *text, int year, int month, int day, int width)
+{
+    char number[LOCAL_TEXT_SIZE];
+
+    snprintf(text, LOCAL_TEXT_SIZE, "%s/", formatLocalNumber(number, year, 1));
+    strcat(text, formatLocalNumber(number, month, width));
+    strcat(text, "/");
+    strcat(text, formatLocalNumber(number, day, width));
+
+    return text;
+}
+
+/**
+ * This function writes the grid of a Shamsi month to an output buffer: the title, the weekday headers,
+ * the days in weeks starting on Saturday, and a bar with the year. The names and digits are in the output script.
+ * Every day takes a column of six characters; a Persian digit is two bytes long but one character wide,
+ * so the padding is counted in digits rather than bytes.
+ *
+ * @param out Pointer to the output buffer.
+ * @param year The calendar year.
+ * @param month The calendar month.
+ * @param daycode The daycode (day of the week) for the first day of the month.
+ * @param monthLength The number of days in the month.
+ */
+void appendCalendarGrid(struct outputBuffer *out, int year, int month, int daycode, int monthLength)
+{
+    int persian = outputScript == SCRIPT_PERSIAN;
+
+    appendBytes(out, "\n", 1);
+    appendText(out, persian ? persianShamsiMonths[month] : shamsiMonths[month]);
+    appendBytes(out, "\n\n", 2);
+    appendText(out, persian ? persianWeekdayHeader : latinWeekdayHeader);
+    appendBytes(out, "\n\n", 2);
+
+    for (int day = 1; day <= daycode; day++)
+    {
+        // Leave empty columns for the days before the start of the month
+        appendBytes(out, "      ", 6);
+    }
+
+    for (int day = 1; day <= monthLength; day++)
+    {
+        // Write each day number, left-aligned in its column
+        appendLocalNumber(out, day, 1);
+        appendBytes(out, "      ", day < 10 ? 5 : 4);
+
+        if ((day + daycode) % 7 == 0 || day == monthLength)
+            // Start a new line after the last day of the week or the last day of the month
+            appendBytes(out, "\n", 1);
+    }
+
+    // Write a horizontal line with the calendar year
+    appendText(out, "\n" BLACK_TEXT WHITE_BACKGROUND "---------------- ");
+    appendLocalNumber(out, year, 1);
+    appendText(out, " ----------------" RESET "\n");
+}
+
+/**
+ * This function reads the --persian option, which can be given with any mode (including the menu),
+ * switches the output to Persian digits and month names and removes the option from the arguments.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments, changed in place.
+ * @return The number of arguments left.
+ */
+int parseScriptOption(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--persian") != 0)
+            continue;
+
+        outputScript = SCRIPT_PERSIAN;
+
+        // Remove the option
+        for (int j = i; j + 1 <= argc; j++)
+            argv[j] = argv[j + 1];
+        return argc - 1;
+    }
+
+    return argc;
+}
+
+/**
+ * This function displays the calendar menu to the user.
+ * It uses the printf() function to print out the menu options and information.
+ * The menu includes options for returning to the main menu,
+ as well as information about the valid range of calendar years and months.
+ */
+void calendarMenu()
+{
+    printf("\n%s", BLACK_TEXT WHITE_BACKGROUND "               Calendar Menu               \n" RESET);
+    printf("\n%s Back to menu!\n",
+           GRAY_TEXT "[0]" RESET);
+    printf("\n%s Calendar Year is between %s and %s.\n",
+           GRAY_TEXT "{!}" RESET,
+           UNDERLINE GRAY_TEXT "1206" RESET,
+           UNDERLINE GRAY_TEXT "1498" RESET);
+    printf("\n%s Calendar Month is between %s and %s.\n",
+           GRAY_TEXT "{!}" RESET,
+           UNDERLINE GRAY_TEXT "1" RESET,
+           UNDERLINE GRAY_TEXT "12" RESET);
+    printf("\n%s\n", BLACK_TEXT WHITE_BACKGROUND "-------------------------------------------" RESET);
+    // Prompt the user to enter a year
+    printf("\nPlease enter a year: ");
+}
+
+/**
+ * This function prompts the user to input a calendar year and validates the input.
+ * It uses the calendarMenu() function to display the calendar menu to the user.
+ * The function then uses scanf() to read the inputted year from the user.
+ * If the user enters 0, indicating they want to go back to the main menu, the function returns 0.
+ * If the inputted year is not within the valid range of 1206 to 1498, the function displays an error message,
+ prompts the user to try again, and clears the input buffer and screen.
+ * The function continues to loop until a valid year is inputted.
+ * Once a valid year is inputted, the function returns the year.
+ *
+ * @return An integer representing the inputted calendar year, or 0 if the user wants to go back to the main menu.
+ */
+int inputCalendarYear(void)
+{
+    int year;
+
+    do
+    {
+        // Display the calendar menu
+        calendarMenu();
+        // Read the inputted year
+        scanf("%d", &year);
+
+        if (year == 0)
+        {
+            // Return 0 to go back to the main menu
+            return 0;
+        }
+
+        if (year < 1206 || year > 1498)
+        {
             printf("\n%s.\n", RED_TEXT "Invalid year! Please enter a year between 1206 and 1498" RESET);
             printf("\nPress Enter to try again...");
             // Clear the input buffer
@@ -351,6 +1404,51 @@ int determineLeapYear(int year)
         return 0; // Year is not a leap year
 }
 
+/**
+ * This string holds the help for the arrow keys and the prompt written under the calendar grid.
+ */
+char calendarNavigation[] =
+        ITALIC " " GRAY_TEXT
+        "\n        " RESET "RIGHT" ITALIC " " GRAY_TEXT ">>" " " RESET "NEXT MONTH!" ITALIC GRAY_TEXT " \n"
+        "\n        " RESET "LEFT" ITALIC " " GRAY_TEXT ">>" " " RESET "PREVIOUS MONTH!" ITALIC GRAY_TEXT " \n"
+        "\n        " RESET "UP" ITALIC " " GRAY_TEXT ">>" " " RESET "NEXT YEAR!" ITALIC GRAY_TEXT " \n"
+        "\n        " RESET "DOWN" ITALIC " " GRAY_TEXT ">>" " " RESET "PREVIOUS YEAR!" ITALIC GRAY_TEXT " \n"
+        RESET
+        "\n" BLACK_TEXT WHITE_BACKGROUND "--------------------------------------" RESET "\n"
+        "\nPress ESC to go back...";
+
+/**
+ * This function returns the number of days that calendar() shows for a month.
+ * Esfand has 29 days in the years for which determineLeapYear() returns 1 and 30 days otherwise.
+ * Unlike calendar(), it does not change days_in_shamsi_month[], so it can be called from any thread.
+ *
+ * @param year The calendar year.
+ * @param month The calendar month.
+ * @return The number of days in the month.
+ */
+int calendarFrameMonthLength(int year, int month)
+{
+    if (month == 12)
+        return determineLeapYear(year) == 1 ? 29 : 30;
+
+    return days_in_shamsi_month[month];
+}
+
+/**
+ * This function writes the whole screen of calendar() for a month to an output buffer:
+ * the grid of the month in the output script, followed by the help for the arrow keys.
+ *
+ * @param out Pointer to the output buffer.
+ * @param year The calendar year.
+ * @param month The calendar month.
+ * @param daycode The daycode (day of the week) for the first day of the month.
+ */
+void appendCalendarFrame(struct outputBuffer *out, int year, int month, int daycode)
+{
+    appendCalendarGrid(out, year, month, daycode, calendarFrameMonthLength(year, month));
+    appendText(out, calendarNavigation);
+}
+
 /**
  * This function displays the calendar for a given year and month.
  * It takes the calendar year, month, and daycode (day of the week) as parameters.
@@ -358,13 +1456,10 @@ int determineLeapYear(int year)
  * If the year is a leap year,
  * it sets the number of days in the 12th month (Esfand) to 29 in the days_in_shamsi_month array.
  * If the year is not a leap year, it sets the number of days in the 12th month to 30.
- * The function then prints the month name and the days of the week as column headers using printf().
- * It uses escape codes to set the text color to gray for the column headers.
- * The function then prints the calendar days, starting from the appropriate daycode.
- * It uses a loop to print empty spaces for the days before the start of the month.
- * It then prints each day number, using printf() with the %-6d format specifier for left-aligned printing.
- * If the day is the last day of the week or the last day of the month, a new line is printed.
- * Finally, the function prints a horizontal line with the calendar year, and prompts the user to press ESC to go back.
+ * The function then writes the grid of the month with appendCalendarGrid(): the month name, the days of the week
+ * as gray column headers, the calendar days starting from the appropriate daycode, and a horizontal line with the year.
+ * Finally, it adds the navigation keys and the prompt to press ESC to go back. The whole screen is built
+ * with appendCalendarFrame() in an output buffer and written at once, in Latin or Persian script depending on the --persian option.
  *
  * @param year The calendar year.
  * @param month The calendar month.
@@ -372,7 +1467,8 @@ int determineLeapYear(int year)
  */
 void calendar(int year, int month, int daycode)
 {
-    int day;
+    static struct outputBuffer out;
+    METRICS_START(METRIC_CALENDAR, start);
 
     if (determineLeapYear(year) == 0)
     {
@@ -385,53 +1481,451 @@ void calendar(int year, int month, int daycode)
         days_in_shamsi_month[12] = 29;
     }
 
-    printf("\n%s\n\n%s    %s    %s    %s    %s    %s    %s\n\n",
-            // Print the month name
-           shamsiMonths[month],
-            // Print the column headers with gray text color
-           GRAY_TEXT "SH" RESET,
-           GRAY_TEXT "YE" RESET,
-           GRAY_TEXT "DO" RESET,
-           GRAY_TEXT "SE" RESET,
-           GRAY_TEXT "CH" RESET,
-           GRAY_TEXT "PA" RESET,
-           GRAY_TEXT "JO" RESET
-    );
+    // Write the grid of the month in the output script, and the info for the calendar navigation
+    out.file = stdout;
+    out.length = 0;
+    appendCalendarFrame(&out, year, month, daycode);
+    flushOutput(&out);
 
-    for (day = 1; day <= daycode; day++)
-    {
-        // Print empty spaces for days before the start of the month
-        printf("      ");
-    }
-
-    for (day = 1; day <= days_in_shamsi_month[month]; day++)
-    {
-        // Print each day number with left-aligned formatting
-        printf("%-6d", day);
+    METRICS_STOP(METRIC_CALENDAR, start);
+}
 
-        if ((day + daycode) % 7 == 0 || day == days_in_shamsi_month[month])
-            // Print a new line for the last day of the week or the last day of the month
-            printf("\n");
-    }
+/**
+ * The astronomical calendar starts every Shamsi year on the true Nowruz: the day of the March equinox
+ * if the equinox comes before noon in Tehran (Iran Standard Time, UTC+3:30), and the day after it otherwise.
+ * shamsiToGregorian() instead places Nowruz on 21 March (20 March in Gregorian leap years), which is off by a day
+ * in about one year in three between 1206 and 1498 and drifts further away outside them.
+ * The astronomical calendar is turned on with the --astronomical option; without it every date is converted as before.
+ *
+ * The equinox is found with the method of Meeus (Astronomical Algorithms, chapter 27): a polynomial for the mean
+ * equinox corrected by 24 periodic terms, then moved from dynamical time to universal time with the ΔT polynomials
+ * of Espenak and Meeus. It is within a few minutes of the exact equinox from about 1000 BC to AD 3000.
+ * The day number of Nowruz of every Shamsi year from NOWRUZ_FIRST_YEAR to NOWRUZ_LAST_YEAR (AD 622 to 3621)
+ * is computed once, on first use, so a conversion costs a table lookup; other years are computed when asked for.
+ */
+#define NOWRUZ_FIRST_YEAR 1
+#define NOWRUZ_LAST_YEAR 3000
+#define TEHRAN_OFFSET_DAYS (3.5 / 24)
 
-    printf("\n%s%d%s\n", BLACK_TEXT WHITE_BACKGROUND "---------------- ",
-           year,
-            // Print a horizontal line with the calendar year
-           " ----------------" RESET);
-    // Print info for the calendar navigation
-    printf("%s %s", ITALIC, GRAY_TEXT);
-    printf("\n        %s%s %s %s%s%s \n", RESET "RIGHT", ITALIC, GRAY_TEXT ">>", RESET, "NEXT MONTH!" ITALIC, GRAY_TEXT );
-    printf("\n        %s%s %s %s%s%s \n", RESET "LEFT", ITALIC, GRAY_TEXT ">>", RESET, "PREVIOUS MONTH!" ITALIC, GRAY_TEXT );
-    printf("\n        %s%s %s %s%s%s \n", RESET "UP", ITALIC, GRAY_TEXT ">>", RESET, "NEXT YEAR!" ITALIC, GRAY_TEXT );
-    printf("\n        %s%s %s %s%s%s \n", RESET "DOWN", ITALIC, GRAY_TEXT ">>", RESET, "PREVIOUS YEAR!" ITALIC, GRAY_TEXT );
-    printf("%s", RESET);
-    printf("\n%s\n", BLACK_TEXT WHITE_BACKGROUND "--------------------------------------" RESET);
-    // Prompt the user to press ESC to go back
-    printf("\nPress ESC to go back..."); 
-}
+/**
+ * The periodic terms of the March equinox: the amplitude in 0.00001 days, then the phase and its rate
+ * in degrees and degrees per Julian century.
+ */
+double equinoxTerms[24][3] = {
+        {485, 324.96, 1934.136}, {203, 337.23, 32964.467}, {199, 342.08, 20.186}, {182, 27.85, 445267.112},
+        {156, 73.14, 45036.886}, {136, 171.52, 22518.443}, {77, 222.54, 65928.934}, {74, 296.72, 3034.906},
+        {70, 243.58, 9037.513}, {58, 119.81, 33718.147}, {52, 297.17, 150.678}, {50, 21.02, 2281.226},
+        {45, 247.54, 29929.562}, {44, 325.15, 31555.956}, {29, 60.93, 4443.417}, {18, 155.12, 67555.328},
+        {17, 288.79, 4562.452}, {16, 198.04, 62894.029}, {14, 199.76, 31436.921}, {12, 95.39, 14577.848},
+        {12, 287.11, 31931.756}, {12, 320.81, 34777.259}, {9, 227.73, 1222.114}, {8, 15.45, 16859.074}
+};
 
 /**
- * This function converts a given date in the Shamsi (Solar Hijri) calendar to the Gregorian calendar.
+ * Nowruz dates of the official Iranian calendar, used by --verify to check the equinox calculation.
+ * Each entry holds the Shamsi year and the Gregorian year, month and day of its Nowruz.
+ * They include years where the arithmetic rule of shamsiToGregorian() is a day off, such as 1371 and 1408.
+ */
+int knownNowruzDates[][4] = {
+        {1304, 1925, 3, 21}, {1354, 1975, 3, 21}, {1370, 1991, 3, 21}, {1371, 1992, 3, 21},
+        {1375, 1996, 3, 20}, {1399, 2020, 3, 20}, {1400, 2021, 3, 21}, {1403, 2024, 3, 20},
+        {1404, 2025, 3, 21}, {1408, 2029, 3, 20}, {1420, 2041, 3, 20}
+};
+
+/**
+ * These variables hold the state of the astronomical calendar: whether it is used for conversions,
+ * and the day numbers of Nowruz of the years NOWRUZ_FIRST_YEAR to NOWRUZ_LAST_YEAR once they are computed.
+ */
+int astronomicalCalendar = 0;
+int nowruzTableBuilt = 0;
+int astronomicalNowruzDays[NOWRUZ_LAST_YEAR - NOWRUZ_FIRST_YEAR + 1];
+
+// The day number functions are defined with the other calendars further down
+int gregorianToDayNumber(int year, int month, int day);
+void dayNumberToGregorian(int dayNumber, int *gYear, int *gMonth, int *gDay);
+
+/**
+ * This function rounds a number down to a whole number, for negative numbers too.
+ *
+ * @param value The number to round.
+ * @return The largest whole number not greater than value.
+ */
+double roundDown(double value)
+{
+    double whole = (double)(long long)value;
+
+    return whole > value ? whole - 1 : whole;
+}
+
+/**
+ * This function returns the cosine of an angle in degrees.
+ * It reduces the angle to the first quadrant and sums the Taylor series there, which is accurate to about 1e-12,
+ * so the program does not need the math library.
+ *
+ * @param degrees The angle in degrees.
+ * @return The cosine of the angle.
+ */
+double cosineDegrees(double degrees)
+{
+    double x, square, term, sum;
+    int sign = 1;
+
+    // Reduce the angle to 0 to 180 degrees, then to 0 to 90 degrees
+    degrees -= 360 * roundDown(degrees / 360);
+    if (degrees > 180)
+        degrees = 360 - degrees;
+    if (degrees > 90)
+    {
+        degrees = 180 - degrees;
+        sign = -1;
+    }
+
+    x = degrees * (3.14159265358979323846 / 180);
+    square = x * x;
+    term = 1;
+    sum = 1;
+    for (int n = 2; n <= 18; n += 2)
+    {
+        term = -term * square / (n * (n - 1));
+        sum += term;
+    }
+
+    return sign * sum;
+}
+
+/**
+ * This function estimates ΔT, the difference between dynamical time and universal time, in a given year,
+ * with the polynomials of Espenak and Meeus. Before 1600 and after 2050 it is an extrapolation
+ * which may be off by several minutes, more the further the year is from the present.
+ *
+ * @param year The Gregorian year, with a fraction for the time of year.
+ * @return ΔT in seconds.
+ */
+double deltaTSeconds(double year)
+{
+    double u, t;
+
+    if (year < -500 || year >= 2150)
+    {
+        u = (year - 1820) / 100;
+        return -20 + 32 * u * u;
+    }
+    if (year < 500)
+    {
+        u = year / 100;
+        return 10583.6 + u * (-1014.41 + u * (33.78311 + u * (-5.952053 + u * (-0.1798452
+               + u * (0.022174192 + u * 0.0090316521)))));
+    }
+    if (year < 1600)
+    {
+        u = (year - 1000) / 100;
+        return 1574.2 + u * (-556.01 + u * (71.23472 + u * (0.319781 + u * (-0.8503463
+               + u * (-0.005050998 + u * 0.0083572073)))));
+    }
+    if (year < 1700)
+    {
+        t = year - 1600;
+        return 120 + t * (-0.9808 + t * (-0.01532 + t / 7129));
+    }
+    if (year < 1800)
+    {
+        t = year - 1700;
+        return 8.83 + t * (0.1603 + t * (-0.0059285 + t * (0.00013336 - t / 1174000)));
+    }
+    if (year < 1860)
+    {
+        t = year - 1800;
+        return 13.72 + t * (-0.332447 + t * (0.0068612 + t * (0.0041116 + t * (-0.00037436
+               + t * (0.0000121272 + t * (-0.0000001699 + t * 0.000000000875))))));
+    }
+    if (year < 1900)
+    {
+        t = year - 1860;
+        return 7.62 + t * (0.5737 + t * (-0.251754 + t * (0.01680668 + t * (-0.0004473624 + t / 233174))));
+    }
+    if (year < 1920)
+    {
+        t = year - 1900;
+        return -2.79 + t * (1.494119 + t * (-0.0598939 + t * (0.0061966 - t * 0.000197)));
+    }
+    if (year < 1941)
+    {
+        t = year - 1920;
+        return 21.20 + t * (0.84493 + t * (-0.076100 + t * 0.0020936));
+    }
+    if (year < 1961)
+    {
+        t = year - 1950;
+        return 29.07 + t * (0.407 + t * (-1.0 / 233 + t / 2547));
+    }
+    if (year < 1986)
+    {
+        t = year - 1975;
+        return 45.45 + t * (1.067 + t * (-1.0 / 260 - t / 718));
+    }
+    if (year < 2005)
+    {
+        t = year - 2000;
+        return 63.86 + t * (0.3345 + t * (-0.060374 + t * (0.0017275 + t * (0.000651814 + t * 0.00002373599))));
+    }
+    if (year < 2050)
+    {
+        t = year - 2000;
+        return 62.92 + t * (0.32217 + t * 0.005589);
+    }
+
+    u = (year - 1820) / 100;
+    return -20 + 32 * u * u - 0.5628 * (2150 - year);
+}
+
+/**
+ * This function finds the moment of the March equinox of a Gregorian year.
+ *
+ * @param year The Gregorian year.
+ * @return The moment of the equinox as a Julian Date in universal time.
+ */
+double marchEquinox(int year)
+{
+    double y, mean, centuries, w, sum = 0;
+
+    // The mean equinox, from the polynomial for the millennium the year is in
+    if (year < 1000)
+    {
+        y = year / 1000.0;
+        mean = 1721139.29189 + y * (365242.13740 + y * (0.06134 + y * (0.00111 - y * 0.00071)));
+    }
+    else
+    {
+        y = (year - 2000) / 1000.0;
+        mean = 2451623.80984 + y * (365242.37404 + y * (0.05169 + y * (-0.00411 - y * 0.00057)));
+    }
+
+    centuries = (mean - 2451545.0) / 36525;
+    w = 35999.373 * centuries - 2.47;
+    for (int i = 0; i < 24; i++)
+        sum += equinoxTerms[i][0] * cosineDegrees(equinoxTerms[i][1] + equinoxTerms[i][2] * centuries);
+
+    mean += 0.00001 * sum / (1 + 0.0334 * cosineDegrees(w) + 0.0007 * cosineDegrees(2 * w));
+    return mean - deltaTSeconds(year + 0.2) / 86400;
+}
+
+/**
+ * This function computes the day number of the astronomical Nowruz of a Shamsi year from the March equinox.
+ *
+ * @param year The Shamsi year.
+ * @param tehranTime Pointer to store the moment of the equinox in Tehran time, as a day number
+ *                   with the fraction of the day, or NULL.
+ * @return The day number of Nowruz.
+ */
+int computeNowruz(int year, double *tehranTime)
+{
+    // Julian Dates start at noon, so adding half a day makes the whole part the day number of the date in Tehran
+    double local = marchEquinox(year + 621) + 0.5 + TEHRAN_OFFSET_DAYS;
+    double day = roundDown(local);
+
+    if (tehranTime != NULL)
+        *tehranTime = local;
+
+    return (int)day + (local - day >= 0.5);
+}
+
+/**
+ * This function computes the Nowruz of every year from NOWRUZ_FIRST_YEAR to NOWRUZ_LAST_YEAR.
+ * It is called on first use, and by the --astronomical option before any thread is started.
+ */
+void buildNowruzTable(void)
+{
+    for (int year = NOWRUZ_FIRST_YEAR; year <= NOWRUZ_LAST_YEAR; year++)
+        astronomicalNowruzDays[year - NOWRUZ_FIRST_YEAR] = computeNowruz(year, NULL);
+    nowruzTableBuilt = 1;
+}
+
+/**
+ * This function returns the day number of the astronomical Nowruz (1 Farvardin) of a Shamsi year,
+ * from the table for the years it covers.
+ *
+ * @param year The Shamsi year.
+ * @return The day number of Nowruz.
+ */
+int astronomicalNowruz(int year)
+{
+    if ((unsigned int)(year - NOWRUZ_FIRST_YEAR) > NOWRUZ_LAST_YEAR - NOWRUZ_FIRST_YEAR)
+        return computeNowruz(year, NULL);
+
+    if (!nowruzTableBuilt)
+        buildNowruzTable();
+    return astronomicalNowruzDays[year - NOWRUZ_FIRST_YEAR];
+}
+
+/**
+ * This function converts a day number to a date of the astronomical Shamsi calendar.
+ * The year is the Gregorian year minus 621, or one less before its Nowruz.
+ *
+ * @param dayNumber The day number to convert.
+ * @param sYear Pointer to store the year in the Shamsi calendar.
+ * @param sMonth Pointer to store the month in the Shamsi calendar.
+ * @param sDay Pointer to store the day in the Shamsi calendar.
+ */
+void astronomicalDayNumberToShamsi(int dayNumber, int *sYear, int *sMonth, int *sDay)
+{
+    int gYear, gMonth, gDay, nowruz, dayOfYear;
+
+    dayNumberToGregorian(dayNumber, &gYear, &gMonth, &gDay);
+    *sYear = gYear - 621;
+    nowruz = astronomicalNowruz(*sYear);
+    if (dayNumber < nowruz)
+        nowruz = astronomicalNowruz(--*sYear);
+
+    dayOfYear = dayNumber - nowruz;
+    if (dayOfYear < 186)
+    {
+        // One of the first six months, which have 31 days
+        *sMonth = dayOfYear / 31 + 1;
+        *sDay = dayOfYear % 31 + 1;
+    }
+    else
+    {
+        // One of the last six months, which have 30 days (Esfand may have 29)
+        *sMonth = (dayOfYear - 186) / 30 + 7;
+        *sDay = (dayOfYear - 186) % 30 + 1;
+    }
+}
+
+/**
+ * This function checks the astronomical Nowruz against the known dates in knownNowruzDates[]
+ * and prints the result, with every date that does not match.
+ *
+ * @return 0 if every date matches, 1 otherwise.
+ */
+int checkKnownNowruzDates(void)
+{
+    int count = (int)(sizeof(knownNowruzDates) / sizeof(knownNowruzDates[0]));
+    int failures = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        int *known = knownNowruzDates[i];
+        int gYear, gMonth, gDay;
+
+        dayNumberToGregorian(astronomicalNowruz(known[0]), &gYear, &gMonth, &gDay);
+        if (gYear != known[1] || gMonth != known[2] || gDay != known[3])
+        {
+            printf(RED_TEXT "Nowruz %d: the equinox gives %04d/%02d/%02d, not %04d/%02d/%02d" RESET "\n", known[0],
+                   gYear, gMonth, gDay, known[1], known[2], known[3]);
+            failures++;
+        }
+    }
+
+    printf("Checked the astronomical Nowruz of %d years against the official calendar: ", count);
+    if (failures == 0)
+        printf("no mismatches.\n");
+    else
+        printf(RED_TEXT "%d mismatches." RESET "\n", failures);
+
+    return failures != 0;
+}
+
+/**
+ * This function reads the --astronomical option, which can be given with any mode (including the menu),
+ * makes the Shamsi conversions follow the astronomical Nowruz and removes the option from the arguments.
+ * The table of Nowruz dates is computed here, before any thread is started.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments, changed in place.
+ * @return The number of arguments left.
+ */
+int parseAstronomicalOption(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--astronomical") != 0)
+            continue;
+
+        buildNowruzTable();
+        astronomicalCalendar = 1;
+
+        // Remove the option
+        for (int j = i; j + 1 <= argc; j++)
+            argv[j] = argv[j + 1];
+        return argc - 1;
+    }
+
+    return argc;
+}
+
+/**
+ * This function lists the March equinox and the astronomical Nowruz of a range of Shamsi years.
+ * Each line holds the Shamsi year, the moment of the equinox in Tehran time, the Gregorian date of Nowruz,
+ * the number of days in the year and the Nowruz given by the arithmetic rule of shamsiToGregorian(),
+ * separated by tabs.
+ *
+ * @param firstYear The first Shamsi year.
+ * @param lastYear The last Shamsi year.
+ * @param output The stream to write to.
+ * @return 0 on success, 1 if the output could not be written.
+ */
+int listNowruz(int firstYear, int lastYear, FILE *output)
+{
+    for (int year = firstYear; year <= lastYear; year++)
+    {
+        double local, fraction;
+        int nowruz = computeNowruz(year, &local);
+        int gYear, gMonth, gDay, eYear, eMonth, eDay, seconds;
+        int arithmeticYear = year + 621;
+
+        // The equinox in Tehran time, rounded to the second
+        fraction = local - roundDown(local);
+        seconds = (int)(fraction * 86400 + 0.5);
+        dayNumberToGregorian((int)roundDown(local) + seconds / 86400, &eYear, &eMonth, &eDay);
+        seconds %= 86400;
+
+        dayNumberToGregorian(nowruz, &gYear, &gMonth, &gDay);
+        fprintf(output, "%d\t%04d/%02d/%02d %02d:%02d:%02d\t%04d/%02d/%02d\t%d\t%04d/%02d/%02d\n", year, eYear, eMonth,
+                eDay, seconds / 3600, seconds / 60 % 60, seconds % 60, gYear, gMonth, gDay,
+                astronomicalNowruz(year + 1) - nowruz, arithmeticYear, 3, determineLeapYear(arithmeticYear) ? 20 : 21);
+    }
+
+    return ferror(output) != 0;
+}
+
+/**
+ * This function prints the tables of the astronomical calendar in calendar_core.c, as C source,
+ * so they can be written again if the equinox calculation changes.
+ * Bit i of word k of coreLeapYears[] is set if the Shamsi year 64 * k + i + 1 has 366 days,
+ * and coreLeapsBefore[k] counts those years before the year 64 * k + 1.
+ *
+ * @param output The stream to write to.
+ * @return 0 on success, 1 if the output could not be written.
+ */
+int writeCoreTables(FILE *output)
+{
+    uint64_t words[CORE_BLOCK_COUNT] = {0};
+    int before = 0;
+
+    for (int year = CORE_ASTRONOMICAL_FIRST_YEAR; year <= CORE_ASTRONOMICAL_LAST_YEAR; year++)
+    {
+        int index = year - CORE_ASTRONOMICAL_FIRST_YEAR;
+
+        if (astronomicalNowruz(year + 1) - astronomicalNowruz(year) == 366)
+            words[index / CORE_BLOCK_YEARS] |= (uint64_t)1 << index % CORE_BLOCK_YEARS;
+    }
+
+    fprintf(output, "static const uint64_t coreLeapYears[CORE_BLOCK_COUNT] = {");
+    for (int i = 0; i < CORE_BLOCK_COUNT; i++)
+        fprintf(output, "%s0x%016llx", i == 0 ? "\n        " : i % 5 == 0 ? ",\n        " : ", ",
+                (unsigned long long)words[i]);
+    fprintf(output, "\n};\n\nstatic const uint16_t coreLeapsBefore[CORE_BLOCK_COUNT] = {");
+    for (int i = 0; i < CORE_BLOCK_COUNT; i++)
+    {
+        fprintf(output, "%s%d", i == 0 ? "\n        " : i % 24 == 0 ? ",\n        " : ", ", before);
+        before += coreCountBits(words[i]);
+    }
+    fprintf(output, "\n};\n");
+
+    return ferror(output) != 0;
+}
+
+/**
+ * This function converts a given date in the Shamsi (Solar Hijri) calendar to the Gregorian calendar.
  * It takes the year, month, and day in the Shamsi calendar as parameters,
  as well as three pointers to integers to store the converted year, month, and day in the Gregorian calendar.
  * The function uses two arrays, sumShamsi[] and gregorianDays[],
@@ -455,10 +1949,21 @@ void calendar(int year, int month, int daycode)
  */
 void shamsiToGregorian(int y, int m, int d, int *gYear, int *gMonth, int *gDay)
 {
+    METRICS_START(METRIC_SHAMSI_TO_GREGORIAN, start);
     int sumShamsi[] = {31, 62, 93, 124, 155, 186, 216, 246, 276, 306, 336, 365};
     int gregorianDays[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
 
     int yy, mm, dayCount;
+
+    if (astronomicalCalendar)
+    {
+        // Count the days from the astronomical Nowruz of the year
+        dayNumberToGregorian(astronomicalNowruz(y) + (m <= 6 ? (m - 1) * 31 : 186 + (m - 7) * 30) + d - 1,
+                             gYear, gMonth, gDay);
+        METRICS_STOP(METRIC_SHAMSI_TO_GREGORIAN, start);
+        return;
+    }
+
     dayCount = d;
     if (m > 1)
         // Calculate the total number of days in the Shamsi calendar from the start of the year to the given date
@@ -503,6 +2008,8 @@ void shamsiToGregorian(int y, int m, int d, int *gYear, int *gMonth, int *gDay)
     *gYear = yy; // Store the converted year in the provided pointer
     *gMonth = mm + 1; // Store the converted month in the provided pointer
     *gDay = dayCount; // Store the converted day in the provided pointer
+
+    METRICS_STOP(METRIC_SHAMSI_TO_GREGORIAN, start);
 }
 
 
@@ -528,10 +2035,18 @@ void shamsiToGregorian(int y, int m, int d, int *gYear, int *gMonth, int *gDay)
  */
 void gregorianToShamsi(int year, int month, int day, int *sYear, int *sMonth, int *sDay)
 {
+    METRICS_START(METRIC_GREGORIAN_TO_SHAMSI, start);
     int countDays[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
     int i, dayYear;
     int newMonth, newYear, newDay;
 
+    if (astronomicalCalendar)
+    {
+        astronomicalDayNumberToShamsi(gregorianToDayNumber(year, month, day), sYear, sMonth, sDay);
+        METRICS_STOP(METRIC_GREGORIAN_TO_SHAMSI, start);
+        return;
+    }
+
     dayYear = 0;
     for (i = 1; i < month; i++)
     {
@@ -546,11 +2061,13 @@ void gregorianToShamsi(int year, int month, int day, int *sYear, int *sMonth, in
 
     if (dayYear <= 79)
     {
-        if ((year - 1) % 4 == 0)
+        if (determineLeapYear(year - 1))
         {
             /*
              * Calculate the day count based on the special rule for
-             the Shamsi calendar when the day count is less than or equal to 79
+             the Shamsi calendar when the day count is less than or equal to 79.
+             * The Shamsi year that started in the previous Gregorian year is a leap year
+             when that Gregorian year is, the same rule shamsiToGregorian() uses
              */
             dayYear = dayYear + 11;
         }
@@ -602,12 +2119,12 @@ void gregorianToShamsi(int year, int month, int day, int *sYear, int *sMonth, in
             if (dayYear % 30 == 0)
             {
                 // Calculate the month in the Shamsi calendar when the day count is divisible by 30
-                newMonth = (dayYear / 30) + 7;
+                newMonth = (dayYear / 30) + 6;
                 newDay = 30;
             } else
             {
                 // Calculate the month in the Shamsi calendar when the day count is notdivisible by 30
-                newMonth = (dayYear / 30) + 8;
+                newMonth = (dayYear / 30) + 7;
                 newDay = dayYear % 30;
             }
         }
@@ -616,6 +2133,8 @@ void gregorianToShamsi(int year, int month, int day, int *sYear, int *sMonth, in
     *sYear = newYear; // Store the converted year in the provided pointer
     *sMonth = newMonth; // Store the converted month in the provided pointer
     *sDay = newDay; // Store the converted day in the provided pointer
+
+    METRICS_STOP(METRIC_GREGORIAN_TO_SHAMSI, start);
 }
 
 /**
@@ -639,6 +2158,144 @@ int intPart(double value)
     }
 }
 
+/**
+ * This function converts a date in the Julian calendar to a day number (Julian Day Number).
+ * The Julian calendar has a leap year every fourth year without exception; it was used before the Gregorian reform
+ * of October 1582, and later in many countries. The formula is the one of gregorianToDayNumber()
+ * without the corrections for the century years.
+ *
+ * @param year The year in the Julian calendar (astronomical numbering, so 1 BC is year 0).
+ * @param month The month in the Julian calendar.
+ * @param day The day in the Julian calendar.
+ * @return The day number of the given date.
+ */
+int julianToDayNumber(int year, int month, int day)
+{
+    // Shift the year so that it starts in March and February becomes the last month
+    int a = (14 - month) / 12;
+    int y = year + 4800 - a;
+    int m = month + 12 * a - 3;
+
+    return day + (153 * m + 2) / 5 + 365 * y + y / 4 - 32083;
+}
+
+/**
+ * This function converts a day number back to a date in the Julian calendar.
+ * It is the inverse of julianToDayNumber().
+ *
+ * @param dayNumber The day number to convert.
+ * @param jYear Pointer to store the year in the Julian calendar.
+ * @param jMonth Pointer to store the month in the Julian calendar.
+ * @param jDay Pointer to store the day in the Julian calendar.
+ */
+void dayNumberToJulian(int dayNumber, int *jYear, int *jMonth, int *jDay)
+{
+    int c = dayNumber + 32082;
+    int d = (4 * c + 3) / 1461;
+    int e = c - 1461 * d / 4;
+    int m = (5 * e + 2) / 153;
+
+    *jDay = e - (153 * m + 2) / 5 + 1; // Store the day in the provided pointer
+    *jMonth = m + 3 - 12 * (m / 10); // Store the month in the provided pointer
+    *jYear = d - 4800 + m / 10; // Store the year in the provided pointer
+}
+
+/**
+ * This function returns the number of days in a month of the Julian calendar.
+ *
+ * @param year The year in the Julian calendar.
+ * @param month The month in the Julian calendar.
+ * @return The number of days in the month.
+ */
+int julianMonthLength(int year, int month)
+{
+    int monthDays[] = {0, 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+    if (month == 2 && (year % 4 + 4) % 4 == 0)
+        return 29; // February of a leap year
+
+    return monthDays[month];
+}
+
+/**
+ * gregorianToLunar() computes the tabular Islamic calendar, whose months can start a day or two away from
+ * the months announced after the new moon is sighted. A table of observed month starts can be loaded from a file
+ * (see loadLunarOverrides()) to correct this: while it is loaded, every Lunar conversion in the program uses
+ * the observed start of the months it lists and the tabular start of all other months.
+ *
+ * Months are numbered as year * 12 + month - 1. The table holds the first day number of every month
+ * from firstMonth to firstMonth + monthCount - 1, with 0 for months that keep their tabular start,
+ * so looking up a month is a single array access.
+ */
+struct lunarOverrideTable
+{
+    int firstMonth; // The number of the first month in the table
+    int monthCount; // The number of months in the table
+    int32_t *starts; // The observed first day number of each month, or 0 if the month is not overridden
+};
+
+/**
+ * This variable holds the observed month starts loaded with loadLunarOverrides(), or NULL when none are loaded.
+ */
+struct lunarOverrideTable *lunarOverrides = NULL;
+
+/**
+ * This function returns the day number of the first day of a month in the tabular Lunar calendar.
+ * It is the formula of lunarToDayNumber() without the override table.
+ *
+ * @param monthNumber The month, numbered as year * 12 + month - 1.
+ * @return The day number of the first day of the month.
+ */
+int tabularLunarMonthStart(int monthNumber)
+{
+    int year = monthNumber / 12, month = monthNumber % 12 + 1;
+
+    return (11 * year + 3) / 30 + 354 * year + 30 * month - (month - 1) / 2 + 1 + 1948440 - 385;
+}
+
+/**
+ * This function returns the day number of the first day of a Lunar month,
+ * from the override table when it lists the month, and from the tabular calendar otherwise.
+ *
+ * @param monthNumber The month, numbered as year * 12 + month - 1.
+ * @return The day number of the first day of the month.
+ */
+int lunarMonthStart(int monthNumber)
+{
+    unsigned int index = (unsigned int)(monthNumber - lunarOverrides->firstMonth);
+
+    if (index < (unsigned int)lunarOverrides->monthCount && lunarOverrides->starts[index] != 0)
+        return lunarOverrides->starts[index];
+    return tabularLunarMonthStart(monthNumber);
+}
+
+/**
+ * This function corrects a tabular Lunar date with the override table.
+ * An override moves a month by a few days at most, so the day is in the tabular month, the one before or the one after.
+ *
+ * @param dayNumber The day number of the date.
+ * @param lYear Pointer to the year, which holds the tabular year and receives the observed year.
+ * @param lMonth Pointer to the month, which holds the tabular month and receives the observed month.
+ * @param lDay Pointer to the day, which receives the observed day.
+ */
+void observeLunarDate(int dayNumber, int *lYear, int *lMonth, int *lDay)
+{
+    int tabular = *lYear * 12 + *lMonth - 1;
+
+    for (int monthNumber = tabular - 1; monthNumber <= tabular + 1; monthNumber++)
+    {
+        int start = lunarMonthStart(monthNumber);
+
+        if (dayNumber >= start && dayNumber < lunarMonthStart(monthNumber + 1))
+        {
+            *lYear = monthNumber / 12;
+            *lMonth = monthNumber % 12 + 1;
+            *lDay = dayNumber - start + 1;
+            return;
+        }
+    }
+}
+
 /**
  * This function converts a given date in the Gregorian calendar to the Lunar calendar.
  * It takes the year, month, and day in the Gregorian calendar as parameters,
@@ -647,7 +2304,8 @@ int intPart(double value)
  * The function calculates the Julian date based on the given Gregorian date.
  * If the Gregorian date is on or after October 15, 1582 (the start of the Gregorian calendar),
  * it uses a formula to calculate the Julian date.
- * If the Gregorian date is before October 15, 1582, it uses a different formula to calculate the Julian date.
+ * If the Gregorian date is before October 15, 1582, it is read as a date of the Julian calendar, which was in use then,
+ * and converted with julianToDayNumber().
  * The function then performs a series of calculations to determine the corresponding date in the Lunar calendar.
  * Finally, the function stores the converted year, month, and day in the provided pointers.
  *
@@ -660,6 +2318,7 @@ int intPart(double value)
  */
 void gregorianToLunar(int year, int month, int day, int *lYear, int *lMonth, int *lDay)
 {
+    METRICS_START(METRIC_GREGORIAN_TO_LUNAR, start);
     int juliandate;
 
     if (year > 1582 || (year == 1582 && (month > 10 || (month == 10 && day >= 15))))
@@ -672,11 +2331,8 @@ void gregorianToLunar(int year, int month, int day, int *lYear, int *lMonth, int
     }
     else
     {
-        juliandate = 367 * year
-                     - intPart((7 * (year + 5001 + intPart((month - 9) / 7))) / 4)
-                     + intPart((275 * month) / 9)
-                       // Calculate the Julian date using the pre-Gregorian date formula
-                     + day + 1729777;
+        // Dates before the reform are in the Julian calendar
+        juliandate = julianToDayNumber(year, month, day);
     }
 
     int l = juliandate - 1948440 + 10632;
@@ -694,38 +2350,483 @@ void gregorianToLunar(int year, int month, int day, int *lYear, int *lMonth, int
     int lunarD = l - intPart((709 * lunarM) / 24);
     int lunarY = 30 * n + j - 30;
 
+    // Use the observed month starts when they are loaded
+    if (lunarOverrides != NULL)
+        observeLunarDate(juliandate, &lunarY, &lunarM, &lunarD);
+
     *lYear = lunarY; // Store the converted year in the provided pointer
     *lMonth = lunarM; // Store the converted month in the provided pointer
     *lDay = lunarD; // Store the converted day in the provided pointer
+
+    METRICS_STOP(METRIC_GREGORIAN_TO_LUNAR, start);
 }
 
 /**
- * This function displays the date conversion menu.
- * It prints the menu options for the user to select from.
- * The menu options include: going back to the main menu, converting from Shamsi (Solar Hijri) to Gregorian/Lunar,
- * and converting from Gregorian to Shamsi/Lunar.
- * The function prompts the user to select an option.
+ * This function converts a date in the Gregorian calendar to a day number (Julian Day Number).
+ * The day number counts days continuously across month and year boundaries,
+ * so the difference between two day numbers is the number of days between the two dates.
+ * It uses the same integer formula as the Gregorian branch of gregorianToLunar().
+ *
+ * @param year The year in the Gregorian calendar.
+ * @param month The month in the Gregorian calendar.
+ * @param day The day in the Gregorian calendar.
+ * @return The day number of the given date.
  */
-void dateConversionMenu()
+int gregorianToDayNumber(int year, int month, int day)
 {
-    printf("\n%s\n%s Back to menu!\n\n%s Shamsi to Gregorian/Lunar\n\n%s Gregorian to Shamsi/Lunar"
-           "\n\n%s\n\nselect option: ",
-           BLACK_TEXT WHITE_BACKGROUND "          Date Conversion Menu          \n" RESET,
-           GRAY_TEXT "[0]" RESET,
-           GRAY_TEXT "[1]" RESET,
-           GRAY_TEXT "[2]" RESET,
-           BLACK_TEXT WHITE_BACKGROUND "----------------------------------------" RESET);
+    // Shift the year so that it starts in March and February becomes the last month
+    int a = (14 - month) / 12;
+    int y = year + 4800 - a;
+    int m = month + 12 * a - 3;
+
+    return day + (153 * m + 2) / 5 + 365 * y + y / 4 - y / 100 + y / 400 - 32045;
 }
 
 /**
- * This function converts a given date from one calendar system to another.
- * It takes the input date and the source and target calendar systems as parameters.
- * The function uses the appropriate conversion
- * formulas and algorithms to calculate the equivalent date in the target calendar system.
- * It handles both forward and backward conversions, depending on the source and target calendars.
- * The function performs input validation to ensure
- * that the input date is valid and within the range supported by the calendar systems.
- * It also checks for leap years and adjusts the number of days in February accordingly.
+ * This function converts a day number (Julian Day Number) back to a date in the Gregorian calendar.
+ * It is the inverse of gregorianToDayNumber().
+ *
+ * @param dayNumber The day number to convert.
+ * @param gYear Pointer to store the year in the Gregorian calendar.
+ * @param gMonth Pointer to store the month in the Gregorian calendar.
+ * @param gDay Pointer to store the day in the Gregorian calendar.
+ */
+void dayNumberToGregorian(int dayNumber, int *gYear, int *gMonth, int *gDay)
+{
+    int a = dayNumber + 32044;
+    int b = (4 * a + 3) / 146097;
+    int c = a - 146097 * b / 4;
+    int d = (4 * c + 3) / 1461;
+    int e = c - 1461 * d / 4;
+    int m = (5 * e + 2) / 153;
+
+    *gDay = e - (153 * m + 2) / 5 + 1; // Store the day in the provided pointer
+    *gMonth = m + 3 - 12 * (m / 10); // Store the month in the provided pointer
+    *gYear = 100 * b + d - 4800 + m / 10; // Store the year in the provided pointer
+}
+
+/**
+ * This function returns the day of the week for a day number.
+ * The week starts on Saturday (SHANBE), as in the column headers of calendar().
+ *
+ * @param dayNumber The day number.
+ * @return 0 for SHANBE (Saturday) up to 6 for JOOMEH (Friday).
+ */
+int dayNumberToWeekday(int dayNumber)
+{
+    return (dayNumber + 2) % 7;
+}
+
+/**
+ * This function returns the number of days in a month of the Gregorian calendar.
+ *
+ * @param year The year in the Gregorian calendar.
+ * @param month The month in the Gregorian calendar.
+ * @return The number of days in the month.
+ */
+int gregorianMonthLength(int year, int month)
+{
+    int monthDays[] = {0, 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+    if (month == 2 && determineLeapYear(year) == 1)
+        return 29; // February of a leap year
+
+    return monthDays[month];
+}
+
+/**
+ * This function returns the number of days in a month of the Shamsi calendar.
+ * The first six months have 31 days and the next five have 30 days.
+ * Esfand has 30 days in the years that shamsiToGregorian() treats as leap years
+ * (when the Gregorian year of Nowruz is a leap year) and 29 days otherwise,
+ * so stepping through the months with this function agrees with shamsiToGregorian().
+ * In the astronomical calendar Esfand lasts until the next astronomical Nowruz.
+ *
+ * @param year The year in the Shamsi calendar.
+ * @param month The month in the Shamsi calendar.
+ * @return The number of days in the month.
+ */
+int shamsiMonthLength(int year, int month)
+{
+    if (month <= 6)
+        return 31;
+    if (month <= 11)
+        return 30;
+
+    if (astronomicalCalendar)
+        return astronomicalNowruz(year + 1) - astronomicalNowruz(year) - 336;
+
+    // Esfand follows the leap year handling of shamsiToGregorian()
+    return determineLeapYear(year + 621) == 1 ? 30 : 29;
+}
+
+/**
+ * This function determines if a given year of the Lunar calendar is a leap year.
+ * gregorianToLunar() implements the tabular Islamic calendar,
+ * which has 11 leap years in every 30-year cycle.
+ *
+ * @param year The year in the Lunar calendar.
+ * @return 1 if the year is a leap year, 0 otherwise.
+ */
+int determineLunarLeapYear(int year)
+{
+    return (14 + 11 * year) % 30 < 11;
+}
+
+/**
+ * This function returns the number of days in a month of the Lunar calendar.
+ * Odd months have 30 days and even months have 29 days,
+ * except the 12th month (Dhu al-Hijjah) which has 30 days in a leap year.
+ *
+ * @param year The year in the Lunar calendar.
+ * @param month The month in the Lunar calendar.
+ * @return The number of days in the month.
+ */
+int lunarMonthLength(int year, int month)
+{
+    if (lunarOverrides != NULL)
+        return lunarMonthStart(year * 12 + month) - lunarMonthStart(year * 12 + month - 1);
+
+    if (month % 2 == 1 || (month == 12 && determineLunarLeapYear(year)))
+        return 30;
+
+    return 29;
+}
+
+/**
+ * This function converts a date in the Shamsi calendar to a day number.
+ * It uses shamsiToGregorian(), so the result agrees with the rest of the program.
+ *
+ * @param year The year in the Shamsi calendar.
+ * @param month The month in the Shamsi calendar.
+ * @param day The day in the Shamsi calendar.
+ * @return The day number of the given date.
+ */
+int shamsiToDayNumber(int year, int month, int day)
+{
+    int gYear, gMonth, gDay;
+
+    shamsiToGregorian(year, month, day, &gYear, &gMonth, &gDay);
+    return gregorianToDayNumber(gYear, gMonth, gDay);
+}
+
+/**
+ * This function converts a day number to a date in the Shamsi calendar.
+ * It finds the Shamsi year from the day number of its first day (Nowruz),
+ * then splits the remaining days into 31-day and 30-day months.
+ * It is the inverse of shamsiToDayNumber().
+ *
+ * @param dayNumber The day number to convert.
+ * @param sYear Pointer to store the year in the Shamsi calendar.
+ * @param sMonth Pointer to store the month in the Shamsi calendar.
+ * @param sDay Pointer to store the day in the Shamsi calendar.
+ */
+void dayNumberToShamsi(int dayNumber, int *sYear, int *sMonth, int *sDay)
+{
+    int gYear, gMonth, gDay;
+    int year, nowruz, dayOfYear;
+
+    dayNumberToGregorian(dayNumber, &gYear, &gMonth, &gDay);
+
+    // The Shamsi year starts in March, so days before Nowruz belong to the previous year
+    year = gYear - 621;
+    nowruz = shamsiToDayNumber(year, 1, 1);
+    if (dayNumber < nowruz)
+    {
+        year--;
+        nowruz = shamsiToDayNumber(year, 1, 1);
+    }
+
+    dayOfYear = dayNumber - nowruz;
+
+    if (dayOfYear < 186)
+    {
+        // One of the first six months, which have 31 days
+        *sMonth = dayOfYear / 31 + 1;
+        *sDay = dayOfYear % 31 + 1;
+    }
+    else
+    {
+        // One of the last six months, which have 30 days (Esfand may have 29)
+        *sMonth = (dayOfYear - 186) / 30 + 7;
+        *sDay = (dayOfYear - 186) % 30 + 1;
+    }
+
+    *sYear = year;
+}
+
+/**
+ * This function converts a date in the Lunar calendar to a day number.
+ * It is the inverse of the tabular Islamic calendar used by gregorianToLunar():
+ * every year has 354 days plus one leap day in 11 years out of 30,
+ * and the months alternate between 30 and 29 days.
+ *
+ * @param year The year in the Lunar calendar.
+ * @param month The month in the Lunar calendar.
+ * @param day The day in the Lunar calendar.
+ * @return The day number of the given date.
+ */
+int lunarToDayNumber(int year, int month, int day)
+{
+    if (lunarOverrides != NULL)
+        return lunarMonthStart(year * 12 + month - 1) + day - 1;
+
+    return (11 * year + 3) / 30 + 354 * year + 30 * month - (month - 1) / 2 + day + 1948440 - 385;
+}
+
+/**
+ * The first day on which gregorianToLunar() uses the Gregorian calendar (15 October 1582).
+ * Before it the function reads its input as a Julian calendar date.
+ */
+#define GREGORIAN_REFORM_DAY_NUMBER 2299161
+
+/**
+ * This function converts a day number to a date in the Lunar calendar using gregorianToLunar().
+ * Days before the Gregorian reform are passed as Julian calendar dates, which is how gregorianToLunar() reads them,
+ * so the result is the inverse of lunarToDayNumber() on both sides of the reform.
+ *
+ * @param dayNumber The day number to convert.
+ * @param lYear Pointer to store the year in the Lunar calendar.
+ * @param lMonth Pointer to store the month in the Lunar calendar.
+ * @param lDay Pointer to store the day in the Lunar calendar.
+ */
+void dayNumberToLunar(int dayNumber, int *lYear, int *lMonth, int *lDay)
+{
+    int year, month, day;
+
+    if (dayNumber < GREGORIAN_REFORM_DAY_NUMBER)
+        dayNumberToJulian(dayNumber, &year, &month, &day);
+    else
+        dayNumberToGregorian(dayNumber, &year, &month, &day);
+    gregorianToLunar(year, month, day, lYear, lMonth, lDay);
+}
+
+/**
+ * The calendar registry describes every calendar the program knows by the same set of functions:
+ * the conversions to and from a day number, the length of a month and the names of the months.
+ * Any date can be converted to any calendar through its day number, so adding a calendar means adding
+ * one entry here instead of a conversion function for every other calendar.
+ * The entries are indexed by the CALENDAR_ constants.
+ */
+struct calendarSystem
+{
+    char *name; // The name used on the command line
+    int (*toDayNumber)(int year, int month, int day);
+    void (*fromDayNumber)(int dayNumber, int *year, int *month, int *day);
+    int (*monthLength)(int year, int month);
+    char **monthNames; // The names of the months, indexed from 1 to 12
+};
+
+struct calendarSystem calendarSystems[CALENDAR_COUNT] = {
+        {"shamsi", shamsiToDayNumber, dayNumberToShamsi, shamsiMonthLength, shamsiMonthNames},
+        {"gregorian", gregorianToDayNumber, dayNumberToGregorian, gregorianMonthLength, gregorianMonthNames},
+        {"lunar", lunarToDayNumber, dayNumberToLunar, lunarMonthLength, lunarMonthNames},
+        {"julian", julianToDayNumber, dayNumberToJulian, julianMonthLength, gregorianMonthNames}
+};
+
+/**
+ * These functions call the functions of a calendar in the registry.
+ * They are inline and name the Shamsi, Gregorian and Lunar calendars, which carry almost all of the traffic, directly:
+ * when the calendar is a constant (as in the conversion loops) the compiler calls the right function
+ * with no table lookup at all. The other calendars, such as the Julian calendar, go through the function pointers
+ * of the registry, so adding a calendar needs no change here.
+ */
+static inline int calendarToDayNumber(int calendar, int year, int month, int day)
+{
+    switch (calendar)
+    {
+        case CALENDAR_SHAMSI:
+            return shamsiToDayNumber(year, month, day);
+        case CALENDAR_GREGORIAN:
+            return gregorianToDayNumber(year, month, day);
+        case CALENDAR_LUNAR:
+            return lunarToDayNumber(year, month, day);
+        default:
+            return calendarSystems[calendar].toDayNumber(year, month, day);
+    }
+}
+
+static inline void calendarFromDayNumber(int calendar, int dayNumber, int *year, int *month, int *day)
+{
+    switch (calendar)
+    {
+        case CALENDAR_SHAMSI:
+            dayNumberToShamsi(dayNumber, year, month, day);
+            break;
+        case CALENDAR_GREGORIAN:
+            dayNumberToGregorian(dayNumber, year, month, day);
+            break;
+        case CALENDAR_LUNAR:
+            dayNumberToLunar(dayNumber, year, month, day);
+            break;
+        default:
+            calendarSystems[calendar].fromDayNumber(dayNumber, year, month, day);
+    }
+}
+
+static inline int calendarMonthLength(int calendar, int year, int month)
+{
+    switch (calendar)
+    {
+        case CALENDAR_SHAMSI:
+            return shamsiMonthLength(year, month);
+        case CALENDAR_GREGORIAN:
+            return gregorianMonthLength(year, month);
+        case CALENDAR_LUNAR:
+            return lunarMonthLength(year, month);
+        default:
+            return calendarSystems[calendar].monthLength(year, month);
+    }
+}
+
+/**
+ * This function tells whether a date converted from a day number lies in the range of its calendar.
+ * A day before the epoch of a calendar gives a year below 1 and, in the Lunar calendar, a month out of range,
+ * so such a date must not be written.
+ *
+ * @param year The converted year.
+ * @param month The converted month.
+ * @return 1 if the date is in range, 0 otherwise.
+ */
+static inline int isDateInRange(int year, int month)
+{
+    return year >= 1 && month >= 1 && month <= 12;
+}
+
+/**
+ * A day cursor holds the same day in the Shamsi, Gregorian and Lunar calendars, together with its day of the week.
+ * It is used to walk forward through a range of days one day at a time
+ * without converting every day from scratch.
+ */
+struct dayCursor
+{
+    int sYear, sMonth, sDay; // Shamsi date
+    int gYear, gMonth, gDay; // Gregorian date
+    int lYear, lMonth, lDay; // Lunar date
+    int dayNumber; // Day number of the date (see gregorianToDayNumber())
+    int weekday; // Day of the week, 0 for SHANBE up to 6 for JOOMEH
+};
+
+/**
+ * This function places a day cursor on a given date in the Shamsi calendar.
+ * It converts the date once with shamsiToGregorian() and dayNumberToLunar().
+ *
+ * @param cursor Pointer to the cursor to initialize.
+ * @param year The year in the Shamsi calendar.
+ * @param month The month in the Shamsi calendar.
+ * @param day The day in the Shamsi calendar.
+ */
+void startDayCursor(struct dayCursor *cursor, int year, int month, int day)
+{
+    cursor->sYear = year;
+    cursor->sMonth = month;
+    cursor->sDay = day;
+
+    // Convert the starting date to the other calendars
+    shamsiToGregorian(year, month, day, &cursor->gYear, &cursor->gMonth, &cursor->gDay);
+    cursor->dayNumber = gregorianToDayNumber(cursor->gYear, cursor->gMonth, cursor->gDay);
+    dayNumberToLunar(cursor->dayNumber, &cursor->lYear, &cursor->lMonth, &cursor->lDay);
+
+    cursor->weekday = dayNumberToWeekday(cursor->dayNumber);
+}
+
+/**
+ * This function moves a day cursor forward by one day.
+ * Each calendar is advanced on its own, rolling over to the next month and year using the month length functions.
+ *
+ * @param cursor Pointer to the cursor to advance.
+ */
+void advanceDayCursor(struct dayCursor *cursor)
+{
+    // Advance the Shamsi date
+    if (++cursor->sDay > shamsiMonthLength(cursor->sYear, cursor->sMonth))
+    {
+        cursor->sDay = 1;
+        if (++cursor->sMonth > 12)
+        {
+            cursor->sMonth = 1;
+            cursor->sYear++;
+        }
+    }
+
+    // Advance the Gregorian date
+    if (++cursor->gDay > gregorianMonthLength(cursor->gYear, cursor->gMonth))
+    {
+        cursor->gDay = 1;
+        if (++cursor->gMonth > 12)
+        {
+            cursor->gMonth = 1;
+            cursor->gYear++;
+        }
+    }
+
+    // Advance the Lunar date
+    if (++cursor->lDay > lunarMonthLength(cursor->lYear, cursor->lMonth))
+    {
+        cursor->lDay = 1;
+        if (++cursor->lMonth > 12)
+        {
+            cursor->lMonth = 1;
+            cursor->lYear++;
+        }
+    }
+
+    cursor->dayNumber++;
+    cursor->weekday = cursor->weekday == 6 ? 0 : cursor->weekday + 1;
+}
+
+/**
+ * This function finds the holiday that falls on a given day of a calendar.
+ * It scans the holidays[] array for an entry of the given calendar with the same month and day.
+ * The monthLength parameter is used to match holidays stored as LAST_DAY_OF_MONTH.
+ *
+ * @param calendar CALENDAR_SHAMSI or CALENDAR_LUNAR.
+ * @param month The month in the given calendar.
+ * @param day The day in the given calendar.
+ * @param monthLength The number of days in the given month.
+ * @return The index of the holiday in holidays[], or -1 if the day is not a holiday.
+ */
+int findHoliday(int calendar, int month, int day, int monthLength)
+{
+    for (int i = 0; i < HOLIDAY_COUNT; i++)
+    {
+        if (holidays[i].calendar != calendar || holidays[i].month != month)
+            continue;
+
+        if (holidays[i].day == day || (holidays[i].day == LAST_DAY_OF_MONTH && day == monthLength))
+            return i; // The day is a holiday
+    }
+
+    return -1; // The day is not a holiday
+}
+
+/**
+ * This function displays the date conversion menu.
+ * It prints the menu options for the user to select from.
+ * The menu options include: going back to the main menu, converting from Shamsi (Solar Hijri) to Gregorian/Lunar,
+ * and converting from Gregorian to Shamsi/Lunar.
+ * The function prompts the user to select an option.
+ */
+void dateConversionMenu()
+{
+    printf("\n%s\n%s Back to menu!\n\n%s Shamsi to Gregorian/Lunar\n\n%s Gregorian to Shamsi/Lunar"
+           "\n\n%s\n\nselect option: ",
+           BLACK_TEXT WHITE_BACKGROUND "          Date Conversion Menu          \n" RESET,
+           GRAY_TEXT "[0]" RESET,
+           GRAY_TEXT "[1]" RESET,
+           GRAY_TEXT "[2]" RESET,
+           BLACK_TEXT WHITE_BACKGROUND "----------------------------------------" RESET);
+}
+
+/**
+ * This function converts a given date from one calendar system to another.
+ * It takes the input date and the source and target calendar systems as parameters.
+ * The function uses the appropriate conversion
+ * formulas and algorithms to calculate the equivalent date in the target calendar system.
+ * It handles both forward and backward conversions, depending on the source and target calendars.
+ * The function performs input validation to ensure
+ * that the input date is valid and within the range supported by the calendar systems.
+ * It also checks for leap years and adjusts the number of days in February accordingly.
  * The function returns the converted date in the target calendar system.
  *
  * @param choice The user's choice for date conversion.
@@ -743,6 +2844,7 @@ void dateConversionMenu()
  */
 int dateConversion(void)
 {
+    char text[LOCAL_TEXT_SIZE];
     int choice;
     int sYear, sMonth, sDay;
     int gYear, gMonth, gDay;
@@ -807,6 +2909,7 @@ int dateConversion(void)
                 if (scanf("%d", &sMonth) != 1 || sMonth < 1 || sMonth > 12)
                 {
                     printf("\n%s\n", RED_TEXT "Invalid input! Please enter a valid month between 1 and 12." RESET);
+                    recordValidationFailure();
                     printf("Press Enter to continue...");
                     clearInputBuffer();
                     getchar();
@@ -819,6 +2922,7 @@ int dateConversion(void)
                 if (scanf("%d", &sDay) != 1 || sDay < 1 || sDay > days_in_shamsi_month[sMonth])
                 {
                     printf("\n%s\n", RED_TEXT "Invalid input! Please enter a valid day within the valid range." RESET);
+                    recordValidationFailure();
                     printf("Press Enter to continue...");
                     clearInputBuffer();
                     getchar();
@@ -831,13 +2935,13 @@ int dateConversion(void)
 
                 // Clear the screen and display the converted Gregorian and Lunar dates
                 clearScreen();
-                printf("\nConverted Gregorian date: %s%d/%02d/%02d%s\n",
+                printf("\nConverted Gregorian date: %s%s%s\n",
                        ITALIC GRAY_TEXT,
-                       gYear, gMonth, gDay,
+                       formatLocalDate(text, gYear, gMonth, gDay, 2),
                        RESET);
-                printf("\nConverted Lunar date: %s%d/%02d/%02d%s\n",
+                printf("\nConverted Lunar date: %s%s%s\n",
                        ITALIC GRAY_TEXT,
-                       lYear, lMonth, lDay,
+                       formatLocalDate(text, lYear, lMonth, lDay, 2),
                        RESET);
                 printf("\nPress Enter to continue...");
                 clearInputBuffer();
@@ -883,6 +2987,7 @@ int dateConversion(void)
                 if (scanf("%d", &gMonth) != 1 || gMonth < 1 || gMonth > 12)
                 {
                     printf("\n%s\n", RED_TEXT "Invalid input! Please enter a valid month between 1 and 12." RESET);
+                    recordValidationFailure();
                     printf("Press Enter to continue...");
                     clearInputBuffer();
                     getchar();
@@ -895,6 +3000,7 @@ int dateConversion(void)
                 if (scanf("%d", &gDay) != 1 || gDay < 1 || gDay > days_in_shamsi_month[gMonth])
                 {
                     printf("\n%s\n", RED_TEXT "Invalid input! Please enter a valid day within the valid range." RESET);
+                    recordValidationFailure();
                     printf("Press Enter to continue...");
                     clearInputBuffer();
                     getchar();
@@ -905,13 +3011,13 @@ int dateConversion(void)
                 gregorianToShamsi(gYear, gMonth, gDay, &sYear, &sMonth, &sDay);
                 gregorianToLunar(gYear, gMonth, gDay, &lYear, &lMonth, &lDay);
                 clearScreen();
-                printf("\nConverted Shamsi date: %s%d/%02d/%02d%s\n",
+                printf("\nConverted Shamsi date: %s%s%s\n",
                        ITALIC GRAY_TEXT,
-                       sYear, sMonth, sDay,
+                       formatLocalDate(text, sYear, sMonth, sDay, 2),
                        RESET);
-                printf("\nConverted Lunar date: %s%d/%02d/%02d%s\n",
+                printf("\nConverted Lunar date: %s%s%s\n",
                        ITALIC GRAY_TEXT,
-                       lYear, lMonth, lDay,
+                       formatLocalDate(text, lYear, lMonth, lDay, 2),
                        RESET);
                 printf("\nPress Enter to continue...");
                 clearInputBuffer();
@@ -992,6 +3098,8 @@ void ageMenu()
  */
 void calculateAge(int birth_year, int birth_month, int birth_day)
 {
+    METRICS_START(METRIC_CALCULATE_AGE, start);
+
     // Clears the screen (assumed function)
     clearScreen();
 
@@ -1015,6 +3123,8 @@ void calculateAge(int birth_year, int birth_month, int birth_day)
         printf("\nPress Enter to try again...");
         clearInputBuffer();
         getchar();
+        recordValidationFailure();
+        METRICS_STOP(METRIC_CALCULATE_AGE, start);
         return;
     }
 
@@ -1025,6 +3135,8 @@ void calculateAge(int birth_year, int birth_month, int birth_day)
         printf("\nPress Enter to try again...");
         clearInputBuffer();
         getchar();
+        recordValidationFailure();
+        METRICS_STOP(METRIC_CALCULATE_AGE, start);
         return;
     }
 
@@ -1033,247 +3145,7500 @@ void calculateAge(int birth_year, int birth_month, int birth_day)
     int age_months = current_month - birth_month;
     int age_days = current_day - birth_day;
 
-    // Adjust the age if the current day is earlier than the birthday
-    if (age_days < 0)
+    // Adjust the age if the current day is earlier than the birthday
+    if (age_days < 0)
+    {
+        age_months--;
+        age_days += days_in_shamsi_month[current_month];
+    }
+
+    // Adjust the age if the current month is earlier than the birth month
+    if (age_months < 0)
+    {
+        age_years--;
+        age_months += 12;
+    }
+
+    // Determine the day of the week for the birthdate
+    int birthdate_daycode = determineDaycode(birth_year, birth_month);
+    int day_of_week_index = (birthdate_daycode + birth_day - 1) % 7;
+
+    // Error handling for invalid birth year
+    if (age_years < 0)
+    {
+        clearScreen();
+        printf("\n%s.\n\n", RED_TEXT "Invalid year! Please enter a year between 1 and 1402" RESET);
+        recordValidationFailure();
+        METRICS_STOP(METRIC_CALCULATE_AGE, start);
+        return;
+    }
+
+    // Array for storing the names of days of the week in the Gregorian calendar (the Shamsi names are global)
+    char *days_of_week_gregorian[] = {"SATURDAY", "SUNDAY", "MONDAY", "TUESDAY", "WEDNESDAY", "THURSDAY", "FRIDAY"};
+
+    // Convert the birthdate from Shamsi to Gregorian calendar
+    int gYear, gMonth, gDay;
+    shamsiToGregorian(birth_year, birth_month, birth_day, &gYear, &gMonth, &gDay);
+
+    birth_year = gYear;
+    birth_month = gMonth;
+    birth_day = gDay;
+
+    // Calculate the time lived in seconds and days since birth
+    time_t birth_time = mktime(&(struct tm){0, 0, 0, birth_day, birth_month - 1, birth_year - 1900});
+    time_t current_time = mktime(&current_date);
+
+    int seconds_lived = difftime(current_time, birth_time);
+    int days_lived = seconds_lived / (60 * 60 * 24);
+
+    // Print the age result and other information, with the numbers in the digits of the output script
+    char years[LOCAL_TEXT_SIZE], months[LOCAL_TEXT_SIZE], days[LOCAL_TEXT_SIZE];
+    printf("\n%s\n Your Age: %s%s years, %s months, %s days%s\n",
+           BLACK_TEXT WHITE_BACKGROUND "                  Age Result                  \n" RESET,
+           ITALIC GRAY_TEXT, formatLocalNumber(years, age_years, 1), formatLocalNumber(months, age_months, 1),
+           formatLocalNumber(days, age_days, 1), RESET);
+    printf("\n You were born on %s%s%s\n", ITALIC, GRAY_TEXT, days_of_week_shamsi[day_of_week_index]);
+    printf("%s", RESET);
+    printf("\n Number of days passed since your birth: %s%s%s%s\n", ITALIC, GRAY_TEXT,
+           formatLocalNumber(days, days_lived, 1), RESET);
+    printf("\n Gregorian birth date: %s%s",
+           ITALIC GRAY_TEXT,
+           formatLocalDate(days, gYear, gMonth, gDay, 2));
+    printf(" [%s%s%s]\n", ITALIC, GRAY_TEXT, days_of_week_gregorian[day_of_week_index]);
+    printf("\n%s\n\n", BLACK_TEXT WHITE_BACKGROUND "----------------------------------------------" RESET);
+    METRICS_STOP(METRIC_CALCULATE_AGE, start);
+}
+
+/**
+ * This function allows the user to enter their birth year, month, and day to calculate their age.
+ * It uses a do-while loop to repeatedly prompt the user
+ for input until a valid date is entered or the user chooses to exit.
+ * The function clears the screen and displays the age menu before prompting for input.
+ * It validates the user's input to ensure they enter valid integers for the birth year, month, and day.
+ * If the user enters an invalid input, an error message is displayed and the user is prompted to try again.
+ * If the user enters a birth year, month, or day of 0, the function returns 0, indicating the user has chosen to exit.
+ * After the user enters a valid date, the function calls the calculateAge()
+ function to calculate the age based on the birth date.
+ * Once the age is calculated, the function prompts the user to press Enter
+ to continue and waits for the user to press Enter.
+ * The do-while loop continues until the user chooses to exit.
+ *
+ * @return The age of the user, or 0 if the user chooses to exit.
+ */
+int age(void)
+{
+    int birth_year, birth_month, birth_day;
+
+    // Start a loop that continues until a valid input is received
+    do
+    {
+        // Clear the console screen
+        clearScreen();
+        // Display the age menu
+        ageMenu();
+
+        // Prompt the user to enter the birth year
+        printf("\nPlease enter the birth year: ");
+
+        // Check if the input is a valid integer
+        if (scanf("%d", &birth_year) != 1)
+        {
+            // Display an error message for invalid input
+            printf("\n%s.\n", RED_TEXT "Invalid input! Please enter a valid integer." RESET);
+            printf("Press Enter to try again...");
+            clearInputBuffer();
+            getchar();
+            clearScreen();
+            // Restart the loop to get a valid input
+            continue;
+        }
+
+        // If the birth year is 0, exit the function and return 0
+        if (birth_year == 0)
+        {
+            return 0;
+        }
+
+        // If the birth year is less than 1, display an error message
+        if (birth_year < 1)
+        {
+            printf("\n%s.\n", RED_TEXT "Invalid year! Please enter a positive year." RESET);
+            printf("Press Enter to try again...");
+            clearInputBuffer();
+            getchar();
+            clearScreen();
+            // Restart the loop to get a valid input
+            continue;
+        }
+
+        // Prompt the user to enter the birth month
+        printf("Please enter a month: ");
+
+        // Check if the input is a valid integer
+        if (scanf("%d", &birth_month) != 1)
+        {
+            // Display an error message for invalid input
+            printf("\n%s.\n", RED_TEXT "Invalid input! Please enter a valid integer." RESET);
+            printf("Press Enter to try again...");
+            clearInputBuffer();
+            getchar();
+            clearScreen();
+            // Restart the loop to get a valid input
+            continue;
+        }
+
+        // If the birth month is 0, exit the function and return 0
+        if (birth_month == 0)
+        {
+            return 0;
+        }
+
+        // If the birth month is not between 1 and 12, display an error message
+        if (birth_month < 1 || birth_month > 12)
+        {
+            printf("\n%s.\n", RED_TEXT "Invalid month! Please enter a month between 1 and 12" RESET);
+            printf("\nPress Enter to try again...");
+            clearInputBuffer();
+            getchar();
+            clearScreen();
+            // Restart the loop to get a valid input
+            continue;
+        }
+
+        // Prompt the user to enter the birthday
+        printf("Please enter a day: ");
+
+        // Check if the input is a valid integer
+        if (scanf("%d", &birth_day) != 1)
+        {
+            // Display an error message for invalid input
+            printf("\n%s.\n", RED_TEXT "Invalid input! Please enter a valid integer." RESET);
+            printf("Press Enter to try again...");
+            clearInputBuffer();
+            getchar();
+            clearScreen();
+            // Restart the loop to get a valid input
+            continue;
+        }
+
+        // If the birthday is 0, exit the function and return 0
+        if (birth_day == 0)
+        {
+            return 0;
+        }
+
+        // Calculate the age based on the provided birth year, month, and day
+        calculateAge(birth_year, birth_month, birth_day);
+
+        // Prompt the user to press Enter to continue
+        printf("Press Enter to continue...");
+        clearInputBuffer();
+        getchar();
+
+    } while (1); // Loop indefinitely until a valid input is obtained
+}
+
+/**
+ * This function displays the current date in three different calendars: Shamsi, Gregorian, and Lunar.
+ * It retrieves the current date and time using the getCurrentDateAndTime() function, which returns a struct tm object.
+ * It then extracts the year, month, and day
+ * from the struct tm object representing the current date in the Gregorian calendar.
+ * The function calls the gregorianToShamsi() function to convert the Gregorian date to the Shamsi date,
+ * storing the result in the variables current_year, current_month, and current_day.
+ * The function also calls the gregorianToLunar() function to convert the Gregorian date to the Lunar date,
+ * storing the result in the variables lYear, lMonth, and lDay.
+ * Finally, the function prints the current dates in the Shamsi, Gregorian, and Lunar calendars using printf statements.
+ * It also prompts the user to press Enter to go back to the menu and waits for user input.
+ */
+void currentDate()
+{
+    int lYear, lMonth, lDay;
+
+    // Get the current date and time
+    struct tm current_date = getCurrentDateAndTime();
+
+    // Extract the current year in the Gregorian calendar
+    int current_gregorian_year = current_date.tm_year + 1900;
+    // Extract the current month in the Gregorian calendar
+    int current_gregorian_month = current_date.tm_mon;
+    // Extract the current day in the Gregorian calendar
+    int current_gregorian_day = current_date.tm_mday;
+
+    int current_year, current_month, current_day;
+    // Convert the Gregorian date to the Shamsi date
+    gregorianToShamsi(current_gregorian_year, current_gregorian_month, current_gregorian_day,
+                      &current_year, &current_month, &current_day);
+
+    // Convert the Gregorian date to the Lunar date
+    gregorianToLunar(current_gregorian_year, current_gregorian_month, current_gregorian_day, &lYear, &lMonth, &lDay);
+
+    char text[LOCAL_TEXT_SIZE];
+    printf("\n%s\n\n",
+           BLACK_TEXT WHITE_BACKGROUND "                 Dates                " RESET);
+    // Print the current Shamsi date
+    printf("   Current Shamsi Date: %s %s %s\n",
+           ITALIC GRAY_TEXT, formatLocalDate(text, current_year, current_month, current_day, 1), RESET);
+    // Print the current Gregorian date
+    printf("\n   Current Gregorian Date: %s %s %s\n",
+           ITALIC GRAY_TEXT,
+           formatLocalDate(text, current_gregorian_year, current_gregorian_month, current_gregorian_day, 1), RESET);
+    // Print the current Lunar date
+    printf("\n   Current Lunar Date: %s %s %s\n",
+           ITALIC GRAY_TEXT, formatLocalDate(text, lYear, lMonth, lDay, 1), RESET);
+    printf("\n%s\n\n",
+           BLACK_TEXT WHITE_BACKGROUND "--------------------------------------" RESET);
+    printf("Press Enter to go back to menu...");
+    clearInputBuffer();
+    // Wait for user input
+    getchar();
+}
+
+/**
+ * These flags select which events exportICS() writes.
+ */
+#define ICS_HOLIDAYS 1
+#define ICS_MONTH_STARTS 2
+
+/**
+ * This function appends one content line of an iCalendar file to an output buffer.
+ * iCalendar lines must not be longer than 75 bytes, so longer lines are folded
+ * by continuing them on the next line after a single space.
+ * Every line ends with CRLF as the iCalendar format requires.
+ *
+ * @param out Pointer to the output buffer.
+ * @param line The content line without the line ending.
+ * @param length The length of the line in bytes.
+ */
+void appendICSLine(struct outputBuffer *out, const char *line, int length)
+{
+    int chunk = 75;
+
+    while (length > chunk)
+    {
+        appendBytes(out, line, chunk);
+        appendBytes(out, "\r\n ", 3);
+        line += chunk;
+        length -= chunk;
+        // Continuation lines start with a space, which counts towards their length
+        chunk = 74;
+    }
+
+    appendBytes(out, line, length);
+    appendBytes(out, "\r\n", 2);
+}
+
+/**
+ * This function appends one all-day event to an iCalendar export.
+ * The summary holds the title of the event followed by the Shamsi and Lunar dates of the day.
+ *
+ * @param out Pointer to the output buffer.
+ * @param cursor The day of the event.
+ * @param title The title of the event, or NULL for a month start.
+ * @param uid A tag that makes the UID of the event unique within the day.
+ * @param stamp The DTSTAMP value of the export.
+ */
+void appendICSEvent(struct outputBuffer *out, struct dayCursor *cursor, char *title, char *uid, char *stamp)
+{
+    char line[256];
+    int length;
+    int endYear, endMonth, endDay;
+
+    // All-day events end on the following day
+    dayNumberToGregorian(cursor->dayNumber + 1, &endYear, &endMonth, &endDay);
+
+    appendText(out, "BEGIN:VEVENT\r\nUID:");
+    appendNumber(out, cursor->sYear, 4);
+    appendNumber(out, cursor->sMonth, 2);
+    appendNumber(out, cursor->sDay, 2);
+    appendText(out, uid);
+    appendText(out, "@c_calendar\r\nDTSTAMP:");
+    appendText(out, stamp);
+    appendText(out, "\r\nDTSTART;VALUE=DATE:");
+    appendNumber(out, cursor->gYear, 4);
+    appendNumber(out, cursor->gMonth, 2);
+    appendNumber(out, cursor->gDay, 2);
+    appendText(out, "\r\nDTEND;VALUE=DATE:");
+    appendNumber(out, endYear, 4);
+    appendNumber(out, endMonth, 2);
+    appendNumber(out, endDay, 2);
+    appendText(out, "\r\n");
+
+    length = snprintf(line, sizeof(line), "SUMMARY:%s%s%d %s %d (%d %s %d)",
+                      title != NULL ? title : "",
+                      title != NULL ? " - " : "",
+                      cursor->sDay, shamsiMonthNames[cursor->sMonth], cursor->sYear,
+                      cursor->lDay, lunarMonthNames[cursor->lMonth], cursor->lYear);
+    appendICSLine(out, line, length);
+
+    appendText(out, "TRANSP:TRANSPARENT\r\nEND:VEVENT\r\n");
+}
+
+/**
+ * This function exports the Shamsi calendar for a range of years as an iCalendar (.ics) file.
+ * It walks through every day of the range once with a day cursor,
+ * writing one all-day event for every holiday and every first day of a Shamsi month.
+ * All output goes through an output buffer, so the file is written in large blocks.
+ *
+ * @param fromYear The first Shamsi year to export.
+ * @param toYear The last Shamsi year to export.
+ * @param events ICS_HOLIDAYS, ICS_MONTH_STARTS or both.
+ * @param path The path of the file to write.
+ * @return 0 on success, 1 if the file could not be written.
+ */
+int exportICS(int fromYear, int toYear, int events, char *path)
+{
+    struct outputBuffer *out;
+    struct dayCursor cursor;
+    char stamp[32];
+    char uid[24];
+    int holiday;
+
+    out = malloc(sizeof(struct outputBuffer));
+    if (out == NULL)
+        return 1;
+
+    // Open the file in binary mode so the CRLF line endings are written unchanged
+    out->file = fopen(path, "wb");
+    out->length = 0;
+    if (out->file == NULL)
+    {
+        free(out);
+        return 1;
+    }
+
+    // Every event carries the time of the export as its DTSTAMP
+    time_t now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", gmtime(&now));
+
+    appendText(out, "BEGIN:VCALENDAR\r\n"
+                    "VERSION:2.0\r\n"
+                    "PRODID:-//c_calendar//Shamsi Calendar//EN\r\n"
+                    "CALSCALE:GREGORIAN\r\n"
+                    "X-WR-CALNAME:Shamsi Calendar\r\n");
+
+    for (startDayCursor(&cursor, fromYear, 1, 1); cursor.sYear <= toYear; advanceDayCursor(&cursor))
+    {
+        if ((events & ICS_MONTH_STARTS) && cursor.sDay == 1)
+        {
+            // Write the first day of the Shamsi month
+            appendICSEvent(out, &cursor, NULL, "-month", stamp);
+        }
+
+        if (events & ICS_HOLIDAYS)
+        {
+            // Write the Shamsi holiday of the day, if any
+            holiday = findHoliday(CALENDAR_SHAMSI, cursor.sMonth, cursor.sDay,
+                                  shamsiMonthLength(cursor.sYear, cursor.sMonth));
+            if (holiday >= 0)
+            {
+                snprintf(uid, sizeof(uid), "-holiday%d", holiday);
+                appendICSEvent(out, &cursor, holidays[holiday].name, uid, stamp);
+            }
+
+            // Write the Lunar holiday of the day, if any
+            holiday = findHoliday(CALENDAR_LUNAR, cursor.lMonth, cursor.lDay,
+                                  lunarMonthLength(cursor.lYear, cursor.lMonth));
+            if (holiday >= 0)
+            {
+                snprintf(uid, sizeof(uid), "-holiday%d", holiday);
+                appendICSEvent(out, &cursor, holidays[holiday].name, uid, stamp);
+            }
+        }
+    }
+
+    appendText(out, "END:VCALENDAR\r\n");
+    flushOutput(out);
+
+    int failed = ferror(out->file) != 0;
+    failed = fclose(out->file) != 0 || failed;
+    free(out);
+
+    return failed;
+}
+
+/**
+ * These constants select how often a recurrence rule repeats.
+ */
+#define RECUR_YEARLY 0
+#define RECUR_MONTHLY 1
+
+/**
+ * A recurrence rule describes an event that repeats on the same day of every year or every month,
+ * in either the Shamsi or the Lunar calendar.
+ * A day of LAST_DAY_OF_MONTH stands for the last day of the month, whatever its length.
+ */
+struct recurrenceRule
+{
+    int calendar; // CALENDAR_SHAMSI or CALENDAR_LUNAR
+    int frequency; // RECUR_YEARLY or RECUR_MONTHLY
+    int month; // The month of a yearly rule
+    int day; // The day of the month, or LAST_DAY_OF_MONTH
+    char name[64];
+};
+
+/**
+ * A recurrence iterator produces the occurrences of one rule in order, one at a time.
+ * It only remembers the month it is looking at, so it uses the same memory however long the window is.
+ */
+struct recurrenceIterator
+{
+    struct recurrenceRule *rule;
+    int year, month; // The month of the next occurrence, in the calendar of the rule
+    int next; // The day number of the next occurrence, or -1 when there are no more occurrences
+    int lastDay; // The day number of the last day of the window
+};
+
+/**
+ * This function returns the day number of a rule's occurrence in a given month,
+ * using the conversion functions of the rule's calendar.
+ *
+ * @param rule The recurrence rule.
+ * @param year The year in the calendar of the rule.
+ * @param month The month in the calendar of the rule.
+ * @return The day number of the occurrence, or -1 if the month is too short for the rule's day.
+ */
+int recurrenceCandidate(struct recurrenceRule *rule, int year, int month)
+{
+    int length, day;
+
+    if (rule->calendar == CALENDAR_SHAMSI)
+        length = shamsiMonthLength(year, month);
+    else
+        length = lunarMonthLength(year, month);
+
+    day = rule->day == LAST_DAY_OF_MONTH ? length : rule->day;
+    if (day > length)
+        return -1; // For example the 30th of Esfand in a common year
+
+    if (rule->calendar == CALENDAR_SHAMSI)
+        return shamsiToDayNumber(year, month, day);
+
+    return lunarToDayNumber(year, month, day);
+}
+
+/**
+ * This function moves a recurrence iterator to the next month (or year) in which its rule occurs.
+ * It jumps straight from one candidate month to the next instead of looking at the days in between.
+ * When the occurrence falls after the end of the window, the iterator is marked as finished.
+ *
+ * @param iterator Pointer to the iterator to advance.
+ */
+void advanceRecurrence(struct recurrenceIterator *iterator)
+{
+    int candidate;
+
+    do
+    {
+        if (iterator->rule->frequency == RECUR_YEARLY)
+        {
+            iterator->year++;
+        }
+        else if (++iterator->month > 12)
+        {
+            iterator->month = 1;
+            iterator->year++;
+        }
+
+        candidate = recurrenceCandidate(iterator->rule, iterator->year, iterator->month);
+    } while (candidate < 0);
+
+    iterator->next = candidate <= iterator->lastDay ? candidate : -1;
+}
+
+/**
+ * This function prepares a recurrence iterator for the window from firstDay to lastDay.
+ * It starts one period before the month containing firstDay and advances
+ * until it reaches the first occurrence inside the window.
+ *
+ * @param iterator Pointer to the iterator to initialize.
+ * @param rule The recurrence rule to expand.
+ * @param firstDay The day number of the first day of the window.
+ * @param lastDay The day number of the last day of the window.
+ */
+void startRecurrence(struct recurrenceIterator *iterator, struct recurrenceRule *rule, int firstDay, int lastDay)
+{
+    int day;
+
+    iterator->rule = rule;
+    iterator->lastDay = lastDay;
+
+    // Find the month of the first day of the window in the calendar of the rule
+    if (rule->calendar == CALENDAR_SHAMSI)
+        dayNumberToShamsi(firstDay, &iterator->year, &iterator->month, &day);
+    else
+        dayNumberToLunar(firstDay, &iterator->year, &iterator->month, &day);
+
+    // Step back one period, so that advancing once lands on the first candidate
+    if (rule->frequency == RECUR_YEARLY)
+    {
+        if (iterator->month <= rule->month)
+            iterator->year--;
+        iterator->month = rule->month;
+    }
+    else if (--iterator->month < 1)
+    {
+        iterator->month = 12;
+        iterator->year--;
+    }
+
+    do
+    {
+        advanceRecurrence(iterator);
+    } while (iterator->next >= 0 && iterator->next < firstDay);
+}
+
+/**
+ * This function compares two recurrence iterators by their next occurrence.
+ * Occurrences on the same day are ordered by the position of their rules.
+ *
+ * @return 1 if the first iterator comes before the second one, 0 otherwise.
+ */
+int recurrenceBefore(struct recurrenceIterator *a, struct recurrenceIterator *b)
+{
+    return a->next < b->next || (a->next == b->next && a->rule < b->rule);
+}
+
+/**
+ * This function restores the order of a heap of recurrence iterators after its first entry has changed.
+ * The heap keeps the iterator with the earliest next occurrence at position 0.
+ *
+ * @param heap The heap of iterators.
+ * @param count The number of iterators in the heap.
+ * @param position The position of the changed entry.
+ */
+void siftRecurrenceHeap(struct recurrenceIterator *heap, int count, int position)
+{
+    struct recurrenceIterator entry = heap[position];
+
+    while (2 * position + 1 < count)
+    {
+        int child = 2 * position + 1;
+
+        // Pick the earlier of the two children
+        if (child + 1 < count && recurrenceBefore(&heap[child + 1], &heap[child]))
+            child++;
+
+        if (!recurrenceBefore(&heap[child], &entry))
+            break;
+
+        heap[position] = heap[child];
+        position = child;
+    }
+
+    heap[position] = entry;
+}
+
+/**
+ * This function reads recurrence rules from a text file, one rule per line:
+ *
+ *     shamsi yearly 1 1 Nowruz
+ *     shamsi monthly last Payday
+ *     lunar yearly 1 10 Ashura
+ *
+ * A rule names its calendar (shamsi or lunar), its frequency (yearly or monthly),
+ * the month for yearly rules, the day (a number or "last") and the name of the event.
+ * Empty lines and lines starting with # are skipped.
+ *
+ * @param path The path of the rules file.
+ * @param count Pointer to store the number of rules read.
+ * @return An array of rules allocated with malloc(), which is empty if the file holds no rule,
+ *         or NULL if the file cannot be read or is invalid.
+ */
+struct recurrenceRule *readRecurrenceRules(char *path, int *count)
+{
+    FILE *file = fopen(path, "r");
+    struct recurrenceRule *rules = NULL;
+    struct recurrenceRule rule;
+    char line[256], calendarName[16], frequencyName[16], dayText[16];
+    int capacity = 0, lineNumber = 0, used, maximumDay;
+
+    if (file == NULL)
+        return NULL;
+
+    *count = 0;
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        lineNumber++;
+
+        if (sscanf(line, "%15s", calendarName) != 1 || calendarName[0] == '#')
+            continue; // Skip empty lines and comments
+
+        if (sscanf(line, "%15s %15s", calendarName, frequencyName) != 2)
+            goto invalid;
+
+        rule.calendar = strcmp(calendarName, "shamsi") == 0 ? CALENDAR_SHAMSI
+                      : strcmp(calendarName, "lunar") == 0 ? CALENDAR_LUNAR : -1;
+        rule.frequency = strcmp(frequencyName, "yearly") == 0 ? RECUR_YEARLY
+                       : strcmp(frequencyName, "monthly") == 0 ? RECUR_MONTHLY : -1;
+
+        // Read the month of yearly rules and the day of all rules
+        rule.month = 1;
+        if (rule.frequency == RECUR_YEARLY)
+        {
+            if (sscanf(line, "%*s %*s %d %15s %n", &rule.month, dayText, &used) != 2)
+                goto invalid;
+        }
+        else if (sscanf(line, "%*s %*s %15s %n", dayText, &used) != 1)
+            goto invalid;
+
+        if (strcmp(dayText, "last") == 0)
+            rule.day = LAST_DAY_OF_MONTH;
+        else if (sscanf(dayText, "%d", &rule.day) != 1 || rule.day < 1)
+            goto invalid;
+
+        // The day must fit in the longest possible version of the month
+        if (rule.calendar == CALENDAR_SHAMSI)
+            maximumDay = rule.frequency == RECUR_MONTHLY || rule.month <= 6 ? 31 : 30;
+        else
+            maximumDay = rule.frequency == RECUR_MONTHLY || rule.month % 2 == 1 || rule.month == 12 ? 30 : 29;
+
+        if (rule.calendar < 0 || rule.frequency < 0 || rule.month < 1 || rule.month > 12 || rule.day > maximumDay)
+            goto invalid;
+
+        // The rest of the line is the name of the event
+        line[strcspn(line, "\r\n")] = '\0';
+        snprintf(rule.name, sizeof(rule.name), "%s", line + used);
+
+        if (*count == capacity)
+        {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            struct recurrenceRule *grown = realloc(rules, capacity * sizeof(struct recurrenceRule));
+            if (grown == NULL)
+                goto invalid;
+            rules = grown;
+        }
+        rules[(*count)++] = rule;
+    }
+
+    if (ferror(file))
+    {
+        fclose(file);
+        free(rules);
+        return NULL;
+    }
+    fclose(file);
+
+    // A file of only comments and empty lines is an empty set of rules, not an error
+    if (rules == NULL)
+        rules = malloc(sizeof(struct recurrenceRule));
+    return rules;
+
+invalid:
+    fprintf(stderr, "%s %s:%d\n", RED_TEXT "Invalid rule in" RESET, path, lineNumber);
+    fclose(file);
+    free(rules);
+    return NULL;
+}
+
+/**
+ * This function writes every occurrence of a set of recurrence rules inside a window, in chronological order.
+ * Each rule gets a recurrence iterator, and the iterators are kept in a heap ordered by their next occurrence.
+ * The earliest occurrence is written, its iterator advances to its next candidate month,
+ * and the heap is repaired, so the rules are expanded lazily and the memory used depends only on the number of rules.
+ * Each line holds the Shamsi date, the Gregorian date and the name of the event.
+ *
+ * @param rules The recurrence rules.
+ * @param count The number of rules.
+ * @param firstDay The day number of the first day of the window.
+ * @param lastDay The day number of the last day of the window.
+ * @param out The output buffer to write the occurrences to.
+ */
+void expandRecurrences(struct recurrenceRule *rules, int count, int firstDay, int lastDay, struct outputBuffer *out)
+{
+    struct recurrenceIterator *heap = malloc((count > 0 ? count : 1) * sizeof(struct recurrenceIterator));
+    int size = 0;
+    int sYear, sMonth, sDay, gYear, gMonth, gDay;
+
+    if (heap == NULL)
+        return;
+
+    // Start an iterator for every rule that occurs inside the window
+    for (int i = 0; i < count; i++)
+    {
+        startRecurrence(&heap[size], &rules[i], firstDay, lastDay);
+        if (heap[size].next >= 0)
+            size++;
+    }
+
+    for (int i = size / 2 - 1; i >= 0; i--)
+        siftRecurrenceHeap(heap, size, i);
+
+    while (size > 0)
+    {
+        int next = heap[0].next;
+
+        // Write the earliest occurrence
+        dayNumberToShamsi(next, &sYear, &sMonth, &sDay);
+        dayNumberToGregorian(next, &gYear, &gMonth, &gDay);
+        appendLocalNumber(out, sYear, 4);
+        appendBytes(out, "/", 1);
+        appendLocalNumber(out, sMonth, 2);
+        appendBytes(out, "/", 1);
+        appendLocalNumber(out, sDay, 2);
+        appendBytes(out, "\t", 1);
+        appendLocalNumber(out, gYear, 4);
+        appendBytes(out, "/", 1);
+        appendLocalNumber(out, gMonth, 2);
+        appendBytes(out, "/", 1);
+        appendLocalNumber(out, gDay, 2);
+        appendBytes(out, "\t", 1);
+        appendText(out, heap[0].rule->name);
+        appendBytes(out, "\n", 1);
+
+        // Move the iterator to its next occurrence, or drop it when it leaves the window
+        advanceRecurrence(&heap[0]);
+        if (heap[0].next < 0)
+            heap[0] = heap[--size];
+        siftRecurrenceHeap(heap, size, 0);
+    }
+
+    free(heap);
+}
+
+/**
+ * This function reads a date written as YEAR/MONTH/DAY (or YEAR-MONTH-DAY) from a command-line argument.
+ *
+ * @param text The command-line argument.
+ * @param year Pointer to store the year.
+ * @param month Pointer to store the month.
+ * @param day Pointer to store the day.
+ * @return 1 if the argument is a valid date, 0 otherwise.
+ */
+int parseDateArgument(char *text, int *year, int *month, int *day)
+{
+    char separator1, separator2, extra;
+
+    if (sscanf(text, "%d%c%d%c%d%c", year, &separator1, month, &separator2, day, &extra) != 5)
+        return 0;
+
+    if ((separator1 != '/' && separator1 != '-') || separator2 != separator1)
+        return 0;
+
+    return *month >= 1 && *month <= 12 && *day >= 1 && *day <= 31;
+}
+
+/**
+ * This function maps a whole file into memory for reading.
+ * The pages are shared with every other process that maps the same file,
+ * so many processes can read a large file while the system keeps only one copy of it in memory.
+ *
+ * @param path The path of the file to map.
+ * @param size Pointer to store the size of the file in bytes.
+ * @return A pointer to the contents of the file, or NULL if the file could not be mapped.
+ */
+const void *mapFileReadOnly(char *path, size_t *size)
+{
+    const void *data;
+
+#ifdef _WIN32
+    HANDLE file, mapping;
+    LARGE_INTEGER fileSize;
+
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return NULL;
+    }
+
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL)
+        return NULL;
+
+    // The view keeps the mapping alive after its handle is closed
+    data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+
+    *size = (size_t)fileSize.QuadPart;
+    return data;
+#else
+    struct stat status;
+    int file = open(path, O_RDONLY);
+
+    if (file < 0)
+        return NULL;
+
+    if (fstat(file, &status) != 0 || status.st_size == 0)
+    {
+        close(file);
+        return NULL;
+    }
+
+    // The mapping stays valid after the file is closed
+    data = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, file, 0);
+    close(file);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    *size = (size_t)status.st_size;
+    return data;
+#endif
+}
+
+/**
+ * This function releases a file mapped with mapFileReadOnly().
+ *
+ * @param data The pointer returned by mapFileReadOnly().
+ * @param size The size of the file in bytes.
+ */
+void unmapFile(const void *data, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(data);
+#else
+    munmap((void *)data, size);
+#endif
+}
+
+/**
+ * A conversion table holds every day of the supported Shamsi years (1206 to 1498) already converted
+ * to the Gregorian and Lunar calendars, so that converting a date becomes a single lookup.
+ * The table is written to a file once with writeConversionTable() and mapped into memory with loadConversionTable().
+ *
+ * The file starts with a tableHeader, followed by the index of the first day of every Shamsi year
+ * (one more entry than there are years, so the last entry marks the end of the table),
+ * followed by one packed 64-bit entry per day, ordered by day number.
+ * Each day entry holds, from the lowest bits up:
+ *     Shamsi day (5 bits), month (4 bits) and year offset (9 bits),
+ *     Gregorian day (5 bits), month (4 bits) and year offset (9 bits),
+ *     Lunar day (5 bits), month (4 bits) and year offset (9 bits),
+ *     and the day of the week (3 bits).
+ * Year offsets are counted from the first year of each calendar stored in the header.
+ */
+#define TABLE_MAGIC "SHCT"
+#define TABLE_VERSION 1
+#define TABLE_BYTE_ORDER 0x01020304
+#define TABLE_FIRST_YEAR 1206
+#define TABLE_LAST_YEAR 1498
+
+struct tableHeader
+{
+    char magic[4]; // Always TABLE_MAGIC
+    uint32_t version; // TABLE_VERSION of the program that wrote the file
+    uint32_t byteOrder; // TABLE_BYTE_ORDER as written by the machine that wrote the file
+    int32_t firstDayNumber; // The day number of the first day in the table
+    uint32_t dayCount; // The number of days in the table
+    uint16_t firstShamsiYear, shamsiYearCount;
+    uint16_t firstGregorianYear, firstLunarYear;
+    uint32_t dayTableOffset; // The position of the first day entry, from the start of the file
+};
+
+struct conversionTable
+{
+    const struct tableHeader *header;
+    const uint32_t *yearStarts; // The index of the first day of every Shamsi year
+    const uint64_t *days; // The packed day entries
+    size_t size; // The size of the mapped file
+};
+
+/**
+ * This variable holds the conversion table loaded with loadConversionTable(), or NULL when no table is loaded.
+ * While a table is loaded, convertDate() uses it instead of the conversion functions.
+ */
+struct conversionTable *loadedTable = NULL;
+
+/**
+ * This function writes a conversion table file covering every day of the Shamsi years 1206 to 1498.
+ * It walks through the days once with a day cursor and packs each day into a 64-bit entry.
+ *
+ * @param path The path of the file to write.
+ * @return 0 on success, 1 if the file could not be written.
+ */
+int writeConversionTable(char *path)
+{
+    struct tableHeader header;
+    struct dayCursor cursor;
+    int yearCount = TABLE_LAST_YEAR - TABLE_FIRST_YEAR + 1;
+    uint32_t *yearStarts = malloc((yearCount + 1) * sizeof(uint32_t));
+    uint64_t *days;
+    uint32_t count = 0;
+    FILE *file;
+
+    startDayCursor(&cursor, TABLE_FIRST_YEAR, 1, 1);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TABLE_MAGIC, 4);
+    header.version = TABLE_VERSION;
+    header.byteOrder = TABLE_BYTE_ORDER;
+    header.firstDayNumber = cursor.dayNumber;
+    header.firstShamsiYear = TABLE_FIRST_YEAR;
+    header.shamsiYearCount = yearCount;
+    header.firstGregorianYear = cursor.gYear;
+    header.firstLunarYear = cursor.lYear;
+    // Day entries start at the first multiple of 8 bytes after the year index
+    header.dayTableOffset = (sizeof(header) + (yearCount + 1) * sizeof(uint32_t) + 7) & ~7u;
+
+    // Every Shamsi year has at most 366 days
+    days = malloc(yearCount * 366 * sizeof(uint64_t));
+    if (yearStarts == NULL || days == NULL)
+    {
+        free(yearStarts);
+        free(days);
+        return 1;
+    }
+
+    for (; cursor.sYear <= TABLE_LAST_YEAR; advanceDayCursor(&cursor))
+    {
+        if (cursor.sMonth == 1 && cursor.sDay == 1)
+            yearStarts[cursor.sYear - TABLE_FIRST_YEAR] = count; // Remember where the year starts
+
+        days[count++] = (uint64_t)cursor.sDay
+                        | (uint64_t)cursor.sMonth << 5
+                        | (uint64_t)(cursor.sYear - header.firstShamsiYear) << 9
+                        | (uint64_t)cursor.gDay << 18
+                        | (uint64_t)cursor.gMonth << 23
+                        | (uint64_t)(cursor.gYear - header.firstGregorianYear) << 27
+                        | (uint64_t)cursor.lDay << 36
+                        | (uint64_t)cursor.lMonth << 41
+                        | (uint64_t)(cursor.lYear - header.firstLunarYear) << 45
+                        | (uint64_t)cursor.weekday << 54;
+    }
+
+    yearStarts[yearCount] = count;
+    header.dayCount = count;
+
+    file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        free(yearStarts);
+        free(days);
+        return 1;
+    }
+
+    // Write the header, the year index, the padding and the day entries
+    uint64_t padding = 0;
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(yearStarts, sizeof(uint32_t), yearCount + 1, file);
+    fwrite(&padding, 1, header.dayTableOffset - sizeof(header) - (yearCount + 1) * sizeof(uint32_t), file);
+    fwrite(days, sizeof(uint64_t), count, file);
+
+    int failed = ferror(file) != 0;
+    failed = fclose(file) != 0 || failed;
+
+    free(yearStarts);
+    free(days);
+    return failed;
+}
+
+/**
+ * This function maps a conversion table file into memory and makes convertDate() use it.
+ * The file is checked for its magic number, version, byte order and size before it is used,
+ * and every entry of the year index is checked to point inside the day entries, so a truncated or corrupt file is refused.
+ * Apart from that check, nothing is computed at startup: the table is used straight from the mapped file.
+ *
+ * @param path The path of the conversion table file.
+ * @return 0 on success, 1 if the file is missing or is not a valid conversion table.
+ */
+int loadConversionTable(char *path)
+{
+    static struct conversionTable table;
+    const struct tableHeader *header;
+    size_t size;
+
+    header = mapFileReadOnly(path, &size);
+    if (header == NULL)
+        return 1;
+
+    if (size < sizeof(struct tableHeader)
+        || memcmp(header->magic, TABLE_MAGIC, 4) != 0
+        || header->version != TABLE_VERSION
+        || header->byteOrder != TABLE_BYTE_ORDER
+        || header->dayTableOffset % 8 != 0
+        || header->dayTableOffset < sizeof(struct tableHeader) + (header->shamsiYearCount + 1) * sizeof(uint32_t)
+        || size < header->dayTableOffset + (size_t)header->dayCount * sizeof(uint64_t))
+    {
+        unmapFile(header, size);
+        return 1;
+    }
+
+    // Every Shamsi year must start where the previous one ended, 365 or 366 days later, and end inside the day entries
+    const uint32_t *yearStarts = (const uint32_t *)(header + 1);
+    for (int i = 0; i <= header->shamsiYearCount; i++)
+    {
+        uint32_t length = i > 0 ? yearStarts[i] - yearStarts[i - 1] : 365;
+
+        if (yearStarts[i] > header->dayCount || length < 365 || length > 366)
+        {
+            unmapFile(header, size);
+            return 1;
+        }
+    }
+
+    table.header = header;
+    table.yearStarts = yearStarts;
+    table.days = (const uint64_t *)((const char *)header + header->dayTableOffset);
+    table.size = size;
+    loadedTable = &table;
+
+    return 0;
+}
+
+/**
+ * This function unpacks one day of the loaded conversion table into a day cursor.
+ *
+ * @param index The position of the day in the table.
+ * @param result Pointer to the cursor to fill.
+ */
+void readTableDay(uint32_t index, struct dayCursor *result)
+{
+    const struct tableHeader *header = loadedTable->header;
+    uint64_t entry = loadedTable->days[index];
+
+    result->sDay = (int)(entry & 31);
+    result->sMonth = (int)(entry >> 5 & 15);
+    result->sYear = (int)(entry >> 9 & 511) + header->firstShamsiYear;
+    result->gDay = (int)(entry >> 18 & 31);
+    result->gMonth = (int)(entry >> 23 & 15);
+    result->gYear = (int)(entry >> 27 & 511) + header->firstGregorianYear;
+    result->lDay = (int)(entry >> 36 & 31);
+    result->lMonth = (int)(entry >> 41 & 15);
+    result->lYear = (int)(entry >> 45 & 511) + header->firstLunarYear;
+    result->weekday = (int)(entry >> 54 & 7);
+    result->dayNumber = header->firstDayNumber + (int)index;
+
+    // The table holds the tabular Lunar calendar and the arithmetic Shamsi calendar
+    if (lunarOverrides != NULL)
+        observeLunarDate(result->dayNumber, &result->lYear, &result->lMonth, &result->lDay);
+    if (astronomicalCalendar)
+        astronomicalDayNumberToShamsi(result->dayNumber, &result->sYear, &result->sMonth, &result->sDay);
+}
+
+/**
+ * This function checks that a date converted to all three calendars lies in the range of each of them,
+ * which fails for days before the epoch of the Shamsi or Lunar calendar.
+ *
+ * @param result Pointer to the converted date.
+ * @return 1 if the date is in range, 0 otherwise.
+ */
+int checkConvertedDate(struct dayCursor *result)
+{
+    if (isDateInRange(result->sYear, result->sMonth) && isDateInRange(result->gYear, result->gMonth)
+        && isDateInRange(result->lYear, result->lMonth))
+        return 1;
+
+    recordValidationFailure();
+    return 0;
+}
+
+/**
+ * This function converts a date from one calendar to all three calendars.
+ * It checks that the month and day are valid for the source calendar first,
+ * and fails for a day that has no date in one of the three calendars, before the epoch of the Shamsi or Lunar calendar.
+ * When a conversion table is loaded and covers the date, the result is read from the table;
+ * otherwise the conversion functions are used. Dates of the other calendars of the registry, such as the Julian calendar,
+ * are first converted to Gregorian dates through their day number.
+ *
+ * @param calendar The CALENDAR_ constant of the calendar of the date.
+ * @param year The year of the date.
+ * @param month The month of the date.
+ * @param day The day of the date.
+ * @param result Pointer to the cursor that receives the date in all three calendars.
+ * @return 1 if the date is valid and was converted, 0 otherwise.
+ */
+int convertDate(int calendar, int year, int month, int day, struct dayCursor *result)
+{
+    int dayNumber;
+
+    if (month < 1 || month > 12 || day < 1)
+    {
+        recordValidationFailure();
+        return 0;
+    }
+
+    if (calendar > CALENDAR_LUNAR)
+    {
+        if (day > calendarMonthLength(calendar, year, month))
+        {
+            recordValidationFailure();
+            return 0;
+        }
+
+        dayNumberToGregorian(calendarToDayNumber(calendar, year, month, day), &year, &month, &day);
+        calendar = CALENDAR_GREGORIAN;
+    }
+
+    if (calendar == CALENDAR_SHAMSI)
+    {
+        if (day > shamsiMonthLength(year, month))
+        {
+            recordValidationFailure();
+            return 0;
+        }
+
+        // The year index of the table only holds for the calendar the table was written with
+        if (loadedTable != NULL && !astronomicalCalendar && year >= loadedTable->header->firstShamsiYear
+            && year < loadedTable->header->firstShamsiYear + loadedTable->header->shamsiYearCount)
+        {
+            // Find the day from the start of its year, as 31-day months followed by 30-day months
+            int dayOfYear = month <= 6 ? (month - 1) * 31 : 186 + (month - 7) * 30;
+            uint32_t index = loadedTable->yearStarts[year - loadedTable->header->firstShamsiYear] + dayOfYear + day - 1;
+
+            // The last day of a leap year can be past the end of a table that was written with another leap rule
+            if (index < loadedTable->header->dayCount)
+            {
+                readTableDay(index, result);
+                return checkConvertedDate(result);
+            }
+        }
+
+        result->sYear = year;
+        result->sMonth = month;
+        result->sDay = day;
+        shamsiToGregorian(year, month, day, &result->gYear, &result->gMonth, &result->gDay);
+        dayNumber = gregorianToDayNumber(result->gYear, result->gMonth, result->gDay);
+        dayNumberToLunar(dayNumber, &result->lYear, &result->lMonth, &result->lDay);
+    }
+    else if (calendar == CALENDAR_GREGORIAN)
+    {
+        if (day > gregorianMonthLength(year, month))
+        {
+            recordValidationFailure();
+            return 0;
+        }
+
+        dayNumber = gregorianToDayNumber(year, month, day);
+
+        if (loadedTable != NULL && (uint32_t)(dayNumber - loadedTable->header->firstDayNumber) < loadedTable->header->dayCount)
+        {
+            readTableDay(dayNumber - loadedTable->header->firstDayNumber, result);
+            return checkConvertedDate(result);
+        }
+
+        result->gYear = year;
+        result->gMonth = month;
+        result->gDay = day;
+        gregorianToShamsi(year, month, day, &result->sYear, &result->sMonth, &result->sDay);
+        // The Gregorian date is proleptic, so the Lunar date comes from the day number rather than gregorianToLunar(),
+        // which reads dates before the reform of 1582 as Julian dates
+        dayNumberToLunar(dayNumber, &result->lYear, &result->lMonth, &result->lDay);
+    }
+    else
+    {
+        if (day > lunarMonthLength(year, month))
+        {
+            recordValidationFailure();
+            return 0;
+        }
+
+        dayNumber = lunarToDayNumber(year, month, day);
+
+        if (loadedTable != NULL && (uint32_t)(dayNumber - loadedTable->header->firstDayNumber) < loadedTable->header->dayCount)
+        {
+            readTableDay(dayNumber - loadedTable->header->firstDayNumber, result);
+            return checkConvertedDate(result);
+        }
+
+        result->lYear = year;
+        result->lMonth = month;
+        result->lDay = day;
+        dayNumberToGregorian(dayNumber, &result->gYear, &result->gMonth, &result->gDay);
+        gregorianToShamsi(result->gYear, result->gMonth, result->gDay, &result->sYear, &result->sMonth, &result->sDay);
+    }
+
+    result->dayNumber = dayNumber;
+    result->weekday = dayNumberToWeekday(dayNumber);
+    return checkConvertedDate(result);
+}
+
+/**
+ * This function reads a date written as YEAR/MONTH/DAY (or YEAR-MONTH-DAY) from a line of text.
+ * It is a faster replacement for sscanf() when converting large files, and stops at the end of the line.
+ *
+ * @param text The start of the text.
+ * @param end The end of the text.
+ * @param year Pointer to store the year.
+ * @param month Pointer to store the month.
+ * @param day Pointer to store the day.
+ * @return 1 if the text holds a date, 0 otherwise.
+ */
+int parseDateText(const char *text, const char *end, int *year, int *month, int *day)
+{
+    int values[3] = {0, 0, 0};
+    char separator = 0;
+
+    for (int part = 0; part < 3; part++)
+    {
+        const char *start = text;
+
+        while (text < end && *text >= '0' && *text <= '9' && text - start < 6)
+            values[part] = values[part] * 10 + (*text++ - '0');
+
+        if (text == start)
+            return 0; // No digits
+
+        if (part < 2)
+        {
+            // The two separators must be the same, either '/' or '-'
+            if (text == end || (*text != '/' && *text != '-') || (separator != 0 && *text != separator))
+                return 0;
+            separator = *text++;
+        }
+    }
+
+    // Allow trailing spaces (and a carriage return) after the date
+    while (text < end && (*text == ' ' || *text == '\t' || *text == '\r'))
+        text++;
+    if (text != end)
+        return 0;
+
+    *year = values[0];
+    *month = values[1];
+    *day = values[2];
+    return 1;
+}
+
+/**
+ * This function appends a date as YEAR/MONTH/DAY, with two-digit months and days, to an output buffer.
+ *
+ * @param out Pointer to the output buffer.
+ * @param year The year.
+ * @param month The month.
+ * @param day The day.
+ */
+void appendDate(struct outputBuffer *out, int year, int month, int day)
+{
+    appendLocalNumber(out, year, 1);
+    appendBytes(out, "/", 1);
+    appendLocalNumber(out, month, 2);
+    appendBytes(out, "/", 1);
+    appendLocalNumber(out, day, 2);
+}
+
+/**
+ * A Lunar month listed in an override file, used while the file is read.
+ */
+struct lunarOverride
+{
+    int monthNumber; // The month, numbered as year * 12 + month - 1
+    int start; // The day number of its observed first day
+    int line; // The line of the file that gave it
+};
+
+/**
+ * This function compares two lunarOverride entries by month, for qsort().
+ *
+ * @param first Pointer to the first entry.
+ * @param second Pointer to the second entry.
+ * @return A negative number, zero or a positive number as the first month is before, the same as or after the second.
+ */
+int compareLunarOverrides(const void *first, const void *second)
+{
+    return ((const struct lunarOverride *)first)->monthNumber - ((const struct lunarOverride *)second)->monthNumber;
+}
+
+/**
+ * This function loads a file of observed Lunar month starts and makes every Lunar conversion use them.
+ * Each line holds a Lunar month as YEAR/MONTH and the Gregorian date of its observed first day as YEAR-MONTH-DAY,
+ * for example "1445/09 2024-03-11". Empty lines and lines starting with # are skipped.
+ * An observed start must be within 3 days of the tabular start. Months whose start and end are both given
+ * must have 29 or 30 days, and the months next to them may be one day shorter or longer.
+ * The file can be changed at any time; it is read again every time the program starts.
+ *
+ * @param path The path of the file.
+ * @return 0 on success, 1 if the file could not be read or holds an invalid line, which is reported.
+ */
+int loadLunarOverrides(char *path)
+{
+    static struct lunarOverrideTable table;
+    struct lunarOverride *entries = NULL;
+    int count = 0, capacity = 0, lineNumber = 0, failed = 0;
+    char line[256];
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "%s %s\n", RED_TEXT "Could not read" RESET, path);
+        return 1;
+    }
+
+    while (!failed && fgets(line, sizeof(line), file) != NULL)
+    {
+        char *text = line, *end, *dateEnd;
+        int year, month, gYear, gMonth, gDay;
+
+        lineNumber++;
+        while (*text == ' ' || *text == '\t')
+            text++;
+        if (*text == '#' || *text == '\n' || *text == '\r' || *text == '\0')
+            continue;
+
+        // Read the Lunar month and the Gregorian date of its first day
+        year = (int)strtol(text, &end, 10);
+        failed = end == text || *end != '/';
+        if (!failed)
+        {
+            text = end + 1;
+            month = (int)strtol(text, &end, 10);
+            failed = end == text || (*end != ' ' && *end != '\t') || month < 1 || month > 12 || year < 1;
+        }
+        if (!failed)
+        {
+            for (text = end; *text == ' ' || *text == '\t'; text++);
+            for (dateEnd = text; *dateEnd != '\0' && *dateEnd != '\n' && *dateEnd != '#'; dateEnd++);
+            failed = !parseDateText(text, dateEnd, &gYear, &gMonth, &gDay) || gMonth < 1 || gMonth > 12 || gDay < 1
+                     || gDay > gregorianMonthLength(gYear, gMonth);
+        }
+        if (failed)
+        {
+            fprintf(stderr, "%s %s:%d\n", RED_TEXT "Expected YEAR/MONTH YEAR-MONTH-DAY at" RESET, path, lineNumber);
+            break;
+        }
+
+        if (count == capacity)
+        {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            struct lunarOverride *grown = realloc(entries, capacity * sizeof(struct lunarOverride));
+            if (grown == NULL)
+            {
+                failed = 1;
+                break;
+            }
+            entries = grown;
+        }
+
+        entries[count].monthNumber = year * 12 + month - 1;
+        entries[count].start = gregorianToDayNumber(gYear, gMonth, gDay);
+        entries[count++].line = lineNumber;
+
+        if (abs(entries[count - 1].start - tabularLunarMonthStart(year * 12 + month - 1)) > 3)
+        {
+            fprintf(stderr, "%s %s:%d\n", RED_TEXT "The month starts more than 3 days away from the tabular calendar at" RESET,
+                    path, lineNumber);
+            failed = 1;
+        }
+    }
+    fclose(file);
+
+    if (!failed && count > 0)
+    {
+        qsort(entries, count, sizeof(struct lunarOverride), compareLunarOverrides);
+
+        table.firstMonth = entries[0].monthNumber;
+        table.monthCount = entries[count - 1].monthNumber - table.firstMonth + 1;
+        table.starts = calloc(table.monthCount, sizeof(int32_t));
+        failed = table.starts == NULL;
+
+        for (int i = 0; !failed && i < count; i++)
+        {
+            if (i > 0 && entries[i].monthNumber == entries[i - 1].monthNumber)
+            {
+                fprintf(stderr, "%s %s:%d\n", RED_TEXT "The month is given twice at" RESET, path, entries[i].line);
+                failed = 1;
+            }
+            else
+                table.starts[entries[i].monthNumber - table.firstMonth] = entries[i].start;
+        }
+
+        // Check the lengths of the months that start or end with an observed day
+        lunarOverrides = &table;
+        for (int i = 0; !failed && i < count; i++)
+            for (int monthNumber = entries[i].monthNumber - 1; !failed && monthNumber <= entries[i].monthNumber; monthNumber++)
+            {
+                int index = monthNumber - table.firstMonth;
+                int bothGiven = index >= 0 && index + 1 < table.monthCount && table.starts[index] != 0
+                                && table.starts[index + 1] != 0;
+                int length = lunarMonthStart(monthNumber + 1) - lunarMonthStart(monthNumber);
+
+                if (length < 29 - !bothGiven || length > 30 + !bothGiven)
+                {
+                    fprintf(stderr, RED_TEXT "Lunar month %d/%02d would have %d days; check" RESET " %s:%d\n",
+                            monthNumber / 12, monthNumber % 12 + 1, length, path, entries[i].line);
+                    failed = 1;
+                }
+            }
+
+        if (failed)
+        {
+            lunarOverrides = NULL;
+            free(table.starts);
+        }
+    }
+
+    free(entries);
+    return failed;
+}
+
+/**
+ * This function reads the --lunar-overrides FILE option, which can be given with any mode (including the menu),
+ * loads the file and removes the option from the arguments.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments.
+ * @return The number of arguments left, or -1 if the file is missing or invalid, which has been reported.
+ */
+int parseLunarOverridesOption(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--lunar-overrides") != 0)
+            continue;
+
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "%s\n", RED_TEXT "--lunar-overrides needs the path of a file." RESET);
+            return -1;
+        }
+        if (loadLunarOverrides(argv[i + 1]) != 0)
+            return -1;
+
+        // Remove the option and its value
+        for (int j = i; j + 2 <= argc; j++)
+            argv[j] = argv[j + 2];
+        return argc - 2;
+    }
+
+    return argc;
+}
+
+/**
+ * This function converts a date in any calendar of the registry to a day number, after checking that the date exists.
+ * It is cheaper than convertDate() when only the day number is needed.
+ *
+ * @param calendar The CALENDAR_ constant of the calendar.
+ * @param year The year.
+ * @param month The month.
+ * @param day The day.
+ * @return The day number of the date, or -1 if the date does not exist.
+ */
+int dateToDayNumber(int calendar, int year, int month, int day)
+{
+    if (month < 1 || month > 12 || day < 1)
+        return -1;
+
+    return day <= calendarMonthLength(calendar, year, month) ? calendarToDayNumber(calendar, year, month, day) : -1;
+}
+
+/**
+ * The names of months and weekdays that textual dates such as "12 Mordad 1402" or "۱۲ مرداد ۱۴۰۲" may use,
+ * in Latin transliteration and in Persian script, with common alternative spellings.
+ * The kind of a month name is the calendar it belongs to; weekday names have the kind NAME_WEEKDAY
+ * and the value 0 for Saturday up to 6 for Friday.
+ */
+#define NAME_WEEKDAY 3
+
+struct dateName
+{
+    const char *name;
+    char kind; // CALENDAR_SHAMSI, CALENDAR_GREGORIAN or CALENDAR_LUNAR for a month, NAME_WEEKDAY for a weekday
+    char value; // The month (1 to 12) or the weekday (0 to 6)
+};
+
+struct dateName dateNames[] = {
+        {"Farvardin", CALENDAR_SHAMSI, 1}, {"Ordibehesht", CALENDAR_SHAMSI, 2}, {"Khordad", CALENDAR_SHAMSI, 3},
+        {"Tir", CALENDAR_SHAMSI, 4}, {"Mordad", CALENDAR_SHAMSI, 5}, {"Amordad", CALENDAR_SHAMSI, 5},
+        {"Shahrivar", CALENDAR_SHAMSI, 6}, {"Mehr", CALENDAR_SHAMSI, 7}, {"Aban", CALENDAR_SHAMSI, 8},
+        {"Azar", CALENDAR_SHAMSI, 9}, {"Dey", CALENDAR_SHAMSI, 10}, {"Dei", CALENDAR_SHAMSI, 10},
+        {"Bahman", CALENDAR_SHAMSI, 11}, {"Esfand", CALENDAR_SHAMSI, 12},
+        {"فروردین", CALENDAR_SHAMSI, 1}, {"اردیبهشت", CALENDAR_SHAMSI, 2}, {"خرداد", CALENDAR_SHAMSI, 3},
+        {"تیر", CALENDAR_SHAMSI, 4}, {"مرداد", CALENDAR_SHAMSI, 5}, {"امرداد", CALENDAR_SHAMSI, 5},
+        {"شهریور", CALENDAR_SHAMSI, 6}, {"مهر", CALENDAR_SHAMSI, 7}, {"آبان", CALENDAR_SHAMSI, 8},
+        {"آذر", CALENDAR_SHAMSI, 9}, {"دی", CALENDAR_SHAMSI, 10}, {"بهمن", CALENDAR_SHAMSI, 11},
+        {"اسفند", CALENDAR_SHAMSI, 12},
+
+        {"January", CALENDAR_GREGORIAN, 1}, {"February", CALENDAR_GREGORIAN, 2}, {"March", CALENDAR_GREGORIAN, 3},
+        {"April", CALENDAR_GREGORIAN, 4}, {"May", CALENDAR_GREGORIAN, 5}, {"June", CALENDAR_GREGORIAN, 6},
+        {"July", CALENDAR_GREGORIAN, 7}, {"August", CALENDAR_GREGORIAN, 8}, {"September", CALENDAR_GREGORIAN, 9},
+        {"October", CALENDAR_GREGORIAN, 10}, {"November", CALENDAR_GREGORIAN, 11}, {"December", CALENDAR_GREGORIAN, 12},
+        {"Jan", CALENDAR_GREGORIAN, 1}, {"Feb", CALENDAR_GREGORIAN, 2}, {"Mar", CALENDAR_GREGORIAN, 3},
+        {"Apr", CALENDAR_GREGORIAN, 4}, {"Jun", CALENDAR_GREGORIAN, 6}, {"Jul", CALENDAR_GREGORIAN, 7},
+        {"Aug", CALENDAR_GREGORIAN, 8}, {"Sep", CALENDAR_GREGORIAN, 9}, {"Sept", CALENDAR_GREGORIAN, 9},
+        {"Oct", CALENDAR_GREGORIAN, 10}, {"Nov", CALENDAR_GREGORIAN, 11}, {"Dec", CALENDAR_GREGORIAN, 12},
+        {"ژانویه", CALENDAR_GREGORIAN, 1}, {"فوریه", CALENDAR_GREGORIAN, 2}, {"مارس", CALENDAR_GREGORIAN, 3},
+        {"آوریل", CALENDAR_GREGORIAN, 4}, {"مه", CALENDAR_GREGORIAN, 5}, {"می", CALENDAR_GREGORIAN, 5},
+        {"ژوئن", CALENDAR_GREGORIAN, 6}, {"ژوئیه", CALENDAR_GREGORIAN, 7}, {"جولای", CALENDAR_GREGORIAN, 7},
+        {"اوت", CALENDAR_GREGORIAN, 8}, {"آگوست", CALENDAR_GREGORIAN, 8}, {"سپتامبر", CALENDAR_GREGORIAN, 9},
+        {"اکتبر", CALENDAR_GREGORIAN, 10}, {"نوامبر", CALENDAR_GREGORIAN, 11}, {"دسامبر", CALENDAR_GREGORIAN, 12},
+
+        {"Muharram", CALENDAR_LUNAR, 1}, {"Moharram", CALENDAR_LUNAR, 1}, {"Safar", CALENDAR_LUNAR, 2},
+        {"Rabi al-Awwal", CALENDAR_LUNAR, 3}, {"Rabi I", CALENDAR_LUNAR, 3}, {"Rabi al-Thani", CALENDAR_LUNAR, 4},
+        {"Rabi al-Akhir", CALENDAR_LUNAR, 4}, {"Rabi II", CALENDAR_LUNAR, 4}, {"Jumada al-Awwal", CALENDAR_LUNAR, 5},
+        {"Jumada al-Ula", CALENDAR_LUNAR, 5}, {"Jumada I", CALENDAR_LUNAR, 5}, {"Jumada al-Thani", CALENDAR_LUNAR, 6},
+        {"Jumada al-Akhirah", CALENDAR_LUNAR, 6}, {"Jumada II", CALENDAR_LUNAR, 6}, {"Rajab", CALENDAR_LUNAR, 7},
+        {"Shaban", CALENDAR_LUNAR, 8}, {"Ramadan", CALENDAR_LUNAR, 9}, {"Ramazan", CALENDAR_LUNAR, 9},
+        {"Shawwal", CALENDAR_LUNAR, 10}, {"Dhu al-Qadah", CALENDAR_LUNAR, 11}, {"Dhu al-Qidah", CALENDAR_LUNAR, 11},
+        {"Dhu al-Hijjah", CALENDAR_LUNAR, 12},
+        {"محرم", CALENDAR_LUNAR, 1}, {"صفر", CALENDAR_LUNAR, 2}, {"ربیع‌الاول", CALENDAR_LUNAR, 3},
+        {"ربیع‌الثانی", CALENDAR_LUNAR, 4}, {"ربیع‌الآخر", CALENDAR_LUNAR, 4},
+        {"جمادی‌الاول", CALENDAR_LUNAR, 5}, {"جمادی‌الاولی", CALENDAR_LUNAR, 5},
+        {"جمادی‌الثانی", CALENDAR_LUNAR, 6}, {"جمادی‌الآخر", CALENDAR_LUNAR, 6}, {"رجب", CALENDAR_LUNAR, 7},
+        {"شعبان", CALENDAR_LUNAR, 8}, {"رمضان", CALENDAR_LUNAR, 9}, {"شوال", CALENDAR_LUNAR, 10},
+        {"ذی‌القعده", CALENDAR_LUNAR, 11}, {"ذی‌القعدة", CALENDAR_LUNAR, 11},
+        {"ذی‌الحجه", CALENDAR_LUNAR, 12}, {"ذی‌الحجة", CALENDAR_LUNAR, 12},
+
+        {"Shanbe", NAME_WEEKDAY, 0}, {"Yekshanbe", NAME_WEEKDAY, 1}, {"Doshanbe", NAME_WEEKDAY, 2},
+        {"Seshanbe", NAME_WEEKDAY, 3}, {"Chaharshanbe", NAME_WEEKDAY, 4}, {"Panjshanbe", NAME_WEEKDAY, 5},
+        {"Panjeshanbe", NAME_WEEKDAY, 5}, {"Jomeh", NAME_WEEKDAY, 6}, {"Joomeh", NAME_WEEKDAY, 6},
+        {"Saturday", NAME_WEEKDAY, 0}, {"Sunday", NAME_WEEKDAY, 1}, {"Monday", NAME_WEEKDAY, 2},
+        {"Tuesday", NAME_WEEKDAY, 3}, {"Wednesday", NAME_WEEKDAY, 4}, {"Thursday", NAME_WEEKDAY, 5},
+        {"Friday", NAME_WEEKDAY, 6}, {"Sat", NAME_WEEKDAY, 0}, {"Sun", NAME_WEEKDAY, 1}, {"Mon", NAME_WEEKDAY, 2},
+        {"Tue", NAME_WEEKDAY, 3}, {"Wed", NAME_WEEKDAY, 4}, {"Thu", NAME_WEEKDAY, 5}, {"Fri", NAME_WEEKDAY, 6},
+        {"شنبه", NAME_WEEKDAY, 0}, {"یکشنبه", NAME_WEEKDAY, 1}, {"دوشنبه", NAME_WEEKDAY, 2},
+        {"سه‌شنبه", NAME_WEEKDAY, 3}, {"چهارشنبه", NAME_WEEKDAY, 4}, {"پنجشنبه", NAME_WEEKDAY, 5},
+        {"جمعه", NAME_WEEKDAY, 6}
+};
+
+#define DATE_NAME_COUNT (int)(sizeof(dateNames) / sizeof(dateNames[0]))
+
+/**
+ * Names are looked up with a perfect hash: NAME_HASH_SEED was chosen offline so that the normalized forms
+ * of all names in dateNames[] fall in different slots of a table of NAME_HASH_SLOTS entries.
+ * A lookup therefore hashes the name, reads one slot and compares one name.
+ * The table is constant data, printed by calendar_tool --name-table; --verify checks that it still matches
+ * dateNames[], and reports a name that collides with another, in which case a new seed must be found.
+ */
+#define NAME_HASH_SEED 9051u
+#define NAME_HASH_SLOTS 1024
+#define NAME_KEY_LENGTH 40
+
+/**
+ * The index of the name in each slot of the perfect hash plus 1, or 0 for an empty slot.
+ */
+static const unsigned char nameSlots[NAME_HASH_SLOTS] = {
+        [13] = 37, [17] = 27, [21] = 58, [38] = 108, [44] = 42, [45] = 24, [49] = 90, [50] = 77,
+        [51] = 15, [59] = 17, [67] = 133, [71] = 104, [83] = 4, [86] = 92, [114] = 95, [115] = 25,
+        [123] = 125, [131] = 49, [152] = 43, [158] = 79, [159] = 54, [160] = 81, [173] = 117, [175] = 12,
+        [178] = 13, [181] = 100, [187] = 68, [190] = 128, [196] = 7, [205] = 44, [222] = 94, [224] = 28,
+        [230] = 89, [232] = 114, [237] = 56, [238] = 48, [243] = 55, [271] = 39, [286] = 98, [301] = 86,
+        [308] = 34, [310] = 9, [315] = 36, [316] = 52, [318] = 26, [330] = 6, [333] = 16, [338] = 14,
+        [339] = 127, [343] = 83, [358] = 112, [360] = 88, [365] = 51, [366] = 129, [368] = 78, [376] = 118,
+        [392] = 29, [394] = 111, [404] = 18, [407] = 120, [415] = 73, [428] = 99, [433] = 132, [441] = 119,
+        [444] = 2, [471] = 93, [478] = 122, [485] = 87, [495] = 40, [496] = 63, [514] = 80, [519] = 60,
+        [520] = 70, [527] = 102, [529] = 23, [547] = 45, [548] = 131, [557] = 85, [569] = 96, [581] = 97,
+        [583] = 75, [599] = 110, [614] = 64, [623] = 105, [627] = 91, [631] = 3, [632] = 11, [633] = 109,
+        [634] = 106, [650] = 1, [669] = 19, [677] = 67, [683] = 107, [687] = 20, [689] = 5, [705] = 74,
+        [707] = 8, [710] = 84, [717] = 124, [736] = 30, [741] = 35, [758] = 50, [766] = 62, [767] = 38,
+        [772] = 130, [787] = 65, [790] = 134, [792] = 61, [794] = 113, [803] = 66, [804] = 33, [821] = 59,
+        [834] = 53, [835] = 103, [836] = 10, [838] = 31, [842] = 69, [858] = 116, [859] = 47, [862] = 123,
+        [871] = 126, [874] = 46, [879] = 76, [880] = 82, [881] = 115, [887] = 22, [899] = 121, [909] = 21,
+        [960] = 71, [985] = 72, [992] = 135, [1009] = 41, [1011] = 57, [1017] = 101, [1021] = 32
+};
+
+/**
+ * This function appends the normalized form of one character of a name to a key.
+ * Latin letters are lowercased; spaces, hyphens, apostrophes and zero-width non-joiners are dropped;
+ * and the Arabic forms of yeh and kaf are replaced by the Persian ones, so that "Rabi al-Awwal", "rabi alawwal",
+ * "ربیع‌الاول" and "ربيع الاول" all give the same key.
+ *
+ * @param text Pointer to the character, which may be several bytes long.
+ * @param end The end of the text.
+ * @param key The key to append to.
+ * @param length Pointer to the length of the key, which is increased.
+ * @return The number of bytes of text used.
+ */
+int normalizeNameCharacter(const unsigned char *text, const unsigned char *end, char *key, int *length)
+{
+    unsigned char c = text[0];
+
+    if (c >= 'A' && c <= 'Z')
+        c = c - 'A' + 'a';
+    else if (c == ' ' || c == '-' || c == '\'')
+        return 1;
+    else if (c == 0xE2 && end - text >= 3 && text[1] == 0x80 && (text[2] == 0x8C || text[2] == 0x99))
+        return 3; // Zero-width non-joiner or right single quotation mark
+    else if (c == 0xD9 && end - text >= 2 && (text[1] == 0x8A || text[1] == 0x89 || text[1] == 0x83))
+    {
+        // Arabic yeh and alef maksura become Persian yeh, Arabic kaf becomes Persian kaf
+        if (*length + 2 <= NAME_KEY_LENGTH)
+        {
+            key[(*length)++] = text[1] == 0x83 ? (char)0xDA : (char)0xDB;
+            key[(*length)++] = text[1] == 0x83 ? (char)0xA9 : (char)0x8C;
+        }
+        else
+            *length = NAME_KEY_LENGTH + 1;
+        return 2;
+    }
+
+    if (*length < NAME_KEY_LENGTH)
+        key[(*length)++] = (char)c;
+    else
+        *length = NAME_KEY_LENGTH + 1; // Too long to be a name
+    return 1;
+}
+
+/**
+ * This function computes the slot of a normalized name in the perfect hash table (FNV-1a with a fixed seed).
+ *
+ * @param key The normalized name.
+ * @param length The length of the name.
+ * @return The slot of the name.
+ */
+unsigned int nameHash(const char *key, int length)
+{
+    uint32_t hash = NAME_HASH_SEED;
+
+    for (int i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+    return (hash ^ (hash >> 16)) & (NAME_HASH_SLOTS - 1);
+}
+
+/**
+ * This function writes the normalized form of a name of dateNames[].
+ *
+ * @param name The name.
+ * @param key The buffer that receives the normalized name, of NAME_KEY_LENGTH bytes.
+ * @return The length of the normalized name.
+ */
+int normalizeDateName(const char *name, char *key)
+{
+    const unsigned char *text = (const unsigned char *)name;
+    const unsigned char *end = text + strlen(name);
+    int length = 0;
+
+    while (text < end)
+        text += normalizeNameCharacter(text, end, key, &length);
+    return length;
+}
+
+/**
+ * This function computes the slots of the perfect hash for the names of dateNames[],
+ * and reports every name that falls in the slot of another.
+ *
+ * @param slots The table that receives the index of the name in each slot plus 1, of NAME_HASH_SLOTS entries.
+ * @return The number of names that share a slot with another.
+ */
+int computeNameSlots(unsigned char *slots)
+{
+    int collisions = 0;
+
+    memset(slots, 0, NAME_HASH_SLOTS);
+    for (int i = 0; i < DATE_NAME_COUNT; i++)
+    {
+        char key[NAME_KEY_LENGTH];
+        unsigned int slot = nameHash(key, normalizeDateName(dateNames[i].name, key));
+
+        if (slots[slot] != 0)
+        {
+            printf(RED_TEXT "The names %s and %s share a hash slot; choose a new NAME_HASH_SEED." RESET "\n",
+                   dateNames[slots[slot] - 1].name, dateNames[i].name);
+            collisions++;
+        }
+        slots[slot] = (unsigned char)(i + 1);
+    }
+
+    return collisions;
+}
+
+/**
+ * This function prints nameSlots[] as C source, to paste into this file after dateNames[] or NAME_HASH_SEED changes.
+ *
+ * @param output The stream to write to.
+ * @return 0 on success, 1 if two names share a slot or the output could not be written.
+ */
+int writeNameTable(FILE *output)
+{
+    unsigned char slots[NAME_HASH_SLOTS];
+    int collisions = computeNameSlots(slots), count = 0;
+
+    fprintf(output, "static const unsigned char nameSlots[NAME_HASH_SLOTS] = {");
+    for (int slot = 0; slot < NAME_HASH_SLOTS; slot++)
+        if (slots[slot] != 0)
+            fprintf(output, "%s[%d] = %d", count == 0 ? "\n        " : count % 8 == 0 ? ",\n        " : ", ", slot,
+                    slots[slot]), count++;
+    fprintf(output, "\n};\n");
+
+    return collisions != 0 || ferror(output) != 0;
+}
+
+/**
+ * This function checks that nameSlots[] matches the names of dateNames[] and prints the result.
+ *
+ * @return 0 if the table matches and no two names share a slot, 1 otherwise.
+ */
+int checkNameTable(void)
+{
+    unsigned char slots[NAME_HASH_SLOTS];
+    int failures = computeNameSlots(slots);
+
+    if (memcmp(slots, nameSlots, NAME_HASH_SLOTS) != 0)
+    {
+        printf(RED_TEXT "nameSlots[] does not match dateNames[]; print it again with --name-table." RESET "\n");
+        failures++;
+    }
+
+    printf("Checked the hash slots of %d month and weekday names: ", DATE_NAME_COUNT);
+    if (failures == 0)
+        printf("no mismatches.\n");
+    else
+        printf(RED_TEXT "%d mismatches." RESET "\n", failures);
+
+    return failures != 0;
+}
+
+/**
+ * This function looks up a normalized month or weekday name.
+ * The table is constant, so any number of threads can look up names at the same time.
+ *
+ * @param key The normalized name.
+ * @param length The length of the name.
+ * @return Pointer to the name in dateNames[], or NULL if it is not a known name.
+ */
+struct dateName *findDateName(const char *key, int length)
+{
+    char nameKey[NAME_KEY_LENGTH];
+    int index;
+
+    if (length > NAME_KEY_LENGTH)
+        return NULL;
+
+    index = nameSlots[nameHash(key, length)] - 1;
+    if (index < 0 || normalizeDateName(dateNames[index].name, nameKey) != length || memcmp(nameKey, key, length) != 0)
+        return NULL;
+    return &dateNames[index];
+}
+
+/**
+ * This function returns the value of a digit, which may be an ASCII digit or a Persian or Arabic-Indic digit in UTF-8.
+ *
+ * @param text Pointer to the character.
+ * @param end The end of the text.
+ * @param size Pointer to the variable that receives the number of bytes of the digit.
+ * @return The value of the digit, or -1 if the character is not a digit.
+ */
+int readDigit(const unsigned char *text, const unsigned char *end, int *size)
+{
+    if (text[0] >= '0' && text[0] <= '9')
+    {
+        *size = 1;
+        return text[0] - '0';
+    }
+
+    // U+06F0 to U+06F9 (Persian) and U+0660 to U+0669 (Arabic-Indic)
+    if (end - text >= 2 && ((text[0] == 0xDB && text[1] >= 0xB0 && text[1] <= 0xB9)
+                            || (text[0] == 0xD9 && text[1] >= 0xA0 && text[1] <= 0xA9)))
+    {
+        *size = 2;
+        return text[1] - (text[0] == 0xDB ? 0xB0 : 0xA0);
+    }
+
+    return -1;
+}
+
+/**
+ * One part of a textual date: a number, or a name made of one or more words, like "Rabi al-Awwal".
+ */
+struct dateToken
+{
+    int value; // The number, for a number
+    int length; // The length of the normalized name, or -1 for a number
+    char key[NAME_KEY_LENGTH]; // The normalized name
+};
+
+/**
+ * This function reads a date written with a month name, such as "12 Mordad 1402", "Mordad 12, 1402",
+ * "March 21, 2024", "1 Ramadan 1445" or "۱۲ مرداد ۱۴۰۲", optionally starting with a weekday ("Shanbe 12 Mordad 1402").
+ * The calendar of the date comes from the month name. Names are matched without regard to case,
+ * and digits may be ASCII, Persian or Arabic-Indic. When a weekday is given it must be the weekday of the date.
+ * A name ends at a space once it is a known name, so "Thursday March 21, 2024" is a weekday and a month,
+ * while the words of "Rabi al-Awwal" or "سه شنبه" are read as one name.
+ *
+ * @param text The start of the text.
+ * @param end The end of the text.
+ * @param calendar Pointer to store the calendar of the date.
+ * @param year Pointer to store the year.
+ * @param month Pointer to store the month.
+ * @param day Pointer to store the day.
+ * @return 1 if the text holds a valid date, 0 otherwise.
+ */
+int parseTextDate(const char *text, const char *end, int *calendar, int *year, int *month, int *day)
+{
+    const unsigned char *position = (const unsigned char *)text;
+    const unsigned char *limit = (const unsigned char *)end;
+    struct dateToken tokens[4];
+    struct dateName *name;
+    int count = 0, joined = 0, first = 0, weekday = -1, dayNumber;
+
+    // Split the text into numbers and names; a word separated only by spaces from a name that is not complete continues it
+    while (position < limit)
+    {
+        int size, digit = readDigit(position, limit, &size);
+
+        if (*position == ' ' || *position == '\t' || *position == '\r')
+        {
+            position++;
+            continue;
+        }
+        if (*position == ',' || *position == '/' || *position == '.')
+        {
+            joined = 0;
+            position++;
+            continue;
+        }
+
+        if (digit >= 0)
+        {
+            if (count == 4)
+                return 0;
+            tokens[count].value = 0;
+            tokens[count].length = -1;
+            for (int digits = 0; digit >= 0 && digits < 6; digits++)
+            {
+                tokens[count].value = tokens[count].value * 10 + digit;
+                position += size;
+                digit = position < limit ? readDigit(position, limit, &size) : -1;
+            }
+            if (digit >= 0)
+                return 0; // Too many digits
+            count++;
+            joined = 0;
+            continue;
+        }
+
+        // A word, added to the name before it if only spaces came between them and that name is not a known name yet
+        if (!joined || findDateName(tokens[count - 1].key, tokens[count - 1].length) != NULL)
+        {
+            if (count == 4)
+                return 0;
+            tokens[count++].length = 0;
+            joined = 1;
+        }
+        while (position < limit && *position != ' ' && *position != '\t' && *position != '\r' && *position != ','
+               && *position != '/' && *position != '.' && readDigit(position, limit, &size) < 0)
+            position += normalizeNameCharacter(position, limit, tokens[count - 1].key, &tokens[count - 1].length);
+    }
+
+    // An optional weekday first
+    if (count == 4 && tokens[0].length >= 0)
+    {
+        name = findDateName(tokens[0].key, tokens[0].length);
+        if (name == NULL || name->kind != NAME_WEEKDAY)
+            return 0;
+        weekday = name->value;
+        first = 1;
+    }
+    if (count - first != 3 || tokens[first + 2].length >= 0)
+        return 0;
+
+    // DAY MONTH YEAR or MONTH DAY YEAR
+    if (tokens[first + 1].length >= 0 && tokens[first].length < 0)
+    {
+        *day = tokens[first].value;
+        name = findDateName(tokens[first + 1].key, tokens[first + 1].length);
+    }
+    else if (tokens[first].length >= 0 && tokens[first + 1].length < 0)
+    {
+        *day = tokens[first + 1].value;
+        name = findDateName(tokens[first].key, tokens[first].length);
+    }
+    else
+        return 0;
+
+    if (name == NULL || name->kind == NAME_WEEKDAY)
+        return 0;
+
+    *calendar = name->kind;
+    *month = name->value;
+    *year = tokens[first + 2].value;
+
+    dayNumber = dateToDayNumber(*calendar, *year, *month, *day);
+    return dayNumber >= 0 && (weekday < 0 || dayNumberToWeekday(dayNumber) == weekday);
+}
+
+/**
+ * The streaming modes read their input in chunks of CONVERT_CHUNK_SIZE bytes
+ * and handle the complete lines of each chunk together.
+ */
+#define CONVERT_CHUNK_SIZE (1 << 20)
+
+/**
+ * A line reader reads a stream in chunks and hands out the complete lines of each chunk at once.
+ * The partial line at the end of a chunk is kept and moved to the start of the next chunk.
+ * The chunk grows when a single line does not fit in it, so lines are never cut.
+ */
+struct lineReader
+{
+    FILE *input; // The stream to read
+    char *chunk; // capacity bytes of input, plus room for a final newline
+    size_t capacity; // The size of the chunk, CONVERT_CHUNK_SIZE unless a longer line has been read
+    size_t length; // The number of bytes in the chunk
+    size_t complete; // The number of bytes handed out by the last call of readLineChunk()
+    int finished; // 1 once the end of the input has been reached
+    int failed; // 1 if memory ran out while growing the chunk
+};
+
+/**
+ * This function prepares a line reader for a stream.
+ *
+ * @param reader Pointer to the reader to initialize.
+ * @param input The stream to read.
+ * @return 0 on success, 1 if memory ran out.
+ */
+int startLineReader(struct lineReader *reader, FILE *input)
+{
+    reader->input = input;
+    reader->chunk = malloc(CONVERT_CHUNK_SIZE + 1);
+    reader->capacity = CONVERT_CHUNK_SIZE;
+    reader->length = 0;
+    reader->complete = 0;
+    reader->finished = 0;
+    reader->failed = 0;
+
+    return reader->chunk == NULL;
+}
+
+/**
+ * This function reads the next chunk of complete lines from a line reader.
+ * The last line of the input is given a newline if it has none, so every chunk handed out ends with a newline.
+ * A line longer than the chunk makes the chunk grow until the whole line fits; its bytes are never changed.
+ *
+ * @param reader Pointer to the reader.
+ * @param text Pointer to store the start of the lines.
+ * @return The number of bytes of complete lines, or 0 at the end of the input or if memory ran out,
+ *         which sets reader->failed.
+ */
+size_t readLineChunk(struct lineReader *reader, char **text)
+{
+    size_t used = reader->length - reader->complete;
+
+    if (reader->finished)
+        return 0;
+
+    // Fill the chunk after the partial line left over from the previous chunk
+    memmove(reader->chunk, reader->chunk + reader->complete, used);
+    reader->length = used;
+    reader->complete = 0;
+
+    while (reader->complete == 0)
+    {
+        char *chunk = reader->chunk, *lastNewline;
+        size_t searched = reader->length;
+
+        reader->length += fread(chunk + reader->length, 1, reader->capacity - reader->length, reader->input);
+        if (reader->length == 0)
+        {
+            reader->finished = 1;
+            return 0;
+        }
+
+        if (reader->length < reader->capacity)
+        {
+            // The end of the input: make sure the last line is complete
+            if (chunk[reader->length - 1] != '\n')
+                chunk[reader->length++] = '\n';
+            reader->complete = reader->length;
+            reader->finished = 1;
+            break;
+        }
+
+        // Hand out the complete lines now and keep the rest for the next chunk.
+        // The bytes before the new ones hold no newline, as they are the start of a partial line
+        lastNewline = chunk + reader->length;
+        while (lastNewline > chunk + searched && lastNewline[-1] != '\n')
+            lastNewline--;
+        if (lastNewline > chunk + searched)
+        {
+            reader->complete = lastNewline - chunk;
+            break;
+        }
+
+        // A line longer than the whole chunk: grow the chunk and read on
+        chunk = realloc(reader->chunk, reader->capacity * 2 + 1);
+        if (chunk == NULL)
+        {
+            reader->failed = 1;
+            reader->finished = 1;
+            return 0;
+        }
+        reader->chunk = chunk;
+        reader->capacity *= 2;
+    }
+
+    *text = reader->chunk;
+    return reader->complete;
+}
+
+/**
+ * This function releases the memory of a line reader.
+ *
+ * @param reader Pointer to the reader.
+ */
+void stopLineReader(struct lineReader *reader)
+{
+    free(reader->chunk);
+    reader->chunk = NULL;
+}
+
+/**
+ * A conversion batch holds the lines of one chunk of input, from parsing to formatting.
+ */
+struct conversionBatch
+{
+    int count; // The number of lines in the batch
+    int capacity; // The number of lines the arrays can hold
+    int *years, *months, *days; // The parsed dates (month 0 for lines that are not dates)
+    struct dayCursor *results; // The converted dates
+    char *valid; // 1 for each line that was converted
+};
+
+/**
+ * This function makes sure the arrays of a batch can hold a given number of lines.
+ *
+ * @param batch The batch to grow.
+ * @param count The number of lines the batch must be able to hold.
+ * @return 0 on success, 1 if memory ran out.
+ */
+int growConversionBatch(struct conversionBatch *batch, int count)
+{
+    int capacity = batch->capacity == 0 ? 4096 : batch->capacity;
+
+    if (count <= batch->capacity)
+        return 0;
+
+    while (capacity < count)
+        capacity *= 2;
+
+    int *years = realloc(batch->years, capacity * sizeof(int));
+    if (years != NULL)
+        batch->years = years;
+    int *months = years != NULL ? realloc(batch->months, capacity * sizeof(int)) : NULL;
+    if (months != NULL)
+        batch->months = months;
+    int *days = months != NULL ? realloc(batch->days, capacity * sizeof(int)) : NULL;
+    if (days != NULL)
+        batch->days = days;
+    struct dayCursor *results = days != NULL ? realloc(batch->results, capacity * sizeof(struct dayCursor)) : NULL;
+    if (results != NULL)
+        batch->results = results;
+    char *valid = results != NULL ? realloc(batch->valid, capacity) : NULL;
+    if (valid == NULL)
+        return 1;
+
+    batch->valid = valid;
+    batch->capacity = capacity;
+    return 0;
+}
+
+/**
+ * This function splits the complete lines of a chunk of input and parses the date on each line.
+ *
+ * @param batch The batch that receives the parsed dates.
+ * @param text The chunk of input, which must end with a newline.
+ * @param length The length of the chunk in bytes.
+ * @param calendar The calendar of the dates, into which dates written with a month name are translated.
+ * @return 0 on success, 1 if memory ran out.
+ */
+int parseConversionBatch(struct conversionBatch *batch, const char *text, size_t length, int calendar)
+{
+    const char *end = text + length;
+
+    batch->count = 0;
+
+    while (text < end)
+    {
+        const char *lineEnd = memchr(text, '\n', end - text);
+        int index = batch->count;
+
+        if (growConversionBatch(batch, index + 1) != 0)
+            return 1;
+
+        if (!parseDateText(text, lineEnd, &batch->years[index], &batch->months[index], &batch->days[index]))
+        {
+            int textCalendar, year, month, day;
+
+            batch->months[index] = 0; // convertDate() rejects month 0
+
+            // A date written with a month name, which gives its own calendar
+            if (parseTextDate(text, lineEnd, &textCalendar, &year, &month, &day))
+            {
+                calendarFromDayNumber(calendar, dateToDayNumber(textCalendar, year, month, day), &year, &month, &day);
+
+                batch->years[index] = year;
+                batch->months[index] = month;
+                batch->days[index] = day;
+            }
+        }
+
+        batch->count++;
+        text = lineEnd + 1;
+    }
+
+    return 0;
+}
+
+/**
+ * This function converts every parsed date of a batch to all three calendars.
+ *
+ * @param batch The batch to convert.
+ * @param calendar The calendar of the input dates.
+ */
+void convertConversionBatch(struct conversionBatch *batch, int calendar)
+{
+    for (int i = 0; i < batch->count; i++)
+        batch->valid[i] = (char)convertDate(calendar, batch->years[i], batch->months[i], batch->days[i],
+                                            &batch->results[i]);
+}
+
+/**
+ * This function writes the converted dates of a batch to an output buffer, one line per input line.
+ * Each line holds the Shamsi, Gregorian and Lunar dates separated by tabs,
+ * or a single "-" for input lines that were not valid dates.
+ *
+ * @param batch The batch to write.
+ * @param out Pointer to the output buffer.
+ */
+void formatConversionBatch(struct conversionBatch *batch, struct outputBuffer *out)
+{
+    for (int i = 0; i < batch->count; i++)
+    {
+        struct dayCursor *date = &batch->results[i];
+
+        if (!batch->valid[i])
+        {
+            appendBytes(out, "-\n", 2);
+            continue;
+        }
+
+        appendDate(out, date->sYear, date->sMonth, date->sDay);
+        appendBytes(out, "\t", 1);
+        appendDate(out, date->gYear, date->gMonth, date->gDay);
+        appendBytes(out, "\t", 1);
+        appendDate(out, date->lYear, date->lMonth, date->lDay);
+        appendBytes(out, "\n", 1);
+    }
+}
+
+/**
+ * A packed date stores a date of any calendar in 32 bits:
+ * the calendar in the top 2 bits, then the year (21 bits), the month (4 bits) and the day (5 bits).
+ * Packed dates of the same calendar compare in the same order as the dates themselves,
+ * and the value 0 is never a valid date, so it can mark a missing date.
+ */
+#define PACKED_CALENDAR_SHIFT 30
+#define PACKED_YEAR_SHIFT 9
+#define PACKED_MONTH_SHIFT 5
+
+/**
+ * This function packs a date into 32 bits.
+ *
+ * @param calendar The calendar of the date.
+ * @param year The year, between 0 and 2097151.
+ * @param month The month.
+ * @param day The day.
+ * @return The packed date.
+ */
+uint32_t packDate(int calendar, int year, int month, int day)
+{
+    return (uint32_t)calendar << PACKED_CALENDAR_SHIFT
+           | (uint32_t)year << PACKED_YEAR_SHIFT
+           | (uint32_t)month << PACKED_MONTH_SHIFT
+           | (uint32_t)day;
+}
+
+/**
+ * This function tells whether a date fits in the fields of a packed date.
+ *
+ * @param year The year.
+ * @param month The month.
+ * @param day The day.
+ * @return 1 if packDate() can pack the date, 0 otherwise.
+ */
+int canPackDate(int year, int month, int day)
+{
+    return year >= 0 && year <= 0x1FFFFF && month >= 1 && month <= 12 && day >= 1 && day <= 31;
+}
+
+/**
+ * This function unpacks a date packed with packDate().
+ *
+ * @param packed The packed date.
+ * @param calendar Pointer to store the calendar of the date.
+ * @param year Pointer to store the year.
+ * @param month Pointer to store the month.
+ * @param day Pointer to store the day.
+ */
+void unpackDate(uint32_t packed, int *calendar, int *year, int *month, int *day)
+{
+    *calendar = (int)(packed >> PACKED_CALENDAR_SHIFT);
+    *year = (int)(packed >> PACKED_YEAR_SHIFT & 0x1FFFFF);
+    *month = (int)(packed >> PACKED_MONTH_SHIFT & 15);
+    *day = (int)(packed & 31);
+}
+
+/**
+ * These constants select the output format of the batch converter.
+ * FORMAT_TEXT writes one line of text per date.
+ * FORMAT_PACKED and FORMAT_DELTA write a columnar file (see writeColumnarBatch()).
+ */
+#define FORMAT_TEXT 0
+#define FORMAT_PACKED 1
+#define FORMAT_DELTA 2
+
+/**
+ * A columnar file starts with a 16-byte header: the magic number "SHCD",
+ * then the version, the format (FORMAT_PACKED or FORMAT_DELTA) and the number of columns,
+ * each as a 32-bit little-endian number.
+ * The header is followed by blocks, one per chunk of input.
+ * Each block holds its number of rows, then each column in turn as 32-bit little-endian values.
+ *
+ * FORMAT_PACKED files have three columns holding the packed Shamsi, Gregorian and Lunar dates (0 for invalid rows).
+ * FORMAT_DELTA files have a single column of day numbers, each stored as the difference from the previous valid row
+ * (the first row of the file counts from 0), with COLUMNAR_INVALID_ROW marking invalid rows.
+ * The three calendars are restored from the day number when the file is read.
+ */
+#define COLUMNAR_MAGIC "SHCD"
+#define COLUMNAR_VERSION 1
+#define COLUMNAR_INVALID_ROW 0x80000000u
+
+/**
+ * This function appends a 32-bit number to an output buffer in little-endian byte order.
+ *
+ * @param out Pointer to the output buffer.
+ * @param value The number to append.
+ */
+void appendLittleEndian32(struct outputBuffer *out, uint32_t value)
+{
+    char bytes[4] = {(char)value, (char)(value >> 8), (char)(value >> 16), (char)(value >> 24)};
+
+    appendBytes(out, bytes, 4);
+}
+
+/**
+ * This function reads a 32-bit little-endian number.
+ *
+ * @param bytes The four bytes of the number.
+ * @return The number.
+ */
+uint32_t loadLittleEndian32(const unsigned char *bytes)
+{
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+/**
+ * This function appends the header of a columnar file to an output buffer.
+ *
+ * @param out Pointer to the output buffer.
+ * @param format FORMAT_PACKED or FORMAT_DELTA.
+ */
+void writeColumnarHeader(struct outputBuffer *out, int format)
+{
+    appendBytes(out, COLUMNAR_MAGIC, 4);
+    appendLittleEndian32(out, COLUMNAR_VERSION);
+    appendLittleEndian32(out, format);
+    appendLittleEndian32(out, format == FORMAT_PACKED ? 3 : 1);
+}
+
+/**
+ * This function appends the converted dates of a batch to a columnar file as one block.
+ *
+ * @param batch The batch to write.
+ * @param out Pointer to the output buffer.
+ * @param format FORMAT_PACKED or FORMAT_DELTA.
+ * @param previousDay Pointer to the day number of the last valid row written so far, updated by delta encoding.
+ */
+void writeColumnarBatch(struct conversionBatch *batch, struct outputBuffer *out, int format, int *previousDay)
+{
+    appendLittleEndian32(out, batch->count);
+
+    if (format == FORMAT_DELTA)
+    {
+        for (int i = 0; i < batch->count; i++)
+        {
+            if (!batch->valid[i])
+            {
+                appendLittleEndian32(out, COLUMNAR_INVALID_ROW);
+                continue;
+            }
+
+            appendLittleEndian32(out, (uint32_t)(batch->results[i].dayNumber - *previousDay));
+            *previousDay = batch->results[i].dayNumber;
+        }
+        return;
+    }
+
+    // A row whose dates do not fit in the packed fields is written as invalid rather than spilling into the calendar bits
+    for (int i = 0; i < batch->count; i++)
+    {
+        struct dayCursor *date = &batch->results[i];
+
+        batch->valid[i] = batch->valid[i] && canPackDate(date->sYear, date->sMonth, date->sDay)
+                          && canPackDate(date->gYear, date->gMonth, date->gDay)
+                          && canPackDate(date->lYear, date->lMonth, date->lDay);
+    }
+
+    // Write the Shamsi, Gregorian and Lunar columns one after the other
+    for (int i = 0; i < batch->count; i++)
+        appendLittleEndian32(out, batch->valid[i] ? packDate(CALENDAR_SHAMSI, batch->results[i].sYear,
+                                                             batch->results[i].sMonth, batch->results[i].sDay) : 0);
+    for (int i = 0; i < batch->count; i++)
+        appendLittleEndian32(out, batch->valid[i] ? packDate(CALENDAR_GREGORIAN, batch->results[i].gYear,
+                                                             batch->results[i].gMonth, batch->results[i].gDay) : 0);
+    for (int i = 0; i < batch->count; i++)
+        appendLittleEndian32(out, batch->valid[i] ? packDate(CALENDAR_LUNAR, batch->results[i].lYear,
+                                                             batch->results[i].lMonth, batch->results[i].lDay) : 0);
+}
+
+/**
+ * This function reads a columnar file written by the batch converter and writes its dates as text,
+ * in the same form as the text output of the batch converter.
+ * The file is mapped into memory and read one block at a time.
+ *
+ * @param path The path of the columnar file.
+ * @param output The stream to write the dates to.
+ * @return 0 on success, 1 if the file is missing or invalid.
+ */
+int readColumnarFile(char *path, FILE *output)
+{
+    struct conversionBatch batch = {0, 0, NULL, NULL, NULL, NULL, NULL};
+    struct outputBuffer *out = malloc(sizeof(struct outputBuffer));
+    const unsigned char *data, *position, *end;
+    size_t size;
+    int format, calendar, day = 0, failed = 0;
+
+    data = mapFileReadOnly(path, &size);
+    if (data == NULL || out == NULL || size < 16 || memcmp(data, COLUMNAR_MAGIC, 4) != 0
+        || loadLittleEndian32(data + 4) != COLUMNAR_VERSION)
+    {
+        if (data != NULL)
+            unmapFile(data, size);
+        free(out);
+        return 1;
+    }
+
+    format = (int)loadLittleEndian32(data + 8);
+    if (format != FORMAT_PACKED && format != FORMAT_DELTA)
+    {
+        unmapFile(data, size);
+        free(out);
+        return 1;
+    }
+
+    out->file = output;
+    out->length = 0;
+    position = data + 16;
+    end = data + size;
+
+    while (position + 4 <= end)
+    {
+        uint32_t rows = loadLittleEndian32(position);
+        size_t columnSize = (size_t)rows * 4;
+
+        // Check that the whole block is inside the file
+        position += 4;
+        if ((size_t)(end - position) < columnSize * (format == FORMAT_PACKED ? 3 : 1)
+            || growConversionBatch(&batch, (int)rows) != 0)
+        {
+            failed = 1;
+            break;
+        }
+
+        batch.count = (int)rows;
+        for (uint32_t i = 0; i < rows; i++)
+        {
+            struct dayCursor *date = &batch.results[i];
+
+            if (format == FORMAT_DELTA)
+            {
+                uint32_t delta = loadLittleEndian32(position + i * 4);
+
+                batch.valid[i] = delta != COLUMNAR_INVALID_ROW;
+                if (!batch.valid[i])
+                    continue;
+
+                // Restore the three calendars from the day number
+                day += (int32_t)delta;
+                dayNumberToGregorian(day, &date->gYear, &date->gMonth, &date->gDay);
+                batch.valid[i] = (char)convertDate(CALENDAR_GREGORIAN, date->gYear, date->gMonth, date->gDay, date);
+            }
+            else
+            {
+                uint32_t shamsi = loadLittleEndian32(position + i * 4);
+
+                batch.valid[i] = shamsi != 0;
+                unpackDate(shamsi, &calendar, &date->sYear, &date->sMonth, &date->sDay);
+                unpackDate(loadLittleEndian32(position + columnSize + i * 4),
+                           &calendar, &date->gYear, &date->gMonth, &date->gDay);
+                unpackDate(loadLittleEndian32(position + 2 * columnSize + i * 4),
+                           &calendar, &date->lYear, &date->lMonth, &date->lDay);
+            }
+        }
+
+        formatConversionBatch(&batch, out);
+        position += columnSize * (format == FORMAT_PACKED ? 3 : 1);
+    }
+
+    flushOutput(out);
+    unmapFile(data, size);
+    free(batch.years);
+    free(batch.months);
+    free(batch.days);
+    free(batch.results);
+    free(batch.valid);
+    free(out);
+    return failed || position != end;
+}
+
+/**
+ * This function converts a stream of dates, one per line, from one calendar to all three calendars.
+ * The input is read in large chunks, and every chunk goes through three stages:
+ * parsing the lines, converting the dates, and formatting the results into an output buffer,
+ * either as text or as one block of a columnar file.
+ *
+ * @param calendar The calendar of the input dates.
+ * @param input The stream to read the dates from.
+ * @param output The stream to write the converted dates to.
+ * @param format FORMAT_TEXT, FORMAT_PACKED or FORMAT_DELTA.
+ * @return 0 on success, 1 if memory ran out or the output could not be written.
+ */
+int convertStream(int calendar, FILE *input, FILE *output, int format)
+{
+    struct conversionBatch batch = {0, 0, NULL, NULL, NULL, NULL, NULL};
+    struct outputBuffer *out = malloc(sizeof(struct outputBuffer));
+    struct lineReader reader;
+    char *text;
+    size_t length;
+    int previousDay = 0;
+    int failed = startLineReader(&reader, input) != 0 || out == NULL;
+
+    if (!failed)
+    {
+        out->file = output;
+        out->length = 0;
+        if (format != FORMAT_TEXT)
+            writeColumnarHeader(out, format);
+    }
+
+    while (!failed)
+    {
+        TRACE_START(chunkStart);
+        TRACE_START(readStart);
+        length = readLineChunk(&reader, &text);
+        TRACE_STOP("read", readStart);
+        if (length == 0)
+            break;
+
+        TRACE_START(parseStart);
+        if (parseConversionBatch(&batch, text, length, calendar) != 0)
+        {
+            failed = 1;
+            break;
+        }
+        TRACE_STOP("parse", parseStart);
+
+        TRACE_START(convertStart);
+        convertConversionBatch(&batch, calendar);
+        TRACE_STOP("convert", convertStart);
+
+        TRACE_START(formatStart);
+        if (format == FORMAT_TEXT)
+            formatConversionBatch(&batch, out);
+        else
+            writeColumnarBatch(&batch, out, format, &previousDay);
+        TRACE_STOP("format", formatStart);
+
+        TRACE_STOP("chunk", chunkStart);
+        checkMetricsDump();
+    }
+
+    if (out != NULL)
+    {
+        flushOutput(out);
+        failed = failed || reader.failed || ferror(output) != 0;
+    }
+
+    free(batch.years);
+    free(batch.months);
+    free(batch.days);
+    free(batch.results);
+    free(batch.valid);
+    stopLineReader(&reader);
+    free(out);
+    return failed;
+}
+
+/**
+ * The JSON Lines converter adds the other calendars to the date of a named field of every object,
+ * so {"id":7,"created_at":"2024-03-20T10:30:00Z"} becomes
+ * {"id":7,"created_at":"2024-03-20T10:30:00Z","shamsi":"1403/01/01","lunar":"1445/09/10"}.
+ * The objects are not parsed: the field is found by searching for its quoted name, and every other byte
+ * is copied through unchanged, so the converter runs at close to the speed of copying its input.
+ */
+char *jsonCalendarFields[] = {",\"shamsi\":\"", ",\"gregorian\":\"", ",\"lunar\":\""};
+
+/**
+ * This function finds the value of a key in a line of JSON without parsing the line.
+ * It searches for the key in quotes followed by a colon. With SSE2 the search tests 16 positions at a time for
+ * the opening quote, the first letter of the key and the closing quote, and only the positions where all three match
+ * are compared in full.
+ * The bytes before a match are then walked once, following strings and the depth of objects and arrays,
+ * so only a key of the object of the line itself is used: not text inside a string, and not a key of a nested object.
+ *
+ * @param line The start of the line.
+ * @param end The end of the line.
+ * @param key The key to find, without quotes.
+ * @param keyLength The length of the key.
+ * @return Pointer to the first character of the value, or NULL if the key is not in the line.
+ */
+const char *findJsonKey(const char *line, const char *end, const char *key, int keyLength)
+{
+    const char *position = line;
+    const char *scanned = line; // The bytes before scanned have been walked for strings and depth
+    int patternLength = keyLength + 2; // The key with its quotes
+    int depth = 0, inString = 0;
+
+    while (end - position >= patternLength)
+    {
+        const char *candidate = NULL;
+
+#ifdef __SSE2__
+        if (end - position >= patternLength + 15)
+        {
+            // Compare 16 positions at once with the opening quote, the first letter and the closing quote
+            __m128i quote = _mm_set1_epi8('"');
+            __m128i opening = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)position), quote);
+            __m128i first = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(position + 1)), _mm_set1_epi8(key[0]));
+            __m128i closing = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(position + patternLength - 1)), quote);
+            int mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(opening, first), closing));
+
+            if (mask == 0)
+            {
+                position += 16;
+                continue;
+            }
+
+            candidate = position + __builtin_ctz(mask);
+        }
+        else
+#endif
+        {
+            candidate = memchr(position, '"', end - position - patternLength + 1);
+            if (candidate == NULL)
+                return NULL;
+            if (candidate[patternLength - 1] != '"')
+            {
+                position = candidate + 1;
+                continue;
+            }
+        }
+
+        position = candidate + 1;
+        if (memcmp(candidate + 1, key, keyLength) == 0)
+        {
+            const char *value = candidate + patternLength;
+
+            // Follow the strings and the nesting up to the match
+            for (; scanned < candidate; scanned++)
+            {
+                if (inString)
+                {
+                    if (*scanned == '\\')
+                        scanned++;
+                    else if (*scanned == '"')
+                        inString = 0;
+                }
+                else if (*scanned == '"')
+                    inString = 1;
+                else if (*scanned == '{' || *scanned == '[')
+                    depth++;
+                else if (*scanned == '}' || *scanned == ']')
+                    depth--;
+            }
+
+            // The match must open a string directly inside the object of the line
+            if (inString || scanned != candidate || depth != 1)
+                continue;
+
+            while (value < end && (*value == ' ' || *value == '\t'))
+                value++;
+            if (value == end || *value != ':')
+                continue;
+            value++;
+            while (value < end && (*value == ' ' || *value == '\t'))
+                value++;
+            return value;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * This function reads the date of a JSON value. The value must be a string that starts with the date,
+ * such as "1403/01/01", "2024-03-20" or "2024-03-20T10:30:00Z"; a time after the date is ignored.
+ *
+ * @param value The first character of the value.
+ * @param end The end of the line.
+ * @param calendar The calendar of the date.
+ * @param result Pointer to the cursor that receives the date in all three calendars.
+ * @return 1 if the value holds a valid date, 0 otherwise.
+ */
+int readJsonDate(const char *value, const char *end, int calendar, struct dayCursor *result)
+{
+    const char *dateEnd;
+    int year, month, day;
+
+    if (value == NULL || value == end || *value != '"')
+        return 0;
+
+    // Stop at the end of the string or at a time written after the date
+    dateEnd = ++value;
+    while (dateEnd < end && *dateEnd != '"' && *dateEnd != 'T' && *dateEnd != ' ')
+        dateEnd++;
+
+    return parseDateText(value, dateEnd, &year, &month, &day) && convertDate(calendar, year, month, day, result);
+}
+
+/**
+ * This function converts a stream of JSON Lines, adding to every object the date of one of its fields
+ * in the calendars other than the calendar of the field (for example "shamsi" and "lunar" for a Gregorian field).
+ * The new fields are written before the closing brace of the object. Lines without the field, with a value
+ * that is not a valid date, or that do not end with a closing brace are copied unchanged.
+ * Unchanged bytes are not copied line by line: a whole run of them is copied at once when the next change is written.
+ *
+ * @param field The name of the field that holds the date.
+ * @param calendar The calendar of the dates in the field.
+ * @param input The stream to read the lines from.
+ * @param output The stream to write the lines to.
+ * @return 0 on success, 1 if memory ran out or the output could not be written.
+ */
+int convertJsonLines(char *field, int calendar, FILE *input, FILE *output)
+{
+    struct outputBuffer *out = malloc(sizeof(struct outputBuffer));
+    struct lineReader reader;
+    struct dayCursor date;
+    int fieldLength = (int)strlen(field);
+    char *text;
+    size_t length;
+    int failed = startLineReader(&reader, input) != 0 || out == NULL;
+
+    if (!failed)
+    {
+        out->file = output;
+        out->length = 0;
+    }
+
+    while (!failed && (length = readLineChunk(&reader, &text)) > 0)
+    {
+        const char *end = text + length;
+        const char *copied = text; // The start of the bytes not written yet
+        const char *line = text;
+
+        while (line < end)
+        {
+            const char *lineEnd = memchr(line, '\n', end - line);
+            const char *close = lineEnd;
+
+            // Find the closing brace of the object, before any trailing spaces
+            while (close > line && (close[-1] == ' ' || close[-1] == '\t' || close[-1] == '\r'))
+                close--;
+
+            if (close > line && close[-1] == '}'
+                && readJsonDate(findJsonKey(line, close, field, fieldLength), close, calendar, &date))
+            {
+                close--;
+                appendBytes(out, copied, (int)(close - copied));
+
+                for (int i = 0; i < CALENDAR_JULIAN; i++)
+                {
+                    if (i == calendar)
+                        continue;
+
+                    appendText(out, jsonCalendarFields[i]);
+                    if (i == CALENDAR_SHAMSI)
+                        appendDate(out, date.sYear, date.sMonth, date.sDay);
+                    else if (i == CALENDAR_GREGORIAN)
+                        appendDate(out, date.gYear, date.gMonth, date.gDay);
+                    else
+                        appendDate(out, date.lYear, date.lMonth, date.lDay);
+                    appendBytes(out, "\"", 1);
+                }
+
+                copied = close;
+            }
+
+            line = lineEnd + 1;
+        }
+
+        appendBytes(out, copied, (int)(end - copied));
+        checkMetricsDump();
+    }
+
+    if (out != NULL)
+    {
+        flushOutput(out);
+        failed = failed || reader.failed || ferror(output) != 0;
+    }
+
+    stopLineReader(&reader);
+    free(out);
+    return failed;
+}
+
+/**
+ * The CSV converter rewrites the dates of chosen columns of a CSV file (RFC 4180) from one calendar to another
+ * and copies every other byte unchanged, including the quotes, the line endings and any time written after a date.
+ * Quoted fields may hold commas, doubled quotes and line breaks.
+ */
+#define CSV_MAX_COLUMNS 1024
+
+/**
+ * This function finds the next comma, quote or line break in unquoted CSV text.
+ * With SSE2 it tests 16 bytes at a time; without it, it tests one byte at a time.
+ *
+ * @param text The start of the text.
+ * @param end The end of the text.
+ * @return Pointer to the first comma, quote or newline, or end if there is none.
+ */
+const char *findCsvSpecial(const char *text, const char *end)
+{
+#ifdef __SSE2__
+    __m128i comma = _mm_set1_epi8(',');
+    __m128i quote = _mm_set1_epi8('"');
+    __m128i newline = _mm_set1_epi8('\n');
+
+    while (end - text >= 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)text);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, comma),
+                                                               _mm_cmpeq_epi8(block, quote)),
+                                                  _mm_cmpeq_epi8(block, newline)));
+
+        if (mask != 0)
+            return text + __builtin_ctz(mask);
+        text += 16;
+    }
+#endif
+
+    while (text < end && *text != ',' && *text != '"' && *text != '\n')
+        text++;
+    return text;
+}
+
+/**
+ * The state of the CSV converter between chunks. A record ends in the chunk it starts in,
+ * unless it is longer than a whole chunk; then its rewriting goes on in the next chunk from this state.
+ */
+struct csvState
+{
+    int column; // The column of the next field, from 1
+    int quoted; // 1 if the chunk ended inside a quoted field
+};
+
+/**
+ * This function finds the end of a CSV record without rewriting it.
+ * Most records hold no quotes and end at the first newline; the others are walked field by field,
+ * since a newline inside a quoted field does not end the record.
+ *
+ * @param text The start of the record, or of the rest of it.
+ * @param end The end of the chunk.
+ * @param quoted 1 if text is inside a quoted field.
+ * @return Pointer to the byte after the newline that ends the record, or NULL if the record goes on after end.
+ */
+const char *findCsvRecordEnd(const char *text, const char *end, int quoted)
+{
+    if (!quoted)
+    {
+        const char *newline = memchr(text, '\n', end - text);
+
+        if (newline == NULL)
+            return NULL;
+        if (memchr(text, '"', newline - text) == NULL)
+            return newline + 1;
+        quoted = *text == '"';
+        text += quoted;
+    }
+
+    for (;;)
+    {
+        if (quoted)
+        {
+            // A quoted field ends at a quote that is not doubled
+            while ((text = memchr(text, '"', end - text)) != NULL && text + 1 < end && text[1] == '"')
+                text += 2;
+            if (text == NULL)
+                return NULL;
+            text++;
+        }
+
+        // A quote inside an unquoted field is an ordinary character
+        while ((text = findCsvSpecial(text, end)) < end && *text == '"')
+            text++;
+        if (text == end)
+            return NULL;
+        if (*text++ == '\n')
+            return text;
+
+        quoted = text < end && *text == '"';
+        text += quoted;
+    }
+}
+
+/**
+ * This function rewrites the records of a chunk of CSV text.
+ * The end of each record is found before any of it is written, so a record that goes on in the next chunk
+ * (because a quoted field holds a line break) is handed back whole and rewritten there.
+ * A record longer than a whole chunk is rewritten piece by piece instead, with its column and quote state kept
+ * in state; the date of a quoted field that starts in one chunk and ends in the next is copied unchanged.
+ *
+ * @param text The chunk, which ends with a newline.
+ * @param end The end of the chunk.
+ * @param selected selected[i] is 1 if column i + 1 must be converted.
+ * @param lastColumn The last column that must be converted.
+ * @param from The calendar of the dates in the file.
+ * @param to The calendar to write the dates in.
+ * @param final 1 if this is the last chunk of the input.
+ * @param state Pointer to the state of the converter, carried from one chunk to the next.
+ * @param out Pointer to the output buffer.
+ * @return The number of bytes of the chunk that were handled.
+ */
+size_t rewriteCsvRecords(const char *text, const char *end, const unsigned char *selected, int lastColumn,
+                         int from, int to, int final, struct csvState *state, struct outputBuffer *out)
+{
+    const char *copied = text; // The start of the bytes not written yet
+    const char *position = text;
+
+    while (position < end)
+    {
+        const char *recordEnd = findCsvRecordEnd(position, end, state->quoted);
+        const char *limit = recordEnd != NULL ? recordEnd : end;
+
+        // Hand back an unfinished record, unless the input ends here or the record fills the whole chunk
+        if (recordEnd == NULL && !final && position != text)
+            break;
+
+        while (position < limit)
+        {
+            const char *value = position, *valueEnd = NULL;
+            int quoted = state->quoted || *position == '"';
+
+            if (quoted)
+            {
+                // A quoted field ends at a quote that is not doubled; one that started in the last chunk has no date here
+                if (state->quoted)
+                    value = NULL;
+                else
+                    value = ++position;
+
+                while ((position = memchr(position, '"', limit - position)) != NULL && position + 1 < limit
+                       && position[1] == '"')
+                    position += 2;
+
+                state->quoted = position == NULL;
+                if (position == NULL)
+                {
+                    position = limit; // The field goes on in the next chunk
+                    break;
+                }
+                valueEnd = position++;
+            }
+
+            // Find the comma or line break after the field; a quote inside an unquoted field is an ordinary character
+            while ((position = findCsvSpecial(position, limit)) < limit && *position == '"')
+                position++;
+            if (position == limit)
+                break;
+            if (!quoted)
+                valueEnd = position;
+
+            if (value != NULL && state->column <= lastColumn && selected[state->column - 1])
+            {
+                const char *dateEnd = value;
+                int year, month, day, dayNumber;
+
+                // Convert the date at the start of the field and keep anything after it, such as a time
+                while (dateEnd < valueEnd && *dateEnd != ' ' && *dateEnd != 'T' && *dateEnd != '\r')
+                    dateEnd++;
+
+                if (parseDateText(value, dateEnd, &year, &month, &day)
+                    && (dayNumber = dateToDayNumber(from, year, month, day)) >= 0)
+                    calendarFromDayNumber(to, dayNumber, &year, &month, &day);
+                else
+                    year = 0;
+
+                // A day before the epoch of the target calendar is left as it is, like a field that is not a date
+                if (isDateInRange(year, month))
+                {
+                    appendBytes(out, copied, (int)(value - copied));
+                    appendDate(out, year, month, day);
+                    copied = dateEnd;
+                }
+            }
+
+            // A comma starts the next field and a newline the next record
+            state->column = *position++ == ',' ? state->column + 1 : 1;
+        }
+    }
+
+    appendBytes(out, copied, (int)(position - copied));
+    return position - text;
+}
+
+/**
+ * This function reads a list of columns such as 3,7 from a command-line argument.
+ *
+ * @param text The command-line argument: column numbers from 1, separated by commas.
+ * @param selected The array of CSV_MAX_COLUMNS flags that receives the columns.
+ * @return The largest column of the list, or 0 if the list is not valid.
+ */
+int parseColumnList(char *text, unsigned char *selected)
+{
+    int lastColumn = 0;
+
+    memset(selected, 0, CSV_MAX_COLUMNS);
+    for (;;)
+    {
+        char *end;
+        long column = strtol(text, &end, 10);
+
+        if (end == text || column < 1 || column > CSV_MAX_COLUMNS || (*end != ',' && *end != '\0'))
+            return 0;
+
+        selected[column - 1] = 1;
+        if (column > lastColumn)
+            lastColumn = (int)column;
+
+        if (*end == '\0')
+            return lastColumn;
+        text = end + 1;
+    }
+}
+
+/**
+ * This function converts the dates of some columns of a CSV stream from one calendar to another.
+ * The input is read in chunks like the other streaming modes; a record that does not end in its chunk
+ * (because a quoted field holds a line break) is moved to the start of the next chunk.
+ * Unchanged bytes are copied in whole runs, so rows without dates to rewrite cost little more than a copy.
+ *
+ * @param selected selected[i] is 1 if column i + 1 must be converted.
+ * @param lastColumn The last column that must be converted.
+ * @param from The calendar of the dates in the file.
+ * @param to The calendar to write the dates in.
+ * @param input The stream to read the CSV from.
+ * @param output The stream to write the CSV to.
+ * @return 0 on success, 1 if memory ran out or the output could not be written.
+ */
+int convertCsvStream(const unsigned char *selected, int lastColumn, int from, int to, FILE *input, FILE *output)
+{
+    struct outputBuffer *out = malloc(sizeof(struct outputBuffer));
+    struct lineReader reader;
+    struct csvState state = {1, 0};
+    char *text;
+    size_t length;
+    int failed = startLineReader(&reader, input) != 0 || out == NULL;
+
+    if (!failed)
+    {
+        out->file = output;
+        out->length = 0;
+    }
+
+    while (!failed && (length = readLineChunk(&reader, &text)) > 0)
+    {
+        // Keep the bytes of an unfinished record for the next chunk
+        reader.complete = rewriteCsvRecords(text, text + length, selected, lastColumn, from, to, reader.finished,
+                                            &state, out);
+        checkMetricsDump();
+    }
+
+    if (out != NULL)
+    {
+        flushOutput(out);
+        failed = failed || reader.failed || ferror(output) != 0;
+    }
+
+    stopLineReader(&reader);
+    free(out);
+    return failed;
+}
+
+/**
+ * These tables describe the UTC offsets of Iran (the Asia/Tehran time zone) since 1935.
+ * Until 13 June 1935 the offset was the Tehran mean time of +3:25:44, and after that +3:30.
+ *
+ * tehranOffsetChanges[] lists the changes up to 1991 as the local date and time of the change
+ * and the offset in seconds that applies after it. These include the period of 1977-1978 when standard time was +4:00.
+ * From 1992 to 2005 and from 2008 to 2022, daylight saving time started at 24:00 on a day in March
+ * and ended at 24:00 on the same day of September. tehranDaylightSavingYears[] lists these years with that day.
+ * Iran stopped using daylight saving time after 2022.
+ */
+struct offsetChange
+{
+    int year, month, day;
+    int minute; // The local time of the change, in minutes after midnight (1440 for 24:00)
+    int offset; // The UTC offset after the change, in seconds
+};
+
+#define TEHRAN_MEAN_TIME_OFFSET 12344
+#define TEHRAN_STANDARD_OFFSET 12600
+#define TEHRAN_DAYLIGHT_OFFSET 16200
+
+struct offsetChange tehranOffsetChanges[] = {
+        {1935, 6, 13, 0, 12600},
+        {1977, 3, 21, 1380, 16200},
+        {1977, 10, 20, 1440, 14400},
+        {1978, 3, 24, 1440, 18000},
+        {1978, 8, 5, 60, 14400},
+        {1978, 11, 10, 1440, 12600},
+        {1979, 5, 26, 1440, 16200},
+        {1979, 9, 18, 1440, 12600},
+        {1980, 3, 20, 1440, 16200},
+        {1980, 9, 22, 1440, 12600},
+        {1991, 5, 2, 1440, 16200},
+        {1991, 9, 21, 1440, 12600}
+};
+
+int tehranDaylightSavingYears[][2] = {
+        {1992, 21}, {1993, 21}, {1994, 21}, {1995, 21}, {1996, 20}, {1997, 21}, {1998, 21}, {1999, 21},
+        {2000, 20}, {2001, 21}, {2002, 21}, {2003, 21}, {2004, 20}, {2005, 21}, {2008, 20}, {2009, 21},
+        {2010, 21}, {2011, 21}, {2012, 20}, {2013, 21}, {2014, 21}, {2015, 21}, {2016, 20}, {2017, 21},
+        {2018, 21}, {2019, 21}, {2020, 20}, {2021, 21}, {2022, 21}
+};
+
+#define TEHRAN_CHANGE_COUNT (int)(sizeof(tehranOffsetChanges) / sizeof(tehranOffsetChanges[0]))
+#define TEHRAN_DAYLIGHT_YEAR_COUNT (int)(sizeof(tehranDaylightSavingYears) / sizeof(tehranDaylightSavingYears[0]))
+#define TEHRAN_TRANSITION_COUNT (TEHRAN_CHANGE_COUNT + 2 * TEHRAN_DAYLIGHT_YEAR_COUNT)
+
+/**
+ * These arrays hold the offset transitions of Asia/Tehran as Unix times (seconds since 1970 in UTC),
+ * with the offset that applies from each transition on. They are filled by buildTehranTransitions().
+ */
+int64_t tehranTransitionTimes[TEHRAN_TRANSITION_COUNT];
+int tehranTransitionOffsets[TEHRAN_TRANSITION_COUNT];
+int tehranTransitionsBuilt = 0;
+
+/**
+ * This function converts the local date and time of an offset change to a Unix time.
+ *
+ * @param change The offset change.
+ * @param offset The UTC offset in seconds that applies before the change.
+ * @return The Unix time of the change.
+ */
+int64_t offsetChangeTime(struct offsetChange *change, int offset)
+{
+    int64_t days = gregorianToDayNumber(change->year, change->month, change->day) - gregorianToDayNumber(1970, 1, 1);
+
+    return days * 86400 + (int64_t)change->minute * 60 - offset;
+}
+
+/**
+ * This function fills the table of Asia/Tehran offset transitions from the rules above.
+ * It runs once, when the first Unix time is converted.
+ */
+void buildTehranTransitions(void)
+{
+    struct offsetChange change;
+    int offset = TEHRAN_MEAN_TIME_OFFSET;
+    int count = 0;
+
+    for (int i = 0; i < TEHRAN_CHANGE_COUNT; i++)
+    {
+        tehranTransitionTimes[count] = offsetChangeTime(&tehranOffsetChanges[i], offset);
+        tehranTransitionOffsets[count++] = offset = tehranOffsetChanges[i].offset;
+    }
+
+    for (int i = 0; i < TEHRAN_DAYLIGHT_YEAR_COUNT; i++)
+    {
+        // Daylight saving time starts at 24:00 on the day in March
+        change = (struct offsetChange){tehranDaylightSavingYears[i][0], 3, tehranDaylightSavingYears[i][1], 1440,
+                                       TEHRAN_DAYLIGHT_OFFSET};
+        tehranTransitionTimes[count] = offsetChangeTime(&change, TEHRAN_STANDARD_OFFSET);
+        tehranTransitionOffsets[count++] = TEHRAN_DAYLIGHT_OFFSET;
+
+        // And ends at 24:00 on the same day of September
+        change.month = 9;
+        tehranTransitionTimes[count] = offsetChangeTime(&change, TEHRAN_DAYLIGHT_OFFSET);
+        tehranTransitionOffsets[count++] = TEHRAN_STANDARD_OFFSET;
+    }
+
+    tehranTransitionsBuilt = 1;
+}
+
+/**
+ * This function returns the UTC offset of Asia/Tehran at a given Unix time.
+ * The hint remembers the transition found by the previous call, so that for timestamps that are sorted
+ * or close together the answer is usually found without searching.
+ * Otherwise the transition is found with a binary search.
+ *
+ * @param epoch The Unix time.
+ * @param hint Pointer to the transition found by the previous call (-1 before the first transition).
+ * @return The UTC offset in seconds.
+ */
+int tehranOffset(int64_t epoch, int *hint)
+{
+    int low, high;
+
+    // Check the transition of the previous call first
+    if ((*hint < 0 || epoch >= tehranTransitionTimes[*hint])
+        && (*hint + 1 >= TEHRAN_TRANSITION_COUNT || epoch < tehranTransitionTimes[*hint + 1]))
+        return *hint < 0 ? TEHRAN_MEAN_TIME_OFFSET : tehranTransitionOffsets[*hint];
+
+    // Find the last transition at or before the time
+    low = -1;
+    high = TEHRAN_TRANSITION_COUNT - 1;
+    while (low < high)
+    {
+        int middle = (low + high + 1) / 2;
+
+        if (tehranTransitionTimes[middle] <= epoch)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+
+    *hint = low;
+    return low < 0 ? TEHRAN_MEAN_TIME_OFFSET : tehranTransitionOffsets[low];
+}
+
+/**
+ * A Shamsi date and time, as produced by epochsToShamsi().
+ * A year of 0 marks a time that is outside the supported range.
+ */
+struct shamsiDateTime
+{
+    int year, month, day; // The Shamsi date
+    int hour, minute, second; // The local time of day
+    int weekday; // The day of the week, 0 for SHANBE up to 6 for JOOMEH
+    int lYear, lMonth, lDay; // The Lunar date, if it was requested
+    int offset; // The UTC offset in seconds
+};
+
+/**
+ * Local times are shifted by EPOCH_BIAS_DAYS days (from 1 January 1800 to 1 January 1970)
+ * so they are never negative, which lets days be split off with unsigned multiplications.
+ * Times up to 2^36 seconds after 1800 (about the year 3977) are supported.
+ */
+#define EPOCH_BIAS_DAYS 62091
+#define EPOCH_LIMIT ((int64_t)1 << 36)
+
+/**
+ * This array holds the day number of Nowruz (1 Farvardin) of every Shamsi year from TABLE_FIRST_YEAR,
+ * plus the year after TABLE_LAST_YEAR. It is filled when the first Unix time is converted.
+ */
+int nowruzDayNumbers[TABLE_LAST_YEAR - TABLE_FIRST_YEAR + 2];
+
+/**
+ * This function converts a day number to a Shamsi date using nowruzDayNumbers[].
+ * The year is estimated with a multiplication and corrected by comparing with the Nowruz of the year,
+ * which is cheaper than dayNumberToShamsi() because no conversion function is called.
+ *
+ * @param dayNumber The day number to convert.
+ * @param result Pointer to the date and time that receives the date.
+ */
+void nowruzTableToShamsi(int dayNumber, struct shamsiDateTime *result)
+{
+    int first = nowruzDayNumbers[0];
+    int last = nowruzDayNumbers[TABLE_LAST_YEAR - TABLE_FIRST_YEAR + 1];
+    int index, dayOfYear;
+
+    if (dayNumber < first || dayNumber >= last)
+    {
+        // Outside the table, use the conversion functions
+        dayNumberToShamsi(dayNumber, &result->year, &result->month, &result->day);
+        return;
+    }
+
+    // 2871 / 2^20 is close to 1 / 365.2422, so this is the number of years since the first Nowruz, give or take one
+    index = (int)(((uint64_t)(dayNumber - first) * 2871) >> 20);
+    if (index > TABLE_LAST_YEAR - TABLE_FIRST_YEAR)
+        index = TABLE_LAST_YEAR - TABLE_FIRST_YEAR;
+    while (dayNumber < nowruzDayNumbers[index])
+        index--;
+    while (dayNumber >= nowruzDayNumbers[index + 1])
+        index++;
+
+    dayOfYear = dayNumber - nowruzDayNumbers[index];
+    result->year = TABLE_FIRST_YEAR + index;
+
+    if (dayOfYear < 186)
+    {
+        // One of the first six months, which have 31 days
+        result->month = dayOfYear / 31 + 1;
+        result->day = dayOfYear - (result->month - 1) * 31 + 1;
+    }
+    else
+    {
+        // One of the last six months, which have 30 days (Esfand may have 29)
+        result->month = (dayOfYear - 186) / 30 + 7;
+        result->day = dayOfYear - 186 - (result->month - 7) * 30 + 1;
+    }
+}
+
+/**
+ * This function converts an array of Unix times (seconds since 1970 in UTC) to Shamsi dates and times in Asia/Tehran.
+ * It does not call any time functions of the C library, so it never waits for their time zone lock.
+ * The offset of each time comes from the transition table, found with a hint for sorted input.
+ * Days, hours, minutes and seconds are split off with multiplications by precomputed reciprocals instead of divisions,
+ * and a time on the same day as the previous one reuses its date.
+ *
+ * @param epochs The Unix times to convert.
+ * @param count The number of times.
+ * @param results The array that receives the converted dates and times.
+ * @param withLunar 1 to also convert each date to the Lunar calendar, 0 otherwise.
+ */
+void epochsToShamsi(const int64_t *epochs, int count, struct shamsiDateTime *results, int withLunar)
+{
+    static int biasDayNumber;
+    struct shamsiDateTime day = {0};
+    int previousDay = -1, hint = -1;
+
+    if (!tehranTransitionsBuilt)
+        buildTehranTransitions();
+    if (biasDayNumber == 0)
+    {
+        // Remember where every Shamsi year starts
+        for (int year = TABLE_FIRST_YEAR; year <= TABLE_LAST_YEAR + 1; year++)
+            nowruzDayNumbers[year - TABLE_FIRST_YEAR] = shamsiToDayNumber(year, 1, 1);
+        biasDayNumber = gregorianToDayNumber(1800, 1, 1);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        int offset = tehranOffset(epochs[i], &hint);
+        int64_t local = epochs[i] + offset + (int64_t)EPOCH_BIAS_DAYS * 86400;
+        uint64_t days, secondOfDay, secondOfHour;
+
+        if (local < 0 || local >= EPOCH_LIMIT)
+        {
+            results[i].year = 0; // Outside the supported range
+            continue;
+        }
+
+        // days = local / 86400, computed as (local / 128) / 675 with 814453058 / 2^39 in place of 1 / 675
+        days = (((uint64_t)local >> 7) * 814453058u) >> 39;
+        secondOfDay = (uint64_t)local - days * 86400;
+
+        if ((int)days != previousDay)
+        {
+            // A new day: convert the date
+            int dayNumber = biasDayNumber + (int)days;
+
+            nowruzTableToShamsi(dayNumber, &day);
+            day.weekday = dayNumberToWeekday(dayNumber);
+            if (withLunar)
+                dayNumberToLunar(dayNumber, &day.lYear, &day.lMonth, &day.lDay);
+            previousDay = (int)days;
+        }
+
+        results[i] = day;
+        results[i].offset = offset;
+
+        // hour = secondOfDay / 3600 = (secondOfDay / 16) / 225, minute = secondOfHour / 60 = (secondOfHour / 4) / 15
+        results[i].hour = (int)(((secondOfDay >> 4) * 9321) >> 21);
+        secondOfHour = secondOfDay - (uint64_t)results[i].hour * 3600;
+        results[i].minute = (int)(((secondOfHour >> 2) * 1093) >> 14);
+        results[i].second = (int)(secondOfHour - (uint64_t)results[i].minute * 60);
+    }
+}
+
+/**
+ * This function converts a stream of Unix times, one per line, to Shamsi dates and times in Asia/Tehran.
+ * Each output line holds the date and time as YEAR/MONTH/DAY HH:MM:SS,
+ * followed by a tab and the Lunar date when requested.
+ * Lines that are not numbers, or times outside the supported range, produce "-".
+ *
+ * @param input The stream to read the times from.
+ * @param output The stream to write the dates and times to.
+ * @param withLunar 1 to add the Lunar date, 0 otherwise.
+ * @return 0 on success, 1 if memory ran out or the output could not be written.
+ */
+int convertEpochStream(FILE *input, FILE *output, int withLunar)
+{
+    struct outputBuffer *out = malloc(sizeof(struct outputBuffer));
+    struct lineReader reader;
+    int64_t *epochs = NULL;
+    char *valid = NULL;
+    struct shamsiDateTime *results = NULL;
+    int capacity = 0;
+    char *text;
+    size_t length;
+    int failed = startLineReader(&reader, input) != 0 || out == NULL;
+
+    if (out != NULL)
+    {
+        out->file = output;
+        out->length = 0;
+    }
+
+    while (!failed && (length = readLineChunk(&reader, &text)) > 0)
+    {
+        const char *end = text + length;
+        int count = 0;
+
+        // Parse the times of the chunk
+        while (text < end)
+        {
+            char *lineEnd = memchr(text, '\n', end - text);
+            const char *position = text;
+            int negative = *position == '-';
+            int64_t value = 0;
+
+            if (count == capacity)
+            {
+                capacity = capacity == 0 ? 65536 : capacity * 2;
+                int64_t *grownEpochs = realloc(epochs, capacity * sizeof(int64_t));
+                if (grownEpochs != NULL)
+                    epochs = grownEpochs;
+                char *grownValid = realloc(valid, capacity);
+                if (grownValid != NULL)
+                    valid = grownValid;
+                struct shamsiDateTime *grownResults = realloc(results, capacity * sizeof(struct shamsiDateTime));
+                if (grownResults != NULL)
+                    results = grownResults;
+                if (grownEpochs == NULL || grownValid == NULL || grownResults == NULL)
+                {
+                    failed = 1;
+                    break;
+                }
+            }
+
+            position += negative;
+            while (position < lineEnd && *position >= '0' && *position <= '9' && position - text < 16)
+                value = value * 10 + (*position++ - '0');
+            while (position < lineEnd && (*position == ' ' || *position == '\r'))
+                position++;
+
+            valid[count] = position == lineEnd && position > text + negative;
+            epochs[count++] = negative ? -value : value;
+            text = lineEnd + 1;
+        }
+
+        if (failed)
+            break;
+
+        epochsToShamsi(epochs, count, results, withLunar);
+
+        // Write the converted times of the chunk
+        for (int i = 0; i < count; i++)
+        {
+            if (!valid[i] || results[i].year == 0)
+            {
+                appendBytes(out, "-\n", 2);
+                continue;
+            }
+
+            appendDate(out, results[i].year, results[i].month, results[i].day);
+            appendBytes(out, " ", 1);
+            appendLocalNumber(out, results[i].hour, 2);
+            appendBytes(out, ":", 1);
+            appendLocalNumber(out, results[i].minute, 2);
+            appendBytes(out, ":", 1);
+            appendLocalNumber(out, results[i].second, 2);
+            if (withLunar)
+            {
+                appendBytes(out, "\t", 1);
+                appendDate(out, results[i].lYear, results[i].lMonth, results[i].lDay);
+            }
+            appendBytes(out, "\n", 1);
+        }
+
+        checkMetricsDump();
+    }
+
+    if (out != NULL)
+    {
+        flushOutput(out);
+        failed = failed || reader.failed || ferror(output) != 0;
+    }
+
+    free(epochs);
+    free(valid);
+    free(results);
+    stopLineReader(&reader);
+    free(out);
+    return failed;
+}
+
+/**
+ * The kinds of time buckets for aggregation. Weeks start on Saturday, as in the header of calendar(),
+ * and years are Shamsi years, which are also the Iranian fiscal years since both start on 1 Farvardin.
+ */
+#define BUCKET_WEEK 0
+#define BUCKET_MONTH 1
+#define BUCKET_QUARTER 2
+#define BUCKET_YEAR 3
+
+char *bucketNames[] = {"week", "month", "quarter", "year"};
+
+/**
+ * A table of bucket boundaries covering Shamsi years TABLE_FIRST_YEAR to TABLE_LAST_YEAR.
+ * starts[i] is the Unix time at which bucket i begins in Asia/Tehran local time, and starts[count] is the end of the last bucket,
+ * so finding the bucket of a timestamp needs no date conversion at all.
+ * The reciprocal of the average bucket length (scaled by 2^BUCKET_RECIPROCAL_SHIFT) gives a first guess of the bucket for unsorted input.
+ */
+struct bucketTable
+{
+    int kind; // One of the BUCKET_ kinds
+    int count; // The number of buckets
+    int64_t *starts; // The start of each bucket, plus the end of the last one
+    uint32_t *labels; // The packed Shamsi date of the first day of each bucket
+    uint64_t reciprocal; // 2^BUCKET_RECIPROCAL_SHIFT divided by the average bucket length in seconds
+};
+
+#define BUCKET_RECIPROCAL_SHIFT 40
+
+/**
+ * This function returns the Unix time at which a day begins in Asia/Tehran local time,
+ * which is the last moment at which the local clock reaches the midnight that starts the day.
+ * If the clock is moved forward over midnight the day begins at the moment of the change,
+ * and if it is moved back over midnight the day begins when midnight is reached the second time.
+ *
+ * @param dayNumber The day number of the day.
+ * @return The Unix time at which the day begins.
+ */
+int64_t tehranDayStart(int dayNumber)
+{
+    int64_t local = (int64_t)(dayNumber - gregorianToDayNumber(1970, 1, 1)) * 86400;
+    int64_t start = INT64_MIN;
+    int hint = -1, nearest;
+
+    // Find the transition nearest to the day
+    tehranOffset(local - TEHRAN_STANDARD_OFFSET, &hint);
+    nearest = hint;
+
+    // Midnight is reached either at midnight under one of the nearby offsets, or at a nearby transition
+    for (int i = nearest - 2; i <= nearest + 2; i++)
+    {
+        int64_t candidates[2];
+
+        if (i < -1 || i >= TEHRAN_TRANSITION_COUNT)
+            continue;
+        candidates[0] = local - (i < 0 ? TEHRAN_MEAN_TIME_OFFSET : tehranTransitionOffsets[i]);
+        candidates[1] = i < 0 ? candidates[0] : tehranTransitionTimes[i];
+
+        for (int j = 0; j < 2; j++)
+        {
+            int64_t moment = candidates[j];
+
+            // Keep the latest moment at which the local time passes midnight
+            if (moment > start && moment + tehranOffset(moment, &hint) >= local
+                && moment - 1 + tehranOffset(moment - 1, &hint) < local)
+                start = moment;
+        }
+    }
+
+    return start;
+}
+
+/**
+ * This function builds the bucket boundaries of one kind of bucket.
+ *
+ * @param kind One of the BUCKET_ kinds.
+ * @param table Pointer to the table to fill.
+ * @return 0 on success, 1 if memory ran out.
+ */
+int buildBucketTable(int kind, struct bucketTable *table)
+{
+    int first = shamsiToDayNumber(TABLE_FIRST_YEAR, 1, 1);
+    int last = shamsiToDayNumber(TABLE_LAST_YEAR + 1, 1, 1);
+    int capacity = kind == BUCKET_WEEK ? (last - first) / 7 + 2 : (TABLE_LAST_YEAR - TABLE_FIRST_YEAR + 1) * 12;
+    int count = 0;
+
+    if (!tehranTransitionsBuilt)
+        buildTehranTransitions();
+
+    table->kind = kind;
+    table->starts = malloc((capacity + 1) * sizeof(int64_t));
+    table->labels = malloc(capacity * sizeof(uint32_t));
+    if (table->starts == NULL || table->labels == NULL)
+    {
+        free(table->starts);
+        free(table->labels);
+        return 1;
+    }
+
+    if (kind == BUCKET_WEEK)
+    {
+        // Weeks start on the Saturday on or before the first Nowruz
+        int day = first - dayNumberToWeekday(first);
+
+        for (; day < last; day += 7)
+        {
+            int year, month, dayOfMonth;
+
+            dayNumberToShamsi(day, &year, &month, &dayOfMonth);
+            table->starts[count] = tehranDayStart(day);
+            table->labels[count++] = packDate(CALENDAR_SHAMSI, year, month, dayOfMonth);
+        }
+        table->starts[count] = tehranDayStart(day);
+    }
+    else
+    {
+        // A month is one month, a quarter three months and a year twelve months
+        int step = kind == BUCKET_MONTH ? 1 : kind == BUCKET_QUARTER ? 3 : 12;
+
+        for (int year = TABLE_FIRST_YEAR; year <= TABLE_LAST_YEAR; year++)
+            for (int month = 1; month <= 12; month += step)
+            {
+                table->starts[count] = tehranDayStart(shamsiToDayNumber(year, month, 1));
+                table->labels[count++] = packDate(CALENDAR_SHAMSI, year, month, 1);
+            }
+        table->starts[count] = tehranDayStart(last);
+    }
+
+    table->count = count;
+    table->reciprocal = ((uint64_t)count << BUCKET_RECIPROCAL_SHIFT) / (uint64_t)(table->starts[count] - table->starts[0]);
+    return 0;
+}
+
+/**
+ * This function frees the boundaries of a bucket table.
+ *
+ * @param table Pointer to the table.
+ */
+void freeBucketTable(struct bucketTable *table)
+{
+    free(table->starts);
+    free(table->labels);
+}
+
+/**
+ * This function finds the bucket that contains a Unix time.
+ * The bucket of the previous call is checked first, then the one after it, so sorted input costs one or two comparisons.
+ * Otherwise the bucket is guessed from the average bucket length and corrected by a few comparisons.
+ *
+ * @param table Pointer to the bucket table.
+ * @param epoch The Unix time.
+ * @param hint Pointer to the bucket of the previous call.
+ * @return The index of the bucket, or -1 if the time is outside the table.
+ */
+int findBucket(struct bucketTable *table, int64_t epoch, int *hint)
+{
+    int64_t *starts = table->starts;
+    int index = *hint;
+
+    if (epoch < starts[0] || epoch >= starts[table->count])
+        return -1;
+
+    if (epoch >= starts[index] && epoch < starts[index + 1])
+        return index;
+    if (index + 2 <= table->count && epoch >= starts[index + 1] && epoch < starts[index + 2])
+        return *hint = index + 1;
+
+    // Guess the bucket and move to the right one
+    index = (int)(((uint64_t)(epoch - starts[0]) * table->reciprocal) >> BUCKET_RECIPROCAL_SHIFT);
+    if (index >= table->count)
+        index = table->count - 1;
+    while (epoch < starts[index])
+        index--;
+    while (epoch >= starts[index + 1])
+        index++;
+
+    return *hint = index;
+}
+
+/**
+ * This function writes the label of a bucket: the Shamsi date of the first day for a week,
+ * YEAR/MONTH for a month, YEAR-Q1 to YEAR-Q4 for a quarter and the year for a fiscal year.
+ *
+ * @param out The output buffer.
+ * @param table Pointer to the bucket table.
+ * @param index The index of the bucket.
+ */
+void appendBucketLabel(struct outputBuffer *out, struct bucketTable *table, int index)
+{
+    int calendar, year, month, day;
+
+    unpackDate(table->labels[index], &calendar, &year, &month, &day);
+    if (table->kind == BUCKET_WEEK)
+    {
+        appendDate(out, year, month, day);
+        return;
+    }
+
+    appendLocalNumber(out, year, 4);
+    if (table->kind == BUCKET_MONTH)
+    {
+        appendBytes(out, "/", 1);
+        appendLocalNumber(out, month, 2);
+    }
+    else if (table->kind == BUCKET_QUARTER)
+    {
+        appendBytes(out, "-Q", 2);
+        appendLocalNumber(out, (month - 1) / 3 + 1, 1);
+    }
+}
+
+/**
+ * This function parses a signed integer of up to 18 digits.
+ *
+ * @param position Pointer to the position in the text, moved past the number.
+ * @param end The end of the text.
+ * @param value Pointer to the variable that receives the number.
+ * @return 1 if a number was found, 0 otherwise.
+ */
+int parseSignedNumber(const char **position, const char *end, int64_t *value)
+{
+    const char *text = *position;
+    int negative = text < end && *text == '-';
+    const char *digits = text + negative;
+    int64_t result = 0;
+
+    text = digits;
+    while (text < end && *text >= '0' && *text <= '9' && text - digits < 18)
+        result = result * 10 + (*text++ - '0');
+
+    *value = negative ? -result : result;
+    *position = text;
+    return text > digits;
+}
+
+/**
+ * This function aggregates a stream of timestamped values by Shamsi week, month, quarter or fiscal year in Asia/Tehran time.
+ * Each input line holds a Unix time, optionally followed by a space, tab or comma and an integer value (1 if missing).
+ * The input may be in any order. For every bucket that received a line, one output line holds
+ * the bucket label, the number of lines and the sum of their values, separated by tabs, in order of time.
+ * Lines that cannot be read or lie outside the table are counted in a last line labelled "-",
+ * whose sum only holds the values of the lines that could be read.
+ *
+ * @param kind One of the BUCKET_ kinds.
+ * @param input The stream to read the timestamps from.
+ * @param output The stream to write the buckets to.
+ * @return 0 on success, 1 if memory ran out or the output could not be written.
+ */
+int aggregateBuckets(int kind, FILE *input, FILE *output)
+{
+    struct bucketTable table;
+    struct outputBuffer *out;
+    struct lineReader reader;
+    int64_t *counts, *sums;
+    int64_t skippedCount = 0, skippedSum = 0;
+    char totals[64];
+    char *text;
+    size_t length;
+    int hint = 0, failed;
+
+    if (buildBucketTable(kind, &table) != 0)
+        return 1;
+
+    out = malloc(sizeof(struct outputBuffer));
+    counts = calloc(table.count, sizeof(int64_t));
+    sums = calloc(table.count, sizeof(int64_t));
+    failed = out == NULL || counts == NULL || sums == NULL || startLineReader(&reader, input) != 0;
+    if (failed)
+    {
+        free(out);
+        free(counts);
+        free(sums);
+        freeBucketTable(&table);
+        return 1;
+    }
+
+    while ((length = readLineChunk(&reader, &text)) > 0)
+    {
+        const char *position = text;
+        const char *end = text + length;
+
+        while (position < end)
+        {
+            const char *lineEnd = memchr(position, '\n', end - position);
+            int64_t epoch, value = 1;
+            int bucket = -1, readable = 0;
+
+            if (parseSignedNumber(&position, lineEnd, &epoch))
+            {
+                if (position < lineEnd && (*position == ' ' || *position == '\t' || *position == ','))
+                {
+                    position++;
+                    if (!parseSignedNumber(&position, lineEnd, &value))
+                        position = lineEnd + 1; // Mark the line as unreadable
+                }
+                if (position < lineEnd && *position == '\r')
+                    position++;
+                readable = position == lineEnd;
+                if (readable)
+                    bucket = findBucket(&table, epoch, &hint);
+            }
+
+            if (bucket >= 0)
+            {
+                counts[bucket]++;
+                sums[bucket] += value;
+            }
+            else
+            {
+                // A line that cannot be read has no value to add
+                skippedCount++;
+                if (readable)
+                    skippedSum += value;
+            }
+            position = lineEnd + 1;
+        }
+
+        checkMetricsDump();
+    }
+
+    // Write the buckets that received values
+    out->file = output;
+    out->length = 0;
+    for (int i = 0; i < table.count; i++)
+    {
+        if (counts[i] == 0)
+            continue;
+
+        appendBucketLabel(out, &table, i);
+        appendBytes(out, totals, snprintf(totals, sizeof(totals), "\t%lld\t%lld\n", (long long)counts[i], (long long)sums[i]));
+    }
+    if (skippedCount > 0)
+        appendBytes(out, totals, snprintf(totals, sizeof(totals), "-\t%lld\t%lld\n", (long long)skippedCount, (long long)skippedSum));
+    flushOutput(out);
+    failed = reader.failed || ferror(output) != 0;
+
+    stopLineReader(&reader);
+    free(out);
+    free(counts);
+    free(sums);
+    freeBucketTable(&table);
+    return failed;
+}
+
+/**
+ * A thread that runs work in parallel, a thin wrapper over Windows threads or POSIX threads.
+ */
+#ifdef _WIN32
+typedef HANDLE workerThread;
+
+/**
+ * The function and argument of a thread while it is being started on Windows.
+ */
+struct workerStart
+{
+    void *(*function)(void *);
+    void *argument;
+};
+
+/**
+ * This function is the entry point of threads on Windows. It calls the function given to startWorker().
+ *
+ * @param parameter Pointer to the workerStart of the thread, which is freed here.
+ * @return Always 0.
+ */
+DWORD WINAPI runWorker(LPVOID parameter)
+{
+    struct workerStart start = *(struct workerStart *)parameter;
+
+    free(parameter);
+    start.function(start.argument);
+    return 0;
+}
+#else
+typedef pthread_t workerThread;
+#endif
+
+/**
+ * This function starts a thread.
+ *
+ * @param thread Pointer to the variable that receives the thread.
+ * @param function The function that the thread runs.
+ * @param argument The argument passed to the function.
+ * @return 0 on success, 1 if the thread could not be started.
+ */
+int startWorker(workerThread *thread, void *(*function)(void *), void *argument)
+{
+#ifdef _WIN32
+    struct workerStart *start = malloc(sizeof(struct workerStart));
+
+    if (start == NULL)
+        return 1;
+    start->function = function;
+    start->argument = argument;
+    *thread = CreateThread(NULL, 0, runWorker, start, 0, NULL);
+    if (*thread == NULL)
+    {
+        free(start);
+        return 1;
+    }
+    return 0;
+#else
+    return pthread_create(thread, NULL, function, argument) != 0;
+#endif
+}
+
+/**
+ * This function waits for a thread to finish.
+ *
+ * @param thread The thread to wait for.
+ */
+void joinWorker(workerThread thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+/**
+ * This function returns the number of processors that can run threads.
+ *
+ * @return The number of processors, at least 1.
+ */
+int countProcessors(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+/**
+ * This function moves the calendar of the menu one step in the direction of an arrow key,
+ * staying within the years 1206 to 1498.
+ *
+ * @param key The result of readKeyboardInput(): 1 for left, 2 for right, 3 for up and 4 for down.
+ * @param year Pointer to the calendar year, changed in place.
+ * @param month Pointer to the calendar month, changed in place.
+ */
+void moveCalendarView(int key, int *year, int *month)
+{
+    if (key == 1)
+    {
+        // The previous month
+        if (*year >= 1206)
+            (*month)--;
+        if (*month < 1)
+        {
+            *month = 12;
+            (*year)--;
+        }
+        if (*year == 1205)
+            (*year)++;
+    }
+    else if (key == 2)
+    {
+        // The next month
+        if (*year <= 1498)
+            (*month)++;
+        if (*month > 12)
+        {
+            *month = 1;
+            (*year)++;
+        }
+        if (*year == 1499)
+            (*year)--;
+    }
+    else if (key == 3)
+    {
+        // The next year
+        if (*year == 1498)
+            (*year)--;
+        (*year)++;
+    }
+    else if (key == 4)
+    {
+        // The previous year
+        if (*year >= 1206)
+            (*year)--;
+    }
+}
+
+/**
+ * The frame cache keeps the screens of calendar() for recently shown months, rendered and ready to write,
+ * so that moving through the calendar with the arrow keys writes a stored block of text instead of building it again.
+ * While the menu waits for a key, a background thread renders the months that each of the four arrow keys leads to.
+ * A frame depends on the year, the month and the output script, which together are its key.
+ * FRAME_CACHE_SLOTS frames are kept, and the least recently used one is replaced when the cache is full.
+ */
+#define FRAME_CACHE_SLOTS 16
+
+struct cachedFrame
+{
+    int year; // The calendar year, or 0 if the slot is empty
+    int month; // The calendar month
+    int script; // The output script the frame was rendered in
+    uint64_t lastUse; // The value of frameCacheClock when the frame was last stored or shown
+    char *data; // The text of the frame
+    int length; // The length of the text in bytes
+};
+
+struct cachedFrame frameCache[FRAME_CACHE_SLOTS];
+uint64_t frameCacheClock = 0;
+
+/**
+ * The state of the thread that renders the neighbouring months in the background.
+ * The menu waits for the thread before it reads the cache again, so the cache is never used by two threads at once.
+ */
+struct framePrefetch
+{
+    int year; // The calendar year shown
+    int month; // The calendar month shown
+    struct outputBuffer *out; // The buffer the frames are rendered in
+    workerThread thread; // The thread
+    int running; // 1 while the thread must still be joined
+};
+
+/**
+ * This function finds a frame in the cache and marks it as used.
+ *
+ * @param year The calendar year.
+ * @param month The calendar month.
+ * @return The frame, or NULL if it is not in the cache.
+ */
+struct cachedFrame *findCachedFrame(int year, int month)
+{
+    for (int i = 0; i < FRAME_CACHE_SLOTS; i++)
+    {
+        struct cachedFrame *frame = &frameCache[i];
+
+        if (frame->year == year && frame->month == month && frame->script == outputScript)
+        {
+            frame->lastUse = ++frameCacheClock;
+            return frame;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * This function renders the screen of calendar() for a month and stores it in the cache,
+ * in an empty slot or in place of the least recently used frame.
+ *
+ * @param year The calendar year.
+ * @param month The calendar month.
+ * @param out Pointer to the output buffer the frame is rendered in. It is not flushed, as a frame is far smaller.
+ * @return The frame, or NULL if memory ran out.
+ */
+struct cachedFrame *renderCachedFrame(int year, int month, struct outputBuffer *out)
+{
+    struct cachedFrame *frame = &frameCache[0];
+    char *data;
+
+    for (int i = 1; i < FRAME_CACHE_SLOTS && frame->year != 0; i++)
+        if (frameCache[i].year == 0 || frameCache[i].lastUse < frame->lastUse)
+            frame = &frameCache[i];
+
+    out->length = 0;
+    appendCalendarFrame(out, year, month, determineDaycode(year, month));
+
+    data = realloc(frame->data, out->length);
+    if (data == NULL)
+        return NULL;
+
+    memcpy(data, out->data, out->length);
+    frame->data = data;
+    frame->length = out->length;
+    frame->year = year;
+    frame->month = month;
+    frame->script = outputScript;
+    frame->lastUse = ++frameCacheClock;
+    return frame;
+}
+
+/**
+ * This function renders the months that the four arrow keys lead to from the month shown, unless they are cached.
+ *
+ * @param argument Pointer to the framePrefetch.
+ * @return Always NULL.
+ */
+void *prefetchFrames(void *argument)
+{
+    struct framePrefetch *prefetch = argument;
+
+    for (int key = 1; key <= 4; key++)
+    {
+        int year = prefetch->year, month = prefetch->month;
+
+        moveCalendarView(key, &year, &month);
+        if (findCachedFrame(year, month) == NULL)
+            renderCachedFrame(year, month, prefetch->out);
+    }
+
+    return NULL;
+}
+
+/**
+ * This function starts rendering the neighbouring months of the month shown in the background.
+ * If the thread cannot be started, they are rendered when the next key is pressed instead.
+ *
+ * @param prefetch Pointer to the framePrefetch, whose buffer must be allocated.
+ * @param year The calendar year shown.
+ * @param month The calendar month shown.
+ */
+void startFramePrefetch(struct framePrefetch *prefetch, int year, int month)
+{
+    prefetch->year = year;
+    prefetch->month = month;
+    prefetch->running = prefetch->out != NULL && startWorker(&prefetch->thread, prefetchFrames, prefetch) == 0;
+}
+
+/**
+ * This function waits for the background rendering started by startFramePrefetch() to finish.
+ * The user has pressed a key by then, so the thread has almost always finished already.
+ *
+ * @param prefetch Pointer to the framePrefetch.
+ */
+void finishFramePrefetch(struct framePrefetch *prefetch)
+{
+    if (prefetch->running)
+        joinWorker(prefetch->thread);
+    prefetch->running = 0;
+}
+
+/**
+ * This function shows the calendar for a given year and month like calendar(), but writes the frame from the cache,
+ * rendering and storing it first if it is not there.
+ *
+ * @param year The calendar year.
+ * @param month The calendar month.
+ */
+void showCachedCalendar(int year, int month)
+{
+    static struct outputBuffer out;
+    struct cachedFrame *frame;
+    METRICS_START(METRIC_CALENDAR, start);
+
+    // calendar() also leaves the length of Esfand of the year shown in days_in_shamsi_month[]
+    days_in_shamsi_month[12] = calendarFrameMonthLength(year, 12);
+
+    frame = findCachedFrame(year, month);
+    if (frame == NULL)
+        frame = renderCachedFrame(year, month, &out);
+
+    if (frame != NULL)
+        fwrite(frame->data, 1, frame->length, stdout);
+    else
+        calendar(year, month, determineDaycode(year, month));
+
+    METRICS_STOP(METRIC_CALENDAR, start);
+}
+
+/**
+ * The checks made by the round-trip verifier for every day, and the message printed when one fails.
+ */
+#define CHECK_CONSECUTIVE 0
+#define CHECK_GREGORIAN_VALID 1
+#define CHECK_GREGORIAN_ROUND_TRIP 2
+#define CHECK_DAY_NUMBER_ROUND_TRIP 3
+#define CHECK_LUNAR 4
+#define CHECK_CORE 5
+
+char *checkMessages[] = {
+        "shamsiToDayNumber() does not follow the previous day",
+        "shamsiToGregorian() gave a date that does not exist",
+        "gregorianToShamsi() does not give back the Shamsi date",
+        "dayNumberToShamsi() does not give back the Shamsi date",
+        "gregorianToLunar() does not agree with lunarToDayNumber()",
+        "the conversion core of calendar_core.c does not agree"
+};
+
+#define VERIFY_CHUNK_YEARS 4
+#define VERIFY_MAX_REPORTS 10
+#define VERIFY_MAX_THREADS 64
+
+/**
+ * The day number of 1 Muharram of year 1, the first day of the Lunar calendar. Lunar dates are checked from here on.
+ */
+#define LUNAR_EPOCH_DAY_NUMBER 1948440
+
+/**
+ * A failed check, with the Shamsi date it failed for and the date the checked function gave instead.
+ */
+struct verifyFailure
+{
+    int check; // One of the CHECK_ values
+    int dayNumber; // The day number of the Shamsi date (from shamsiToDayNumber)
+    int year, month, day; // The Shamsi date
+    int gotYear, gotMonth, gotDay; // The date the checked function gave
+};
+
+/**
+ * The state of one thread of the round-trip verifier.
+ * Threads take chunks of VERIFY_CHUNK_YEARS years from the shared nextYear counter until all years are checked,
+ * so a slow thread does not hold up the others.
+ */
+struct verifyWorker
+{
+    int lastYear; // The last Shamsi year to check
+    atomic_int *nextYear; // The first year of the next chunk, shared by all threads
+    long long days; // The number of days checked by this thread
+    long long failures; // The number of failed checks found by this thread
+    int reportCount; // The number of failures kept in reports[]
+    struct verifyFailure reports[VERIFY_MAX_REPORTS]; // The first failures found by this thread
+};
+
+/**
+ * This function records a failed check in the state of a verifier thread.
+ *
+ * @param worker Pointer to the state of the thread.
+ * @param failure The failed check.
+ */
+void reportFailure(struct verifyWorker *worker, struct verifyFailure failure)
+{
+    if (worker->reportCount < VERIFY_MAX_REPORTS)
+        worker->reports[worker->reportCount++] = failure;
+    worker->failures++;
+}
+
+/**
+ * This function checks every day of a range of Shamsi years.
+ * For each day it checks that the day follows the previous one, that shamsiToGregorian() gives a real date,
+ * that gregorianToShamsi() and dayNumberToShamsi() convert it back, that the Lunar date
+ * from gregorianToLunar() is a real date with the same day number, and that the conversion core gives the same dates.
+ *
+ * @param worker Pointer to the state of the thread that receives the results.
+ * @param firstYear The first Shamsi year to check.
+ * @param lastYear The last Shamsi year to check.
+ */
+void verifyYears(struct verifyWorker *worker, int firstYear, int lastYear)
+{
+    int previous = shamsiToDayNumber(firstYear - 1, 12, shamsiMonthLength(firstYear - 1, 12));
+    int rule = astronomicalCalendar ? CORE_ASTRONOMICAL : CORE_ARITHMETIC;
+
+    for (int year = firstYear; year <= lastYear; year++)
+        for (int month = 1; month <= 12; month++)
+        {
+            int length = shamsiMonthLength(year, month);
+
+            for (int day = 1; day <= length; day++)
+            {
+                struct verifyFailure failure = {0, 0, year, month, day, 0, 0, 0};
+                int gYear, gMonth, gDay, sYear, sMonth, sDay, lYear, lMonth, lDay;
+
+                shamsiToGregorian(year, month, day, &gYear, &gMonth, &gDay);
+                failure.dayNumber = gregorianToDayNumber(gYear, gMonth, gDay);
+
+                if (failure.dayNumber != previous + 1)
+                {
+                    failure.check = CHECK_CONSECUTIVE;
+                    dayNumberToGregorian(previous, &failure.gotYear, &failure.gotMonth, &failure.gotDay);
+                    reportFailure(worker, failure);
+                }
+                previous = failure.dayNumber;
+
+                if (gMonth < 1 || gMonth > 12 || gDay < 1 || gDay > gregorianMonthLength(gYear, gMonth))
+                {
+                    failure.check = CHECK_GREGORIAN_VALID;
+                    failure.gotYear = gYear, failure.gotMonth = gMonth, failure.gotDay = gDay;
+                    reportFailure(worker, failure);
+                }
+
+                gregorianToShamsi(gYear, gMonth, gDay, &sYear, &sMonth, &sDay);
+                if (sYear != year || sMonth != month || sDay != day)
+                {
+                    failure.check = CHECK_GREGORIAN_ROUND_TRIP;
+                    failure.gotYear = sYear, failure.gotMonth = sMonth, failure.gotDay = sDay;
+                    reportFailure(worker, failure);
+                }
+
+                dayNumberToShamsi(failure.dayNumber, &sYear, &sMonth, &sDay);
+                if (sYear != year || sMonth != month || sDay != day)
+                {
+                    failure.check = CHECK_DAY_NUMBER_ROUND_TRIP;
+                    failure.gotYear = sYear, failure.gotMonth = sMonth, failure.gotDay = sDay;
+                    reportFailure(worker, failure);
+                }
+
+                // Lunar dates are checked from the first day of the Lunar calendar on
+                if (failure.dayNumber >= LUNAR_EPOCH_DAY_NUMBER)
+                {
+                    dayNumberToLunar(failure.dayNumber, &lYear, &lMonth, &lDay);
+                    if (lMonth < 1 || lMonth > 12 || lDay < 1 || lDay > lunarMonthLength(lYear, lMonth)
+                        || lunarToDayNumber(lYear, lMonth, lDay) != failure.dayNumber)
+                    {
+                        failure.check = CHECK_LUNAR;
+                        failure.gotYear = lYear, failure.gotMonth = lMonth, failure.gotDay = lDay;
+                        reportFailure(worker, failure);
+                    }
+                }
+
+                // The core covers the astronomical calendar up to its last year, has no observed Lunar months
+                // and rejects the days before the first day of the Lunar calendar
+                if (rule == CORE_ARITHMETIC || year <= CORE_ASTRONOMICAL_LAST_YEAR)
+                {
+                    int coreDayNumber = 0, cYear = 0, cMonth = 0, cDay = 0;
+
+                    dayNumberToLunar(failure.dayNumber, &lYear, &lMonth, &lDay);
+                    if (!coreToDayNumber(CORE_SHAMSI, rule, year, month, day, &coreDayNumber)
+                        || coreDayNumber != failure.dayNumber
+                        || !coreFromDayNumber(CORE_SHAMSI, rule, failure.dayNumber, &cYear, &cMonth, &cDay)
+                        || cYear != year || cMonth != month || cDay != day
+                        || !coreConvert(CORE_SHAMSI, CORE_GREGORIAN, rule, year, month, day, &cYear, &cMonth, &cDay)
+                        || cYear != gYear || cMonth != gMonth || cDay != gDay
+                        || !coreConvert(CORE_GREGORIAN, CORE_SHAMSI, rule, gYear, gMonth, gDay, &cYear, &cMonth, &cDay)
+                        || cYear != year || cMonth != month || cDay != day
+                        || (failure.dayNumber < LUNAR_EPOCH_DAY_NUMBER
+                            && coreFromDayNumber(CORE_LUNAR, rule, failure.dayNumber, &cYear, &cMonth, &cDay))
+                        || (failure.dayNumber >= LUNAR_EPOCH_DAY_NUMBER && lunarOverrides == NULL
+                            && (!coreFromDayNumber(CORE_LUNAR, rule, failure.dayNumber, &cYear, &cMonth, &cDay)
+                                || cYear != lYear || cMonth != lMonth || cDay != lDay))
+                        || !coreFromDayNumber(CORE_JULIAN, rule, failure.dayNumber, &cYear, &cMonth, &cDay)
+                        || coreToDayNumber(CORE_JULIAN, rule, cYear, cMonth, cDay, &coreDayNumber) != 1
+                        || coreDayNumber != julianToDayNumber(cYear, cMonth, cDay))
+                    {
+                        failure.check = CHECK_CORE;
+                        failure.gotYear = cYear, failure.gotMonth = cMonth, failure.gotDay = cDay;
+                        reportFailure(worker, failure);
+                    }
+                }
+
+                worker->days++;
+            }
+        }
+}
+
+/**
+ * This function is run by each thread of the round-trip verifier. It checks chunks of years until none are left.
+ *
+ * @param argument Pointer to the verifyWorker of the thread.
+ * @return Always NULL.
+ */
+void *runVerifyWorker(void *argument)
+{
+    struct verifyWorker *worker = argument;
+    int first;
+
+    while ((first = atomic_fetch_add(worker->nextYear, VERIFY_CHUNK_YEARS)) <= worker->lastYear)
+    {
+        int last = first + VERIFY_CHUNK_YEARS - 1;
+
+        verifyYears(worker, first, last < worker->lastYear ? last : worker->lastYear);
+    }
+
+    return NULL;
+}
+
+/**
+ * This function checks that the conversion functions agree with each other on every day of a range of Shamsi years,
+ * using one thread per processor, and prints the result with the first failures in order of date.
+ *
+ * @param firstYear The first Shamsi year to check.
+ * @param lastYear The last Shamsi year to check.
+ * @return 0 if every check passed, 1 if any failed or the threads could not be started.
+ */
+int verifyRoundTrips(int firstYear, int lastYear)
+{
+    struct verifyWorker *workers;
+    workerThread threads[VERIFY_MAX_THREADS];
+    struct verifyFailure reports[VERIFY_MAX_THREADS * VERIFY_MAX_REPORTS];
+    atomic_int nextYear;
+    long long days = 0, failures = 0;
+    int threadCount = countProcessors();
+    int started = 0, reportCount = 0;
+    uint64_t begin = readNanoseconds();
+
+    if (threadCount > VERIFY_MAX_THREADS)
+        threadCount = VERIFY_MAX_THREADS;
+
+    workers = calloc(threadCount, sizeof(struct verifyWorker));
+    if (workers == NULL)
+        return 1;
+    atomic_init(&nextYear, firstYear);
+
+    // Start one thread per processor; the calling thread is the first one
+    for (int i = 0; i < threadCount; i++)
+    {
+        workers[i].lastYear = lastYear;
+        workers[i].nextYear = &nextYear;
+    }
+    for (int i = 1; i < threadCount; i++)
+    {
+        if (startWorker(&threads[i], runVerifyWorker, &workers[i]) != 0)
+            break;
+        started = i;
+    }
+    runVerifyWorker(&workers[0]);
+    for (int i = 1; i <= started; i++)
+        joinWorker(threads[i]);
+
+    // Collect the results of all threads
+    for (int i = 0; i < threadCount; i++)
+    {
+        days += workers[i].days;
+        failures += workers[i].failures;
+        for (int j = 0; j < workers[i].reportCount; j++)
+            reports[reportCount++] = workers[i].reports[j];
+    }
+
+    printf("Checked %lld days (Shamsi years %d to %d) on %d threads in %.1f ms: ", days, firstYear, lastYear,
+           started + 1, (double)(readNanoseconds() - begin) / 1e6);
+
+    if (failures == 0)
+    {
+        printf("no mismatches.\n");
+        free(workers);
+        return 0;
+    }
+
+    printf(RED_TEXT "%lld mismatches." RESET "\n", failures);
+
+    // Print the earliest failures, sorted by date
+    for (int shown = 0; shown < VERIFY_MAX_REPORTS && shown < reportCount; shown++)
+    {
+        int earliest = shown;
+
+        for (int i = shown + 1; i < reportCount; i++)
+            if (reports[i].dayNumber < reports[earliest].dayNumber)
+                earliest = i;
+
+        struct verifyFailure failure = reports[earliest];
+        reports[earliest] = reports[shown];
+        reports[shown] = failure;
+
+        printf(RED_TEXT "%04d/%02d/%02d: %s (got %04d/%02d/%02d)" RESET "\n", failure.year, failure.month, failure.day,
+               checkMessages[failure.check], failure.gotYear, failure.gotMonth, failure.gotDay);
+    }
+
+    free(workers);
+    return 1;
+}
+
+/**
+ * The age histogram counts a stream of birth dates by age in whole Shamsi years, by Shamsi month of birth
+ * and by day of the week of birth, without keeping anything per person.
+ * Ages of AGE_MAX_YEARS and above share the last bucket.
+ */
+#define AGE_MAX_YEARS 150
+
+/**
+ * The counts of an age histogram. Every thread has its own, which are added together at the end.
+ */
+struct ageCounts
+{
+    int64_t years[AGE_MAX_YEARS + 1]; // The number of people of each age in years
+    int64_t months[13]; // The number of people born in each Shamsi month, from 1
+    int64_t weekdays[7]; // The number of people born on each day of the week, 0 for SHANBE
+    int64_t future; // The number of birth dates after the reference date
+    int64_t skipped; // The number of lines that are not valid dates
+};
+
+/**
+ * The part of a chunk of birth dates counted by one thread.
+ */
+struct ageWorker
+{
+    const char *text; // The first line of the part
+    const char *end; // The end of the part, just after a newline
+    int calendar; // The calendar of the birth dates
+    int referenceYear; // The Shamsi year of the reference date
+    int referenceKey; // The Shamsi month and day of the reference date, as month * 32 + day
+    struct ageCounts counts; // The counts of this thread, over all chunks
+};
+
+/**
+ * This function counts the birth dates of the part of a chunk given to a thread.
+ * The age is the number of Shamsi birthdays passed by the reference date, as in calculateAge().
+ *
+ * @param argument Pointer to the ageWorker.
+ * @return Always NULL.
+ */
+void *countAgePart(void *argument)
+{
+    struct ageWorker *worker = argument;
+    struct ageCounts *counts = &worker->counts;
+    const char *text = worker->text;
+    TRACE_START(start);
+
+    while (text < worker->end)
+    {
+        const char *lineEnd = memchr(text, '\n', worker->end - text);
+        int year, month, day, dayNumber = -1, age;
+
+        if (parseDateText(text, lineEnd, &year, &month, &day))
+            dayNumber = dateToDayNumber(worker->calendar, year, month, day);
+        text = lineEnd + 1;
+
+        if (dayNumber < 0)
+        {
+            counts->skipped++;
+            continue;
+        }
+
+        if (worker->calendar != CALENDAR_SHAMSI)
+            dayNumberToShamsi(dayNumber, &year, &month, &day);
+
+        age = worker->referenceYear - year - (month * 32 + day > worker->referenceKey);
+        if (age < 0)
+        {
+            counts->future++;
+            continue;
+        }
+
+        counts->years[age < AGE_MAX_YEARS ? age : AGE_MAX_YEARS]++;
+        counts->months[month]++;
+        counts->weekdays[dayNumberToWeekday(dayNumber)]++;
+    }
+
+    TRACE_STOP("count", start);
+    return NULL;
+}
+
+/**
+ * This function writes one line of an age histogram: the kind of the count, its label and the count.
+ * The label is a number, a text or a number followed by a text, and lines such as "future" have none.
+ *
+ * @param out Pointer to the output buffer.
+ * @param kind The kind of the count, such as "month".
+ * @param number The number at the start of the label, or -1 for none.
+ * @param label The text of the label, or NULL for none.
+ * @param count The count.
+ */
+void appendAgeCount(struct outputBuffer *out, const char *kind, int number, const char *label, int64_t count)
+{
+    char text[32];
+
+    appendText(out, kind);
+    if (number >= 0 || label != NULL)
+        appendBytes(out, "\t", 1);
+    if (number >= 0)
+        appendLocalNumber(out, number, 1);
+    if (label != NULL)
+        appendText(out, label);
+    appendBytes(out, text, snprintf(text, sizeof(text), "\t%lld\n", (long long)count));
+}
+
+/**
+ * This function reads birth dates (one per line) from a stream and writes histograms of the ages in years,
+ * the Shamsi months of birth and the days of the week of birth, all counted in a single pass.
+ * Each chunk of input is split between one thread per processor, and every thread adds to its own counts,
+ * which are added together once the input ends.
+ *
+ * The output has one line per count, with the kind of the count, its label and the count separated by tabs:
+ * "age" for every age from the youngest to the oldest (the last bucket, written as AGE_MAX_YEARS followed by "+",
+ * also holds older ages), "month" for the twelve Shamsi months and "weekday" for the seven days of the week.
+ * The number of birth dates after the reference date follows as "future", and the number of lines that are not
+ * valid dates as "-".
+ *
+ * @param calendar The calendar of the birth dates.
+ * @param referenceDay The day number of the date at which ages are measured.
+ * @param input The stream to read.
+ * @param output The stream to write the histograms to.
+ * @return 0 on success, 1 if memory ran out or the output could not be written.
+ */
+int aggregateAges(int calendar, int referenceDay, FILE *input, FILE *output)
+{
+    struct ageWorker *workers;
+    struct outputBuffer *out;
+    struct lineReader reader;
+    workerThread threads[VERIFY_MAX_THREADS];
+    char started[VERIFY_MAX_THREADS];
+    int workerCount = countProcessors(), referenceYear, referenceMonth, referenceDate, youngest, oldest, failed;
+    char *text;
+    size_t length;
+
+    if (workerCount > VERIFY_MAX_THREADS)
+        workerCount = VERIFY_MAX_THREADS;
+
+    workers = calloc(workerCount, sizeof(struct ageWorker));
+    out = malloc(sizeof(struct outputBuffer));
+    if (workers == NULL || out == NULL || startLineReader(&reader, input) != 0)
+    {
+        free(workers);
+        free(out);
+        return 1;
+    }
+
+    dayNumberToShamsi(referenceDay, &referenceYear, &referenceMonth, &referenceDate);
+    for (int i = 0; i < workerCount; i++)
+    {
+        workers[i].calendar = calendar;
+        workers[i].referenceYear = referenceYear;
+        workers[i].referenceKey = referenceMonth * 32 + referenceDate;
+    }
+
+    while ((length = readLineChunk(&reader, &text)) > 0)
+    {
+        const char *end = text + length;
+        const char *start = text;
+
+        // Split the chunk into one part per thread, each ending after a newline
+        for (int i = 0; i < workerCount; i++)
+        {
+            const char *partEnd = i == workerCount - 1 ? end : text + length * (i + 1) / workerCount;
+
+            if (partEnd < start)
+                partEnd = start;
+            else if (partEnd < end)
+                partEnd = (const char *)memchr(partEnd, '\n', end - partEnd) + 1;
+
+            workers[i].text = start;
+            workers[i].end = partEnd;
+            start = partEnd;
+        }
+
+        for (int i = 1; i < workerCount; i++)
+            started[i] = startWorker(&threads[i], countAgePart, &workers[i]) == 0;
+        countAgePart(&workers[0]);
+        for (int i = 1; i < workerCount; i++)
+        {
+            if (started[i])
+                joinWorker(threads[i]);
+            else
+                countAgePart(&workers[i]);
+        }
+
+        checkMetricsDump();
+    }
+
+    // Add the counts of the other threads to those of the first
+    for (int i = 1; i < workerCount; i++)
+    {
+        for (int age = 0; age <= AGE_MAX_YEARS; age++)
+            workers[0].counts.years[age] += workers[i].counts.years[age];
+        for (int month = 1; month <= 12; month++)
+            workers[0].counts.months[month] += workers[i].counts.months[month];
+        for (int weekday = 0; weekday < 7; weekday++)
+            workers[0].counts.weekdays[weekday] += workers[i].counts.weekdays[weekday];
+        workers[0].counts.future += workers[i].counts.future;
+        workers[0].counts.skipped += workers[i].counts.skipped;
+    }
+
+    youngest = 0;
+    while (youngest < AGE_MAX_YEARS && workers[0].counts.years[youngest] == 0)
+        youngest++;
+    oldest = AGE_MAX_YEARS;
+    while (oldest > youngest && workers[0].counts.years[oldest] == 0)
+        oldest--;
+
+    out->file = output;
+    out->length = 0;
+    for (int age = youngest; age <= oldest && workers[0].counts.years[oldest] > 0; age++)
+        appendAgeCount(out, "age", age, age < AGE_MAX_YEARS ? NULL : "+", workers[0].counts.years[age]);
+    for (int month = 1; month <= 12; month++)
+        appendAgeCount(out, "month", -1, shamsiMonthNames[month], workers[0].counts.months[month]);
+    for (int weekday = 0; weekday < 7; weekday++)
+        appendAgeCount(out, "weekday", -1, days_of_week_shamsi[weekday], workers[0].counts.weekdays[weekday]);
+    appendAgeCount(out, "future", -1, NULL, workers[0].counts.future);
+    appendAgeCount(out, "-", -1, NULL, workers[0].counts.skipped);
+    flushOutput(out);
+    failed = reader.failed || ferror(output) != 0;
+
+    stopLineReader(&reader);
+    free(workers);
+    free(out);
+    return failed;
+}
+
+/**
+ * This function reads a whole stream into memory.
+ *
+ * @param input The stream to read.
+ * @param size Pointer to the variable that receives the number of bytes read.
+ * @return The bytes read, which the caller frees, or NULL if memory ran out.
+ */
+char *readWholeStream(FILE *input, size_t *size)
+{
+    size_t capacity = CONVERT_CHUNK_SIZE, length = 0, count;
+    char *data = malloc(capacity);
+
+    while (data != NULL && (count = fread(data + length, 1, capacity - length, input)) > 0)
+    {
+        length += count;
+        if (length == capacity)
+        {
+            char *grown = realloc(data, capacity * 2);
+            if (grown == NULL)
+                free(data);
+            data = grown;
+            capacity *= 2;
+        }
+    }
+
+    *size = length;
+    return data;
+}
+
+/**
+ * Records are sorted by the radix sort as 64-bit values holding the sort key in the upper 32 bits
+ * and the index of the line in the lower 32 bits. The key is sorted in digits of SORT_DIGIT_BITS bits,
+ * starting from the lowest digit, and each pass is stable, so lines with the same date keep their order.
+ */
+#define SORT_DIGIT_BITS 8
+#define SORT_BUCKETS (1 << SORT_DIGIT_BITS)
+#define SORT_MAX_THREADS 64
+#define SORT_PARALLEL_RECORDS (1 << 20)
+#define SORT_PREFETCH_DISTANCE 16
+
+/**
+ * The part of one radix sort pass done by one thread: the records first to last of the source.
+ * The thread first counts how many of its records fall in each bucket,
+ * and then, once the counts of all threads are turned into positions, moves its records to the target.
+ */
+struct sortPart
+{
+    const uint64_t *source; // The records before the pass
+    uint64_t *target; // The records after the pass
+    size_t first, last; // The records of this thread
+    int shift; // The position of the digit of this pass
+    size_t positions[SORT_BUCKETS]; // The counts of the buckets, then where the next record of each bucket goes
+};
+
+/**
+ * This function counts the records of a sortPart in each bucket.
+ *
+ * @param argument Pointer to the sortPart.
+ * @return Always NULL.
+ */
+void *countSortPart(void *argument)
+{
+    struct sortPart *part = argument;
+
+    memset(part->positions, 0, sizeof(part->positions));
+    for (size_t i = part->first; i < part->last; i++)
+        part->positions[(part->source[i] >> part->shift) & (SORT_BUCKETS - 1)]++;
+    return NULL;
+}
+
+/**
+ * This function moves the records of a sortPart to their positions in the target.
+ *
+ * @param argument Pointer to the sortPart.
+ * @return Always NULL.
+ */
+void *scatterSortPart(void *argument)
+{
+    struct sortPart *part = argument;
+
+    for (size_t i = part->first; i < part->last; i++)
+    {
+        uint64_t record = part->source[i];
+        part->target[part->positions[(record >> part->shift) & (SORT_BUCKETS - 1)]++] = record;
+    }
+    return NULL;
+}
+
+/**
+ * This function runs a step of the radix sort on every part, using one thread per part (the calling thread runs the first).
+ * If a thread cannot be started its part is run by the calling thread.
+ *
+ * @param step countSortPart or scatterSortPart.
+ * @param parts The parts.
+ * @param partCount The number of parts.
+ */
+void runSortStep(void *(*step)(void *), struct sortPart *parts, int partCount)
+{
+    workerThread threads[SORT_MAX_THREADS];
+    char started[SORT_MAX_THREADS];
+
+    for (int i = 1; i < partCount; i++)
+        started[i] = startWorker(&threads[i], step, &parts[i]) == 0;
+    step(&parts[0]);
+    for (int i = 1; i < partCount; i++)
+    {
+        if (started[i])
+            joinWorker(threads[i]);
+        else
+            step(&parts[i]);
+    }
+}
+
+/**
+ * This function sorts records by their upper 32 bits with a least-significant-digit radix sort.
+ * Large inputs are split into one part per processor: every thread counts its part,
+ * the counts are turned into positions in order of bucket and then of part, and every thread moves its part.
+ * Because the parts are in order and each thread keeps the order of its records, every pass stays stable.
+ *
+ * @param records The records to sort.
+ * @param scratch Space for as many records, used between passes.
+ * @param count The number of records.
+ * @param keyBits The number of bits used by the largest key.
+ * @return records or scratch, whichever holds the sorted records.
+ */
+uint64_t *radixSortRecords(uint64_t *records, uint64_t *scratch, size_t count, int keyBits)
+{
+    struct sortPart parts[SORT_MAX_THREADS];
+    int partCount = count >= SORT_PARALLEL_RECORDS ? countProcessors() : 1;
+
+    if (partCount > SORT_MAX_THREADS)
+        partCount = SORT_MAX_THREADS;
+
+    for (int shift = 32; shift < 32 + keyBits; shift += SORT_DIGIT_BITS)
+    {
+        size_t position = 0;
+
+        for (int i = 0; i < partCount; i++)
+        {
+            parts[i].source = records;
+            parts[i].target = scratch;
+            parts[i].first = count * i / partCount;
+            parts[i].last = count * (i + 1) / partCount;
+            parts[i].shift = shift;
+        }
+        runSortStep(countSortPart, parts, partCount);
+
+        // Turn the counts into the position of the first record of each bucket in each part
+        for (int bucket = 0; bucket < SORT_BUCKETS; bucket++)
+            for (int i = 0; i < partCount; i++)
+            {
+                size_t bucketCount = parts[i].positions[bucket];
+                parts[i].positions[bucket] = position;
+                position += bucketCount;
+            }
+        runSortStep(scatterSortPart, parts, partCount);
+
+        // The target of this pass is the source of the next one
+        uint64_t *swap = records;
+        records = scratch;
+        scratch = swap;
+    }
+
+    return records;
+}
+
+/**
+ * This function reads the date at the start of a line: the text up to the first space, tab or comma.
+ * The date may start with S:, G:, L: or J: to give its calendar; otherwise the given calendar is used.
+ *
+ * @param line The start of the line.
+ * @param end The end of the line.
+ * @param calendar The calendar of dates without a prefix.
+ * @return The day number of the date, or -1 if the line does not start with a valid date.
+ */
+int readLineDate(const char *line, const char *end, int calendar)
+{
+    const char *fieldEnd = line;
+    int year, month, day;
+
+    while (fieldEnd < end && *fieldEnd != ' ' && *fieldEnd != '\t' && *fieldEnd != ',' && *fieldEnd != '\r')
+        fieldEnd++;
+
+    if (fieldEnd - line > 2 && line[1] == ':')
+    {
+        calendar = line[0] == 'S' ? CALENDAR_SHAMSI : line[0] == 'G' ? CALENDAR_GREGORIAN
+                 : line[0] == 'L' ? CALENDAR_LUNAR : line[0] == 'J' ? CALENDAR_JULIAN : -1;
+        line += 2;
+    }
+
+    if (calendar < 0 || !parseDateText(line, fieldEnd, &year, &month, &day))
+        return -1;
+    return dateToDayNumber(calendar, year, month, day);
+}
+
+/**
+ * This function writes the lines of a file sorted by the date at the start of each line,
+ * which may be in any calendar of the registry, so that for example Lunar and Gregorian dates can be mixed.
+ * Each date is converted once to a day number, which becomes the key of a radix sort.
+ * Lines with the same date keep their order, and lines without a valid date come last in their original order.
+ *
+ * @param calendar The calendar of dates without a prefix.
+ * @param path The file to sort, or NULL to read the standard input.
+ * @param output The stream to write the sorted lines to.
+ * @return 0 on success, 1 if the input could not be read, memory ran out or the output could not be written.
+ */
+int sortDateLines(int calendar, char *path, FILE *output)
+{
+    const char *data = NULL;
+    char *readData = NULL;
+    size_t size = 0, count = 0;
+    size_t *starts;
+    uint64_t *records, *scratch, *sorted;
+    struct outputBuffer *out;
+    int minimum = INT32_MAX, maximum = 0, keyBits = 0, failed;
+
+    // Map the file, or read it when it cannot be mapped (an empty file, a pipe or the standard input)
+    if (path != NULL)
+        data = mapFileReadOnly(path, &size);
+    if (data == NULL)
+    {
+        FILE *input = path == NULL ? stdin : fopen(path, "rb");
+
+        if (input == NULL)
+        {
+            fprintf(stderr, "%s %s\n", RED_TEXT "Could not read" RESET, path);
+            return 1;
+        }
+        data = readData = readWholeStream(input, &size);
+        if (input != stdin)
+            fclose(input);
+        if (readData == NULL)
+            return 1;
+    }
+
+    // Find where every line starts
+    for (size_t i = 0; i < size; i++)
+        count += data[i] == '\n';
+    count += size > 0 && data[size - 1] != '\n';
+
+    starts = malloc((count + 1) * sizeof(size_t));
+    records = malloc(count * sizeof(uint64_t) + 1);
+    scratch = malloc(count * sizeof(uint64_t) + 1);
+    out = malloc(sizeof(struct outputBuffer));
+    failed = starts == NULL || records == NULL || scratch == NULL || out == NULL || count >= UINT32_MAX;
+
+    if (!failed)
+    {
+        const char *position = data;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const char *lineEnd = memchr(position, '\n', data + size - position);
+
+            if (lineEnd == NULL)
+                lineEnd = data + size;
+            starts[i] = position - data;
+
+            // Keep the day number for now; it becomes a key once the earliest date is known
+            int dayNumber = readLineDate(position, lineEnd, calendar);
+            records[i] = ((uint64_t)(uint32_t)dayNumber << 32) | i;
+            if (dayNumber >= 0 && dayNumber < minimum)
+                minimum = dayNumber;
+            if (dayNumber > maximum)
+                maximum = dayNumber;
+            position = lineEnd + 1;
+        }
+        starts[count] = position - data;
+
+        // With no valid date at all every line gets the same key, and the lines keep their order
+        if (minimum > maximum)
+            minimum = maximum = 0;
+
+        // The key is the number of days after the earliest date; lines without a date get the largest key
+        for (size_t i = 0; i < count; i++)
+        {
+            int dayNumber = (int)(uint32_t)(records[i] >> 32);
+            uint64_t key = dayNumber < 0 ? (uint64_t)(maximum - minimum + 1) : (uint64_t)(dayNumber - minimum);
+            records[i] = (key << 32) | (uint32_t)records[i];
+        }
+        while (count > 0 && keyBits < 32 && ((uint64_t)(maximum - minimum + 1) >> keyBits) != 0)
+            keyBits++;
+
+        sorted = radixSortRecords(records, scratch, count, keyBits);
+
+        // Write the lines in the sorted order
+        out->file = output;
+        out->length = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t line = (uint32_t)sorted[i];
+            size_t length = starts[line + 1] - 1 - starts[line];
+
+#if defined(__GNUC__)
+            // The lines are read in a random order, so start loading a later one while this one is copied
+            if (i + SORT_PREFETCH_DISTANCE < count)
+                __builtin_prefetch(data + starts[(uint32_t)sorted[i + SORT_PREFETCH_DISTANCE]]);
+#endif
+
+            appendBytes(out, data + starts[line], (int)length);
+            appendBytes(out, "\n", 1);
+        }
+        flushOutput(out);
+        failed = ferror(output) != 0;
+    }
+
+    if (readData != NULL)
+        free(readData);
+    else
+        unmapFile(data, size);
+    free(starts);
+    free(records);
+    free(scratch);
+    free(out);
+    return failed;
+}
+
+/**
+ * A date index is a file that lists the lines of a log in order of the date at their start,
+ * so that the lines of a range of dates can be found by binary search instead of reading the whole log.
+ * After the header comes a block summary (the day number of the first entry of every block of INDEX_BLOCK_ENTRIES entries),
+ * which is small enough to stay in the cache, and then the entries, sorted by day number and then by position in the log.
+ * The header stores the size of the log, so an index that no longer matches its log is refused.
+ */
+#define INDEX_MAGIC "SHIX"
+#define INDEX_VERSION 1
+#define INDEX_BLOCK_ENTRIES 256
+
+struct indexHeader
+{
+    char magic[4]; // Always INDEX_MAGIC
+    uint32_t version; // INDEX_VERSION of the program that wrote the file
+    uint32_t byteOrder; // TABLE_BYTE_ORDER as written by the machine that wrote the file
+    uint32_t blockEntries; // The number of entries in each block (INDEX_BLOCK_ENTRIES)
+    uint64_t entryCount; // The number of entries
+    uint64_t blockCount; // The number of blocks
+    uint64_t logSize; // The size of the log when it was indexed
+    uint64_t entryOffset; // The position of the first entry, from the start of the file
+};
+
+struct indexEntry
+{
+    int32_t dayNumber; // The day number of the date at the start of the line
+    uint32_t length; // The length of the line, without the line break
+    uint64_t offset; // The position of the line in the log
+};
+
+/**
+ * This function writes the date index of a log. The date at the start of each line is converted once to a day number
+ * (see readLineDate()), and the entries are ordered with the radix sort of the --sort mode.
+ * Lines that do not start with a valid date are left out of the index.
+ *
+ * @param logPath The path of the log.
+ * @param indexPath The path of the index file to write.
+ * @param calendar The calendar of the dates in the log (unless a date has an S:, G:, L: or J: prefix).
+ * @return 0 on success, 1 if the log could not be read or the index could not be written.
+ */
+int writeDateIndex(char *logPath, char *indexPath, int calendar)
+{
+    struct indexHeader header;
+    size_t size, count = 0, capacity = 0;
+    const char *data = mapFileReadOnly(logPath, &size);
+    const char *position;
+    struct indexEntry *entries = NULL;
+    uint64_t *records, *scratch, *sorted;
+    int32_t *summary;
+    int minimum = INT32_MAX, maximum = 0, keyBits = 0, failed;
+    FILE *file;
+
+    if (data == NULL)
+        return 1;
+
+    // Read the date of every line; a line has at least 2 bytes, so this is enough room
+    capacity = size / 2 + 1;
+    entries = malloc(capacity * sizeof(struct indexEntry));
+    if (entries == NULL)
+    {
+        unmapFile(data, size);
+        return 1;
+    }
+
+    for (position = data; position < data + size;)
+    {
+        const char *lineEnd = memchr(position, '\n', data + size - position);
+        int dayNumber;
+
+        if (lineEnd == NULL)
+            lineEnd = data + size;
+
+        dayNumber = readLineDate(position, lineEnd, calendar);
+        if (dayNumber >= 0)
+        {
+            entries[count].dayNumber = dayNumber;
+            entries[count].length = (uint32_t)(lineEnd - position - (lineEnd > position && lineEnd[-1] == '\r'));
+            entries[count++].offset = position - data;
+            if (dayNumber < minimum)
+                minimum = dayNumber;
+            if (dayNumber > maximum)
+                maximum = dayNumber;
+        }
+        position = lineEnd + 1;
+    }
+    unmapFile(data, size);
+
+    // Sort the entries by day number, keeping lines of the same day in log order
+    records = malloc(count * sizeof(uint64_t) + 1);
+    scratch = malloc(count * sizeof(uint64_t) + 1);
+    summary = malloc(((count + INDEX_BLOCK_ENTRIES - 1) / INDEX_BLOCK_ENTRIES) * sizeof(int32_t) + 1);
+    if (records == NULL || scratch == NULL || summary == NULL || count >= UINT32_MAX)
+    {
+        free(entries);
+        free(records);
+        free(scratch);
+        free(summary);
+        return 1;
+    }
+
+    // A log without a valid date gives an empty index
+    if (count == 0)
+        minimum = maximum = 0;
+
+    for (size_t i = 0; i < count; i++)
+        records[i] = (uint64_t)(entries[i].dayNumber - minimum) << 32 | i;
+    while (count > 0 && keyBits < 32 && ((uint64_t)(maximum - minimum) >> keyBits) != 0)
+        keyBits++;
+    sorted = radixSortRecords(records, scratch, count, keyBits);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, 4);
+    header.version = INDEX_VERSION;
+    header.byteOrder = TABLE_BYTE_ORDER;
+    header.blockEntries = INDEX_BLOCK_ENTRIES;
+    header.entryCount = count;
+    header.blockCount = (count + INDEX_BLOCK_ENTRIES - 1) / INDEX_BLOCK_ENTRIES;
+    header.logSize = size;
+    // Entries start at the first multiple of 8 bytes after the block summary
+    header.entryOffset = (sizeof(header) + header.blockCount * sizeof(int32_t) + 7) & ~(uint64_t)7;
+
+    for (size_t block = 0; block < header.blockCount; block++)
+        summary[block] = entries[(uint32_t)sorted[block * INDEX_BLOCK_ENTRIES]].dayNumber;
+
+    file = fopen(indexPath, "wb");
+    failed = file == NULL;
+    if (!failed)
+    {
+        // Write the header, the block summary, the padding and the entries in sorted order
+        uint64_t padding = 0;
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(summary, sizeof(int32_t), header.blockCount, file);
+        fwrite(&padding, 1, header.entryOffset - sizeof(header) - header.blockCount * sizeof(int32_t), file);
+        for (size_t i = 0; i < count; i++)
+            fwrite(&entries[(uint32_t)sorted[i]], sizeof(struct indexEntry), 1, file);
+
+        failed = ferror(file) != 0;
+        failed = fclose(file) != 0 || failed;
+    }
+
+    free(entries);
+    free(records);
+    free(scratch);
+    free(summary);
+    return failed;
+}
+
+/**
+ * This function finds the first entry of a date index whose day number is at least a given day number.
+ * It first searches the block summary for the last block that starts before the day number,
+ * then searches the entries of that block.
+ *
+ * @param header Pointer to the header of the mapped index.
+ * @param dayNumber The day number to look for.
+ * @return The index of the first entry on or after the day, or the number of entries if there is none.
+ */
+uint64_t findIndexEntry(const struct indexHeader *header, int dayNumber)
+{
+    const int32_t *summary = (const int32_t *)(header + 1);
+    const struct indexEntry *entries = (const struct indexEntry *)((const char *)header + header->entryOffset);
+    uint64_t low = 0, high = header->blockCount, end;
+
+    // Find the first block that starts on or after the day; the entry is in it or at the end of the block before it
+    while (low < high)
+    {
+        uint64_t middle = low + (high - low) / 2;
+
+        if (summary[middle] < dayNumber)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if (low == 0)
+        return 0;
+
+    // Search the block before it
+    end = low * header->blockEntries < header->entryCount ? low * header->blockEntries : header->entryCount;
+    low = (low - 1) * header->blockEntries;
+    high = end;
+    while (low < high)
+    {
+        uint64_t middle = low + (high - low) / 2;
+
+        if (entries[middle].dayNumber < dayNumber)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+/**
+ * This function reads one end of a query range, written as YEAR/MONTH/DAY or as YEAR/MONTH for a whole month.
+ *
+ * @param text The text to read.
+ * @param calendar The calendar of the date.
+ * @param lastDay 1 to give the last day of a month, 0 to give the first day.
+ * @return The day number of the date, or -1 if the text is not a valid date or month.
+ */
+int parseRangeArgument(char *text, int calendar, int lastDay)
+{
+    int year, month, day, length;
+    char *end = text + strlen(text);
+
+    if (parseDateText(text, end, &year, &month, &day))
+        return dateToDayNumber(calendar, year, month, day);
+
+    // A month: YEAR/MONTH or YEAR-MONTH
+    year = (int)strtol(text, &end, 10);
+    if (end == text || (*end != '/' && *end != '-'))
+        return -1;
+    text = end + 1;
+    month = (int)strtol(text, &end, 10);
+    if (end == text || *end != '\0' || month < 1 || month > 12)
+        return -1;
+
+    length = calendarMonthLength(calendar, year, month);
+    return dateToDayNumber(calendar, year, month, lastDay ? length : 1);
+}
+
+/**
+ * This function prints the lines of a log whose dates fall in a range, using the date index of the log.
+ * The range is turned into day numbers, found by binary search in the index, and the lines are copied
+ * from the log in order of date without reading the rest of the log.
+ *
+ * @param indexPath The path of the index file.
+ * @param logPath The path of the log.
+ * @param fromDay The day number of the first day of the range.
+ * @param toDay The day number of the last day of the range.
+ * @param output The stream to write the lines to.
+ * @return 0 on success, 1 if the index or log could not be read, do not match, or the output could not be written.
+ */
+int queryDateIndex(char *indexPath, char *logPath, int fromDay, int toDay, FILE *output)
+{
+    size_t indexSize, logSize;
+    const struct indexHeader *header = mapFileReadOnly(indexPath, &indexSize);
+    const char *log;
+    const struct indexEntry *entries;
+    struct outputBuffer *out;
+    int failed;
+
+    if (header == NULL || indexSize < sizeof(struct indexHeader)
+        || memcmp(header->magic, INDEX_MAGIC, 4) != 0
+        || header->version != INDEX_VERSION
+        || header->byteOrder != TABLE_BYTE_ORDER
+        || header->blockEntries == 0
+        || header->blockCount != (header->entryCount + header->blockEntries - 1) / header->blockEntries
+        || header->entryOffset % 8 != 0
+        || header->entryOffset < sizeof(struct indexHeader) + header->blockCount * sizeof(int32_t)
+        || indexSize < header->entryOffset + header->entryCount * sizeof(struct indexEntry))
+    {
+        if (header != NULL)
+            unmapFile(header, indexSize);
+        fprintf(stderr, "%s %s\n", RED_TEXT "Not a valid date index:" RESET, indexPath);
+        return 1;
+    }
+
+    log = mapFileReadOnly(logPath, &logSize);
+    if (log == NULL || logSize != header->logSize)
+    {
+        if (log != NULL)
+            unmapFile(log, logSize);
+        unmapFile(header, indexSize);
+        fprintf(stderr, "%s %s\n", RED_TEXT "The index does not match the log; build it again for" RESET, logPath);
+        return 1;
+    }
+
+    out = malloc(sizeof(struct outputBuffer));
+    failed = out == NULL;
+    if (!failed)
+    {
+        entries = (const struct indexEntry *)((const char *)header + header->entryOffset);
+        out->file = output;
+        out->length = 0;
+
+        for (uint64_t i = findIndexEntry(header, fromDay); i < header->entryCount && entries[i].dayNumber <= toDay; i++)
+        {
+            if (entries[i].offset + entries[i].length > logSize)
+                break;
+            appendBytes(out, log + entries[i].offset, (int)entries[i].length);
+            appendBytes(out, "\n", 1);
+        }
+
+        flushOutput(out);
+        failed = ferror(output) != 0;
+    }
+
+    free(out);
+    unmapFile(log, logSize);
+    unmapFile(header, indexSize);
+    return failed;
+}
+
+/**
+ * The directory converter converts every file of a directory tree, each holding dates one per line,
+ * into a file of the same name in another tree, in the same form as --convert.
+ * DIRECTORY_PATH_SIZE is the longest path it handles, and DIRECTORY_READ_SIZE the first size of the buffer
+ * a file is read into, which grows for larger files.
+ */
+#define DIRECTORY_PATH_SIZE 4096
+#define DIRECTORY_READ_SIZE (1 << 16)
+
+/**
+ * A file list holds the paths of the files of a directory tree, relative to the root of the tree.
+ * The paths are stored one after the other in a single block of memory, so a tree of hundreds of thousands
+ * of files does not need an allocation for every file.
+ */
+struct fileList
+{
+    char *names; // The paths, each ending with a null character
+    size_t used; // The number of bytes of names in use
+    size_t capacity; // The size of names in bytes
+    size_t *offsets; // The start of each path in names
+    int count; // The number of paths
+    int slots; // The number of entries offsets can hold
+};
+
+/**
+ * This function adds a path to a file list.
+ *
+ * @param list Pointer to the file list.
+ * @param name The path to add.
+ * @return 0 on success, 1 if memory ran out.
+ */
+int addFileName(struct fileList *list, const char *name)
+{
+    size_t length = strlen(name) + 1;
+
+    if (list->used + length > list->capacity)
+    {
+        size_t capacity = list->capacity > 0 ? list->capacity * 2 : DIRECTORY_READ_SIZE;
+        char *grown;
+
+        while (capacity < list->used + length)
+            capacity *= 2;
+        grown = realloc(list->names, capacity);
+        if (grown == NULL)
+            return 1;
+        list->names = grown;
+        list->capacity = capacity;
+    }
+
+    if (list->count == list->slots)
+    {
+        int slots = list->slots > 0 ? list->slots * 2 : 1024;
+        size_t *grown = realloc(list->offsets, slots * sizeof(size_t));
+
+        if (grown == NULL)
+            return 1;
+        list->offsets = grown;
+        list->slots = slots;
+    }
+
+    memcpy(list->names + list->used, name, length);
+    list->offsets[list->count++] = list->used;
+    list->used += length;
+    return 0;
+}
+
+/**
+ * This function creates a directory, unless it exists already.
+ *
+ * @param path The path of the directory.
+ * @return 0 if the directory exists now, 1 if it could not be created.
+ */
+int makeDirectory(const char *path)
+{
+#ifdef _WIN32
+    return !CreateDirectoryA(path, NULL) && GetLastError() != ERROR_ALREADY_EXISTS;
+#else
+    return mkdir(path, 0777) != 0 && errno != EEXIST;
+#endif
+}
+
+/**
+ * This function lists the files of a directory and of all directories below it,
+ * and creates the same directories in the destination tree. Other kinds of entries, like symbolic links, are skipped.
+ *
+ * @param source The root of the source tree.
+ * @param destination The root of the destination tree.
+ * @param relative The path of the directory to list, relative to the roots, or "" for the roots themselves.
+ * @param list Pointer to the file list that receives the paths of the files, relative to the roots.
+ * @return 0 on success, 1 if a directory could not be read or created, which has been reported, or memory ran out.
+ */
+int listDirectory(const char *source, const char *destination, const char *relative, struct fileList *list)
+{
+    char path[DIRECTORY_PATH_SIZE], child[DIRECTORY_PATH_SIZE];
+    const char *separator = relative[0] != '\0' ? "/" : "";
+    int failed = 0;
+
+    snprintf(path, sizeof(path), "%s%s%s", destination, separator, relative);
+    if (makeDirectory(path) != 0)
+    {
+        fprintf(stderr, "%s %s\n", RED_TEXT "Could not create" RESET, path);
+        return 1;
+    }
+
+#ifdef _WIN32
+    WIN32_FIND_DATAA entry;
+    HANDLE search;
+
+    snprintf(path, sizeof(path), "%s/%s%s*", source, relative, separator);
+    search = FindFirstFileA(path, &entry);
+    if (search == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "%s %s%s%s\n", RED_TEXT "Could not read" RESET, source, separator, relative);
+        return 1;
+    }
+
+    do
+    {
+        if (strcmp(entry.cFileName, ".") == 0 || strcmp(entry.cFileName, "..") == 0
+            || (entry.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+            continue;
+
+        snprintf(child, sizeof(child), "%s%s%s", relative, separator, entry.cFileName);
+        if (entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            failed = listDirectory(source, destination, child, list);
+        else
+            failed = addFileName(list, child);
+    } while (!failed && FindNextFileA(search, &entry));
+
+    FindClose(search);
+#else
+    struct dirent *entry;
+    DIR *directory;
+
+    snprintf(path, sizeof(path), "%s%s%s", source, separator, relative);
+    directory = opendir(path);
+    if (directory == NULL)
+    {
+        fprintf(stderr, "%s %s\n", RED_TEXT "Could not read" RESET, path);
+        return 1;
+    }
+
+    while (!failed && (entry = readdir(directory)) != NULL)
+    {
+        int type = entry->d_type;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        snprintf(child, sizeof(child), "%s%s%s", relative, separator, entry->d_name);
+        if (type == DT_UNKNOWN)
+        {
+            // Some file systems do not report the type of an entry
+            struct stat status;
+
+            if (snprintf(path, sizeof(path), "%s/%s", source, child) >= (int)sizeof(path))
+                type = DT_UNKNOWN;
+            else
+                type = lstat(path, &status) != 0 ? DT_UNKNOWN
+                     : S_ISDIR(status.st_mode) ? DT_DIR : S_ISREG(status.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+
+        if (type == DT_DIR)
+            failed = listDirectory(source, destination, child, list);
+        else if (type == DT_REG)
+            failed = addFileName(list, child);
+    }
+
+    closedir(directory);
+#endif
+
+    return failed;
+}
+
+/**
+ * This function converts the dates of a file held in memory, one per line, and writes them to an output buffer
+ * in the same form as --convert.
+ *
+ * @param calendar The calendar of the dates.
+ * @param text The contents of the file, which must end with a newline unless it is empty.
+ * @param length The length of the contents in bytes.
+ * @param batch The batch used for the conversion, which can be reused for the next file.
+ * @param out Pointer to the output buffer.
+ * @return 0 on success, 1 if memory ran out.
+ */
+int convertTextBlock(int calendar, const char *text, size_t length, struct conversionBatch *batch,
+                     struct outputBuffer *out)
+{
+    if (length == 0)
+        return 0;
+
+    TRACE_START(parseStart);
+    if (parseConversionBatch(batch, text, length, calendar) != 0)
+        return 1;
+    TRACE_STOP("parse", parseStart);
+
+    TRACE_START(convertStart);
+    convertConversionBatch(batch, calendar);
+    TRACE_STOP("convert", convertStart);
+
+    TRACE_START(formatStart);
+    formatConversionBatch(batch, out);
+    TRACE_STOP("format", formatStart);
+    return 0;
+}
+
+/**
+ * This function makes sure a file read into memory ends with a newline, as convertTextBlock() needs.
+ * The buffer always has room for one more byte.
+ *
+ * @param data The contents of the file.
+ * @param length Pointer to the length of the contents, which grows by one if a newline is added.
+ */
+void endWithNewline(char *data, size_t *length)
+{
+    if (*length > 0 && data[*length - 1] != '\n')
+        data[(*length)++] = '\n';
+}
+
+/**
+ * The state shared by the threads of the directory converter when io_uring cannot be used.
+ * Every thread takes the next file from the list until none are left.
+ */
+struct directoryWorker
+{
+    struct fileList *files; // The files to convert
+    const char *source; // The root of the source tree
+    const char *destination; // The root of the destination tree
+    int calendar; // The calendar of the dates
+    _Atomic int *nextFile; // The index of the next file to convert, shared by all threads
+    int failures; // The number of files this thread could not convert
+    uint64_t bytes; // The number of bytes this thread read
+};
+
+/**
+ * This function converts files of the list with ordinary blocking calls until none are left.
+ * Each thread keeps its read buffer, batch and output buffer from one file to the next.
+ *
+ * @param argument Pointer to the directoryWorker of the thread.
+ * @return Always NULL.
+ */
+void *runDirectoryWorker(void *argument)
+{
+    struct directoryWorker *worker = argument;
+    struct conversionBatch batch = {0, 0, NULL, NULL, NULL, NULL, NULL};
+    struct outputBuffer *out = malloc(sizeof(struct outputBuffer));
+    size_t capacity = DIRECTORY_READ_SIZE;
+    char *data = malloc(capacity);
+    char sourcePath[DIRECTORY_PATH_SIZE], destinationPath[DIRECTORY_PATH_SIZE];
+    int index;
+
+    while ((index = atomic_fetch_add(worker->nextFile, 1)) < worker->files->count)
+    {
+        const char *name = worker->files->names + worker->files->offsets[index];
+        size_t length = 0, count;
+        FILE *input, *output;
+        int failed = out == NULL || data == NULL;
+        TRACE_START(fileStart);
+
+        snprintf(sourcePath, sizeof(sourcePath), "%s/%s", worker->source, name);
+        snprintf(destinationPath, sizeof(destinationPath), "%s/%s", worker->destination, name);
+
+        input = failed ? NULL : fopen(sourcePath, "rb");
+        if (input == NULL)
+            failed = 1;
+
+        // Read the whole file, keeping one byte free for a final newline
+        while (!failed && (count = fread(data + length, 1, capacity - 1 - length, input)) > 0)
+        {
+            length += count;
+            if (length == capacity - 1)
+            {
+                char *grown = realloc(data, capacity * 2);
+
+                if (grown == NULL)
+                    failed = 1;
+                else
+                {
+                    data = grown;
+                    capacity *= 2;
+                }
+            }
+        }
+        if (input != NULL)
+            failed = ferror(input) != 0 || fclose(input) != 0 || failed;
+
+        output = failed ? NULL : fopen(destinationPath, "wb");
+        if (output != NULL)
+        {
+            endWithNewline(data, &length);
+            out->file = output;
+            out->length = 0;
+            failed = convertTextBlock(worker->calendar, data, length, &batch, out) != 0;
+            flushOutput(out);
+            failed = ferror(output) != 0 || fclose(output) != 0 || failed;
+        }
+        else
+            failed = 1;
+
+        if (failed)
+        {
+            fprintf(stderr, "%s %s\n", RED_TEXT "Could not convert" RESET, sourcePath);
+            worker->failures++;
+        }
+        worker->bytes += length;
+        TRACE_STOP("file", fileStart);
+    }
+
+    free(batch.years);
+    free(batch.months);
+    free(batch.days);
+    free(batch.results);
+    free(batch.valid);
+    free(data);
+    free(out);
+    return NULL;
+}
+
+/**
+ * This function converts the files of a list with one thread per processor.
+ *
+ * @param files The files to convert.
+ * @param source The root of the source tree.
+ * @param destination The root of the destination tree.
+ * @param calendar The calendar of the dates.
+ * @param bytes Pointer to the variable that receives the number of bytes read.
+ * @return The number of files that could not be converted.
+ */
+int convertFilesWithThreads(struct fileList *files, const char *source, const char *destination, int calendar,
+                            uint64_t *bytes)
+{
+    struct directoryWorker workers[VERIFY_MAX_THREADS];
+    workerThread threads[VERIFY_MAX_THREADS];
+    _Atomic int nextFile = 0;
+    int threadCount = countProcessors(), started = 0, failures = 0;
+
+    if (threadCount > VERIFY_MAX_THREADS)
+        threadCount = VERIFY_MAX_THREADS;
+
+    for (int i = 0; i < threadCount; i++)
+    {
+        workers[i].files = files;
+        workers[i].source = source;
+        workers[i].destination = destination;
+        workers[i].calendar = calendar;
+        workers[i].nextFile = &nextFile;
+        workers[i].failures = 0;
+        workers[i].bytes = 0;
+    }
+
+    // Start the threads; the calling thread works too, as the last worker
+    for (int i = 0; i < threadCount - 1; i++)
+        if (startWorker(&threads[i], runDirectoryWorker, &workers[i]) == 0)
+            started = i + 1;
+        else
+            break;
+    runDirectoryWorker(&workers[threadCount - 1]);
+    for (int i = 0; i < started; i++)
+        joinWorker(threads[i]);
+
+    *bytes = 0;
+    for (int i = 0; i < threadCount; i++)
+    {
+        failures += workers[i].failures;
+        *bytes += workers[i].bytes;
+    }
+    return failures;
+}
+
+#ifdef CALENDAR_HAVE_IO_URING
+/**
+ * On Linux the directory converter uses io_uring, so that the opens, reads, writes and closes of many files
+ * are handed to the kernel together in one system call instead of one call each.
+ * Up to URING_FILES_IN_FLIGHT files are converted at the same time; each of them waits for one operation at a time,
+ * which moves it through the steps below. The dates of a file are converted as soon as it has been read.
+ * The ring is set up with the raw system calls, so no library is needed.
+ */
+#define URING_FILES_IN_FLIGHT 64
+
+#define URING_OPEN_SOURCE 0
+#define URING_READ 1
+#define URING_CLOSE_SOURCE 2
+#define URING_OPEN_DESTINATION 3
+#define URING_WRITE 4
+#define URING_CLOSE_DESTINATION 5
+
+/**
+ * The shared memory of an io_uring instance: the submission queue, where operations are added,
+ * and the completion queue, where the kernel reports their results.
+ */
+struct uring
+{
+    int fd; // The file descriptor of the ring
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing; // The mappings of the two queues
+    size_t sqRingSize, cqRingSize, sqesSize;
+    unsigned queued; // The number of operations added but not submitted yet
+};
+
+/**
+ * A file being converted through io_uring.
+ */
+struct uringFile
+{
+    int index; // The index of the file in the list, or -1 if the slot is free
+    int step; // The operation the file waits for: URING_OPEN_SOURCE to URING_CLOSE_DESTINATION
+    int fd; // The open file
+    char *data; // The contents of the file
+    size_t length; // The number of bytes read
+    size_t capacity; // The size of data
+    char *output; // The converted dates
+    size_t outputLength; // The length of output
+    size_t written; // The number of bytes of output written
+    int failed; // 1 once a step has failed
+    char sourcePath[DIRECTORY_PATH_SIZE];
+    char destinationPath[DIRECTORY_PATH_SIZE];
+};
+
+/**
+ * This function sets up an io_uring instance and checks that the kernel supports every operation the converter uses.
+ *
+ * @param ring Pointer to the ring to set up.
+ * @param entries The number of entries of the submission queue.
+ * @return 0 on success, 1 if io_uring cannot be used.
+ */
+int setupUring(struct uring *ring, unsigned entries)
+{
+    static const int operations[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE};
+    struct io_uring_params params;
+    struct io_uring_probe *probe;
+    int supported;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return 1;
+
+    // Ask the kernel which operations it supports
+    probe = calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+    supported = probe != NULL && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (int i = 0; supported && i < (int)(sizeof(operations) / sizeof(operations[0])); i++)
+        supported = operations[i] <= probe->last_op && (probe->ops[operations[i]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+
+    // Map the queues into memory
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (supported)
+    {
+        ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_SQ_RING);
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQES);
+        supported = ring->sqRing != MAP_FAILED && ring->cqRing != MAP_FAILED && ring->sqes != MAP_FAILED;
+    }
+
+    if (!supported)
+    {
+        if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED)
+            munmap(ring->sqRing, ring->sqRingSize);
+        if (ring->cqRing != NULL && ring->cqRing != MAP_FAILED)
+            munmap(ring->cqRing, ring->cqRingSize);
+        if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqesSize);
+        close(ring->fd);
+        return 1;
+    }
+
+    ring->sqHead = (unsigned *)((char *)ring->sqRing + params.sq_off.head);
+    ring->sqTail = (unsigned *)((char *)ring->sqRing + params.sq_off.tail);
+    ring->sqMask = (unsigned *)((char *)ring->sqRing + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)((char *)ring->sqRing + params.sq_off.array);
+    ring->cqHead = (unsigned *)((char *)ring->cqRing + params.cq_off.head);
+    ring->cqTail = (unsigned *)((char *)ring->cqRing + params.cq_off.tail);
+    ring->cqMask = (unsigned *)((char *)ring->cqRing + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cqRing + params.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * This function releases an io_uring instance.
+ *
+ * @param ring Pointer to the ring.
+ */
+void closeUring(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->cqRing, ring->cqRingSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+/**
+ * This function adds an operation to the submission queue. The queue is large enough for one operation
+ * of every file in flight, so it never runs full.
+ *
+ * @param ring Pointer to the ring.
+ * @param opcode The operation, such as IORING_OP_READ.
+ * @param fd The file descriptor the operation works on.
+ * @param address The buffer or path of the operation.
+ * @param length The length of the buffer, or the mode of a new file for IORING_OP_OPENAT.
+ * @param offset The position in the file.
+ * @param flags The flags of IORING_OP_OPENAT.
+ * @param slot The index of the file the operation belongs to, returned with its result.
+ */
+void queueUring(struct uring *ring, int opcode, int fd, const void *address, unsigned length, uint64_t offset,
+                int flags, int slot)
+{
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)address;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->open_flags = (uint32_t)flags;
+    sqe->user_data = (uint64_t)slot;
+
+    // Publish the entry before moving the tail, which the kernel reads
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+}
+
+/**
+ * This function moves a file to its next operation, or finishes it.
+ * It is called when the file starts and whenever its last operation completes, with the result of that operation.
+ *
+ * @param ring Pointer to the ring.
+ * @param files The files in flight.
+ * @param slot The index of the file in files.
+ * @param result The result of the last operation: a file descriptor or a number of bytes, or a negative error code.
+ * @param calendar The calendar of the dates.
+ * @param batch The batch used to convert the dates.
+ * @param out Pointer to the output buffer used to format the dates.
+ * @return 1 if the file is finished, 0 if it waits for another operation.
+ */
+int advanceUringFile(struct uring *ring, struct uringFile *files, int slot, int result, int calendar,
+                     struct conversionBatch *batch, struct outputBuffer *out)
+{
+    struct uringFile *file = &files[slot];
+
+    if (result < 0 && file->step != URING_CLOSE_SOURCE && file->step != URING_CLOSE_DESTINATION)
+    {
+        // Close the file that is open, if any, and give up
+        file->failed = 1;
+        if (file->step == URING_READ || file->step == URING_WRITE)
+        {
+            file->step = file->step == URING_READ ? URING_CLOSE_SOURCE : URING_CLOSE_DESTINATION;
+            queueUring(ring, IORING_OP_CLOSE, file->fd, NULL, 0, 0, 0, slot);
+            return 0;
+        }
+        return 1;
+    }
+
+    switch (file->step)
+    {
+        case URING_OPEN_SOURCE:
+            file->fd = result;
+            file->length = 0;
+            file->step = URING_READ;
+            break;
+
+        case URING_READ:
+            file->length += result;
+            if (result > 0)
+            {
+                // Read on until the end of the file, growing the buffer when it is full
+                if (file->length == file->capacity - 1)
+                {
+                    char *grown = realloc(file->data, file->capacity * 2);
+
+                    if (grown == NULL)
+                        return advanceUringFile(ring, files, slot, -ENOMEM, calendar, batch, out);
+                    file->data = grown;
+                    file->capacity *= 2;
+                }
+                break;
+            }
+            file->step = URING_CLOSE_SOURCE;
+            queueUring(ring, IORING_OP_CLOSE, file->fd, NULL, 0, 0, 0, slot);
+            return 0;
+
+        case URING_CLOSE_SOURCE:
+            if (file->failed)
+                return 1;
+
+            // Convert the dates into a block of memory; the "write" spans of this step time the flushes into it
+            {
+                TRACE_START(fileStart);
+                endWithNewline(file->data, &file->length);
+                out->file = open_memstream(&file->output, &file->outputLength);
+                out->length = 0;
+                if (out->file == NULL)
+                    file->failed = 1;
+                else
+                {
+                    file->failed = convertTextBlock(calendar, file->data, file->length, batch, out) != 0;
+                    flushOutput(out);
+                    fclose(out->file);
+                }
+                TRACE_STOP("file", fileStart);
+            }
+            if (file->failed)
+                return 1;
+
+            file->step = URING_OPEN_DESTINATION;
+            queueUring(ring, IORING_OP_OPENAT, AT_FDCWD, file->destinationPath, 0666, 0,
+                       O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, slot);
+            return 0;
+
+        case URING_OPEN_DESTINATION:
+            file->fd = result;
+            file->written = 0;
+            file->step = URING_WRITE;
+            break;
+
+        case URING_WRITE:
+            file->written += result;
+            break;
+
+        case URING_CLOSE_DESTINATION:
+            file->failed = file->failed || result < 0;
+            return 1;
+    }
+
+    if (file->step == URING_READ)
+        queueUring(ring, IORING_OP_READ, file->fd, file->data + file->length,
+                   (unsigned)(file->capacity - 1 - file->length), file->length, 0, slot);
+    else if (file->written < file->outputLength)
+        queueUring(ring, IORING_OP_WRITE, file->fd, file->output + file->written,
+                   (unsigned)(file->outputLength - file->written), file->written, 0, slot);
+    else
+    {
+        file->step = URING_CLOSE_DESTINATION;
+        queueUring(ring, IORING_OP_CLOSE, file->fd, NULL, 0, 0, 0, slot);
+    }
+    return 0;
+}
+
+/**
+ * This function converts the files of a list through io_uring.
+ *
+ * @param list The files to convert.
+ * @param source The root of the source tree.
+ * @param destination The root of the destination tree.
+ * @param calendar The calendar of the dates.
+ * @param bytes Pointer to the variable that receives the number of bytes read.
+ * @return The number of files that could not be converted, or -1 if io_uring cannot be used.
+ */
+int convertFilesWithUring(struct fileList *list, const char *source, const char *destination, int calendar,
+                          uint64_t *bytes)
+{
+    struct conversionBatch batch = {0, 0, NULL, NULL, NULL, NULL, NULL};
+    struct outputBuffer *out;
+    struct uringFile *files;
+    struct uring ring;
+    int nextFile = 0, active = 0, failures = 0, allocated;
+
+    if (setupUring(&ring, URING_FILES_IN_FLIGHT) != 0)
+        return -1;
+
+    out = malloc(sizeof(struct outputBuffer));
+    files = calloc(URING_FILES_IN_FLIGHT, sizeof(struct uringFile));
+    allocated = out != NULL && files != NULL;
+    for (int i = 0; files != NULL && i < URING_FILES_IN_FLIGHT; i++)
+    {
+        files[i].index = -1;
+        files[i].capacity = DIRECTORY_READ_SIZE;
+        files[i].data = malloc(DIRECTORY_READ_SIZE);
+        if (files[i].data == NULL)
+            allocated = 0;
+    }
+    if (!allocated)
+    {
+        failures = list->count;
+        nextFile = list->count;
+    }
+
+    *bytes = 0;
+    while (nextFile < list->count || active > 0)
+    {
+        unsigned head, tail;
+        long submitted;
+
+        // Start new files in the free slots
+        for (int slot = 0; slot < URING_FILES_IN_FLIGHT && nextFile < list->count; slot++)
+        {
+            if (files[slot].index >= 0)
+                continue;
+
+            const char *name = list->names + list->offsets[nextFile];
+            files[slot].index = nextFile++;
+            files[slot].step = URING_OPEN_SOURCE;
+            files[slot].failed = 0;
+            snprintf(files[slot].sourcePath, DIRECTORY_PATH_SIZE, "%s/%s", source, name);
+            snprintf(files[slot].destinationPath, DIRECTORY_PATH_SIZE, "%s/%s", destination, name);
+            queueUring(&ring, IORING_OP_OPENAT, AT_FDCWD, files[slot].sourcePath, 0, 0, O_RDONLY | O_CLOEXEC, slot);
+            active++;
+        }
+
+        // Submit the new operations and wait for at least one result. The kernel may take only some of them,
+        // and the rest stay in the submission queue for the next call
+        TRACE_START(submitStart);
+        submitted = syscall(__NR_io_uring_enter, ring.fd, ring.queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        TRACE_STOP("submit", submitStart);
+        if (submitted < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            fprintf(stderr, "%s\n", RED_TEXT "io_uring stopped working." RESET);
+            failures += list->count - nextFile + active;
+            break;
+        }
+        ring.queued -= (unsigned)submitted;
+
+        // Handle the results
+        TRACE_START(completeStart);
+        head = *ring.cqHead;
+        tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+            int slot = (int)cqe->user_data;
+
+            if (advanceUringFile(&ring, files, slot, cqe->res, calendar, &batch, out))
+            {
+                if (files[slot].failed)
+                {
+                    fprintf(stderr, "%s %s\n", RED_TEXT "Could not convert" RESET, files[slot].sourcePath);
+                    failures++;
+                }
+                *bytes += files[slot].length;
+                free(files[slot].output);
+                files[slot].output = NULL;
+                files[slot].outputLength = 0;
+                files[slot].index = -1;
+                active--;
+            }
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+        TRACE_STOP("complete", completeStart);
+    }
+
+    for (int i = 0; files != NULL && i < URING_FILES_IN_FLIGHT; i++)
+        free(files[i].data);
+    free(files);
+    free(out);
+    free(batch.years);
+    free(batch.months);
+    free(batch.days);
+    free(batch.results);
+    free(batch.valid);
+    closeUring(&ring);
+    return failures;
+}
+#endif
+
+/**
+ * This function converts every file of a directory tree, each holding dates one per line, into a file of the same name
+ * in another tree, in the same form as --convert. It uses io_uring where the kernel supports it and a thread
+ * per processor otherwise, and reports the number of files converted per second on the standard error stream.
+ *
+ * @param calendar The calendar of the dates.
+ * @param source The root of the source tree.
+ * @param destination The root of the destination tree, which is created if needed.
+ * @param useThreads 1 to use threads even when io_uring is available.
+ * @return 0 on success, 1 if any file could not be converted.
+ */
+int convertDirectory(int calendar, const char *source, const char *destination, int useThreads)
+{
+    struct fileList files = {NULL, 0, 0, NULL, 0, 0};
+    uint64_t start = readNanoseconds(), bytes = 0;
+    char *method = "threads";
+    int failures = -1;
+    double seconds;
+
+    if (listDirectory(source, destination, "", &files) != 0)
+    {
+        free(files.names);
+        free(files.offsets);
+        return 1;
+    }
+
+#ifdef CALENDAR_HAVE_IO_URING
+    if (!useThreads)
+    {
+        failures = convertFilesWithUring(&files, source, destination, calendar, &bytes);
+        method = "io_uring";
+    }
+#else
+    (void)useThreads;
+#endif
+    if (failures < 0)
+    {
+        failures = convertFilesWithThreads(&files, source, destination, calendar, &bytes);
+        method = "threads";
+    }
+
+    seconds = (double)(readNanoseconds() - start) / 1e9;
+    fprintf(stderr, "Converted %d files (%.1f MB) with %s in %.3f s: %.0f files/s.\n", files.count - failures,
+            (double)bytes / 1e6, method, seconds, seconds > 0 ? (files.count - failures) / seconds : 0.0);
+
+    free(files.names);
+    free(files.offsets);
+    return failures > 0;
+}
+
+/**
+ * The publisher writes Shamsi calendars of whole years as HTML tables or SVG pages.
+ * A calendar is written from six templates, one per section: the document, a year, a month,
+ * a week of a month, a day and an empty cell before the first or after the last day of a month.
+ * A template is plain text in which placeholders such as {{year}} are replaced; {{years}}, {{months}}, {{weeks}}
+ * and {{days}} are replaced by the next section repeated for every year, month, week or day of the week.
+ * Templates are split into tokens once, so filling them is a single pass over the tokens of every section.
+ */
+#define SECTION_DOCUMENT 0
+#define SECTION_YEAR 1
+#define SECTION_MONTH 2
+#define SECTION_WEEK 3
+#define SECTION_DAY 4
+#define SECTION_BLANK 5
+#define SECTION_COUNT 6
+
+char *sectionNames[] = {"document", "year", "month", "week", "day", "blank"};
+
+/**
+ * The placeholders of a template. The tokens of literal text have the kind TOKEN_TEXT.
+ * placeholderSections[] gives the only section in which each of the repeating placeholders may be used,
+ * or -1 for placeholders that may be used anywhere.
+ */
+#define TOKEN_TEXT -1
+#define PLACEHOLDER_FIRST 0
+#define PLACEHOLDER_LAST 1
+#define PLACEHOLDER_YEARS 2
+#define PLACEHOLDER_YEAR 3
+#define PLACEHOLDER_MONTHS 4
+#define PLACEHOLDER_MONTH 5
+#define PLACEHOLDER_NAME 6
+#define PLACEHOLDER_WEEKS 7
+#define PLACEHOLDER_DAYS 8
+#define PLACEHOLDER_DAY 9
+#define PLACEHOLDER_CLASS 10
+#define PLACEHOLDER_TITLE 11
+#define PLACEHOLDER_X 12
+#define PLACEHOLDER_Y 13
+#define PLACEHOLDER_COUNT 14
+
+char *placeholderNames[] = {"first", "last", "years", "year", "months", "month", "name",
+                            "weeks", "days", "day", "class", "title", "x", "y"};
+int placeholderSections[] = {-1, -1, SECTION_DOCUMENT, -1, SECTION_YEAR, -1, -1,
+                             SECTION_MONTH, SECTION_WEEK, -1, -1, -1, -1, -1};
+
+/**
+ * The built-in templates of each format. An HTML calendar is a single file holding every year;
+ * an SVG calendar is a page per year, so its year section is a whole SVG document and its document section is not used.
+ * In SVG pages, {{x}} and {{y}} are the position of a month on the page, and of a day within its month.
+ */
+char *htmlTemplates[] = {
+        "<!DOCTYPE html>\n"
+        "<html>\n"
+        "<head>\n"
+        "<meta charset=\"utf-8\">\n"
+        "<title>Shamsi Calendar {{first}} to {{last}}</title>\n"
+        "<style>\n"
+        "body { font-family: sans-serif; }\n"
+        ".year { page-break-after: always; }\n"
+        ".months { display: grid; grid-template-columns: repeat(3, max-content); gap: 24px; }\n"
+        "table { border-collapse: collapse; }\n"
+        "caption { font-weight: bold; padding: 4px; }\n"
+        "th { color: #888; }\n"
+        "th, td { width: 2.2em; padding: 2px; text-align: center; }\n"
+        "td.friday, td.holiday { color: #c00; }\n"
+        "</style>\n"
+        "</head>\n"
+        "<body>\n"
+        "{{years}}"
+        "</body>\n"
+        "</html>\n",
+
+        "<section class=\"year\">\n"
+        "<h1>{{year}}</h1>\n"
+        "<div class=\"months\">\n"
+        "{{months}}"
+        "</div>\n"
+        "</section>\n",
+
+        "<table class=\"month\">\n"
+        "<caption>{{name}} {{year}}</caption>\n"
+        "<tr><th>SH</th><th>YE</th><th>DO</th><th>SE</th><th>CH</th><th>PA</th><th>JO</th></tr>\n"
+        "{{weeks}}"
+        "</table>\n",
+
+        "<tr>{{days}}</tr>\n",
+
+        "<td class=\"{{class}}\" title=\"{{title}}\">{{day}}</td>",
+
+        "<td></td>"
+};
+
+char *svgTemplates[] = {
+        "",
+
+        "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"860\" height=\"1060\" font-family=\"sans-serif\">\n"
+        "<style>.friday, .holiday { fill: #c00; }</style>\n"
+        "<rect width=\"100%\" height=\"100%\" fill=\"white\"/>\n"
+        "<text x=\"430\" y=\"50\" font-size=\"32\" text-anchor=\"middle\">{{year}}</text>\n"
+        "{{months}}"
+        "</svg>\n",
+
+        "<g transform=\"translate({{x}},{{y}})\">\n"
+        "<text x=\"126\" y=\"0\" font-size=\"18\" text-anchor=\"middle\">{{name}}</text>\n"
+        "<text y=\"26\" font-size=\"12\" fill=\"#888\" text-anchor=\"middle\"><tspan x=\"18\">SH</tspan>"
+        "<tspan x=\"54\">YE</tspan><tspan x=\"90\">DO</tspan><tspan x=\"126\">SE</tspan><tspan x=\"162\">CH</tspan>"
+        "<tspan x=\"198\">PA</tspan><tspan x=\"234\">JO</tspan></text>\n"
+        "{{weeks}}"
+        "</g>\n",
+
+        "{{days}}",
+
+        "<text x=\"{{x}}\" y=\"{{y}}\" font-size=\"14\" text-anchor=\"middle\" class=\"{{class}}\">"
+        "<title>{{title}}</title>{{day}}</text>\n",
+
+        ""
+};
+
+/**
+ * A template split into tokens: runs of literal text and placeholders.
+ */
+#define TEMPLATE_MAX_TOKENS 256
+
+struct templateToken
+{
+    int kind; // TOKEN_TEXT or a PLACEHOLDER_ constant
+    const char *text; // The literal text
+    int length; // The length of the literal text
+};
+
+struct publishTemplate
+{
+    struct templateToken tokens[TEMPLATE_MAX_TOKENS];
+    int count; // The number of tokens
+};
+
+/**
+ * The layout of a Shamsi month, computed once for every month before the templates are filled.
+ */
+struct monthLayout
+{
+    int firstWeekday; // The day of the week of the first day, 0 for SHANBE up to 6 for JOOMEH
+    int length; // The number of days
+    signed char shamsiHolidays[32]; // The index in holidays[] of the Shamsi holiday of each day, or -1
+    signed char lunarHolidays[32]; // The index in holidays[] of the Lunar holiday of each day, or -1
+};
+
+/**
+ * The state of the publisher while it fills the templates: the templates, the layouts,
+ * and the year, month, week and day being written.
+ */
+struct publishContext
+{
+    struct publishTemplate templates[SECTION_COUNT];
+    struct monthLayout *layouts; // The layouts of the months of the years firstYear to lastYear
+    int firstYear, lastYear; // The years of the calendar
+    int year; // The year being written
+    int month; // The month being written
+    int row; // The week of the month being written, from 0
+    int column; // The day of the week being written, from 0
+    int day; // The day being written
+};
+
+/**
+ * This function splits the text of a template into tokens. The tokens point into the text, which must be kept.
+ * Unknown placeholders are kept as literal text.
+ *
+ * @param text The text of the template.
+ * @param length The length of the text.
+ * @param section The SECTION_ constant of the template.
+ * @param template Pointer to the template that receives the tokens.
+ * @return 0 on success, 1 if the template has too many tokens or uses a repeating placeholder in the wrong section,
+ *         which has been reported.
+ */
+int tokenizeTemplate(const char *text, int length, int section, struct publishTemplate *template)
+{
+    const char *end = text + length;
+    const char *literal = text;
+
+    template->count = 0;
+
+    while (text < end)
+    {
+        const char *open = memchr(text, '{', end - text);
+        const char *close;
+        int kind = TOKEN_TEXT;
+
+        if (open == NULL || open + 1 == end)
+            break;
+        if (open[1] != '{')
+        {
+            text = open + 1;
+            continue;
+        }
+
+        // Find the name of the placeholder
+        close = open + 2;
+        while (close + 1 < end && !(close[0] == '}' && close[1] == '}') && close - open < 16)
+            close++;
+        for (int i = 0; close + 1 < end && close[0] == '}' && close[1] == '}' && i < PLACEHOLDER_COUNT; i++)
+            if ((int)strlen(placeholderNames[i]) == close - open - 2
+                && memcmp(placeholderNames[i], open + 2, close - open - 2) == 0)
+                kind = i;
+
+        if (kind == TOKEN_TEXT)
+        {
+            text = open + 2;
+            continue;
+        }
+
+        if (placeholderSections[kind] >= 0 && placeholderSections[kind] != section)
+        {
+            fprintf(stderr, "%s {{%s}} %s %s.\n", RED_TEXT "Template error:" RESET, placeholderNames[kind],
+                    "can only be used in the section", sectionNames[placeholderSections[kind]]);
+            return 1;
+        }
+
+        if (template->count + 2 > TEMPLATE_MAX_TOKENS)
+        {
+            fprintf(stderr, "%s %s.\n", RED_TEXT "Template error: too many placeholders in the section" RESET,
+                    sectionNames[section]);
+            return 1;
+        }
+
+        // Keep the text before the placeholder, then the placeholder
+        if (open > literal)
+            template->tokens[template->count++] = (struct templateToken){TOKEN_TEXT, literal, (int)(open - literal)};
+        template->tokens[template->count++] = (struct templateToken){kind, NULL, 0};
+        text = literal = close + 2;
+    }
+
+    if (end > literal)
+    {
+        if (template->count + 1 > TEMPLATE_MAX_TOKENS)
+        {
+            fprintf(stderr, "%s %s.\n", RED_TEXT "Template error: too many placeholders in the section" RESET,
+                    sectionNames[section]);
+            return 1;
+        }
+        template->tokens[template->count++] = (struct templateToken){TOKEN_TEXT, literal, (int)(end - literal)};
+    }
+
+    return 0;
+}
+
+/**
+ * This function reads the templates of a calendar from a file, in place of the built-in templates of its format.
+ * Each section of the file starts with a line holding the name of the section in brackets, such as [month],
+ * and ends where the next one starts. Sections missing from the file keep their built-in template.
+ *
+ * @param text The contents of the file, which must be kept while the templates are used.
+ * @param length The length of the contents.
+ * @param sections The start of the text of every section, changed for the sections found.
+ * @param lengths The length of the text of every section, changed for the sections found.
+ * @return 0 on success, 1 if the file does not start with a section, which has been reported.
+ */
+int splitTemplateFile(const char *text, size_t length, const char **sections, int *lengths)
+{
+    const char *end = text + length;
+    int section = -1;
+
+    while (text < end)
+    {
+        const char *lineEnd = memchr(text, '\n', end - text);
+        const char *next = lineEnd != NULL ? lineEnd + 1 : end;
+        int found = -1;
+
+        if (lineEnd == NULL)
+            lineEnd = end;
+        if (lineEnd > text && lineEnd[-1] == '\r')
+            lineEnd--;
+
+        for (int i = 0; text[0] == '[' && lineEnd[-1] == ']' && i < SECTION_COUNT; i++)
+            if ((int)strlen(sectionNames[i]) == lineEnd - text - 2 && memcmp(sectionNames[i], text + 1, lineEnd - text - 2) == 0)
+                found = i;
+
+        if (found >= 0)
+        {
+            section = found;
+            sections[section] = next;
+            lengths[section] = 0;
+        }
+        else if (section < 0)
+        {
+            fprintf(stderr, "%s\n", RED_TEXT "Template error: the file must start with a section such as [month]." RESET);
+            return 1;
+        }
+        else
+            lengths[section] = (int)(next - sections[section]);
+
+        text = next;
+    }
+
+    return 0;
+}
+
+/**
+ * This function computes the layout of every month of the years of a calendar in a single walk over their days.
+ *
+ * @param layouts The layouts, twelve per year.
+ * @param firstYear The first year.
+ * @param lastYear The last year.
+ */
+void buildMonthLayouts(struct monthLayout *layouts, int firstYear, int lastYear)
+{
+    struct dayCursor cursor;
+
+    for (startDayCursor(&cursor, firstYear, 1, 1); cursor.sYear <= lastYear; advanceDayCursor(&cursor))
+    {
+        struct monthLayout *layout = &layouts[(cursor.sYear - firstYear) * 12 + cursor.sMonth - 1];
+
+        if (cursor.sDay == 1)
+        {
+            layout->firstWeekday = cursor.weekday;
+            layout->length = shamsiMonthLength(cursor.sYear, cursor.sMonth);
+        }
+
+        layout->shamsiHolidays[cursor.sDay] = (signed char)findHoliday(CALENDAR_SHAMSI, cursor.sMonth, cursor.sDay,
+                                                                        layout->length);
+        layout->lunarHolidays[cursor.sDay] = (signed char)findHoliday(CALENDAR_LUNAR, cursor.lMonth, cursor.lDay,
+                                                                       lunarMonthLength(cursor.lYear, cursor.lMonth));
+    }
+}
+
+/**
+ * This function appends text to an output buffer, escaping the characters that are special in HTML and SVG.
+ *
+ * @param out Pointer to the output buffer.
+ * @param text The text to append.
+ */
+void appendEscapedText(struct outputBuffer *out, const char *text)
+{
+    for (; *text != '\0'; text++)
+    {
+        if (*text == '&')
+            appendText(out, "&amp;");
+        else if (*text == '<')
+            appendText(out, "&lt;");
+        else if (*text == '>')
+            appendText(out, "&gt;");
+        else if (*text == '"')
+            appendText(out, "&quot;");
+        else if (*text == '\'')
+            appendText(out, "&#39;");
+        else
+            appendBytes(out, text, 1);
+    }
+}
+
+void fillTemplate(struct outputBuffer *out, struct publishContext *context, int section);
+
+/**
+ * This function writes the value of a placeholder to an output buffer.
+ *
+ * @param out Pointer to the output buffer.
+ * @param context Pointer to the state of the publisher.
+ * @param section The section the placeholder is used in.
+ * @param kind The PLACEHOLDER_ constant of the placeholder.
+ */
+void appendPlaceholder(struct outputBuffer *out, struct publishContext *context, int section, int kind)
+{
+    struct monthLayout *layout = &context->layouts[(context->year - context->firstYear) * 12 + context->month - 1];
+    int shamsiHoliday = layout->shamsiHolidays[context->day];
+    int lunarHoliday = layout->lunarHolidays[context->day];
+
+    switch (kind)
+    {
+        case PLACEHOLDER_FIRST:
+            appendLocalNumber(out, context->firstYear, 1);
+            break;
+
+        case PLACEHOLDER_LAST:
+            appendLocalNumber(out, context->lastYear, 1);
+            break;
+
+        case PLACEHOLDER_YEARS:
+            for (context->year = context->firstYear; context->year <= context->lastYear; context->year++)
+                fillTemplate(out, context, SECTION_YEAR);
+            context->year = context->firstYear;
+            break;
+
+        case PLACEHOLDER_YEAR:
+            appendLocalNumber(out, context->year, 1);
+            break;
+
+        case PLACEHOLDER_MONTHS:
+            for (context->month = 1; context->month <= 12; context->month++)
+                fillTemplate(out, context, SECTION_MONTH);
+            context->month = 1;
+            break;
+
+        case PLACEHOLDER_MONTH:
+            appendLocalNumber(out, context->month, 1);
+            break;
+
+        case PLACEHOLDER_NAME:
+            appendText(out, shamsiMonthNames[context->month]);
+            break;
+
+        case PLACEHOLDER_WEEKS:
+            for (context->row = 0; context->row * 7 < layout->firstWeekday + layout->length; context->row++)
+                fillTemplate(out, context, SECTION_WEEK);
+            context->row = 0;
+            break;
+
+        case PLACEHOLDER_DAYS:
+            for (context->column = 0; context->column < 7; context->column++)
+            {
+                context->day = context->row * 7 + context->column - layout->firstWeekday + 1;
+                if (context->day >= 1 && context->day <= layout->length)
+                    fillTemplate(out, context, SECTION_DAY);
+                else
+                {
+                    context->day = 0;
+                    fillTemplate(out, context, SECTION_BLANK);
+                }
+            }
+            context->column = 0;
+            context->day = 0;
+            break;
+
+        case PLACEHOLDER_DAY:
+            appendLocalNumber(out, context->day, 1);
+            break;
+
+        case PLACEHOLDER_CLASS:
+            appendText(out, "day");
+            if (context->column == 6)
+                appendText(out, " friday");
+            if (context->day > 0 && (shamsiHoliday >= 0 || lunarHoliday >= 0))
+                appendText(out, " holiday");
+            break;
+
+        case PLACEHOLDER_TITLE:
+            if (context->day > 0 && shamsiHoliday >= 0)
+                appendEscapedText(out, holidays[shamsiHoliday].name);
+            if (context->day > 0 && shamsiHoliday >= 0 && lunarHoliday >= 0)
+                appendText(out, ", ");
+            if (context->day > 0 && lunarHoliday >= 0)
+                appendEscapedText(out, holidays[lunarHoliday].name);
+            break;
+
+        case PLACEHOLDER_X:
+            // Months are laid out in three columns, and days in columns 36 units wide
+            appendNumber(out, section == SECTION_MONTH ? 20 + (context->month - 1) % 3 * 280 : context->column * 36 + 18, 1);
+            break;
+
+        case PLACEHOLDER_Y:
+            // Months are laid out in four rows, and weeks in rows 28 units high
+            appendNumber(out, section == SECTION_MONTH ? 100 + (context->month - 1) / 3 * 240 : 52 + context->row * 28, 1);
+            break;
+    }
+}
+
+/**
+ * This function fills the template of a section and writes it to an output buffer.
+ *
+ * @param out Pointer to the output buffer.
+ * @param context Pointer to the state of the publisher.
+ * @param section The SECTION_ constant of the template.
+ */
+void fillTemplate(struct outputBuffer *out, struct publishContext *context, int section)
+{
+    struct publishTemplate *template = &context->templates[section];
+
+    for (int i = 0; i < template->count; i++)
+    {
+        struct templateToken *token = &template->tokens[i];
+
+        if (token->kind == TOKEN_TEXT)
+            appendBytes(out, token->text, token->length);
+        else
+            appendPlaceholder(out, context, section, token->kind);
+    }
+}
+
+/**
+ * This function writes the Shamsi calendars of a range of years as HTML or SVG.
+ * An HTML calendar is written to a single file. An SVG calendar is written as one page per year,
+ * named after the year (such as 1403.svg) in a directory, which is created if needed.
+ *
+ * @param svg 1 for SVG pages, 0 for an HTML file.
+ * @param fromYear The first Shamsi year.
+ * @param toYear The last Shamsi year.
+ * @param path The HTML file, or the directory of the SVG pages.
+ * @param templatePath A file of templates replacing some or all of the built-in ones, or NULL.
+ * @return 0 on success, 1 if the templates could not be read or a file could not be written, which has been reported.
+ */
+int publishCalendar(int svg, int fromYear, int toYear, char *path, char *templatePath)
+{
+    char **builtIn = svg ? svgTemplates : htmlTemplates;
+    const char *sections[SECTION_COUNT];
+    int lengths[SECTION_COUNT];
+    struct publishContext *context = calloc(1, sizeof(struct publishContext));
+    struct outputBuffer *out = malloc(sizeof(struct outputBuffer));
+    char *templateText = NULL;
+    char pagePath[DIRECTORY_PATH_SIZE];
+    int failed = context == NULL || out == NULL;
+
+    for (int i = 0; i < SECTION_COUNT; i++)
+    {
+        sections[i] = builtIn[i];
+        lengths[i] = (int)strlen(builtIn[i]);
+    }
+
+    if (!failed && templatePath != NULL)
+    {
+        FILE *input = fopen(templatePath, "rb");
+        size_t size = 0;
+
+        templateText = input != NULL ? readWholeStream(input, &size) : NULL;
+        if (input != NULL)
+            fclose(input);
+        if (templateText == NULL)
+            fprintf(stderr, "%s %s\n", RED_TEXT "Could not read" RESET, templatePath);
+        failed = templateText == NULL || splitTemplateFile(templateText, size, sections, lengths) != 0;
+    }
+
+    // Split every template into tokens once
+    for (int i = 0; !failed && i < SECTION_COUNT; i++)
+        failed = tokenizeTemplate(sections[i], lengths[i], i, &context->templates[i]);
+
+    if (!failed)
+    {
+        context->layouts = calloc((toYear - fromYear + 1) * 12, sizeof(struct monthLayout));
+        failed = context->layouts == NULL;
+    }
+
+    if (!failed)
+    {
+        buildMonthLayouts(context->layouts, fromYear, toYear);
+        context->firstYear = context->year = fromYear;
+        context->lastYear = toYear;
+        context->month = 1;
+
+        if (svg && makeDirectory(path) != 0)
+        {
+            fprintf(stderr, "%s %s\n", RED_TEXT "Could not create" RESET, path);
+            failed = 1;
+        }
+
+        // Write the HTML file, or the SVG page of every year
+        for (int year = fromYear; !failed && year <= (svg ? toYear : fromYear); year++)
+        {
+            if (svg)
+                snprintf(pagePath, sizeof(pagePath), "%s/%d.svg", path, year);
+            else
+                snprintf(pagePath, sizeof(pagePath), "%s", path);
+
+            out->file = fopen(pagePath, "wb");
+            out->length = 0;
+            if (out->file != NULL)
+            {
+                context->year = year;
+                fillTemplate(out, context, svg ? SECTION_YEAR : SECTION_DOCUMENT);
+                flushOutput(out);
+                failed = ferror(out->file) != 0;
+                failed = fclose(out->file) != 0 || failed;
+            }
+            else
+                failed = 1;
+
+            if (failed)
+                fprintf(stderr, "%s %s\n", RED_TEXT "Could not write" RESET, pagePath);
+        }
+    }
+
+    if (context != NULL)
+        free(context->layouts);
+    free(context);
+    free(out);
+    free(templateText);
+    return failed;
+}
+
+/**
+ * This function reads the name of a calendar from a command-line argument.
+ *
+ * @param text The command-line argument: the name of a calendar in the registry (shamsi, gregorian, lunar or julian).
+ * @return The CALENDAR_ constant of the calendar, or -1 for an unknown name.
+ */
+int parseCalendarArgument(char *text)
+{
+    for (int calendar = 0; calendar < CALENDAR_COUNT; calendar++)
+        if (strcmp(text, calendarSystems[calendar].name) == 0)
+            return calendar;
+    return -1;
+}
+
+/**
+ * This function writes the final metrics dump when the program exits.
+ * It is registered with atexit() by the --metrics option.
+ */
+void dumpMetricsAtExit(void)
+{
+    if (metricsFormat != 0)
+        dumpMetrics(stderr);
+}
+
+/**
+ * This function finds the --metrics option among the command-line arguments, turns on the metrics
+ * and removes the option, so that the remaining arguments select the mode as usual.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments, changed in place.
+ * @return The number of remaining arguments, or -1 if the option is invalid.
+ */
+int parseMetricsOption(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--metrics") != 0)
+            continue;
+
+        if (i + 1 >= argc || (strcmp(argv[i + 1], "prometheus") != 0 && strcmp(argv[i + 1], "json") != 0))
+            return -1;
+
+        enableMetrics(strcmp(argv[i + 1], "prometheus") == 0 ? METRICS_PROMETHEUS : METRICS_JSON);
+        atexit(dumpMetricsAtExit);
+
+        // Remove the option and its value
+        for (int j = i; j + 2 <= argc; j++)
+            argv[j] = argv[j + 2];
+        return argc - 2;
+    }
+
+    return argc;
+}
+
+/**
+ * This function reads the --trace option, which can be given with any mode (including the menu),
+ * turns on tracing into the given file and removes the option from the arguments.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments, changed in place.
+ * @return The number of arguments left, or -1 if the option has no file.
+ */
+int parseTraceOption(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--trace") != 0)
+            continue;
+
+        if (i + 1 >= argc)
+            return -1;
+
+        tracePath = argv[i + 1];
+        traceStartNanoseconds = readNanoseconds();
+        atexit(writeTraceAtExit);
+
+        // Remove the option and its value
+        for (int j = i; j + 2 <= argc; j++)
+            argv[j] = argv[j + 2];
+        return argc - 2;
+    }
+
+    return argc;
+}
+
+/**
+ * The benchmark reads hardware performance counters where the system allows it, so that the time of a conversion
+ * can be explained: cycles and instructions, mispredicted branches and cache misses.
+ * On Linux they are read with perf_event_open(), counting only the user-space work of the calling thread.
+ * Each counter is opened on its own, so a counter the processor or the system does not offer (as in many virtual
+ * machines, or with a high kernel.perf_event_paranoid) is simply missing. Elsewhere no counter is available.
+ */
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_BRANCH_MISSES 2
+#define PERF_CACHE_MISSES 3
+#define PERF_COUNTER_COUNT 4
+
+char *perfCounterNames[] = {"cycles", "instructions", "branch-misses", "cache-misses"};
+
+struct perfCounters
+{
+    int fds[PERF_COUNTER_COUNT]; // The file descriptor of each counter, or -1 if it is not available
+    double values[PERF_COUNTER_COUNT]; // The counts of the last measurement
+    int available; // The number of counters available
+};
+
+/**
+ * This function opens the hardware counters of the calling thread. They start stopped.
+ *
+ * @param counters Pointer to the counters.
+ * @return The number of counters available, 0 if none can be read.
+ */
+int openPerfCounters(struct perfCounters *counters)
+{
+    counters->available = 0;
+
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+    {
+        counters->fds[i] = -1;
+        counters->values[i] = 0;
+
+#ifdef CALENDAR_HAVE_PERF_EVENTS
+        static const uint64_t configs[] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                           PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES};
+        struct perf_event_attr attributes;
+
+        memset(&attributes, 0, sizeof(attributes));
+        attributes.size = sizeof(attributes);
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.config = configs[i];
+        attributes.disabled = 1;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        // The times let the count be scaled if the kernel had to share the counter with other events
+        attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        counters->fds[i] = (int)syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0);
+        if (counters->fds[i] >= 0)
+            counters->available++;
+#endif
+    }
+
+    return counters->available;
+}
+
+/**
+ * This function resets and starts the hardware counters.
+ *
+ * @param counters Pointer to the counters.
+ */
+void startPerfCounters(struct perfCounters *counters)
+{
+#ifdef CALENDAR_HAVE_PERF_EVENTS
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+    {
+        if (counters->fds[i] < 0)
+            continue;
+        ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#else
+    (void)counters;
+#endif
+}
+
+/**
+ * This function stops the hardware counters and reads their counts into counters->values.
+ * A count is scaled up if the counter only ran for part of the time; a counter that cannot be read is set to -1.
+ *
+ * @param counters Pointer to the counters.
+ */
+void stopPerfCounters(struct perfCounters *counters)
+{
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+    {
+        counters->values[i] = -1;
+
+#ifdef CALENDAR_HAVE_PERF_EVENTS
+        uint64_t data[3]; // The count, the time enabled and the time running
+
+        if (counters->fds[i] < 0)
+            continue;
+        ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counters->fds[i], data, sizeof(data)) == (ssize_t)sizeof(data) && data[2] > 0)
+            counters->values[i] = (double)data[0] * ((double)data[1] / (double)data[2]);
+#endif
+    }
+}
+
+/**
+ * This function closes the hardware counters.
+ *
+ * @param counters Pointer to the counters.
+ */
+void closePerfCounters(struct perfCounters *counters)
+{
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+    {
+#ifdef CALENDAR_HAVE_PERF_EVENTS
+        if (counters->fds[i] >= 0)
+            close(counters->fds[i]);
+#endif
+        counters->fds[i] = -1;
+    }
+    counters->available = 0;
+}
+
+/**
+ * The operations of the benchmark of the conversion core, each timed with the core and with the full library.
+ */
+char *coreBenchmarkNames[] = {"shamsiToGregorian", "gregorianToShamsi", "gregorianToLunar", "convert line"};
+
+/**
+ * This function compares the speed of the conversion core of calendar_core.c with the full conversions,
+ * on the same dates as runBenchmark(), and prints the average time of one call of each.
+ * The core checks every date it converts, so its times include the checks that the library functions leave out;
+ * "convert line" reads, converts and writes a line of text as --convert does, in both.
+ *
+ * @param rounds The number of times every day is converted.
+ * @param shamsi The Shamsi dates, as year, month and day.
+ * @param gregorian The same dates in the Gregorian calendar.
+ * @param count The number of dates.
+ */
+void benchmarkCore(int rounds, int *shamsi, int *gregorian, int count)
+{
+    int rule = astronomicalCalendar ? CORE_ASTRONOMICAL : CORE_ARITHMETIC;
+    char *lines = malloc((size_t)count * 16);
+    int *lineStarts = malloc((count + 1) * sizeof(int));
+    struct outputBuffer *out = malloc(sizeof(struct outputBuffer));
+    char buffer[CORE_LINE_SIZE];
+    volatile int sink = 0;
+    int y, m, d;
+
+    if (lines == NULL || lineStarts == NULL || out == NULL)
+    {
+        free(lines);
+        free(lineStarts);
+        free(out);
+        return;
+    }
+
+    // Write the Shamsi dates as lines of text for "convert line"
+    lineStarts[0] = 0;
+    for (int i = 0; i < count; i++)
+        lineStarts[i + 1] = lineStarts[i] + sprintf(lines + lineStarts[i], "%d/%d/%d", shamsi[i * 3],
+                                                    shamsi[i * 3 + 1], shamsi[i * 3 + 2]);
+
+    printf("\n%-22s %12s %12s\n", "core operation", "library", "core");
+    for (int operation = 0; operation < 4; operation++)
+    {
+        double nanoseconds[2];
+
+        for (int useCore = 0; useCore < 2; useCore++)
+        {
+            uint64_t start = readNanoseconds();
+
+            for (int round = 0; round < rounds; round++)
+            {
+                for (int i = 0; i < count; i++)
+                {
+                    int *s = shamsi + i * 3, *g = gregorian + i * 3;
+
+                    if (operation == 0 && useCore)
+                        coreConvert(CORE_SHAMSI, CORE_GREGORIAN, rule, s[0], s[1], s[2], &y, &m, &d);
+                    else if (operation == 0)
+                        shamsiToGregorian(s[0], s[1], s[2], &y, &m, &d);
+                    else if (operation == 1 && useCore)
+                        coreConvert(CORE_GREGORIAN, CORE_SHAMSI, rule, g[0], g[1], g[2], &y, &m, &d);
+                    else if (operation == 1)
+                        gregorianToShamsi(g[0], g[1], g[2], &y, &m, &d);
+                    else if (operation == 2 && useCore)
+                        coreConvert(CORE_GREGORIAN, CORE_LUNAR, rule, g[0], g[1], g[2], &y, &m, &d);
+                    else if (operation == 2)
+                        gregorianToLunar(g[0], g[1], g[2], &y, &m, &d);
+                    else if (useCore)
+                        d = coreConvertLine(lines + lineStarts[i], lineStarts[i + 1] - lineStarts[i], CORE_SHAMSI,
+                                            rule, buffer);
+                    else
+                    {
+                        struct dayCursor date;
+
+                        // The steps of --convert for one line, without the batching
+                        out->length = 0;
+                        if (parseDateText(lines + lineStarts[i], lines + lineStarts[i + 1], &y, &m, &d)
+                            && convertDate(CALENDAR_SHAMSI, y, m, d, &date))
+                        {
+                            appendDate(out, date.sYear, date.sMonth, date.sDay);
+                            appendBytes(out, "\t", 1);
+                            appendDate(out, date.gYear, date.gMonth, date.gDay);
+                            appendBytes(out, "\t", 1);
+                            appendDate(out, date.lYear, date.lMonth, date.lDay);
+                            appendBytes(out, "\n", 1);
+                        }
+                        d = out->length;
+                    }
+                    sink += d;
+                }
+            }
+            nanoseconds[useCore] = (double)(readNanoseconds() - start) / ((double)rounds * count);
+        }
+
+        printf("%-22s %12.2f %12.2f\n", coreBenchmarkNames[operation], nanoseconds[0], nanoseconds[1]);
+    }
+
+    free(lines);
+    free(lineStarts);
+    free(out);
+}
+
+/**
+ * This function measures the average time of one call of each conversion function.
+ * Every function converts each day of the Shamsi years 1206 to 1498 a number of times,
+ * first with the metrics off and then with them on, so the cost of the metrics can be read from the difference.
+ * Where hardware counters are available, the run with the metrics off also reports the cycles, instructions,
+ * mispredicted branches and cache misses of one call, and IPC, the instructions per cycle.
+ * The conversion core is then measured on the same dates with benchmarkCore().
+ *
+ * @param rounds The number of times every day is converted.
+ */
+void runBenchmark(int rounds)
+{
+    struct dayCursor cursor;
+    struct perfCounters counters;
+    int count = 0, savedFormat = metricsFormat;
+    int dayTotal = shamsiToDayNumber(TABLE_LAST_YEAR + 1, 1, 1) - shamsiToDayNumber(TABLE_FIRST_YEAR, 1, 1);
+    int *shamsi = malloc(dayTotal * 3 * sizeof(int));
+    int *gregorian = malloc(dayTotal * 3 * sizeof(int));
+    volatile int sink = 0;
+    int y, m, d;
+
+    if (shamsi == NULL || gregorian == NULL)
+    {
+        free(shamsi);
+        free(gregorian);
+        return;
+    }
+
+    // Collect every day of the range in the Shamsi and Gregorian calendars
+    for (startDayCursor(&cursor, TABLE_FIRST_YEAR, 1, 1); cursor.sYear <= TABLE_LAST_YEAR; advanceDayCursor(&cursor))
+    {
+        shamsi[count * 3] = cursor.sYear;
+        shamsi[count * 3 + 1] = cursor.sMonth;
+        shamsi[count * 3 + 2] = cursor.sDay;
+        gregorian[count * 3] = cursor.gYear;
+        gregorian[count * 3 + 1] = cursor.gMonth;
+        gregorian[count * 3 + 2] = cursor.gDay;
+        count++;
+    }
+
+    if (savedFormat == 0)
+        enableMetrics(METRICS_JSON);
+
+    printf("%-22s %12s %12s %10s", "operation", "ns/op", "metrics on", "overhead");
+    if (openPerfCounters(&counters) > 0)
+    {
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+            printf(" %13s", perfCounterNames[i]);
+        printf(" %6s", "IPC");
+    }
+    printf("\n");
+
+    for (int operation = METRIC_SHAMSI_TO_GREGORIAN; operation <= METRIC_GREGORIAN_TO_LUNAR; operation++)
+    {
+        double nanoseconds[2];
+
+        for (int pass = 0; pass < 2; pass++)
+        {
+            int savedPassFormat = metricsFormat;
+            uint64_t start;
+
+            // The first pass runs with the metrics off
+            if (pass == 0)
+                metricsFormat = 0;
+
+            if (pass == 0)
+                startPerfCounters(&counters);
+            start = readNanoseconds();
+            for (int round = 0; round < rounds; round++)
+            {
+                for (int i = 0; i < count; i++)
+                {
+                    if (operation == METRIC_SHAMSI_TO_GREGORIAN)
+                        shamsiToGregorian(shamsi[i * 3], shamsi[i * 3 + 1], shamsi[i * 3 + 2], &y, &m, &d);
+                    else if (operation == METRIC_GREGORIAN_TO_SHAMSI)
+                        gregorianToShamsi(gregorian[i * 3], gregorian[i * 3 + 1], gregorian[i * 3 + 2], &y, &m, &d);
+                    else
+                        gregorianToLunar(gregorian[i * 3], gregorian[i * 3 + 1], gregorian[i * 3 + 2], &y, &m, &d);
+                    sink += d;
+                }
+            }
+            nanoseconds[pass] = (double)(readNanoseconds() - start) / ((double)rounds * count);
+            if (pass == 0)
+                stopPerfCounters(&counters);
+
+            metricsFormat = savedPassFormat;
+        }
+
+        printf("%-22s %12.2f %12.2f %10.2f", metricNames[operation],
+               nanoseconds[0], nanoseconds[1], nanoseconds[1] - nanoseconds[0]);
+        if (counters.available > 0)
+        {
+            double *values = counters.values;
+
+            // Show every count per call, or "-" for a counter that could not be read
+            for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+                if (values[i] >= 0)
+                    printf(" %13.3f", values[i] / ((double)rounds * count));
+                else
+                    printf(" %13s", "-");
+            if (values[PERF_CYCLES] > 0 && values[PERF_INSTRUCTIONS] >= 0)
+                printf(" %6.2f", values[PERF_INSTRUCTIONS] / values[PERF_CYCLES]);
+            else
+                printf(" %6s", "-");
+        }
+        printf("\n");
+    }
+
+    if (counters.available == 0)
+        fprintf(stderr, "Hardware counters are not available here (no PMU, or kernel.perf_event_paranoid "
+                        "does not allow them), so only times are shown.\n");
+
+    closePerfCounters(&counters);
+    metricsFormat = savedFormat;
+    benchmarkCore(rounds, shamsi, gregorian, count);
+    free(shamsi);
+    free(gregorian);
+}
+
+/**
+ * This function reads an integer from a command-line argument.
+ * Unlike atoi(), it rejects arguments that are empty or contain anything besides the number.
+ *
+ * @param text The command-line argument.
+ * @param value Pointer to store the number.
+ * @return 1 if the argument is a valid integer, 0 otherwise.
+ */
+int parseIntegerArgument(char *text, int *value)
+{
+    char *end;
+    long number = strtol(text, &end, 10);
+
+    if (end == text || *end != '\0')
+        return 0;
+
+    *value = (int)number;
+    return 1;
+}
+
+/**
+ * This function prints the usage of the command-line modes to the standard error stream.
+ */
+void printCommandLineUsage(void)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "  calendar_tool                              Start the interactive menu.\n");
+    fprintf(stderr, "  calendar_tool --ics FROM TO FILE [EVENTS]  Export Shamsi years FROM to TO as an iCalendar file.\n");
+    fprintf(stderr, "                                             EVENTS is --holidays, --months or both (default).\n");
+    fprintf(stderr, "  calendar_tool --publish html|svg FROM TO PATH [TEMPLATES]\n");
+    fprintf(stderr, "                                             Write Shamsi years FROM to TO as an HTML file PATH, or as\n");
+    fprintf(stderr, "                                             SVG pages in the directory PATH, one page per year.\n");
+    fprintf(stderr, "  calendar_tool --recur RULES FROM TO        List the occurrences of the rules in RULES between\n");
+    fprintf(stderr, "                                             the Shamsi dates FROM and TO (YEAR/MONTH/DAY).\n");
+    fprintf(stderr, "  calendar_tool --build-table FILE           Write the conversion table of years 1206 to 1498 to FILE.\n");
+    fprintf(stderr, "  calendar_tool --convert CALENDAR [--table FILE] [--columnar FILE [--delta]]\n");
+    fprintf(stderr, "                                             Convert dates (one per line) from the standard input.\n");
+    fprintf(stderr, "                                             CALENDAR is shamsi, gregorian, lunar or julian.\n");
+    fprintf(stderr, "  calendar_tool --convert-dir CALENDAR SOURCE DEST [--threads]\n");
+    fprintf(stderr, "                                             Convert every file below the directory SOURCE into a file\n");
+    fprintf(stderr, "                                             of the same name below DEST, with io_uring if available.\n");
+    fprintf(stderr, "  calendar_tool --read-columnar FILE         Print the dates of a columnar file as text.\n");
+    fprintf(stderr, "  calendar_tool --csv --columns LIST [FROM [TO]]\n");
+    fprintf(stderr, "                                             Convert the dates in the columns of LIST (such as 3,7) of a\n");
+    fprintf(stderr, "                                             CSV file read from the standard input from calendar FROM\n");
+    fprintf(stderr, "                                             (default gregorian) to calendar TO (default shamsi).\n");
+    fprintf(stderr, "  calendar_tool --jsonl --field NAME [CALENDAR]\n");
+    fprintf(stderr, "                                             Add the date of field NAME (Gregorian unless CALENDAR is\n");
+    fprintf(stderr, "                                             given) in the other calendars to every JSON object read\n");
+    fprintf(stderr, "                                             from the standard input, one object per line.\n");
+    fprintf(stderr, "  calendar_tool --epoch [--lunar]            Convert Unix times (one per line) from the standard input\n");
+    fprintf(stderr, "                                             to Shamsi dates and times in Asia/Tehran.\n");
+    fprintf(stderr, "  calendar_tool --bucket week|month|quarter|year\n");
+    fprintf(stderr, "                                             Sum timestamped values (\"EPOCH [VALUE]\" lines) from the\n");
+    fprintf(stderr, "                                             standard input by Shamsi week, month, quarter or fiscal year.\n");
+    fprintf(stderr, "  calendar_tool --ages CALENDAR [DATE]       Count birth dates (one per line) from the standard input by\n");
+    fprintf(stderr, "                                             age in years on DATE (default today), Shamsi month of birth\n");
+    fprintf(stderr, "                                             and day of the week of birth.\n");
+    fprintf(stderr, "  calendar_tool --verify [FIRST LAST]        Check that the conversion functions agree on every day\n");
+    fprintf(stderr, "                                             of the Shamsi years FIRST to LAST (default 1 to 3000).\n");
+    fprintf(stderr, "  calendar_tool --nowruz FROM TO             List the March equinox in Tehran time and the astronomical\n");
+    fprintf(stderr, "                                             Nowruz of the Shamsi years FROM to TO (1 to 3000).\n");
+    fprintf(stderr, "  calendar_tool --core-tables                Print the astronomical tables of calendar_core.c as C source.\n");
+    fprintf(stderr, "  calendar_tool --name-table                 Print the hash table of month and weekday names as C source.\n");
+    fprintf(stderr, "  calendar_tool --sort CALENDAR [FILE]       Sort lines by the date at their start, in order of time.\n");
+    fprintf(stderr, "                                             A date may start with S:, G:, L: or J: to give its calendar.\n");
+    fprintf(stderr, "  calendar_tool --build-index LOG INDEX [CALENDAR]\n");
+    fprintf(stderr, "                                             Index the lines of LOG by the date at their start\n");
+    fprintf(stderr, "                                             (Gregorian unless CALENDAR is given).\n");
+    fprintf(stderr, "  calendar_tool --query INDEX LOG CALENDAR FROM [TO]\n");
+    fprintf(stderr, "                                             Print the lines of LOG dated FROM to TO (YEAR/MONTH/DAY,\n");
+    fprintf(stderr, "                                             or YEAR/MONTH for a whole month) in CALENDAR.\n");
+    fprintf(stderr, "  calendar_tool --bench [ROUNDS]             Measure the conversion functions.\n");
+    fprintf(stderr, "Any mode, including the menu, also accepts --metrics prometheus|json to write metrics\n");
+    fprintf(stderr, "to the standard error stream at exit and whenever the process receives SIGUSR1,\n");
+    fprintf(stderr, "--trace FILE to write a Chrome trace of the stages of the batch modes to FILE at exit,\n");
+    fprintf(stderr, "--lunar-overrides FILE to use the observed Lunar month starts listed in FILE,\n");
+    fprintf(stderr, "--astronomical to start every Shamsi year at the astronomical Nowruz (the March equinox),\n");
+    fprintf(stderr, "and --persian to write dates, times and the calendar in Persian digits and month names.\n");
+}
+
+/**
+ * This function runs the program in command-line mode, without the interactive menu.
+ * It is called by main() when the program is started with arguments,
+ * and selects the mode from the first argument.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments.
+ * @return The exit status of the program: 0 on success, 1 on failure.
+ */
+int runCommandLine(int argc, char *argv[])
+{
+    if (strcmp(argv[1], "--ics") == 0)
+    {
+        int fromYear, toYear;
+        int events = 0;
+
+        if (argc < 5 || !parseIntegerArgument(argv[2], &fromYear) || !parseIntegerArgument(argv[3], &toYear))
+        {
+            printCommandLineUsage();
+            return 1;
+        }
+
+        if (fromYear < 1206 || toYear > 1498 || fromYear > toYear)
+        {
+            fprintf(stderr, "%s\n", RED_TEXT "Invalid range! Years must be between 1206 and 1498." RESET);
+            return 1;
+        }
+
+        // Select the events to export
+        for (int i = 5; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--holidays") == 0)
+                events |= ICS_HOLIDAYS;
+            else if (strcmp(argv[i], "--months") == 0)
+                events |= ICS_MONTH_STARTS;
+            else
+            {
+                printCommandLineUsage();
+                return 1;
+            }
+        }
+
+        if (events == 0)
+            events = ICS_HOLIDAYS | ICS_MONTH_STARTS;
+
+        if (exportICS(fromYear, toYear, events, argv[4]) != 0)
+        {
+            fprintf(stderr, "%s %s\n", RED_TEXT "Could not write" RESET, argv[4]);
+            return 1;
+        }
+
+        return 0;
+    }
+
+    if (strcmp(argv[1], "--publish") == 0)
+    {
+        int svg = argc >= 6 && strcmp(argv[2], "svg") == 0;
+        int fromYear, toYear;
+
+        if (argc < 6 || argc > 7 || (!svg && strcmp(argv[2], "html") != 0)
+            || !parseIntegerArgument(argv[3], &fromYear) || !parseIntegerArgument(argv[4], &toYear))
+        {
+            printCommandLineUsage();
+            return 1;
+        }
+
+        if (fromYear < 1206 || toYear > 1498 || fromYear > toYear)
+        {
+            fprintf(stderr, "%s\n", RED_TEXT "Invalid range! Years must be between 1206 and 1498." RESET);
+            return 1;
+        }
+
+        return publishCalendar(svg, fromYear, toYear, argv[5], argc == 7 ? argv[6] : NULL);
+    }
+
+    if (strcmp(argv[1], "--recur") == 0)
+    {
+        struct recurrenceRule *rules;
+        struct outputBuffer *out;
+        int count;
+        int fromYear, fromMonth, fromDay, toYear, toMonth, toDay;
+
+        if (argc != 5 || !parseDateArgument(argv[3], &fromYear, &fromMonth, &fromDay)
+            || !parseDateArgument(argv[4], &toYear, &toMonth, &toDay))
+        {
+            printCommandLineUsage();
+            return 1;
+        }
+
+        rules = readRecurrenceRules(argv[2], &count);
+        out = malloc(sizeof(struct outputBuffer));
+        if (rules == NULL || out == NULL)
+        {
+            fprintf(stderr, "%s %s\n", RED_TEXT "Could not read" RESET, argv[2]);
+            free(rules);
+            free(out);
+            return 1;
+        }
+
+        out->file = stdout;
+        out->length = 0;
+        expandRecurrences(rules, count, shamsiToDayNumber(fromYear, fromMonth, fromDay),
+                          shamsiToDayNumber(toYear, toMonth, toDay), out);
+        flushOutput(out);
+
+        free(rules);
+        free(out);
+        return 0;
+    }
+
+    if (strcmp(argv[1], "--build-table") == 0)
+    {
+        if (argc != 3)
+        {
+            printCommandLineUsage();
+            return 1;
+        }
+
+        if (writeConversionTable(argv[2]) != 0)
+        {
+            fprintf(stderr, "%s %s\n", RED_TEXT "Could not write" RESET, argv[2]);
+            return 1;
+        }
+
+        return 0;
+    }
+
+    if (strcmp(argv[1], "--convert") == 0)
+    {
+        int calendar = argc >= 3 ? parseCalendarArgument(argv[2]) : -1;
+        int format = FORMAT_TEXT;
+        char *tablePath = NULL, *columnarPath = NULL;
+        FILE *output = stdout;
+        int failed;
+
+        // Read the options of the batch converter
+        for (int i = 3; i < argc && calendar >= 0; i++)
+        {
+            if (strcmp(argv[i], "--table") == 0 && i + 1 < argc)
+                tablePath = argv[++i];
+            else if (strcmp(argv[i], "--columnar") == 0 && i + 1 < argc)
+                columnarPath = argv[++i];
+            else if (strcmp(argv[i], "--delta") == 0)
+                format = FORMAT_DELTA;
+            else
+                calendar = -1;
+        }
+
+        if (calendar < 0 || (format == FORMAT_DELTA && columnarPath == NULL))
+        {
+            printCommandLineUsage();
+            return 1;
+        }
+
+        if (tablePath != NULL && loadConversionTable(tablePath) != 0)
+        {
+            fprintf(stderr, "%s %s\n", RED_TEXT "Not a valid conversion table:" RESET, tablePath);
+            return 1;
+        }
+
+        if (columnarPath != NULL)
+        {
+            if (format == FORMAT_TEXT)
+                format = FORMAT_PACKED;
+
+            output = fopen(columnarPath, "wb");
+            if (output == NULL)
+            {
+                fprintf(stderr, "%s %s\n", RED_TEXT "Could not write" RESET, columnarPath);
+                return 1;
+            }
+        }
+
+        failed = convertStream(calendar, stdin, output, format);
+        if (output != stdout)
+            failed = fclose(output) != 0 || failed;
+
+        return failed;
+    }
+
+    if (strcmp(argv[1], "--jsonl") == 0)
     {
-        age_months--;
-        age_days += days_in_shamsi_month[current_month];
+        int calendar = argc == 5 ? parseCalendarArgument(argv[4]) : CALENDAR_GREGORIAN;
+
+        if (argc < 4 || argc > 5 || strcmp(argv[2], "--field") != 0 || argv[3][0] == '\0' || calendar < 0)
+        {
+            printCommandLineUsage();
+            return 1;
+        }
+
+        return convertJsonLines(argv[3], calendar, stdin, stdout);
     }
 
-    // Adjust the age if the current month is earlier than the birth month
-    if (age_months < 0)
+    if (strcmp(argv[1], "--csv") == 0)
     {
-        age_years--;
-        age_months += 12;
-    }
+        unsigned char selected[CSV_MAX_COLUMNS];
+        int lastColumn = argc >= 4 && strcmp(argv[2], "--columns") == 0 ? parseColumnList(argv[3], selected) : 0;
+        int from = argc >= 5 ? parseCalendarArgument(argv[4]) : CALENDAR_GREGORIAN;
+        int to = argc >= 6 ? parseCalendarArgument(argv[5]) : CALENDAR_SHAMSI;
 
-    // Determine the day of the week for the birthdate
-    int birthdate_daycode = determineDaycode(birth_year, birth_month);
-    int day_of_week_index = (birthdate_daycode + birth_day - 1) % 7;
+        if (argc > 6 || lastColumn == 0 || from < 0 || to < 0)
+        {
+            printCommandLineUsage();
+            return 1;
+        }
 
-    // Error handling for invalid birth year
-    if (age_years < 0)
+        return convertCsvStream(selected, lastColumn, from, to, stdin, stdout);
+    }
+
+    if (strcmp(argv[1], "--convert-dir") == 0)
     {
-        clearScreen();
-        printf("\n%s.\n\n", RED_TEXT "Invalid year! Please enter a year between 1 and 1402" RESET);
-        return;
+        int calendar = argc >= 5 ? parseCalendarArgument(argv[2]) : -1;
+        int useThreads = argc == 6 && strcmp(argv[5], "--threads") == 0;
+
+        if (calendar < 0 || argc > 6 || (argc == 6 && !useThreads))
+        {
+            printCommandLineUsage();
+            return 1;
+        }
+
+        return convertDirectory(calendar, argv[3], argv[4], useThreads);
     }
 
-    // Arrays for storing the names of days of the week in both Shamsi and Gregorian calendars
-    char *days_of_week_shamsi[] = {"SHANBE", "YEKSHANBE", "DOSHANBE", "SESHANBE", "CHAHARSHANBE", "PANJESHANBE", "JOOMEH"};
-    char *days_of_week_gregorian[] = {"SATURDAY", "SUNDAY", "MONDAY", "TUESDAY", "WEDNESDAY", "THURSDAY", "FRIDAY"};
+    if (strcmp(argv[1], "--read-columnar") == 0)
+    {
+        if (argc != 3)
+        {
+            printCommandLineUsage();
+            return 1;
+        }
 
-    // Convert the birthdate from Shamsi to Gregorian calendar
-    int gYear, gMonth, gDay;
-    shamsiToGregorian(birth_year, birth_month, birth_day, &gYear, &gMonth, &gDay);
+        if (readColumnarFile(argv[2], stdout) != 0)
+        {
+            fprintf(stderr, "%s %s\n", RED_TEXT "Not a valid columnar file:" RESET, argv[2]);
+            return 1;
+        }
 
-    birth_year = gYear;
-    birth_month = gMonth;
-    birth_day = gDay;
+        return 0;
+    }
 
-    // Calculate the time lived in seconds and days since birth
-    time_t birth_time = mktime(&(struct tm){0, 0, 0, birth_day, birth_month - 1, birth_year - 1900});
-    time_t current_time = mktime(&current_date);
+    if (strcmp(argv[1], "--epoch") == 0)
+    {
+        if (argc > 3 || (argc == 3 && strcmp(argv[2], "--lunar") != 0))
+        {
+            printCommandLineUsage();
+            return 1;
+        }
 
-    int seconds_lived = difftime(current_time, birth_time);
-    int days_lived = seconds_lived / (60 * 60 * 24);
+        return convertEpochStream(stdin, stdout, argc == 3);
+    }
 
-    // Print the age result and other information
-    printf("\n%s\n Your Age: %s%d years, %d months, %d days%s\n",
-           BLACK_TEXT WHITE_BACKGROUND "                  Age Result                  \n" RESET,
-           ITALIC GRAY_TEXT, age_years, age_months, age_days, RESET);
-    printf("\n You were born on %s%s%s\n", ITALIC, GRAY_TEXT, days_of_week_shamsi[day_of_week_index]);
-    printf("%s", RESET);
-    printf("\n Number of days passed since your birth: %s%s%d%s\n", ITALIC, GRAY_TEXT, days_lived, RESET);
-    printf("\n Gregorian birth date: %s%d/%02d/%02d",
-           ITALIC GRAY_TEXT,
-           gYear, gMonth, gDay);
-    printf(" [%s%s%s]\n", ITALIC, GRAY_TEXT, days_of_week_gregorian[day_of_week_index]);
-    printf("\n%s\n\n", BLACK_TEXT WHITE_BACKGROUND "----------------------------------------------" RESET);
-}
+    if (strcmp(argv[1], "--bucket") == 0)
+    {
+        for (int kind = BUCKET_WEEK; argc == 3 && kind <= BUCKET_YEAR; kind++)
+            if (strcmp(argv[2], bucketNames[kind]) == 0)
+                return aggregateBuckets(kind, stdin, stdout);
 
-/**
- * This function allows the user to enter their birth year, month, and day to calculate their age.
- * It uses a do-while loop to repeatedly prompt the user
- for input until a valid date is entered or the user chooses to exit.
- * The function clears the screen and displays the age menu before prompting for input.
- * It validates the user's input to ensure they enter valid integers for the birth year, month, and day.
- * If the user enters an invalid input, an error message is displayed and the user is prompted to try again.
- * If the user enters a birth year, month, or day of 0, the function returns 0, indicating the user has chosen to exit.
- * After the user enters a valid date, the function calls the calculateAge()
- function to calculate the age based on the birth date.
- * Once the age is calculated, the function prompts the user to press Enter
- to continue and waits for the user to press Enter.
- * The do-while loop continues until the user chooses to exit.
- *
- * @return The age of the user, or 0 if the user chooses to exit.
- */
-int age(void)
-{
-    int birth_year, birth_month, birth_day;
+        printCommandLineUsage();
+        return 1;
+    }
 
-    // Start a loop that continues until a valid input is received
-    do
+    if (strcmp(argv[1], "--ages") == 0)
     {
-        // Clear the console screen
-        clearScreen();
-        // Display the age menu
-        ageMenu();
+        int calendar = argc == 3 || argc == 4 ? parseCalendarArgument(argv[2]) : -1;
+        int year, month, day, referenceDay;
 
-        // Prompt the user to enter the birth year
-        printf("\nPlease enter the birth year: ");
+        if (argc == 4)
+            referenceDay = calendar >= 0 && parseDateArgument(argv[3], &year, &month, &day)
+                         ? dateToDayNumber(calendar, year, month, day) : -1;
+        else
+        {
+            // Measure ages today unless a reference date is given
+            struct tm today = getCurrentDateAndTime();
+            referenceDay = gregorianToDayNumber(today.tm_year + 1900, today.tm_mon + 1, today.tm_mday);
+        }
 
-        // Check if the input is a valid integer
-        if (scanf("%d", &birth_year) != 1)
+        if (calendar < 0 || referenceDay < 0)
         {
-            // Display an error message for invalid input
-            printf("\n%s.\n", RED_TEXT "Invalid input! Please enter a valid integer." RESET);
-            printf("Press Enter to try again...");
-            clearInputBuffer();
-            getchar();
-            clearScreen();
-            // Restart the loop to get a valid input
-            continue;
+            printCommandLineUsage();
+            return 1;
         }
 
-        // If the birth year is 0, exit the function and return 0
-        if (birth_year == 0)
+        return aggregateAges(calendar, referenceDay, stdin, stdout);
+    }
+
+    if (strcmp(argv[1], "--verify") == 0)
+    {
+        int firstYear = 1, lastYear = 3000;
+
+        if ((argc != 2 && argc != 4)
+            || (argc == 4 && (!parseIntegerArgument(argv[2], &firstYear) || !parseIntegerArgument(argv[3], &lastYear)))
+            || firstYear < 1 || lastYear < firstYear || lastYear > 100000)
         {
-            return 0;
+            printCommandLineUsage();
+            return 1;
         }
 
-        // If the birth year is less than 1, display an error message
-        if (birth_year < 1)
+        int failed = verifyRoundTrips(firstYear, lastYear) != 0;
+        failed = checkKnownNowruzDates() != 0 || failed;
+        failed = checkNameTable() != 0 || failed;
+        return failed;
+    }
+
+    if (strcmp(argv[1], "--nowruz") == 0)
+    {
+        int firstYear, lastYear;
+
+        if (argc != 4 || !parseIntegerArgument(argv[2], &firstYear) || !parseIntegerArgument(argv[3], &lastYear)
+            || firstYear < NOWRUZ_FIRST_YEAR || lastYear < firstYear || lastYear > NOWRUZ_LAST_YEAR)
         {
-            printf("\n%s.\n", RED_TEXT "Invalid year! Please enter a positive year." RESET);
-            printf("Press Enter to try again...");
-            clearInputBuffer();
-            getchar();
-            clearScreen();
-            // Restart the loop to get a valid input
-            continue;
+            printCommandLineUsage();
+            return 1;
         }
 
-        // Prompt the user to enter the birth month
-        printf("Please enter a month: ");
+        return listNowruz(firstYear, lastYear, stdout);
+    }
 
-        // Check if the input is a valid integer
-        if (scanf("%d", &birth_month) != 1)
+    if (strcmp(argv[1], "--name-table") == 0)
+    {
+        if (argc != 2)
         {
-            // Display an error message for invalid input
-            printf("\n%s.\n", RED_TEXT "Invalid input! Please enter a valid integer." RESET);
-            printf("Press Enter to try again...");
-            clearInputBuffer();
-            getchar();
-            clearScreen();
-            // Restart the loop to get a valid input
-            continue;
+            printCommandLineUsage();
+            return 1;
         }
 
-        // If the birth month is 0, exit the function and return 0
-        if (birth_month == 0)
+        return writeNameTable(stdout);
+    }
+
+    if (strcmp(argv[1], "--core-tables") == 0)
+    {
+        if (argc != 2)
         {
-            return 0;
+            printCommandLineUsage();
+            return 1;
         }
 
-        // If the birth month is not between 1 and 12, display an error message
-        if (birth_month < 1 || birth_month > 12)
+        return writeCoreTables(stdout);
+    }
+
+    if (strcmp(argv[1], "--sort") == 0)
+    {
+        int calendar = argc >= 3 ? parseCalendarArgument(argv[2]) : -1;
+
+        if (calendar < 0 || argc > 4)
         {
-            printf("\n%s.\n", RED_TEXT "Invalid month! Please enter a month between 1 and 12" RESET);
-            printf("\nPress Enter to try again...");
-            clearInputBuffer();
-            getchar();
-            clearScreen();
-            // Restart the loop to get a valid input
-            continue;
+            printCommandLineUsage();
+            return 1;
         }
 
-        // Prompt the user to enter the birthday
-        printf("Please enter a day: ");
+        return sortDateLines(calendar, argc == 4 ? argv[3] : NULL, stdout);
+    }
 
-        // Check if the input is a valid integer
-        if (scanf("%d", &birth_day) != 1)
+    if (strcmp(argv[1], "--build-index") == 0)
+    {
+        int calendar = argc == 5 ? parseCalendarArgument(argv[4]) : CALENDAR_GREGORIAN;
+
+        if ((argc != 4 && argc != 5) || calendar < 0)
         {
-            // Display an error message for invalid input
-            printf("\n%s.\n", RED_TEXT "Invalid input! Please enter a valid integer." RESET);
-            printf("Press Enter to try again...");
-            clearInputBuffer();
-            getchar();
-            clearScreen();
-            // Restart the loop to get a valid input
-            continue;
+            printCommandLineUsage();
+            return 1;
         }
 
-        // If the birthday is 0, exit the function and return 0
-        if (birth_day == 0)
+        if (writeDateIndex(argv[2], argv[3], calendar) != 0)
         {
-            return 0;
+            fprintf(stderr, "%s %s\n", RED_TEXT "Could not index" RESET, argv[2]);
+            return 1;
         }
 
-        // Calculate the age based on the provided birth year, month, and day
-        calculateAge(birth_year, birth_month, birth_day);
+        return 0;
+    }
 
-        // Prompt the user to press Enter to continue
-        printf("Press Enter to continue...");
-        clearInputBuffer();
-        getchar();
+    if (strcmp(argv[1], "--query") == 0)
+    {
+        int calendar = argc >= 5 ? parseCalendarArgument(argv[4]) : -1;
+        int fromDay, toDay;
 
-    } while (1); // Loop indefinitely until a valid input is obtained
-}
+        if ((argc != 6 && argc != 7) || calendar < 0)
+        {
+            printCommandLineUsage();
+            return 1;
+        }
 
-/**
- * This function displays the current date in three different calendars: Shamsi, Gregorian, and Lunar.
- * It retrieves the current date and time using the getCurrentDateAndTime() function, which returns a struct tm object.
- * It then extracts the year, month, and day
- * from the struct tm object representing the current date in the Gregorian calendar.
- * The function calls the gregorianToShamsi() function to convert the Gregorian date to the Shamsi date,
- * storing the result in the variables current_year, current_month, and current_day.
- * The function also calls the gregorianToLunar() function to convert the Gregorian date to the Lunar date,
- * storing the result in the variables lYear, lMonth, and lDay.
- * Finally, the function prints the current dates in the Shamsi, Gregorian, and Lunar calendars using printf statements.
- * It also prompts the user to press Enter to go back to the menu and waits for user input.
- */
-void currentDate()
-{
-    int lYear, lMonth, lDay;
+        // A single month or date covers itself
+        fromDay = parseRangeArgument(argv[5], calendar, 0);
+        toDay = parseRangeArgument(argv[argc == 7 ? 6 : 5], calendar, 1);
+        if (fromDay < 0 || toDay < 0)
+        {
+            fprintf(stderr, "%s\n", RED_TEXT "Invalid date or month in the query." RESET);
+            return 1;
+        }
 
-    // Get the current date and time
-    struct tm current_date = getCurrentDateAndTime();
+        return queryDateIndex(argv[2], argv[3], fromDay, toDay, stdout);
+    }
 
-    // Extract the current year in the Gregorian calendar
-    int current_gregorian_year = current_date.tm_year + 1900;
-    // Extract the current month in the Gregorian calendar
-    int current_gregorian_month = current_date.tm_mon;
-    // Extract the current day in the Gregorian calendar
-    int current_gregorian_day = current_date.tm_mday;
+    if (strcmp(argv[1], "--bench") == 0)
+    {
+        int rounds = 20;
 
-    int current_year, current_month, current_day;
-    // Convert the Gregorian date to the Shamsi date
-    gregorianToShamsi(current_gregorian_year, current_gregorian_month, current_gregorian_day,
-                      &current_year, &current_month, &current_day);
+        if (argc > 3 || (argc == 3 && (!parseIntegerArgument(argv[2], &rounds) || rounds < 1)))
+        {
+            printCommandLineUsage();
+            return 1;
+        }
 
-    // Convert the Gregorian date to the Lunar date
-    gregorianToLunar(current_gregorian_year, current_gregorian_month, current_gregorian_day, &lYear, &lMonth, &lDay);
+        runBenchmark(rounds);
+        return 0;
+    }
 
-    printf("\n%s\n\n",
-           BLACK_TEXT WHITE_BACKGROUND "                 Dates                " RESET);
-    // Print the current Shamsi date
-    printf("   Current Shamsi Date: %s %d/%d/%d %s\n",
-           ITALIC GRAY_TEXT, current_year, current_month, current_day ,RESET);
-    // Print the current Gregorian date
-    printf("\n   Current Gregorian Date: %s %d/%d/%d %s\n",
-           ITALIC GRAY_TEXT, current_gregorian_year, current_gregorian_month, current_gregorian_day , RESET);
-    // Print the current Lunar date
-    printf("\n   Current Lunar Date: %s %d/%d/%d %s\n",
-           ITALIC GRAY_TEXT, lYear, lMonth, lDay ,RESET);
-    printf("\n%s\n\n",
-           BLACK_TEXT WHITE_BACKGROUND "--------------------------------------" RESET);
-    printf("Press Enter to go back to menu...");
-    clearInputBuffer();
-    // Wait for user input
-    getchar();
+    printCommandLineUsage();
+    return 1;
 }
 
+/*
+ * main() is left out when this file is compiled into another program with CALENDAR_NO_MAIN defined.
+ */
+#ifndef CALENDAR_NO_MAIN
 /**
  * The main function of the program. It serves as the entry point for the program execution.
  * It displays a menu to the user and takes their input to perform various operations.
@@ -1287,16 +10652,59 @@ void currentDate()
  * If the user enters an invalid choice or invalid input,
  * appropriate error messages are displayed and the function prompts the user to try again.
  * The function continues to display the menu until the user chooses to quit.
+ * If the program is started with arguments, the menu is skipped and runCommandLine() handles them instead.
  *
+ * @param argc The number of command-line arguments.
+ * @param argv The command-line arguments.
  * @return 0 indicating successful program execution.
  */
-int main(void)
+int main(int argc, char *argv[])
 {
     int choice;
-    int shamsi_year, shamsi_month, shamsi_daycode;
+    int shamsi_year, shamsi_month;
+    struct framePrefetch prefetch = {0, 0, NULL, 0, 0};
+
+    // Turn on the metrics if they were requested
+    argc = parseMetricsOption(argc, argv);
+    if (argc < 0)
+    {
+        printCommandLineUsage();
+        return 1;
+    }
+
+    // Turn on tracing if it was requested
+    argc = parseTraceOption(argc, argv);
+    if (argc < 0)
+    {
+        printCommandLineUsage();
+        return 1;
+    }
+
+    // Load the observed Lunar months if they were requested
+    argc = parseLunarOverridesOption(argc, argv);
+    if (argc < 0)
+        return 1;
+
+    // Switch the output to Persian script if it was requested
+    argc = parseScriptOption(argc, argv);
+
+    // Follow the astronomical Nowruz if it was requested
+    argc = parseAstronomicalOption(argc, argv);
+
+    // Run a command-line mode instead of the menu when arguments are given
+    if (argc > 1)
+    {
+        return runCommandLine(argc, argv);
+    }
+
+    // The buffer the calendar frames of the neighbouring months are rendered in
+    prefetch.out = malloc(sizeof(struct outputBuffer));
 
     do
     {
+        // Write the metrics if they were requested with a signal
+        checkMetricsDump();
+
         // Clear the console screen
         clearScreen();
 
@@ -1356,68 +10764,22 @@ int main(void)
                         break;
                     }
 
-                    shamsi_daycode = determineDaycode(shamsi_year, shamsi_month);
                     determineLeapYear(shamsi_year);
 
                     int arrowResult;
                     do {
                         clearScreen();
-                        calendar(shamsi_year, shamsi_month, shamsi_daycode);
+
+                        // Show the month from the frame cache, and render its neighbours while waiting for a key
+                        showCachedCalendar(shamsi_year, shamsi_month);
                         printf("\n");
+                        fflush(stdout);
+                        startFramePrefetch(&prefetch, shamsi_year, shamsi_month);
 
                         arrowResult = readKeyboardInput();
+                        finishFramePrefetch(&prefetch);
 
-                        if (arrowResult == 1)
-                        {
-                            if (shamsi_year >= 1206)
-                            {
-                                shamsi_month--;
-                            }
-                            if (shamsi_month < 1)
-                            {
-                                shamsi_month = 12;
-                                shamsi_year--;
-                            }
-                            if (shamsi_year == 1205)
-                            {
-                                shamsi_year++;
-                            }
-                            shamsi_daycode = determineDaycode(shamsi_year, shamsi_month);
-                        }
-                        else if (arrowResult == 2)
-                        {
-                            if (shamsi_year <= 1498)
-                            {
-                                shamsi_month++;
-                            }
-                            if (shamsi_month > 12)
-                            {
-                                shamsi_month = 1;
-                                shamsi_year++;
-                            }
-                            if (shamsi_year == 1499)
-                            {
-                                shamsi_year--;
-                            }
-                            shamsi_daycode = determineDaycode(shamsi_year, shamsi_month);
-                        }
-                        else if (arrowResult == 3)
-                        {
-                            if (shamsi_year == 1498)
-                            {
-                                shamsi_year--;
-                            }
-                            shamsi_year++;
-                            shamsi_daycode = determineDaycode(shamsi_year, shamsi_month);
-                        }
-                        else if (arrowResult == 4)
-                        {
-                            if (shamsi_year >= 1206)
-                            {
-                                shamsi_year--;
-                            }
-                            shamsi_daycode = determineDaycode(shamsi_year, shamsi_month);
-                        }
+                        moveCalendarView(arrowResult, &shamsi_year, &shamsi_month);
                     } while (arrowResult != 0);
 
                 } while (1);
@@ -1451,5 +10813,7 @@ int main(void)
 
     } while (choice != 0);
 
+    free(prefetch.out);
     return 0;
-}
\ No newline at end of file
+}
+#endif
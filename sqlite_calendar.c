@@ -0,0 +1,291 @@
+/**
+ * This file builds the calendar conversions of calendar_tool as a loadable SQLite extension,
+ * so that queries can convert dates inside GROUP BY and WHERE clauses instead of exporting rows to calendar_tool.
+ * It is built on the conversion core of calendar_core.c alone, not on main.c, so the library holds no state
+ * and exports only its entry point, sqlite3_calendar_init(): everything else is static or hidden, and cannot
+ * clash with the symbols of the program that loads it.
+ *
+ * Build it as a shared library, for example:
+ *     gcc -O2 -fPIC -shared sqlite_calendar.c -o calendar.so              (Linux)
+ *     gcc -O2 -shared sqlite_calendar.c -o calendar.dll                    (Windows)
+ * and load it in SQLite with: .load ./calendar
+ *
+ * The extension adds these functions. Dates are text; Gregorian dates are written as YEAR-MONTH-DAY
+ * (anything after the date, like a time, is ignored) and Shamsi and Lunar dates as YEAR/MONTH/DAY.
+ * Invalid dates give NULL.
+ *     shamsi(date)                 The Shamsi date of a Gregorian date.
+ *     lunar(date)                  The Lunar date of a Gregorian date.
+ *     gregorian(date [, calendar]) The Gregorian date of a Shamsi date, or of a Lunar or Julian date if calendar is
+ *                                  'lunar' or 'julian'.
+ *     shamsi_month_start(date)     The Gregorian date of the first day of the Shamsi month of a Gregorian date.
+ *     shamsi_bucket(date, kind)    The Shamsi week, month, quarter or year ('week', 'month', 'quarter' or 'year')
+ *                                  of a Gregorian date, labelled like the --bucket mode of calendar_tool.
+ */
+#include <sqlite3ext.h>
+#include <stdio.h>
+#include <string.h>
+
+// Keep the functions of the core and the API pointer of SQLite out of the symbols the library exports
+#if defined(__GNUC__) && !defined(_WIN32)
+#pragma GCC visibility push(hidden)
+#endif
+
+SQLITE_EXTENSION_INIT1
+
+#include "calendar_core.c"
+
+#ifndef SQLITE_INNOCUOUS
+#define SQLITE_INNOCUOUS 0
+#endif
+
+/**
+ * The kinds of shamsi_bucket(), named like the kinds of the --bucket mode of calendar_tool.
+ */
+#define BUCKET_WEEK 0
+#define BUCKET_MONTH 1
+#define BUCKET_QUARTER 2
+#define BUCKET_YEAR 3
+
+static const char *bucketNames[] = {"week", "month", "quarter", "year"};
+
+/**
+ * A date read from a SQL argument, with its day number, so it can be converted to any calendar.
+ */
+struct sqlDate
+{
+    int dayNumber;
+    int year, month, day; // The date in the calendar it was written in
+};
+
+/**
+ * This function reads a date argument of a SQL function and checks that it exists in its calendar.
+ * Only the date at the start of the text is read, so '2024-03-20 10:30:00' is read as '2024-03-20'.
+ *
+ * @param value The SQL value of the argument.
+ * @param calendar The CORE_ constant of the calendar the date is written in.
+ * @param result Pointer to the date that receives the argument and its day number.
+ * @return 1 if the argument holds a valid date, 0 otherwise.
+ */
+static int readDateValue(sqlite3_value *value, int calendar, struct sqlDate *result)
+{
+    const char *text = (const char *)sqlite3_value_text(value);
+    const char *end;
+
+    if (text == NULL)
+        return 0;
+
+    // Stop at a time written after the date
+    end = text;
+    while (*end != '\0' && *end != ' ' && *end != 'T')
+        end++;
+
+    return coreParseDate(text, (int)(end - text), &result->year, &result->month, &result->day)
+           && coreToDayNumber(calendar, CORE_ARITHMETIC, result->year, result->month, result->day, &result->dayNumber);
+}
+
+/**
+ * This function sets the result of a SQL function to a date written as YEAR/MONTH/DAY, or YEAR-MONTH-DAY for Gregorian dates.
+ *
+ * @param context The context of the SQL function.
+ * @param year The year.
+ * @param month The month.
+ * @param day The day.
+ * @param separator The character between the parts of the date.
+ */
+static void resultDate(sqlite3_context *context, int year, int month, int day, char separator)
+{
+    char text[24];
+    int length = snprintf(text, sizeof(text), "%04d%c%02d%c%02d", year, separator, month, separator, day);
+
+    sqlite3_result_text(context, text, length, SQLITE_TRANSIENT);
+}
+
+/**
+ * This function sets the result of a SQL function to the date of a day number in a calendar,
+ * or leaves it NULL if the calendar does not cover the day.
+ *
+ * @param context The context of the SQL function.
+ * @param calendar The CORE_ constant of the calendar to write the date in.
+ * @param dayNumber The day number.
+ * @param separator The character between the parts of the date.
+ */
+static void resultDayNumber(sqlite3_context *context, int calendar, int dayNumber, char separator)
+{
+    int year, month, day;
+
+    if (coreFromDayNumber(calendar, CORE_ARITHMETIC, dayNumber, &year, &month, &day))
+        resultDate(context, year, month, day, separator);
+}
+
+/**
+ * This function implements shamsi(date), the Shamsi date of a Gregorian date.
+ *
+ * @param context The context of the SQL function.
+ * @param argc The number of arguments.
+ * @param argv The arguments.
+ */
+static void sqlShamsi(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    struct sqlDate date;
+
+    (void)argc;
+    if (readDateValue(argv[0], CORE_GREGORIAN, &date))
+        resultDayNumber(context, CORE_SHAMSI, date.dayNumber, '/');
+}
+
+/**
+ * This function implements lunar(date), the Lunar date of a Gregorian date.
+ *
+ * @param context The context of the SQL function.
+ * @param argc The number of arguments.
+ * @param argv The arguments.
+ */
+static void sqlLunar(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    struct sqlDate date;
+
+    (void)argc;
+    if (readDateValue(argv[0], CORE_GREGORIAN, &date))
+        resultDayNumber(context, CORE_LUNAR, date.dayNumber, '/');
+}
+
+/**
+ * This function implements gregorian(date [, calendar]), the Gregorian date of a Shamsi or Lunar date.
+ *
+ * @param context The context of the SQL function.
+ * @param argc The number of arguments.
+ * @param argv The arguments.
+ */
+static void sqlGregorian(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    struct sqlDate date;
+    int calendar = CORE_SHAMSI;
+
+    if (argc == 2)
+    {
+        const char *name = (const char *)sqlite3_value_text(argv[1]);
+
+        calendar = name == NULL ? -1
+                 : strcmp(name, "shamsi") == 0 ? CORE_SHAMSI
+                 : strcmp(name, "lunar") == 0 ? CORE_LUNAR
+                 : strcmp(name, "julian") == 0 ? CORE_JULIAN : -1;
+        if (calendar < 0)
+        {
+            sqlite3_result_error(context, "gregorian(): the calendar must be 'shamsi', 'lunar' or 'julian'", -1);
+            return;
+        }
+    }
+
+    if (readDateValue(argv[0], calendar, &date))
+        resultDayNumber(context, CORE_GREGORIAN, date.dayNumber, '-');
+}
+
+/**
+ * This function implements shamsi_month_start(date), the Gregorian date of the first day of the Shamsi month of a Gregorian date.
+ *
+ * @param context The context of the SQL function.
+ * @param argc The number of arguments.
+ * @param argv The arguments.
+ */
+static void sqlShamsiMonthStart(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    struct sqlDate date;
+    int year, month, day;
+
+    (void)argc;
+    if (readDateValue(argv[0], CORE_GREGORIAN, &date)
+        && coreFromDayNumber(CORE_SHAMSI, CORE_ARITHMETIC, date.dayNumber, &year, &month, &day))
+        resultDayNumber(context, CORE_GREGORIAN, date.dayNumber - (day - 1), '-');
+}
+
+/**
+ * This function implements shamsi_bucket(date, kind), the Shamsi week, month, quarter or year of a Gregorian date.
+ * Weeks start on Saturday and are labelled by the Shamsi date of that Saturday, months like 1402/08,
+ * quarters like 1402-Q3 and years (which are also fiscal years) like 1402, so the labels sort in order of time.
+ *
+ * @param context The context of the SQL function.
+ * @param argc The number of arguments.
+ * @param argv The arguments.
+ */
+static void sqlShamsiBucket(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    const char *name = (const char *)sqlite3_value_text(argv[1]);
+    struct sqlDate date;
+    char text[24];
+    int kind = -1, length, year, month, day;
+
+    (void)argc;
+    for (int i = BUCKET_WEEK; name != NULL && i <= BUCKET_YEAR; i++)
+        if (strcmp(name, bucketNames[i]) == 0)
+            kind = i;
+
+    if (kind < 0)
+    {
+        sqlite3_result_error(context, "shamsi_bucket(): the kind must be 'week', 'month', 'quarter' or 'year'", -1);
+        return;
+    }
+
+    if (!readDateValue(argv[0], CORE_GREGORIAN, &date))
+        return;
+
+    if (kind == BUCKET_WEEK)
+    {
+        // The week starts on the Saturday on or before the date
+        resultDayNumber(context, CORE_SHAMSI, date.dayNumber - coreWeekday(date.dayNumber), '/');
+        return;
+    }
+
+    if (!coreFromDayNumber(CORE_SHAMSI, CORE_ARITHMETIC, date.dayNumber, &year, &month, &day))
+        return;
+
+    if (kind == BUCKET_MONTH)
+        length = snprintf(text, sizeof(text), "%04d/%02d", year, month);
+    else if (kind == BUCKET_QUARTER)
+        length = snprintf(text, sizeof(text), "%04d-Q%d", year, (month - 1) / 3 + 1);
+    else
+        length = snprintf(text, sizeof(text), "%04d", year);
+
+    sqlite3_result_text(context, text, length, SQLITE_TRANSIENT);
+}
+
+/**
+ * This function is the entry point of the extension, called by SQLite when the extension is loaded.
+ * It registers the SQL functions, which are deterministic so SQLite can use them in indexes and reuse their results.
+ *
+ * @param db The database connection.
+ * @param errorMessage Pointer to the error message returned on failure.
+ * @param api The SQLite functions available to the extension.
+ * @return SQLITE_OK on success, or the error code of the registration that failed.
+ */
+#if defined(__GNUC__) && !defined(_WIN32)
+#pragma GCC visibility pop
+#endif
+
+#ifdef _WIN32
+__declspec(dllexport)
+#elif defined(__GNUC__)
+__attribute__((visibility("default")))
+#endif
+int sqlite3_calendar_init(sqlite3 *db, char **errorMessage, const sqlite3_api_routines *api)
+{
+    int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS;
+    int result = SQLITE_OK;
+
+    SQLITE_EXTENSION_INIT2(api);
+    (void)errorMessage;
+
+    if (result == SQLITE_OK)
+        result = sqlite3_create_function(db, "shamsi", 1, flags, NULL, sqlShamsi, NULL, NULL);
+    if (result == SQLITE_OK)
+        result = sqlite3_create_function(db, "lunar", 1, flags, NULL, sqlLunar, NULL, NULL);
+    if (result == SQLITE_OK)
+        result = sqlite3_create_function(db, "gregorian", 1, flags, NULL, sqlGregorian, NULL, NULL);
+    if (result == SQLITE_OK)
+        result = sqlite3_create_function(db, "gregorian", 2, flags, NULL, sqlGregorian, NULL, NULL);
+    if (result == SQLITE_OK)
+        result = sqlite3_create_function(db, "shamsi_month_start", 1, flags, NULL, sqlShamsiMonthStart, NULL, NULL);
+    if (result == SQLITE_OK)
+        result = sqlite3_create_function(db, "shamsi_bucket", 2, flags, NULL, sqlShamsiBucket, NULL, NULL);
+
+    return result;
+}